@@ -13,13 +13,14 @@ for p in $platforms; do
 
 	CC=${ccmap[$p]}
 
-	# Statically link zlib on Windows so we don't have to ship a zlib.dll
+	# Statically link zlib and winpthreads on Windows so we don't have to
+	# ship a zlib.dll or libwinpthread-1.dll
 	# Don't statically link on other platforms as Mac doesn't have static
 	# libz (and linux could go either way)
 	if [[ "$CC" == *mingw* ]]; then
-		CFLAGS="-l:libz.a -lm -std=gnu99"
+		CFLAGS="-l:libz.a -l:libwinpthread.a -lm -std=gnu99"
 	else
-		CFLAGS="-lz -lm -std=gnu99"
+		CFLAGS="-lz -lpthread -lm -std=gnu99"
 	fi
 
 	if [[ "$p" == win* ]]; then
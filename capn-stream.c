@@ -79,7 +79,8 @@ int capn_deflate(struct capn_stream* s) {
 			s->next_in += 8;
 			s->avail_in -= 8;
 
-			s->raw = min(s->avail_in, 256*8);
+			/* The count byte holds at most 255 words */
+			s->raw = min(s->avail_in, 255*8);
 			if ((p = (uint8_t*) memchr(s->next_in, 0, s->raw)) != NULL) {
 				s->raw = (p - s->next_in) & ~7;
 			}
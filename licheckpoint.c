@@ -0,0 +1,112 @@
+//
+//  licheckpoint.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "licheckpoint.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liplace.h"
+
+#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
+#define REQUIRE_IO(X) do { if (!( X )) { result = LI_IO_ERROR; LI_ON_ERROR; goto cleanup; } } while(false)
+
+void li_checkpoint_ctor(li_checkpoint* self) {
+    assert(self);
+    memset(self, 0, sizeof(li_checkpoint));
+}
+
+void li_checkpoint_dtor(li_checkpoint* self) {
+    assert(self);
+    li_block_dtor(&self->header);
+    li_block_dtor(&self->state);
+    li_dealloc(self->sinks);
+    li_checkpoint_ctor(self);
+}
+
+li_status li_checkpoint_save(const li_checkpoint* self, const char* path) {
+    assert(self && path && (self->sinks || !self->count));
+    li_status result = LI_SUCCESS;
+    FILE* file = NULL;
+    char* temporary = li_alloc(strlen(path) + 5);
+    if (!temporary)
+        return LI_BAD_ALLOC;
+    strcpy(temporary, path);
+    strcat(temporary, ".tmp");
+
+    uint64_t sizes[9] = { self->offset, self->row, self->first, self->last, self->rows, self->aligned,
+        self->header.size, self->state.size, self->count };
+    file = fopen(temporary, "wb");
+    REQUIRE_IO(file);
+    REQUIRE_IO(fwrite(LI_CHECKPOINT_MAGIC "\0\0\0\0", 1, 8, file) == 8);
+    REQUIRE_IO(fwrite(sizes, 1, sizeof(sizes), file) == sizeof(sizes));
+    REQUIRE_IO(fwrite(self->header.begin, 1, self->header.size, file) == self->header.size);
+    REQUIRE_IO(fwrite(self->sinks, sizeof(li_sink_state), self->count, file) == self->count);
+    REQUIRE_IO(fwrite(self->state.begin, 1, self->state.size, file) == self->state.size);
+    result = li_file_sync(file);
+    REQUIRE_SUCCESS;
+    REQUIRE_IO(!fclose(file));
+    file = NULL;
+#ifdef _WIN32
+    remove(path); // rename won't replace a file
+#endif
+    REQUIRE_IO(!rename(temporary, path));
+
+cleanup:
+
+    if (file) {
+        fclose(file);
+        remove(temporary);
+    }
+    li_dealloc(temporary);
+    return result;
+}
+
+li_status li_checkpoint_load(li_checkpoint* self, FILE* file) {
+    assert(self && file);
+    li_checkpoint_dtor(self);
+    li_status result = LI_SUCCESS;
+
+    li_byte magic[8];
+    uint64_t sizes[9];
+    if ((fread(magic, 1, sizeof(magic), file) != sizeof(magic))
+        || (fread(sizes, 1, sizeof(sizes), file) != sizeof(sizes)))
+        return ferror(file) ? LI_IO_ERROR : LI_BAD_FORMAT;
+    if (memcmp(magic, LI_CHECKPOINT_MAGIC, 4) || (sizes[5] > 1) || (sizes[6] > SIZE_MAX)
+        || (sizes[7] > SIZE_MAX) || (sizes[8] > SIZE_MAX / sizeof(li_sink_state)))
+        return LI_BAD_FORMAT;
+    self->offset = sizes[0];
+    self->row = sizes[1];
+    self->first = sizes[2];
+    self->last = sizes[3];
+    self->rows = sizes[4];
+    self->aligned = sizes[5];
+    self->count = (size_t) sizes[8];
+
+    result = li_block_ctor(&self->header, MAX((size_t) sizes[6], (size_t) 1));
+    REQUIRE_SUCCESS;
+    result = li_block_ctor(&self->state, MAX((size_t) sizes[7], (size_t) 1));
+    REQUIRE_SUCCESS;
+    self->sinks = li_alloc(MAX(self->count, (size_t) 1) * sizeof(li_sink_state));
+    if (!self->sinks) {
+        result = LI_BAD_ALLOC;
+        goto cleanup;
+    }
+    self->header.size = (size_t) sizes[6];
+    self->state.size = (size_t) sizes[7];
+    if ((fread(self->header.begin, 1, self->header.size, file) != self->header.size)
+        || (fread(self->sinks, sizeof(li_sink_state), self->count, file) != self->count)
+        || (fread(self->state.begin, 1, self->state.size, file) != self->state.size))
+        result = ferror(file) ? LI_IO_ERROR : LI_BAD_FORMAT;
+
+cleanup:
+
+    if (result != LI_SUCCESS)
+        li_checkpoint_dtor(self);
+    return result;
+}
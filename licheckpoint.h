@@ -0,0 +1,68 @@
+//
+//  licheckpoint.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef licheckpoint_h
+#define licheckpoint_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lipipeline.h"
+#include "lireader.h"
+#include "lisink.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // A checkpoint (.lick) saves how far li_convert has got through its
+    // input, so a conversion that is killed part way can resume where it
+    // was instead of starting over.  It is taken at a message boundary,
+    // once every record decoded so far has been written, and holds what the
+    // reader and the sinks need to carry on from there:
+    //
+    //     "LCK1", u32 reserved
+    //     u64 offset, row, first, last, rows, aligned,
+    //         header bytes, state bytes, sinks
+    //     magic number and header of the .li file
+    //     li_sink_state for each sink
+    //     state of the reader, as LI_STATE_U8V gives it
+    //
+    // Numbers are in the byte order of the machine that wrote them.
+
+#define LI_CHECKPOINT_MAGIC "LCK1"
+
+    typedef struct li_checkpoint {
+        uint64_t offset;        // Of the next message in the input
+        uint64_t row;           // Row number of the next record
+        uint64_t first;         // Row numbers of the records converted
+        uint64_t last;
+        uint64_t rows;          // Rows the sinks were told they would get
+        bool aligned;           // A record has been decoded
+        li_block header;        // Input up to where data messages start
+        li_block state;         // Of the reader
+        li_sink_state* sinks;
+        size_t count;           // Of sinks
+    } li_checkpoint;
+
+    void li_checkpoint_ctor(li_checkpoint* self);
+    void li_checkpoint_dtor(li_checkpoint* self);
+
+    // Write the checkpoint to path, replacing any there only once it is
+    // safely on storage, so a crash leaves the old checkpoint or the new
+    li_status li_checkpoint_save(const li_checkpoint* self, const char* path);
+
+    // Read a checkpoint back from file
+    li_status li_checkpoint_load(li_checkpoint* self, FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* licheckpoint_h */
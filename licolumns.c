@@ -0,0 +1,197 @@
+//
+//  licolumns.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "licolumns.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+void li_column_dtor(li_column* self) {
+    assert(self);
+    li_array_dtor(li_block)(&self->blocks);
+    li_array_ctor(li_block)(&self->blocks); // Released columns may be destroyed again
+    if (self->spill)
+        fclose(self->spill);
+    self->spill = NULL;
+    self->spilled = 0;
+    self->bytes = 0;
+}
+
+li_status li_columns_ctor(li_columns* self, size_t count, size_t budget) {
+    assert(self);
+    memset(self, 0, sizeof(li_columns));
+    li_array_ctor(li_column)(&self->columns);
+    self->budget = budget ? budget : LI_COLUMNS_BUDGET;
+    self->block_bytes = LI_COLUMNS_BLOCK_BYTES;
+    if (count && (self->block_bytes > self->budget / count))
+        self->block_bytes = MAX(self->budget / count, 4096);
+    for (size_t i = 0; i != count; ++i) {
+        li_column c;
+        memset(&c, 0, sizeof(c));
+        li_array_ctor(li_block)(&c.blocks);
+        li_block b;
+        li_status result = li_block_ctor(&b, self->block_bytes);
+        if (result == LI_SUCCESS) {
+            result = li_array_push(li_block)(&c.blocks, b);
+            if (result != LI_SUCCESS)
+                li_block_dtor(&b);
+        }
+        if (result == LI_SUCCESS)
+            result = li_array_push(li_column)(&self->columns, c);
+        if (result != LI_SUCCESS) {
+            li_column_dtor(&c);
+            return result;
+        }
+        self->resident += self->block_bytes;
+    }
+    return LI_SUCCESS;
+}
+
+void li_columns_dtor(li_columns* self) {
+    assert(self);
+    li_array_dtor(li_column)(&self->columns);
+    li_block_dtor(&self->scratch);
+}
+
+// The last block of a column is full.  Keep it and start another if the
+// budget allows; otherwise, or once the column has started spilling (so that
+// the file stays between the blocks kept and the current block), write it
+// out and reuse it.
+
+static li_status li_columns_full(li_columns* self, li_column* c) {
+    li_block* b = li_array_end(li_block)(&c->blocks) - 1;
+    if (!c->spill && (self->resident + self->block_bytes <= self->budget)) {
+        li_block d;
+        LI_DOUBT(li_block_ctor(&d, self->block_bytes));
+        li_status result = li_array_push(li_block)(&c->blocks, d);
+        if (result != LI_SUCCESS) {
+            li_block_dtor(&d);
+            return result;
+        }
+        self->resident += self->block_bytes;
+        return LI_SUCCESS;
+    }
+    if (!c->spill && !(c->spill = tmpfile()))
+        return LI_IO_ERROR;
+    if (fwrite(b->begin, 1, b->size, c->spill) != b->size)
+        return LI_IO_ERROR;
+    c->spilled += b->size;
+    b->size = 0;
+    return LI_SUCCESS;
+}
+
+li_status li_columns_append(li_columns* self, size_t column, const void* src, size_t count) {
+    assert(self && (column < li_array_size(li_column)(&self->columns)));
+    li_column* c = li_array_begin(li_column)(&self->columns) + column;
+    const li_byte* p = src;
+    c->bytes += count;
+    while (count) {
+        li_block* b = li_array_end(li_block)(&c->blocks) - 1;
+        if (b->size == b->capacity) {
+            LI_DOUBT(li_columns_full(self, c));
+            b = li_array_end(li_block)(&c->blocks) - 1;
+        }
+        size_t n = MIN(count, b->capacity - b->size);
+        memcpy(b->begin + b->size, p, n);
+        b->size += n;
+        p += n;
+        count -= n;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_columns_read(li_columns* self, size_t column, li_write_function write, void* user) {
+    assert(self && write && (column < li_array_size(li_column)(&self->columns)));
+    li_column* c = li_array_begin(li_column)(&self->columns) + column;
+    li_block* last = li_array_end(li_block)(&c->blocks) - 1;
+    for (li_block* b = li_array_begin(li_block)(&c->blocks); b != last; ++b)
+        LI_DOUBT(write(user, b->begin, b->size));
+    if (c->spill) {
+        if (!self->scratch.begin)
+            LI_DOUBT(li_block_ctor(&self->scratch, self->block_bytes));
+        if (fflush(c->spill) || fseek(c->spill, 0, SEEK_SET))
+            return LI_IO_ERROR;
+        size_t n;
+        while ((n = fread(self->scratch.begin, 1, self->scratch.capacity, c->spill)))
+            LI_DOUBT(write(user, self->scratch.begin, n));
+        if (ferror(c->spill))
+            return LI_IO_ERROR;
+    }
+    return write(user, last->begin, last->size);
+}
+
+static li_status li_columns_fwrite(void* user, const void* src, size_t count) {
+    return (fwrite(src, 1, count, (FILE*) user) == count) ? LI_SUCCESS : LI_IO_ERROR;
+}
+
+// Copy count bytes from the start of input to the current position of output
+// without passing them through user space.  Returns false, with output where
+// it was, if the kernel can't do it.
+
+static bool li_columns_copy_file_range(FILE* input, FILE* output, uint64_t count) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    if (fflush(input) || fflush(output))
+        return false;
+    off_t position = ftello(output);
+    if (position < 0)
+        return false;
+    long long in_offset = 0;
+    long long out_offset = position;
+    while ((uint64_t) in_offset < count) {
+        size_t n = (size_t) MIN(count - (uint64_t) in_offset, (uint64_t) 1 << 30);
+        if (syscall(SYS_copy_file_range, fileno(input), &in_offset, fileno(output), &out_offset, n, 0) <= 0) {
+            // Let the caller start again from where we started
+            fseeko(output, position, SEEK_SET);
+            return false;
+        }
+    }
+    // Our explicit offsets left the file offset alone, so move the stream
+    return !fseeko(output, (off_t) out_offset, SEEK_SET);
+#else
+    (void) input;
+    (void) output;
+    (void) count;
+    return false;
+#endif
+}
+
+li_status li_columns_write(li_columns* self, size_t column, FILE* output) {
+    assert(self && output && (column < li_array_size(li_column)(&self->columns)));
+    li_column* c = li_array_begin(li_column)(&self->columns) + column;
+    if (!c->spill || !c->spilled)
+        return li_columns_read(self, column, li_columns_fwrite, output);
+    li_block* last = li_array_end(li_block)(&c->blocks) - 1;
+    for (li_block* b = li_array_begin(li_block)(&c->blocks); b != last; ++b)
+        LI_DOUBT(li_columns_fwrite(output, b->begin, b->size));
+    if (!li_columns_copy_file_range(c->spill, output, c->spilled)) {
+        if (ferror(output))
+            return LI_IO_ERROR;
+        if (!self->scratch.begin)
+            LI_DOUBT(li_block_ctor(&self->scratch, self->block_bytes));
+        if (fflush(c->spill) || fseek(c->spill, 0, SEEK_SET))
+            return LI_IO_ERROR;
+        size_t n;
+        while ((n = fread(self->scratch.begin, 1, self->scratch.capacity, c->spill)))
+            LI_DOUBT(li_columns_fwrite(output, self->scratch.begin, n));
+        if (ferror(c->spill))
+            return LI_IO_ERROR;
+    }
+    return li_columns_fwrite(output, last->begin, last->size);
+}
+
+void li_columns_release(li_columns* self, size_t column) {
+    assert(self && (column < li_array_size(li_column)(&self->columns)));
+    li_column* c = li_array_begin(li_column)(&self->columns) + column;
+    self->resident -= li_array_size(li_block)(&c->blocks) * self->block_bytes;
+    li_column_dtor(c);
+}
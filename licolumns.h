@@ -0,0 +1,76 @@
+//
+//  licolumns.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef licolumns_h
+#define licolumns_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lipipeline.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_columns accumulates the columns of a table row by row, to be read
+    // back one whole column at a time, as the MAT and NPZ writers need to
+    // transpose the .li records.  Columns grow in large blocks kept in memory
+    // until the memory budget is spent; after that, each column appends its
+    // full blocks to its own temporary file.
+
+#define LI_COLUMNS_BLOCK_BYTES (1 << 20)
+#define LI_COLUMNS_BUDGET ((size_t) 256 << 20)
+
+    typedef struct {
+        li_array(li_block) blocks; // Full blocks kept in memory, then the
+                                   // block being filled
+        FILE* spill;               // Full blocks after those in memory
+        uint64_t spilled;          // Bytes in spill
+        uint64_t bytes;            // Bytes in the column
+    } li_column;
+
+    void li_column_dtor(li_column* self);
+    li_array_define(li_column);
+
+    typedef struct {
+        li_array(li_column) columns;
+        size_t block_bytes;
+        size_t budget;             // Bytes of blocks we may keep in memory
+        size_t resident;           // Bytes of blocks in memory
+        li_block scratch;          // For reading back spilled blocks
+    } li_columns;
+
+    // budget is the memory to use for blocks, or 0 for LI_COLUMNS_BUDGET.
+    // Each column keeps at least one block, which may be made smaller to
+    // respect the budget.
+    li_status li_columns_ctor(li_columns* self, size_t count, size_t budget);
+    void li_columns_dtor(li_columns* self);
+
+    li_status li_columns_append(li_columns* self, size_t column, const void* src, size_t count);
+
+    inline static uint64_t li_columns_size(li_columns* self, size_t column) {
+        return li_array_begin(li_column)(&self->columns)[column].bytes;
+    }
+
+    // Pass the whole of a column, in order and in large pieces, to write
+    li_status li_columns_read(li_columns* self, size_t column, li_write_function write, void* user);
+
+    // Append the whole of a column to output, copying spilled blocks between
+    // files in the kernel where we can
+    li_status li_columns_write(li_columns* self, size_t column, FILE* output);
+
+    // Free the memory and temporary file of a column that has been read
+    void li_columns_release(li_columns* self, size_t column);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* licolumns_h */
@@ -10,17 +10,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
 
+#include "capnp_priv.h"
+#include "ligzindex.h"
+#include "lipack.h"
+#include "lipipeline.h"
+#include "lisink.h"
+#include "lisource.h"
+#include "litoarrow.h"
 #include "litocsv.h"
+#include "litolic.h"
 #include "litomat.h"
 #include "litonpy.h"
+#include "litonpz.h"
+#include "liverify.h"
 
 char* li_change_extension(char* filename, char* extension)
 {
     long n = strlen(filename);
     long m = strlen(extension);
-    char* q = strrchr(filename, '.'); // Find the last '.' if it exists
-    ptrdiff_t i = q ? (q - filename) : n;
+    // Compressed inputs like "file.li.gz" convert to "file.csv"
+    if ((n > 3) && !strcmp(filename + n - 3, ".gz"))
+        n -= 3;
+    ptrdiff_t i = n;
+    while (i && (filename[i - 1] != '.') && (filename[i - 1] != '/'))
+        --i; // Find the last '.' if it exists
+    i = (i && (filename[i - 1] == '.')) ? (i - 1) : n;
     size_t j = i + 1 + m + 1; // Prefix + '.' + extension + '\0'
     char* newname = malloc(j);
     if (newname) {
@@ -31,40 +49,571 @@ char* li_change_extension(char* filename, char* extension)
     return newname;
 }
 
+// Parse a bound for --from or --to: seconds, optionally followed by 's', or
+// a record number followed by 'r'
+
+static bool li_parse_bound(const char* s, double* time, uint64_t* row, bool* is_row)
+{
+    char* end = NULL;
+    size_t n = strlen(s);
+    if (n && (s[n - 1] == 'r')) {
+        if (!isdigit((unsigned char) *s))
+            return false;
+        unsigned long long x = strtoull(s, &end, 10);
+        *row = (uint64_t) x;
+        *is_row = true;
+        return end == s + n - 1;
+    }
+    double x = strtod(s, &end);
+    *time = x;
+    *is_row = false;
+    if (*end == 's') // Optional unit
+        ++end;
+    return (end != s) && !*end && !isnan(x);
+}
+
+// An index of the input, by which a window of its records can be read
+// without inflating and framing everything before it: the index of a packed
+// file, or a gzip index (file.gzi) beside a gzip compressed one
+
+typedef struct {
+    li_pack pack;
+    bool packed;
+    li_gzindex gzindex;
+    FILE* gzindex_file; // NULL if there is no gzip index
+} li_input_index;
+
+static void li_input_index_open(li_input_index* self, FILE* infile, char* filename)
+{
+    memset(self, 0, sizeof(li_input_index));
+    if (li_pack_ctor(&self->pack, infile) == LI_SUCCESS) {
+        self->packed = true;
+        return;
+    }
+    unsigned char magic[2] = { 0 };
+    if (fseek(infile, 0, SEEK_SET) || (fread(magic, 1, 2, infile) != 2) || (magic[0] != 0x1f) || (magic[1] != 0x8b))
+        return;
+    char* name = li_change_extension(filename, "gzi");
+    FILE* file = name ? fopen(name, "rb") : NULL;
+    free(name);
+    if (!file)
+        return;
+    if (li_gzindex_ctor(&self->gzindex, file) != LI_SUCCESS) {
+        fclose(file);
+        return;
+    }
+    self->gzindex_file = file;
+}
+
+static void li_input_index_close(li_input_index* self)
+{
+    if (self->packed)
+        li_pack_dtor(&self->pack);
+    if (self->gzindex_file) {
+        li_gzindex_dtor(&self->gzindex);
+        fclose(self->gzindex_file);
+    }
+    memset(self, 0, sizeof(li_input_index));
+}
+
+// The first row at or after t seconds of the file whose header is read from
+// source
+
+static li_status li_header_row_at(li_source* source, double t, uint64_t* row)
+{
+    li_reader* r = li_init(malloc, free);
+    if (!r)
+        return LI_BAD_ALLOC;
+    li_metadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    li_status result = LI_SMALL_SRC;
+    li_byte buffer[4096];
+    size_t n;
+    while ((result == LI_SMALL_SRC) && (n = li_source_read(source, buffer, sizeof(buffer)))) {
+        result = li_put(r, buffer, n);
+        if (result == LI_SUCCESS)
+            result = li_get(r, LI_TIME_STEP_F64, 0, &metadata.time_step, sizeof(double));
+    }
+    if (result == LI_SUCCESS)
+        result = li_get(r, LI_START_OFFSET_F64, 0, &metadata.start_offset, sizeof(double));
+    if (result == LI_SMALL_SRC)
+        result = li_source_status(source) ? li_source_status(source) : LI_BAD_FORMAT;
+    if (result == LI_SUCCESS)
+        *row = li_metadata_row_at(&metadata, t);
+    li_finalize(r);
+    return result;
+}
+
+// Construct a source reading a window of records from the packed block or
+// gzip checkpoint before its first record, numbering rows as in the whole
+// file.  Without an index, or if the window starts in the first block or
+// before the first checkpoint, the source reads the whole file.
+
+static li_status li_window_source(li_source* source, FILE* infile, li_source_kind kind,
+                                  const li_input_index* index, const li_convert_options* window)
+{
+    uint64_t first = window->first;
+    if (window->timed && (index->packed || index->gzindex_file)) {
+        li_source header;
+        li_status result = index->packed ? li_pack_source(&index->pack, &header, 1, 0)
+                                         : li_gzindex_source(&index->gzindex, infile, &header, 0, 0);
+        if (result == LI_SUCCESS)
+            result = li_header_row_at(&header, window->from, &first);
+        li_source_dtor(&header);
+        LI_DOUBT(result);
+    }
+    if (index->packed && (index->pack.blocks > 1)) {
+        uint64_t block = MIN(li_pack_find(&index->pack, first), index->pack.blocks - 1);
+        if (block > 1)
+            return li_pack_source(&index->pack, source, block, index->pack.blocks - block);
+    }
+    if (index->gzindex_file) {
+        uint64_t point = MIN(li_gzindex_find(&index->gzindex, first), index->gzindex.count - 1);
+        if (point)
+            return li_gzindex_source(&index->gzindex, infile, source, point, index->gzindex.count - point);
+    }
+    if (fseek(infile, 0, SEEK_SET))
+        return LI_IO_ERROR;
+    return li_source_ctor(source, infile, kind);
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Pack each Cap'n Proto message of an unpacked file, so that we can compare
+// decoding the two encodings of the same data.  Returns the size of the
+// packed file, or 0 if the file isn't made of unpacked messages.
+
+static size_t repack(const li_byte* src, size_t n, li_byte* dest)
+{
+    if ((n < 3) || (src[2] == '1'))
+        return 0;
+    memcpy(dest, src, 3);
+    struct capn_stream z;
+    memset(&z, 0, sizeof(z));
+    z.next_out = (uint8_t*) dest + 3;
+    z.avail_out = n + n / 4;
+    uint64_t* message = NULL; // capn_deflate wants aligned input
+    size_t capacity = 0;
+    size_t i = 3;
+    while (i + 4 <= n) {
+        uint32_t segments;
+        memcpy(&segments, src + i, 4);
+        if (segments > 1023)
+            goto failure; // Already packed
+        size_t total = (4 + (segments + 1) * 4 + 7) & ~(size_t) 7;
+        if (i + total > n)
+            goto failure;
+        for (uint32_t j = 0; j <= segments; ++j) {
+            uint32_t words;
+            memcpy(&words, src + i + 4 + 4 * j, 4);
+            total += (size_t) words * 8;
+        }
+        if (i + total > n)
+            goto failure;
+        if (total > capacity) {
+            free(message);
+            capacity = total;
+            if (!(message = malloc(capacity)))
+                goto failure;
+        }
+        memcpy(message, src + i, total);
+        z.next_in = (const uint8_t*) message;
+        z.avail_in = total;
+        if (capn_deflate(&z))
+            goto failure;
+        i += total;
+    }
+    free(message);
+    return (size_t) ((li_byte*) z.next_out - dest);
+failure:
+    free(message);
+    return 0;
+}
+
+// Time decoding every record of a file held in memory
+
+static double decode(const li_byte* data, size_t n, uint64_t* records)
+{
+    double t = seconds();
+    li_reader* r = li_init(malloc, free);
+    double* record = NULL;
+    uint64_t bytes = 0;
+    *records = 0;
+    for (size_t i = 0; i < n; i += LI_PIPELINE_BLOCK_BYTES) {
+        li_put(r, data + i, MIN(n - i, LI_PIPELINE_BLOCK_BYTES));
+        if (!record) {
+            if (li_get(r, LI_RECORD_BYTES_U64, 0, &bytes, sizeof(bytes)))
+                continue;
+            if (!(record = malloc((size_t) bytes)))
+                break;
+        }
+        while (li_get(r, LI_RECORD_F64V, 0, record, (size_t) bytes) == LI_SUCCESS)
+            ++*records;
+    }
+    t = seconds() - t;
+    free(record);
+    li_finalize(r);
+    return t;
+}
+
+static void benchmark_decode(FILE* file)
+{
+    // Load the whole (decompressed) file
+    fseek(file, 0, SEEK_SET);
+    li_source source;
+    li_source_ctor(&source, file, LI_SOURCE_AUTO);
+    size_t n = 0;
+    size_t capacity = LI_PIPELINE_BLOCK_BYTES;
+    li_byte* data = malloc(capacity);
+    size_t m;
+    while (data && (m = li_source_read(&source, data + n, capacity - n))) {
+        n += m;
+        if (n == capacity) {
+            li_byte* p = realloc(data, capacity *= 2);
+            if (!p)
+                free(data);
+            data = p;
+        }
+    }
+    li_source_dtor(&source);
+    if (!data)
+        return;
+
+    li_byte* packed = malloc(n + n / 4 + 16);
+    size_t p = packed ? repack(data, n, packed) : 0;
+    const char* labels[] = { p ? "unpacked" : "as is", "packed" };
+    const li_byte* inputs[] = { data, packed };
+    size_t sizes[] = { n, p };
+    for (int i = 0; i != (p ? 2 : 1); ++i) {
+        uint64_t records = 0;
+        double t = decode(inputs[i], sizes[i], &records);
+        printf("  decode %-8s %10.1f MB/s  (%llu bytes, %llu records in %.3f s)\n",
+               labels[i],
+               sizes[i] / t * 1e-6,
+               (unsigned long long) sizes[i],
+               (unsigned long long) records,
+               t);
+    }
+    free(packed);
+    free(data);
+}
+
+// Time reading a whole file with each input strategy, first with the file
+// evicted from the page cache (cold) and then with it resident (warm), and
+// then decoding it from memory
+
+static void benchmark(FILE* file, const char* filename)
+{
+    li_source_kind kinds[] = { LI_SOURCE_STREAM, LI_SOURCE_PREAD, LI_SOURCE_MMAP };
+    char* buffer = malloc(LI_PIPELINE_BLOCK_BYTES);
+    if (!buffer)
+        return;
+    printf("%s\n", filename);
+    for (size_t i = 0; i != sizeof(kinds) / sizeof(kinds[0]); ++i) {
+        for (int cold = 1; cold >= 0; --cold) {
+            if (cold && li_source_evict(file)) {
+                printf("  %-11s cold  unavailable\n", li_source_kind_name(kinds[i]));
+                continue;
+            }
+            fseek(file, 0, SEEK_SET);
+            li_source source;
+            li_source_ctor(&source, file, kinds[i]);
+            uint64_t total = 0;
+            size_t n;
+            double t = seconds();
+            while ((n = li_source_read(&source, buffer, LI_PIPELINE_BLOCK_BYTES)))
+                total += n;
+            t = seconds() - t;
+            char label[32];
+            snprintf(label, sizeof(label), "%s%s",
+                     li_source_kind_name(source.kind),
+                     source.compressed ? "+gzip" : "");
+            printf("  %-11s %s  %10.1f MB/s  (%llu bytes in %.3f s)\n",
+                   label,
+                   cold ? "cold" : "warm",
+                   total / t * 1e-6,
+                   (unsigned long long) total,
+                   t);
+            li_source_dtor(&source);
+        }
+    }
+    free(buffer);
+    benchmark_decode(file);
+}
+
 static void help()
 {
-    printf("Convert Liquid Instruments binary log files (.li) to\n");
+    printf("Convert Liquid Instruments binary log files (.li or .li.gz) to\n");
     printf("  * Comma Separated Value (.csv)\n");
     printf("  * MATLAB 5.0 MAT-file (.mat)\n");
-    printf("  * NumPy (.npy)");
+    printf("  * NumPy (.npy)\n");
+    printf("  * NumPy archive (.npz)\n");
+    printf("  * Arrow IPC file (.arrow)\n");
+    printf("  * Columnar archive of the raw fields (.lic)\n");
+    printf("or repack them into independently compressed blocks (.liz)\n");
     printf("(C) Liquid Instruments 2016\n");
     printf("\n");
-    printf("usage:   liconvert [--mat] [--csv] [--npy] [--stdin] [file ...]\n");
+    printf("usage:   liconvert [--mat] [--csv] [--npy] [--npz] [--arrow] [--lic] [--formats=csv,mat,...]\n");
+    printf("                   [--pack] [--pack-block=bytes] [--gzindex]\n");
+    printf("                   [--from=seconds|recordr] [--to=seconds|recordr]\n");
+    printf("                   [--stdin] [--source=auto|stream|pread|mmap]\n");
+    printf("                   [--shortest] [--threads=n] [--structured] [--deflate[=level]]\n");
+    printf("                   [--memory=MiB] [--batch=rows] [--block=rows] [--prealloc] [--channel-threads]\n");
+    printf("                   [--checkpoint[=MiB]] [--resume]\n");
+    printf("                   [--count] [--verify] [--benchmark] [file ...]\n");
     printf("\n");
     printf("example: liconvert file              Write file.csv\n");
     printf("         liconvert file1 file2       Write file1.csv and file2.csv\n");
     printf("         liconvert --mat f1 f2       Write f1.mat and f2.mat\n");
     printf("         liconvert --stdin file      Accept binary data from stdin and write to file.csv\n");
     printf("         liconvert --npy file        Write file.npy\n");
+    printf("         liconvert --npy --structured file\n");
+    printf("                                     Write file.npy with fields named from the CSV header\n");
+    printf("         liconvert --npz file        Write file.npz with a member for each column\n");
+    printf("         liconvert --npz --deflate file\n");
+    printf("                                     Write file.npz with compressed members\n");
+    printf("         liconvert --arrow file      Write file.arrow for pyarrow, polars or R arrow\n");
+    printf("         liconvert --arrow --batch=1000000 file\n");
+    printf("                                     Write file.arrow in record batches of a million rows\n");
+    printf("         liconvert --lic file        Write file.lic, packing the raw fields column by column\n");
+    printf("         liconvert --lic --block=65536 file\n");
+    printf("                                     Write file.lic in blocks of 65536 rows\n");
+    printf("         liconvert --from=3600 --to=3660 file\n");
+    printf("                                     Write file.csv with only the records from 3600 s up to 3660 s\n");
+    printf("         liconvert --from=1000r --to=2000r file\n");
+    printf("                                     Write file.csv with only records 1000 to 1999\n");
+    printf("         liconvert --pack file       Write file.liz, which liconvert reads like file.li\n");
+    printf("         liconvert --pack --deflate=9 --pack-block=4194304 file\n");
+    printf("                                     Write file.liz in blocks of at least 4 MiB, compressed harder\n");
+    printf("         liconvert --gzindex file.li.gz\n");
+    printf("                                     Write file.gzi, an index for reading file.li.gz from the middle\n");
+    printf("         liconvert --formats=csv,mat,npy file\n");
+    printf("                                     Write file.csv, file.mat and file.npy, decoding file once\n");
+    printf("         liconvert file.li.gz        Decompress and write file.csv\n");
+    printf("         liconvert --shortest file   Write file.csv with the fewest digits that read back exactly\n");
+    printf("         liconvert --threads=4 file  Write file.csv formatting on 4 threads (default: all processors)\n");
+    printf("         liconvert --mat --deflate file\n");
+    printf("                                     Write file.mat compressed as MATLAB does\n");
+    printf("         liconvert --mat --memory=64 file\n");
+    printf("                                     Write file.mat holding at most 64 MiB of columns in memory\n");
+    printf("         liconvert --prealloc --formats=npy,mat file\n");
+    printf("                                     Count the records first, then write file.npy and file.mat\n");
+    printf("                                     in place on several threads, with no temporary files\n");
+    printf("         liconvert --channel-threads file\n");
+    printf("                                     Write file.csv decoding each channel on a thread of its own\n");
+    printf("         liconvert --checkpoint --formats=csv,npy file\n");
+    printf("                                     Write file.csv and file.npy, saving progress to file.lick\n");
+    printf("                                     every 256 MiB of input\n");
+    printf("         liconvert --resume --formats=csv,npy file\n");
+    printf("                                     Carry on from file.lick after the run above was killed\n");
+    printf("         liconvert --count file      Print the number of records without decoding them\n");
+    printf("         liconvert --verify file     Check the framing and sync fields of every record,\n");
+    printf("                                     printing the offset of the first problem\n");
+    printf("         liconvert --benchmark file  Compare input strategies on cold and warm cache,\n");
+    printf("                                     and decoding packed and unpacked messages\n");
 }
 
 int main(int argc, char** argv) {
     if (argc == 1)
         help();
     enum {
-        csv, mat, npy
-    } kind = csv;
+        csv, mat, npy, npz, arrow, lic, kinds
+    };
+    char* extensions[kinds] = { "csv", "mat", "npy", "npz", "arrow", "lic" };
+    unsigned formats = 1 << csv; // Set of kinds to write
+    enum {
+        converting, benchmarking, packing, indexing, counting, verifying
+    } mode = converting; // What to do with each file
+    bool prealloc = false;
+    bool channel_threads = false;
+    bool checkpointing = false; // Save progress to file.lick
+    bool resume = false;        // Carry on from file.lick, if it exists
+    uint64_t checkpoint_bytes = 0;
+    li_source_kind source_kind = LI_SOURCE_AUTO;
+    li_csv_options csv_options = { 0 };
+    li_npy_options npy_options = { 0 };
+    li_mat_options mat_options = { 0 };
+    li_npz_options npz_options = { 0 };
+    li_arrow_options arrow_options = { 0 };
+    li_lic_options lic_options = { 0 };
+    li_pack_options pack_options = { 0 };
+    li_verify_options verify_options = { 0 };
+    double from_time = -INFINITY; // Window of records to convert
+    double to_time = INFINITY;
+    uint64_t from_row = 0;
+    uint64_t to_row = UINT64_MAX;
+    bool from_is_row = false;
+    bool to_is_row = false;
+    bool from_set = false;
+    bool to_set = false;
     bool use_stdin = false;
+    li_reader* reader = NULL; // Shared by the files, which often have the same header
+    int status = EXIT_SUCCESS; // Fails if a file doesn't verify
     bool stdin_already_used = false;
 
     while (*++argv)
         if (**argv == '-') { // Process a flag
             if (!strcmp(*argv, "--csv")) {
-                kind = csv;
+                formats = 1 << csv;
+                mode = converting;
             } else if (!strcmp(*argv, "--mat")) {
-                kind = mat;
+                formats = 1 << mat;
+                mode = converting;
             } else if (!strcmp(*argv, "--npy")) {
-                kind = npy;
+                formats = 1 << npy;
+                mode = converting;
+            } else if (!strcmp(*argv, "--npz")) {
+                formats = 1 << npz;
+                mode = converting;
+            } else if (!strcmp(*argv, "--arrow")) {
+                formats = 1 << arrow;
+                mode = converting;
+            } else if (!strcmp(*argv, "--lic")) {
+                formats = 1 << lic;
+                mode = converting;
+            } else if (!strncmp(*argv, "--formats=", 10)) {
+                formats = 0;
+                for (char* p = *argv + 10; *p; ) {
+                    size_t n = strcspn(p, ",");
+                    int k = 0;
+                    while ((k != kinds) && ((strlen(extensions[k]) != n) || strncmp(p, extensions[k], n)))
+                        ++k;
+                    if (k == kinds) {
+                        printf("Unrecognized format \"%.*s\"\n", (int) n, p);
+                        return EXIT_FAILURE;
+                    }
+                    formats |= 1u << k;
+                    p += n + (p[n] == ',');
+                }
+                if (!formats) {
+                    printf("No formats in \"%s\"\n", *argv);
+                    return EXIT_FAILURE;
+                }
+                mode = converting;
+            } else if (!strcmp(*argv, "--pack")) {
+                mode = packing;
+            } else if (!strcmp(*argv, "--gzindex")) {
+                mode = indexing;
+            } else if (!strcmp(*argv, "--count")) {
+                mode = counting;
+            } else if (!strcmp(*argv, "--verify")) {
+                mode = verifying;
+            } else if (!strncmp(*argv, "--pack-block=", 13)) {
+                char* end = NULL;
+                long n = strtol(*argv + 13, &end, 10);
+                if ((end == *argv + 13) || *end || (n <= 0)) {
+                    printf("Unrecognized block size \"%s\"\n", *argv + 13);
+                    return EXIT_FAILURE;
+                }
+                pack_options.block_bytes = (size_t) n;
+            } else if (!strncmp(*argv, "--from=", 7) || !strncmp(*argv, "--to=", 5)) {
+                bool to = (*argv)[2] == 't';
+                char* bound = strchr(*argv, '=') + 1;
+                if (!li_parse_bound(bound, to ? &to_time : &from_time, to ? &to_row : &from_row,
+                                    to ? &to_is_row : &from_is_row)) {
+                    printf("Unrecognized time or record \"%s\"\n", bound);
+                    return EXIT_FAILURE;
+                }
+                if (to)
+                    to_set = true;
+                else
+                    from_set = true;
+                if (from_set && to_set && (from_is_row != to_is_row)) {
+                    printf("Give --from and --to both in seconds or both as records\n");
+                    return EXIT_FAILURE;
+                }
+                if (from_set && to_set && (from_is_row ? (from_row > to_row) : (from_time > to_time))) {
+                    printf("--from is after --to\n");
+                    return EXIT_FAILURE;
+                }
+            } else if (!strncmp(*argv, "--batch=", 8)) {
+                char* end = NULL;
+                long n = strtol(*argv + 8, &end, 10);
+                if ((end == *argv + 8) || *end || (n <= 0)) {
+                    printf("Unrecognized batch size \"%s\"\n", *argv + 8);
+                    return EXIT_FAILURE;
+                }
+                arrow_options.batch_rows = (size_t) n;
+            } else if (!strncmp(*argv, "--block=", 8)) {
+                char* end = NULL;
+                long n = strtol(*argv + 8, &end, 10);
+                if ((end == *argv + 8) || *end || (n <= 0)) {
+                    printf("Unrecognized block size \"%s\"\n", *argv + 8);
+                    return EXIT_FAILURE;
+                }
+                lic_options.block_rows = (size_t) n;
+            } else if (!strcmp(*argv, "--deflate")) {
+                npz_options.level = 6; // As zlib's default
+                mat_options.level = 6;
+                pack_options.level = 6;
+            } else if (!strncmp(*argv, "--deflate=", 10)) {
+                char* end = NULL;
+                long n = strtol(*argv + 10, &end, 10);
+                if ((end == *argv + 10) || *end || (n < 0) || (n > 9)) {
+                    printf("Unrecognized compression level \"%s\"\n", *argv + 10);
+                    return EXIT_FAILURE;
+                }
+                npz_options.level = (int) n;
+                mat_options.level = (int) n;
+                pack_options.level = n ? (int) n : -1;
+            } else if (!strcmp(*argv, "--prealloc")) {
+                prealloc = true;
+            } else if (!strcmp(*argv, "--checkpoint")) {
+                checkpointing = true;
+            } else if (!strncmp(*argv, "--checkpoint=", 13)) {
+                char* end = NULL;
+                long n = strtol(*argv + 13, &end, 10);
+                if ((end == *argv + 13) || *end || (n <= 0)) {
+                    printf("Unrecognized checkpoint interval \"%s\"\n", *argv + 13);
+                    return EXIT_FAILURE;
+                }
+                checkpointing = true;
+                checkpoint_bytes = (uint64_t) n << 20;
+            } else if (!strcmp(*argv, "--resume")) {
+                checkpointing = true;
+                resume = true;
+            } else if (!strcmp(*argv, "--channel-threads")) {
+                channel_threads = true;
+            } else if (!strcmp(*argv, "--structured")) {
+                npy_options.structured = true;
+            } else if (!strcmp(*argv, "--shortest")) {
+                csv_options.shortest = true;
+            } else if (!strncmp(*argv, "--threads=", 10)) {
+                char* end = NULL;
+                long n = strtol(*argv + 10, &end, 10);
+                if ((end == *argv + 10) || *end || (n < 0)) {
+                    printf("Unrecognized thread count \"%s\"\n", *argv + 10);
+                    return EXIT_FAILURE;
+                }
+                csv_options.threads = (size_t) n;
+                npy_options.threads = (size_t) n;
+                mat_options.threads = (size_t) n;
+                verify_options.threads = (size_t) n;
+            } else if (!strncmp(*argv, "--memory=", 9)) {
+                char* end = NULL;
+                long n = strtol(*argv + 9, &end, 10);
+                if ((end == *argv + 9) || *end || (n <= 0)) {
+                    printf("Unrecognized memory size \"%s\"\n", *argv + 9);
+                    return EXIT_FAILURE;
+                }
+                mat_options.memory = (size_t) n << 20;
+                npz_options.memory = (size_t) n << 20;
+            } else if (!strcmp(*argv, "--benchmark")) {
+                mode = benchmarking;
+            } else if (!strncmp(*argv, "--source=", 9)) {
+                li_source_kind k = LI_SOURCE_AUTO;
+                while ((k <= LI_SOURCE_MMAP) && strcmp(*argv + 9, li_source_kind_name(k)))
+                    ++k;
+                if (k > LI_SOURCE_MMAP) {
+                    printf("Unrecognized source \"%s\"\n", *argv + 9);
+                    return EXIT_FAILURE;
+                }
+                source_kind = k;
             } else if (!strcmp(*argv, "--stdin")) {
                 if (stdin_already_used) {
                     printf("Cannot process stdin twice\n");
@@ -89,47 +638,215 @@ int main(int argc, char** argv) {
                 fprintf(stderr, "Could not open \"%s\"\n", *argv);
                 continue;
             }
-            char* outname = NULL;
-            switch (kind) {
-                case csv:
-                    outname = li_change_extension(*argv, "csv");
-                    break;
-                case mat:
-                    outname = li_change_extension(*argv, "mat");
-                    break;
-                case npy:
-                    outname = li_change_extension(*argv, "npy");
-                    break;
+            li_source source = { 0 };
+            li_input_index index = { 0 };
+            li_sink* sinks[kinds] = { NULL };
+            FILE* outfiles[kinds] = { NULL };
+            size_t count = 0;
+            char* checkpoint = NULL;
+            bool resuming = false;
+            if (mode == benchmarking) {
+                benchmark(infile, *argv);
+                goto cleanup;
             }
-            
-            //printf("%s -> %s\n", *argv, outname);
-            
-            FILE* outfile = fopen(outname, "w+b");
-            if (!outfile) {
-                fprintf(stderr, "Could not open \"%s\" for output\n", outname);
+            if (mode == indexing) {
+                char* outname = li_change_extension(*argv, "gzi");
+                FILE* outfile = outname ? fopen(outname, "wb") : NULL;
+                if (!outfile) {
+                    fprintf(stderr, "Could not open \"%s\" for output\n", outname ? outname : *argv);
+                    free(outname);
+                    goto cleanup;
+                }
+                free(outname);
+                outfiles[0] = outfile;
+                li_status result = li_gzindex_build(infile, outfile, NULL, NULL, NULL);
+                if (result)
+                    printf("%s error indexing \"%s\"\n", li_status_string(result), *argv);
+                goto cleanup;
+            }
+            li_source_ctor(&source, infile, source_kind);
+            if (mode == counting) {
+                uint64_t records = 0;
+                li_status result = li_count_records(&source, &records, NULL, NULL);
+                if (result)
+                    printf("%s error counting \"%s\"\n", li_status_string(result), *argv);
+                else
+                    printf("%s: %llu records\n", *argv, (unsigned long long) records);
+                goto cleanup;
+            }
+            if (mode == verifying) {
+                li_verify_report report;
+                li_status result = li_verify(&source, &verify_options, &report, NULL, NULL);
+                if (result == LI_BAD_FORMAT) {
+                    printf("%s: %s at offset %llu, after %llu good records\n", *argv, report.problem,
+                           (unsigned long long) report.offset, (unsigned long long) report.records);
+                    status = EXIT_FAILURE;
+                } else if (result) {
+                    printf("%s error verifying \"%s\"\n", li_status_string(result), *argv);
+                    status = EXIT_FAILURE;
+                } else if (report.skipped) {
+                    printf("%s: OK, %llu records after skipping %llu bytes of each channel\n", *argv,
+                           (unsigned long long) report.records, (unsigned long long) report.skipped);
+                } else {
+                    printf("%s: OK, %llu records\n", *argv, (unsigned long long) report.records);
+                }
+                goto cleanup;
+            }
+            if (mode == packing) {
+                char* outname = li_change_extension(*argv, "liz");
+                FILE* outfile = outname ? fopen(outname, "wb") : NULL;
+                if (!outfile) {
+                    fprintf(stderr, "Could not open \"%s\" for output\n", outname ? outname : *argv);
+                    free(outname);
+                    goto cleanup;
+                }
+                free(outname);
+                outfiles[0] = outfile;
+                li_status result = li_source_to_pack(&source, outfile, &pack_options, NULL, NULL);
+                if (result)
+                    printf("%s error packing \"%s\"\n", li_status_string(result), *argv);
                 goto cleanup;
             }
-            li_status result;
-            switch (kind) {
-                case csv:
-                    result = li_to_csv(infile, outfile, NULL, NULL);
-                    break;
-                case mat:
-                    result = li_to_mat(infile, outfile, NULL, NULL);
-                    break;
-                case npy:
-                    result = li_to_npy(infile, outfile, NULL, NULL);
-                    break;
+            
+            if (checkpointing) {
+                // MAT-files are only written in place, as checkpoints need,
+                // when uncompressed and counted first
+                unsigned resumable = (1u << csv) | (1u << npy);
+                if (!mat_options.level && !use_stdin)
+                    resumable |= 1u << mat;
+                if (formats & ~resumable) {
+                    printf("Checkpoints need csv, npy or uncompressed mat output converting \"%s\"\n", *argv);
+                    goto cleanup;
+                }
+                checkpoint = li_change_extension(*argv, "lick");
+                if (!checkpoint) {
+                    printf("%s error converting \"%s\"\n", li_status_string(LI_BAD_ALLOC), *argv);
+                    goto cleanup;
+                }
+                // Resuming carries on with the outputs as they are
+                FILE* file = resume ? fopen(checkpoint, "rb") : NULL;
+                if (file) {
+                    resuming = true;
+                    fclose(file);
+                }
+            }
+
+            // Decode once for all the formats, writing each on its own
+            // thread if there are several
+            for (int k = 0; k != kinds; ++k) {
+                if (!(formats & (1u << k)))
+                    continue;
+                char* outname = li_change_extension(*argv, extensions[k]);
+                FILE* outfile = outname ? fopen(outname, resuming ? "r+b" : "w+b") : NULL;
+                if (!outfile) {
+                    fprintf(stderr, "Could not open \"%s\" for output\n", outname ? outname : *argv);
+                    free(outname);
+                    goto cleanup;
+                }
+                free(outname);
+                outfiles[count] = outfile;
+                li_sink* sink = NULL;
+                switch (k) {
+                    case csv:
+                        sink = li_csv_sink_new(outfile, &csv_options);
+                        break;
+                    case mat:
+                        sink = li_mat_sink_new(outfile, &mat_options);
+                        break;
+                    case npy:
+                        sink = li_npy_sink_new(outfile, &npy_options);
+                        break;
+                    case npz:
+                        sink = li_npz_sink_new(outfile, &npz_options);
+                        break;
+                    case arrow:
+                        sink = li_arrow_sink_new(outfile, &arrow_options);
+                        break;
+                    case lic:
+                        sink = li_lic_sink_new(outfile, &lic_options);
+                        break;
+                }
+                if (!sink) {
+                    printf("%s error converting \"%s\"\n", li_status_string(LI_BAD_ALLOC), *argv);
+                    goto cleanup;
+                }
+                sink->threaded = (formats & (formats - 1)) != 0;
+                sinks[count++] = sink;
+            }
+            if (!reader)
+                reader = li_init(malloc, free);
+            li_convert_options window = {
+                .first = from_row,
+                .count = UINT64_MAX,
+                .from = from_time,
+                .to = to_time,
+                .channel_threads = channel_threads,
+                .reader = reader,
+                .checkpoint = checkpoint,
+                .checkpoint_bytes = checkpoint_bytes,
+                .resume = resume,
+            };
+            if ((from_set && !from_is_row) || (to_set && !to_is_row))
+                window.timed = true;
+            else if (to_row != UINT64_MAX)
+                window.count = (to_row > from_row) ? (to_row - from_row) : 0;
+            // A window starting part way through a file with an index is
+            // read from the block or checkpoint before it.  Checkpoints
+            // record where they are in the whole input, so don't mix with
+            // this.
+            bool seeking = from_set && !checkpointing && !use_stdin && !fseek(infile, 0, SEEK_CUR);
+            if (seeking) {
+                li_source_dtor(&source);
+                li_input_index_open(&index, infile, *argv);
+                li_status result = li_window_source(&source, infile, source_kind, &index, &window);
+                if (result) {
+                    printf("%s error converting \"%s\"\n", li_status_string(result), *argv);
+                    goto cleanup;
+                }
+            }
+            // Outputs are written in place when asked to be, and MAT-files
+            // must be to be checkpointed; CSV and NPY can be checkpointed
+            // as they are appended.  A checkpoint already knows how many
+            // records there are.
+            unsigned placed = prealloc ? ((1u << npy) | (1u << mat)) : checkpointing ? (1u << mat) : 0;
+            if (!resuming && !use_stdin && (formats & placed)) {
+                // Count the records, then read the file again to convert
+                // knowing how large the outputs will be
+                li_status result = li_count_records(&source, &window.records, NULL, NULL);
+                li_source_dtor(&source);
+                if (!result && fseek(infile, 0, SEEK_SET))
+                    result = LI_IO_ERROR;
+                if (result) {
+                    printf("%s error counting \"%s\"\n", li_status_string(result), *argv);
+                    goto cleanup;
+                }
+                if (seeking)
+                    result = li_window_source(&source, infile, source_kind, &index, &window);
+                else
+                    li_source_ctor(&source, infile, source_kind);
+                if (result) {
+                    printf("%s error converting \"%s\"\n", li_status_string(result), *argv);
+                    goto cleanup;
+                }
             }
+            li_status result = li_convert(&source, sinks, count, &window, NULL, NULL);
             if (result)
                 printf("%s error converting \"%s\"\n", li_status_string(result), *argv);
-            fclose(outfile);
         cleanup:
-            free(outname);
+            free(checkpoint);
+            for (size_t i = 0; i != count; ++i)
+                li_sink_release(sinks[i]);
+            for (int k = 0; k != kinds; ++k)
+                if (outfiles[k])
+                    fclose(outfiles[k]);
+            li_source_dtor(&source);
+            li_input_index_close(&index);
             if (!use_stdin)
                 fclose(infile);
             else
                 use_stdin = false;
         }
-    return EXIT_SUCCESS;
+    if (reader)
+        li_finalize(reader);
+    return status;
 }
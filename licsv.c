@@ -0,0 +1,358 @@
+//
+//  licsv.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "licsv.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+void li_csv_program_ctor(li_csv_program* self) {
+    assert(self);
+    li_array_ctor(li_csv_op)(&self->ops);
+    self->row_bytes = 0;
+}
+
+void li_csv_program_dtor(li_csv_program* self) {
+    assert(self);
+    li_array_dtor(li_csv_op)(&self->ops);
+}
+
+static li_status li_csv_emit(li_csv_program* self, li_csv_op op) {
+    memcpy(op.literal, ", ", 2);
+    // Formats that li_fmt handles have a bounded length; for printf we guess
+    self->row_bytes += LI_FMT_MAX + (size_t) MAX(op.spec.width, 0) + sizeof(op.literal);
+    return li_array_push(li_csv_op)(&self->ops, op);
+}
+
+li_status li_csv_compile(li_csv_program* self,
+                         li_array(Replacement)* replacements,
+                         size_t columns,
+                         bool shortest)
+{
+    assert(self && replacements);
+    li_array_clear(li_csv_op)(&self->ops);
+    self->row_bytes = 0;
+
+    li_csv_op op;
+    memset(&op, 0, sizeof(op));
+    if (li_array_empty(Replacement)(replacements)) {
+        // There's no format string so print time followed by everything
+        op.kind = LI_CSV_TIME;
+        li_fmt_parse(&op.spec, "%.10e");
+        LI_DOUBT(li_csv_emit(self, op));
+        op.kind = LI_CSV_VALUE;
+        li_fmt_parse(&op.spec, "%.16e");
+        op.spec.shortest = shortest;
+        for (op.column = 0; op.column != columns; ++op.column)
+            LI_DOUBT(li_csv_emit(self, op));
+    } else {
+        LI_FOR(Replacement, p, replacements) {
+            memset(&op, 0, sizeof(op));
+            op.format = p->format;
+            switch (*p->identifier) {
+                case 't':
+                    op.kind = LI_CSV_TIME;
+                    break;
+                case 'n':
+                    op.kind = LI_CSV_ROW;
+                    break;
+                case 'c':
+                    op.kind = LI_CSV_VALUE;
+                    op.column = p->index;
+                    assert(op.column < columns);
+                    break;
+                default:
+                    op.kind = LI_CSV_EMPTY;
+                    break;
+            }
+            // Formats li_fmt can't handle keep no conversion and go to printf
+            if (!p->format || !li_fmt_parse(&op.spec, p->format))
+                memset(&op.spec, 0, sizeof(op.spec));
+            if (shortest && (op.kind == LI_CSV_VALUE))
+                op.spec.shortest = true;
+            LI_DOUBT(li_csv_emit(self, op));
+        }
+    }
+    // CR+LF line end
+    memcpy(li_array_end(li_csv_op)(&self->ops)[-1].literal, "\r\n", 2);
+    return LI_SUCCESS;
+}
+
+size_t li_csv_run(const li_csv_program* self,
+                  char* dest,
+                  size_t capacity,
+                  double t,
+                  uint64_t row,
+                  const double* record)
+{
+    assert(self && (dest || !capacity));
+    size_t n = 0; // Length so far; we keep counting after we run out of room
+    for (const li_csv_op* p = self->ops.begin; p != self->ops.end; ++p) {
+        size_t room = (n < capacity) ? capacity - n : 0;
+        char* q = dest + (room ? n : 0);
+        double x = (p->kind == LI_CSV_TIME) ? t : record[p->column];
+        switch (p->kind) {
+            case LI_CSV_TIME:
+            case LI_CSV_VALUE:
+                if (p->spec.conversion) {
+                    n += li_fmt_double(q, room, x, &p->spec);
+                } else {
+                    int m = snprintf(q, room, p->format, x);
+                    n += (m > 0) ? (size_t) m : 0;
+                }
+                break;
+            case LI_CSV_ROW:
+                if (room > 20)
+                    n += li_fmt_u64(q, row);
+                else
+                    n += 20; // Retry with enough room
+                break;
+            case LI_CSV_EMPTY:
+                break;
+        }
+        if (n + 2 <= capacity)
+            memcpy(dest + n, p->literal, 2);
+        n += 2;
+    }
+    return n;
+}
+
+
+
+// li_csv_pool operations
+
+// Make room for n more bytes in the current output block, handing it to the
+// writer thread first if it is too full.  Returns where to write.
+
+static char* li_csv_room(li_pipeline* pipe, li_block** out, size_t n) {
+    li_block* b = *out;
+    if (b->capacity - b->size < n) {
+        if (b->size) {
+            li_pipeline_submit(pipe, b);
+            b = *out = li_pipeline_acquire(pipe);
+        }
+        if (li_block_reserve(b, n)) {
+            li_pipeline_fail(pipe, LI_BAD_ALLOC);
+            return NULL;
+        }
+    }
+    return (char*) b->begin + b->size;
+}
+
+// Grow a block keeping its contents
+
+static li_status li_csv_grow(li_block* self, size_t capacity) {
+    if (capacity <= self->capacity)
+        return LI_SUCCESS;
+    capacity = MAX(capacity, 2 * self->capacity);
+    li_byte* p = li_alloc(capacity);
+    if (!p)
+        return LI_BAD_ALLOC;
+    memcpy(p, self->begin, self->size);
+    li_dealloc(self->begin);
+    self->begin = p;
+    self->capacity = capacity;
+    return LI_SUCCESS;
+}
+
+static void li_csv_format(const li_csv_pool* self, li_csv_batch* batch) {
+    li_block* text = &batch->text;
+    text->size = 0;
+    batch->status = li_block_reserve(text, batch->count * self->program->row_bytes);
+    const double* record = (const double*) batch->records.begin;
+    for (size_t i = 0; (i != batch->count) && !batch->status; ++i, record += self->columns) {
+        uint64_t row = batch->row + i;
+        double t = self->start + self->step * (double) row;
+        for (;;) {
+            size_t room = text->capacity - text->size;
+            size_t m = li_csv_run(self->program, (char*) text->begin + text->size, room, t, row, record);
+            if (m < room) {
+                text->size += m;
+                break;
+            }
+            if ((batch->status = li_csv_grow(text, text->size + m + 1)))
+                break;
+        }
+    }
+}
+
+static void* li_csv_worker_main(void* ptr) {
+    li_csv_worker* self = ptr;
+    li_csv_batch* batch;
+    while ((batch = li_spsc_pop(&self->todo))) {
+        li_csv_format(self->pool, batch);
+        li_spsc_push(&self->done, batch);
+    }
+    return NULL;
+}
+
+void li_csv_pool_ctor(li_csv_pool* self) {
+    assert(self);
+    memset(self, 0, sizeof(li_csv_pool));
+}
+
+void li_csv_pool_dtor(li_csv_pool* self) {
+    assert(self);
+    if (self->workers) {
+        for (size_t i = 0; i != self->threads; ++i) {
+            li_csv_worker* w = self->workers + i;
+            if (w->started) {
+                li_spsc_push(&w->todo, NULL);
+                pthread_join(w->thread, NULL);
+            }
+            for (int j = 0; j != LI_CSV_DEPTH; ++j) {
+                li_block_dtor(&w->batches[j].records);
+                li_block_dtor(&w->batches[j].text);
+            }
+            li_spsc_dtor(&w->done);
+            li_spsc_dtor(&w->todo);
+        }
+        li_dealloc(self->workers);
+    }
+    li_block_dtor(&self->record);
+    li_csv_pool_ctor(self);
+}
+
+li_status li_csv_pool_start(li_csv_pool* self,
+                            const li_csv_program* program,
+                            size_t columns,
+                            double start,
+                            double step,
+                            size_t threads,
+                            li_pipeline* pipe,
+                            li_block** out)
+{
+    assert(self && program && pipe && out);
+    li_csv_pool_dtor(self);
+    self->program = program;
+    self->columns = columns;
+    self->start = start;
+    self->step = step;
+    self->pipe = pipe;
+    self->out = out;
+    if (!threads)
+        threads = MIN(li_thread_count() - 1, LI_CSV_THREADS_MAX);
+    if (threads <= 1) {
+        self->threads = 1;
+        return li_block_ctor(&self->record, MAX(columns, 1) * sizeof(double));
+    }
+
+    // Batches of about one output block
+    self->batch_rows = MAX(LI_PIPELINE_BLOCK_BYTES / MAX(program->row_bytes, 1), 1);
+    self->workers = li_alloc(threads * sizeof(li_csv_worker));
+    if (!self->workers)
+        return LI_BAD_ALLOC;
+    memset(self->workers, 0, threads * sizeof(li_csv_worker));
+    self->threads = threads;
+    for (size_t i = 0; i != threads; ++i) {
+        li_csv_worker* w = self->workers + i;
+        w->pool = self;
+        LI_DOUBT(li_spsc_ctor(&w->todo, LI_CSV_DEPTH + 1)); // Room for the stop signal
+        LI_DOUBT(li_spsc_ctor(&w->done, LI_CSV_DEPTH));
+        for (int j = 0; j != LI_CSV_DEPTH; ++j)
+            LI_DOUBT(li_block_ctor(&w->batches[j].records, self->batch_rows * MAX(columns, 1) * sizeof(double)));
+        if (pthread_create(&w->thread, NULL, li_csv_worker_main, w))
+            return LI_BAD_ALLOC;
+        w->started = true;
+    }
+    return LI_SUCCESS;
+}
+
+// Batches are dealt to workers in turn, so batch k is always in the same
+// slot of the same worker
+
+static li_csv_batch* li_csv_pool_batch(li_csv_pool* self, uint64_t k) {
+    return self->workers[k % self->threads].batches + (k / self->threads) % LI_CSV_DEPTH;
+}
+
+// Wait for the oldest batch and hand its text to the writer
+
+static li_status li_csv_pool_collect(li_csv_pool* self, uint64_t* written) {
+    li_csv_worker* w = self->workers + self->collected % self->threads;
+    li_csv_batch* batch = li_spsc_pop(&w->done);
+    assert(batch == li_csv_pool_batch(self, self->collected));
+    ++self->collected;
+    batch->count = 0;
+    if (batch->status) {
+        li_pipeline_fail(self->pipe, batch->status);
+        return batch->status;
+    }
+    // Send anything already in the output block first, then trade the
+    // formatted text for an empty output block
+    li_block* b = *self->out;
+    if (b->size) {
+        li_pipeline_submit(self->pipe, b);
+        b = li_pipeline_acquire(self->pipe);
+    }
+    li_block text = batch->text;
+    batch->text = *b;
+    *b = text;
+    *written += b->size;
+    li_pipeline_submit(self->pipe, b);
+    *self->out = li_pipeline_acquire(self->pipe);
+    return LI_SUCCESS;
+}
+
+static li_status li_csv_pool_dispatch(li_csv_pool* self, uint64_t* written) {
+    li_csv_batch* batch = li_csv_pool_batch(self, self->dispatched);
+    li_spsc_push(&self->workers[self->dispatched % self->threads].todo, batch);
+    ++self->dispatched;
+    // Make sure the next batch is free
+    if (self->dispatched - self->collected == self->threads * LI_CSV_DEPTH)
+        LI_DOUBT(li_csv_pool_collect(self, written));
+    return LI_SUCCESS;
+}
+
+double* li_csv_pool_record(li_csv_pool* self) {
+    assert(self && self->program);
+    if (!self->workers)
+        return (double*) self->record.begin;
+    li_csv_batch* batch = li_csv_pool_batch(self, self->dispatched);
+    if (!batch->count)
+        batch->row = self->rows;
+    return (double*) batch->records.begin + batch->count * self->columns;
+}
+
+li_status li_csv_pool_commit(li_csv_pool* self, uint64_t* written) {
+    assert(self && self->program && written);
+    uint64_t row = self->rows++;
+    if (!self->workers) {
+        double t = self->start + self->step * (double) row;
+        // Format the row in place, growing the block for unusually long
+        // values
+        size_t m = self->program->row_bytes;
+        for (;;) {
+            char* dest = li_csv_room(self->pipe, self->out, m);
+            if (!dest)
+                return LI_BAD_ALLOC;
+            size_t room = (*self->out)->capacity - (*self->out)->size;
+            m = li_csv_run(self->program, dest, room, t, row, (const double*) self->record.begin);
+            if (m < room)
+                break;
+            ++m;
+        }
+        (*self->out)->size += m;
+        *written += m;
+        return LI_SUCCESS;
+    }
+    li_csv_batch* batch = li_csv_pool_batch(self, self->dispatched);
+    if (++batch->count == self->batch_rows)
+        return li_csv_pool_dispatch(self, written);
+    return LI_SUCCESS;
+}
+
+li_status li_csv_pool_finish(li_csv_pool* self, uint64_t* written) {
+    assert(self && written);
+    if (!self->workers)
+        return LI_SUCCESS;
+    if (li_csv_pool_batch(self, self->dispatched)->count)
+        LI_DOUBT(li_csv_pool_dispatch(self, written));
+    while (self->collected != self->dispatched)
+        LI_DOUBT(li_csv_pool_collect(self, written));
+    return LI_SUCCESS;
+}
@@ -0,0 +1,159 @@
+//
+//  licsv.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef licsv_h
+#define licsv_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lifmt.h"
+#include "liparse.h"
+#include "lipipeline.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_csv_program is the CSV format string of a file compiled once into a
+    // list of operations, so that formatting a row neither walks the
+    // Replacement list nor parses printf formats.  Each operation writes one
+    // value followed by its separator.
+
+    typedef enum li_csv_kind {
+        LI_CSV_TIME = 0,  // Time of the record
+        LI_CSV_ROW = 1,   // Zero-based row number
+        LI_CSV_VALUE = 2, // An element of the record
+        LI_CSV_EMPTY = 3, // Unknown identifier; only the separator is written
+    } li_csv_kind;
+
+    typedef struct li_csv_op {
+        li_csv_kind kind;
+        size_t column;      // Index into the record for LI_CSV_VALUE
+        li_fmt_spec spec;   // If spec.conversion is 0 we fall back to printf ...
+        const char* format; // ... with this format, borrowed from the Replacement
+        char literal[2];    // Separator following the value, ", " or "\r\n"
+    } li_csv_op;
+
+    inline static void li_csv_op_dtor(li_csv_op* self) {};
+    li_array_define(li_csv_op);
+
+    typedef struct li_csv_program {
+        li_array(li_csv_op) ops;
+        size_t row_bytes;   // Room for a row, unless a value is unusually long
+    } li_csv_program;
+
+    void li_csv_program_ctor(li_csv_program* self);
+    void li_csv_program_dtor(li_csv_program* self);
+
+    // Compile a Replacement list whose indices have been resolved to
+    // positions in a record of the given number of columns.  Replacements
+    // must outlive the program.  An empty list gives the default format,
+    // time then every column.  shortest selects round-trip formatting for
+    // the columns.
+    li_status li_csv_compile(li_csv_program* self,
+                             li_array(Replacement)* replacements,
+                             size_t columns,
+                             bool shortest);
+
+    // Format one row into dest, like snprintf without the terminating null.
+    // Returns the length of the row; if it is not less than capacity the row
+    // is incomplete and should be retried with more room.
+    size_t li_csv_run(const li_csv_program* self,
+                      char* dest,
+                      size_t capacity,
+                      double t,
+                      uint64_t row,
+                      const double* record);
+
+
+
+    // li_csv_pool formats rows on a pool of threads.  The decoding thread
+    // writes records directly into batches, which are dealt round-robin to
+    // the formatter threads and collected in the same order, so the output
+    // is identical to formatting on one thread.  Formatted batches are handed
+    // to an li_pipeline writer by swapping buffers with its output blocks.
+    // With one thread, rows are formatted directly into the output block.
+    //
+    // li_csv_pool pool;
+    // li_csv_pool_ctor(&pool);
+    // li_csv_pool_start(&pool, &program, columns, start, step, 0, &pipe, &out);
+    // while (li_get(r, LI_RECORD_F64V, 0, li_csv_pool_record(&pool), bytes) == LI_SUCCESS)
+    //     li_csv_pool_commit(&pool, &written);
+    // li_csv_pool_finish(&pool, &written);
+    // li_csv_pool_dtor(&pool);
+
+#define LI_CSV_DEPTH 2          // Batches in flight per formatter thread
+#define LI_CSV_THREADS_MAX 16
+
+    typedef struct li_csv_batch {
+        li_block records;   // Decoded records, columns doubles each
+        size_t count;       // Records in the batch
+        uint64_t row;       // Row number of the first record
+        li_block text;      // The formatted rows
+        li_status status;
+    } li_csv_batch;
+
+    typedef struct li_csv_worker {
+        struct li_csv_pool* pool;
+        li_spsc todo;       // decode -> formatter
+        li_spsc done;       // formatter -> decode
+        li_csv_batch batches[LI_CSV_DEPTH];
+        pthread_t thread;
+        bool started;
+    } li_csv_worker;
+
+    typedef struct li_csv_pool {
+        const li_csv_program* program;
+        size_t columns;
+        double start;       // Time of row 0
+        double step;        // Time between rows
+        li_pipeline* pipe;
+        li_block** out;     // Current output block of pipe
+
+        size_t threads;
+        size_t batch_rows;
+        li_csv_worker* workers; // NULL when formatting on the calling thread
+        li_block record;        // Record when formatting on the calling thread
+        uint64_t dispatched;    // Batches handed to workers
+        uint64_t collected;     // Batches handed to the pipeline
+
+        uint64_t rows;          // Rows committed
+    } li_csv_pool;
+
+    void li_csv_pool_ctor(li_csv_pool* self);
+
+    // Stop and join the formatter threads, discarding unfinished batches
+    void li_csv_pool_dtor(li_csv_pool* self);
+
+    // Start formatting with a compiled program, writing to a pipeline.
+    // threads is the number of formatter threads, or 0 to choose from the
+    // number of processors.
+    li_status li_csv_pool_start(li_csv_pool* self,
+                                const li_csv_program* program,
+                                size_t columns,
+                                double start,
+                                double step,
+                                size_t threads,
+                                li_pipeline* pipe,
+                                li_block** out);
+
+    // Where to decode the next record, which is formatted once committed.
+    // Commit and finish add the bytes handed to the pipeline to *written.
+    double* li_csv_pool_record(li_csv_pool* self);
+    li_status li_csv_pool_commit(li_csv_pool* self, uint64_t* written);
+
+    // Format the remaining records and hand everything to the pipeline
+    li_status li_csv_pool_finish(li_csv_pool* self, uint64_t* written);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* licsv_h */
@@ -0,0 +1,138 @@
+//
+//  lidecode.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lidecode.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "liutility.h"
+
+static void* li_decode_worker_main(void* ptr) {
+    li_decode_worker* self = ptr;
+    li_decode_pool* pool = self->pool;
+    li_decode_run* run;
+    while ((run = li_spsc_pop(&self->todo))) {
+        run->status = li_decode_records(pool->reader, self->index, run->payload.begin, run->count,
+                                        run->dest, run->raw, pool->stride);
+        li_spsc_push(&self->done, run);
+    }
+    return NULL;
+}
+
+void li_decode_pool_ctor(li_decode_pool* self) {
+    assert(self);
+    memset(self, 0, sizeof(li_decode_pool));
+}
+
+void li_decode_pool_dtor(li_decode_pool* self) {
+    assert(self);
+    if (self->workers) {
+        for (size_t i = 0; i != self->count; ++i) {
+            li_decode_worker* w = self->workers + i;
+            if (w->started) {
+                li_spsc_push(&w->todo, NULL);
+                pthread_join(w->thread, NULL);
+            }
+            for (int j = 0; j != LI_DECODE_DEPTH; ++j)
+                li_block_dtor(&w->runs[j].payload);
+            li_spsc_dtor(&w->done);
+            li_spsc_dtor(&w->todo);
+        }
+        li_dealloc(self->workers);
+    }
+    li_decode_pool_ctor(self);
+}
+
+li_status li_decode_pool_start(li_decode_pool* self, li_reader* reader, size_t record_doubles) {
+    assert(self && reader);
+    li_decode_pool_dtor(self);
+    self->reader = reader;
+    self->stride = record_doubles;
+
+    // Channels are laid out in a record in order of their numbers
+    size_t numbers[8];
+    uint64_t fields[8];
+    uint64_t bytes[8];
+    size_t count = 0;
+    for (size_t i = 1; i != 9; ++i) {
+        // Fails for channels that don't exist
+        if ((li_get(reader, LI_COUNT_FOR_INDEX_U64, i, fields + count, sizeof(uint64_t)) == LI_SUCCESS)
+            && (li_get(reader, LI_RECORD_BYTES_FOR_INDEX_U64, i, bytes + count, sizeof(uint64_t)) == LI_SUCCESS))
+            numbers[count++] = i;
+    }
+    if (!count)
+        return LI_BAD_FORMAT;
+
+    self->workers = li_alloc(count * sizeof(li_decode_worker));
+    if (!self->workers)
+        return LI_BAD_ALLOC;
+    memset(self->workers, 0, count * sizeof(li_decode_worker));
+    self->count = count;
+    size_t offset = 0;
+    for (size_t i = 0; i != count; ++i) {
+        li_decode_worker* w = self->workers + i;
+        w->pool = self;
+        w->index = numbers[i];
+        w->offset = offset;
+        w->rec_bytes = (size_t) bytes[i];
+        offset += (size_t) fields[i];
+        LI_DOUBT(li_spsc_ctor(&w->todo, LI_DECODE_DEPTH + 1)); // Room for the stop signal
+        LI_DOUBT(li_spsc_ctor(&w->done, LI_DECODE_DEPTH));
+        for (int j = 0; j != LI_DECODE_DEPTH; ++j)
+            li_spsc_push(&w->done, w->runs + j);
+        if (pthread_create(&w->thread, NULL, li_decode_worker_main, w))
+            return LI_BAD_ALLOC;
+        w->started = true;
+    }
+    if (offset > record_doubles)
+        return LI_BAD_FORMAT;
+    return LI_SUCCESS;
+}
+
+li_status li_decode_pool_put(li_decode_pool* self, li_reader* reader, uint64_t count, double* dest, int64_t* raw) {
+    assert(self && self->workers && reader && dest);
+    if (self->status || !count)
+        return self->status;
+    for (size_t i = 0; i != self->count; ++i) {
+        li_decode_worker* w = self->workers + i;
+        li_decode_run* run = li_spsc_pop(&w->done);
+        if (!self->status)
+            self->status = run->status;
+        size_t bytes = (size_t) count * w->rec_bytes;
+        if (!self->status)
+            self->status = li_block_reserve(&run->payload, MAX(bytes, (size_t) 1));
+        if (!self->status)
+            self->status = li_take_records(reader, w->index, count, run->payload.begin, run->payload.capacity);
+        if (self->status) {
+            li_spsc_push(&w->done, run);
+            return self->status;
+        }
+        run->payload.size = bytes;
+        run->count = count;
+        run->dest = dest + w->offset;
+        run->raw = raw ? (raw + w->offset) : NULL;
+        li_spsc_push(&w->todo, run);
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_decode_pool_wait(li_decode_pool* self) {
+    assert(self);
+    for (size_t i = 0; i != self->count; ++i) {
+        li_decode_worker* w = self->workers + i;
+        li_decode_run* runs[LI_DECODE_DEPTH];
+        for (int j = 0; j != LI_DECODE_DEPTH; ++j) {
+            runs[j] = li_spsc_pop(&w->done);
+            if (!self->status)
+                self->status = runs[j]->status;
+        }
+        for (int j = 0; j != LI_DECODE_DEPTH; ++j)
+            li_spsc_push(&w->done, runs[j]);
+    }
+    return self->status;
+}
@@ -0,0 +1,80 @@
+//
+//  lidecode.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lidecode_h
+#define lidecode_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lipipeline.h"
+#include "lireader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_decode_pool decodes each channel of a binary log file on a thread
+    // of its own.  The thread framing the input takes the payload of a run
+    // of records out of the reader channel by channel, and each channel's
+    // worker decodes its share straight into that channel's fields of the
+    // destination records, so rows need no separate assembly.
+
+#define LI_DECODE_DEPTH 4 // Runs of records queued for each channel
+
+    typedef struct li_decode_run {
+        li_block payload;
+        uint64_t count;
+        double* dest;     // First value of the channel in the first record
+        int64_t* raw;     // Likewise for the raw fields, or NULL
+        li_status status;
+    } li_decode_run;
+
+    typedef struct li_decode_pool li_decode_pool;
+
+    typedef struct li_decode_worker {
+        li_decode_pool* pool;
+        size_t index;     // Channel number
+        size_t offset;    // Of the channel's first value in a record
+        size_t rec_bytes; // Payload bytes of each record
+        pthread_t thread;
+        bool started;
+        li_spsc todo;
+        li_spsc done;
+        li_decode_run runs[LI_DECODE_DEPTH];
+    } li_decode_worker;
+
+    struct li_decode_pool {
+        const li_reader* reader;
+        size_t stride;    // Doubles in each record
+        size_t count;     // Channels
+        li_decode_worker* workers;
+        li_status status; // First failure
+    };
+
+    void li_decode_pool_ctor(li_decode_pool* self);
+    void li_decode_pool_dtor(li_decode_pool* self);
+
+    // Start a worker for each channel of reader, whose header must have
+    // been parsed, decoding records of record_doubles values
+    li_status li_decode_pool_start(li_decode_pool* self, li_reader* reader, size_t record_doubles);
+
+    // Take the payload of the next count records of every channel from
+    // the reader and queue them to be decoded into dest and, if not NULL,
+    // raw, each with room for count records.  Waits for a channel's worker
+    // if its queue is full.  Returns the first failure of any run so far.
+    li_status li_decode_pool_put(li_decode_pool* self, li_reader* reader, uint64_t count, double* dest, int64_t* raw);
+
+    // Wait until every queued run is decoded, returning the first failure
+    li_status li_decode_pool_wait(li_decode_pool* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lidecode_h */
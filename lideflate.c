@@ -0,0 +1,223 @@
+//
+//  lideflate.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lideflate.h"
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+// Compress one chunk with a raw stream, so that the chunks can be joined
+
+static void li_deflate_run(li_deflate_worker* self, li_deflate_chunk* chunk) {
+    z_stream* z = self->stream;
+    const Bytef* src = (const Bytef*) chunk->input.begin;
+    uInt n = (uInt) chunk->input.size;
+    if (self->owner->format == LI_DEFLATE_ZLIB)
+        chunk->check = (uint32_t) adler32(adler32(0L, Z_NULL, 0), src, n);
+    else
+        chunk->check = (uint32_t) crc32(crc32(0L, Z_NULL, 0), src, n);
+    chunk->output.size = 0;
+    // deflateBound doesn't count the empty block of a sync flush
+    if ((chunk->status = li_block_reserve(&chunk->output, deflateBound(z, n) + 16)))
+        return;
+    if (deflateReset(z) != Z_OK) {
+        chunk->status = LI_INVALID_ARGUMENT;
+        return;
+    }
+    z->next_in = (Bytef*) src;
+    z->avail_in = n;
+    z->next_out = (Bytef*) chunk->output.begin;
+    z->avail_out = (uInt) chunk->output.capacity;
+    int status = deflate(z, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((status != (chunk->last ? Z_STREAM_END : Z_OK)) || z->avail_in) {
+        chunk->status = LI_BAD_ALLOC;
+        return;
+    }
+    chunk->output.size = chunk->output.capacity - z->avail_out;
+}
+
+static void* li_deflate_worker_main(void* ptr) {
+    li_deflate_worker* self = ptr;
+    li_deflate_chunk* chunk;
+    while ((chunk = li_spsc_pop(&self->todo))) {
+        li_deflate_run(self, chunk);
+        li_spsc_push(&self->done, chunk);
+    }
+    return NULL;
+}
+
+li_status li_deflate_ctor(li_deflate* self,
+                          int level,
+                          li_deflate_format format,
+                          size_t threads,
+                          li_write_function write,
+                          void* user)
+{
+    assert(self && write);
+    memset(self, 0, sizeof(li_deflate));
+    self->level = level;
+    self->format = format;
+    self->write = write;
+    self->user = user;
+    self->check = (format == LI_DEFLATE_ZLIB) ? 1 : 0;
+    if (!threads)
+        threads = MIN(li_thread_count(), LI_DEFLATE_THREADS_MAX);
+    threads = MAX(threads, 1);
+    self->workers = li_alloc(threads * sizeof(li_deflate_worker));
+    if (!self->workers)
+        return LI_BAD_ALLOC;
+    memset(self->workers, 0, threads * sizeof(li_deflate_worker));
+    self->threads = threads;
+    for (size_t i = 0; i != threads; ++i) {
+        li_deflate_worker* w = self->workers + i;
+        w->owner = self;
+        if (!(w->stream = li_alloc(sizeof(z_stream))))
+            return LI_BAD_ALLOC;
+        memset(w->stream, 0, sizeof(z_stream));
+        if (deflateInit2(w->stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            li_dealloc(w->stream);
+            w->stream = NULL;
+            return LI_INVALID_ARGUMENT;
+        }
+        for (int j = 0; j != LI_DEFLATE_DEPTH; ++j)
+            LI_DOUBT(li_block_ctor(&w->chunks[j].input, LI_DEFLATE_CHUNK_BYTES));
+    }
+    // With one thread, compress on the caller's thread instead
+    if (threads > 1) {
+        for (size_t i = 0; i != threads; ++i) {
+            li_deflate_worker* w = self->workers + i;
+            LI_DOUBT(li_spsc_ctor(&w->todo, LI_DEFLATE_DEPTH + 1)); // Room for the stop signal
+            LI_DOUBT(li_spsc_ctor(&w->done, LI_DEFLATE_DEPTH));
+            if (pthread_create(&w->thread, NULL, li_deflate_worker_main, w))
+                return LI_BAD_ALLOC;
+            w->started = true;
+        }
+    }
+    if (format == LI_DEFLATE_ZLIB) {
+        // CMF for deflate with a 32K window, FLEVEL from the level, and FCHECK
+        // to make the pair a multiple of 31
+        int flevel = (level == Z_DEFAULT_COMPRESSION) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+        unsigned header = (0x78 << 8) | (unsigned) (flevel << 6);
+        if (header % 31)
+            header += 31 - header % 31;
+        unsigned char bytes[2] = { (unsigned char) (header >> 8), (unsigned char) header };
+        LI_DOUBT(write(user, bytes, sizeof(bytes)));
+        self->bytes_out += sizeof(bytes);
+    }
+    return LI_SUCCESS;
+}
+
+void li_deflate_dtor(li_deflate* self) {
+    assert(self);
+    if (self->workers) {
+        for (size_t i = 0; i != self->threads; ++i) {
+            li_deflate_worker* w = self->workers + i;
+            if (w->started) {
+                li_spsc_push(&w->todo, NULL);
+                pthread_join(w->thread, NULL);
+            }
+            for (int j = 0; j != LI_DEFLATE_DEPTH; ++j) {
+                li_block_dtor(&w->chunks[j].input);
+                li_block_dtor(&w->chunks[j].output);
+            }
+            if (self->threads > 1) {
+                li_spsc_dtor(&w->done);
+                li_spsc_dtor(&w->todo);
+            }
+            if (w->stream) {
+                deflateEnd(w->stream);
+                li_dealloc(w->stream);
+            }
+        }
+        li_dealloc(self->workers);
+    }
+    memset(self, 0, sizeof(li_deflate));
+}
+
+// Chunks are dealt to workers in turn, so chunk k is always in the same slot
+// of the same worker
+
+static li_deflate_chunk* li_deflate_chunk_at(li_deflate* self, uint64_t k) {
+    return self->workers[k % self->threads].chunks + (k / self->threads) % LI_DEFLATE_DEPTH;
+}
+
+// Wait for the oldest chunk and write it out
+
+static li_status li_deflate_collect(li_deflate* self) {
+    li_deflate_worker* w = self->workers + self->collected % self->threads;
+    li_deflate_chunk* chunk = li_deflate_chunk_at(self, self->collected);
+    if (w->started) {
+        li_deflate_chunk* done = li_spsc_pop(&w->done);
+        (void) done;
+        assert(done == chunk);
+    }
+    ++self->collected;
+    size_t n = chunk->input.size;
+    chunk->input.size = 0;
+    LI_DOUBT(chunk->status);
+    if (self->format == LI_DEFLATE_ZLIB)
+        self->check = (uint32_t) adler32_combine(self->check, chunk->check, (z_off_t) n);
+    else
+        self->check = (uint32_t) crc32_combine(self->check, chunk->check, (z_off_t) n);
+    self->bytes_in += n;
+    self->bytes_out += chunk->output.size;
+    return self->write(self->user, chunk->output.begin, chunk->output.size);
+}
+
+static li_status li_deflate_dispatch(li_deflate* self, bool last) {
+    li_deflate_worker* w = self->workers + self->dispatched % self->threads;
+    li_deflate_chunk* chunk = li_deflate_chunk_at(self, self->dispatched);
+    chunk->last = last;
+    ++self->dispatched;
+    if (!w->started) {
+        li_deflate_run(w, chunk);
+        return li_deflate_collect(self);
+    }
+    li_spsc_push(&w->todo, chunk);
+    // Make sure the next chunk is free
+    if (self->dispatched - self->collected == self->threads * LI_DEFLATE_DEPTH)
+        LI_DOUBT(li_deflate_collect(self));
+    return LI_SUCCESS;
+}
+
+li_status li_deflate_write(void* ptr, const void* src, size_t count) {
+    li_deflate* self = ptr;
+    assert(self && self->workers && !self->finished);
+    const li_byte* p = src;
+    while (count) {
+        li_block* b = &li_deflate_chunk_at(self, self->dispatched)->input;
+        if (b->size == b->capacity)
+            LI_DOUBT(li_deflate_dispatch(self, false));
+        b = &li_deflate_chunk_at(self, self->dispatched)->input;
+        size_t n = MIN(count, b->capacity - b->size);
+        memcpy(b->begin + b->size, p, n);
+        b->size += n;
+        p += n;
+        count -= n;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_deflate_finish(li_deflate* self) {
+    assert(self && self->workers && !self->finished);
+    self->finished = true;
+    LI_DOUBT(li_deflate_dispatch(self, true));
+    while (self->collected != self->dispatched)
+        LI_DOUBT(li_deflate_collect(self));
+    if (self->format == LI_DEFLATE_ZLIB) {
+        unsigned char bytes[4] = {
+            (unsigned char) (self->check >> 24),
+            (unsigned char) (self->check >> 16),
+            (unsigned char) (self->check >> 8),
+            (unsigned char) self->check
+        };
+        LI_DOUBT(self->write(self->user, bytes, sizeof(bytes)));
+        self->bytes_out += sizeof(bytes);
+    }
+    return LI_SUCCESS;
+}
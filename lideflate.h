@@ -0,0 +1,102 @@
+//
+//  lideflate.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lideflate_h
+#define lideflate_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lipipeline.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_deflate compresses a stream on a pool of threads.  Input is cut into
+    // chunks that are deflated independently, each ending on a byte boundary
+    // (Z_SYNC_FLUSH, and Z_FINISH for the last), so their concatenation is a
+    // single valid deflate stream.  The check values of the chunks are
+    // combined in order.  Compressed chunks are passed to a write function in
+    // input order, and are the same whatever the number of threads.
+    //
+    // li_deflate z;
+    // li_deflate_ctor(&z, 6, LI_DEFLATE_ZLIB, 0, write, user);
+    // li_deflate_write(&z, src, count); ...
+    // li_deflate_finish(&z);
+    // li_deflate_dtor(&z);
+
+#define LI_DEFLATE_CHUNK_BYTES (1 << 20)
+#define LI_DEFLATE_DEPTH 2          // Chunks in flight per thread
+#define LI_DEFLATE_THREADS_MAX 16
+
+    typedef enum li_deflate_format {
+        LI_DEFLATE_RAW,   // Bare deflate stream, as in ZIP; check is CRC-32
+        LI_DEFLATE_ZLIB,  // zlib header and Adler-32 trailer, as in MAT-files
+    } li_deflate_format;
+
+    typedef struct li_deflate_chunk {
+        li_block input;
+        li_block output;
+        bool last;          // Finish the stream after this chunk
+        uint32_t check;     // Check value of the input alone
+        li_status status;
+    } li_deflate_chunk;
+
+    typedef struct li_deflate_worker {
+        struct li_deflate* owner;
+        struct z_stream_s* stream;
+        li_spsc todo;       // caller -> compressor
+        li_spsc done;       // compressor -> caller
+        li_deflate_chunk chunks[LI_DEFLATE_DEPTH];
+        pthread_t thread;
+        bool started;       // Otherwise chunks are compressed on the caller's thread
+    } li_deflate_worker;
+
+    typedef struct li_deflate {
+        int level;
+        li_deflate_format format;
+        li_write_function write;
+        void* user;
+
+        size_t threads;
+        li_deflate_worker* workers;
+        uint64_t dispatched;    // Chunks handed to workers
+        uint64_t collected;     // Chunks handed to write
+
+        uint32_t check;         // Of all input so far
+        uint64_t bytes_in;
+        uint64_t bytes_out;     // Including any header and trailer
+        bool finished;
+    } li_deflate;
+
+    // threads is the number of compressor threads, or 0 to choose from the
+    // number of processors.  level is a zlib compression level.
+    li_status li_deflate_ctor(li_deflate* self,
+                              int level,
+                              li_deflate_format format,
+                              size_t threads,
+                              li_write_function write,
+                              void* user);
+
+    // Stop and join the threads, discarding unfinished chunks
+    void li_deflate_dtor(li_deflate* self);
+
+    // Compress count bytes.  As an li_write_function, so that self can be
+    // the user of another stage.
+    li_status li_deflate_write(void* self, const void* src, size_t count);
+
+    // Compress the remaining input and write the trailer
+    li_status li_deflate_finish(li_deflate* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lideflate_h */
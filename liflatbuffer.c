@@ -0,0 +1,203 @@
+//
+//  liflatbuffer.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "liflatbuffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+void li_fb_ctor(li_fb* self) {
+    assert(self);
+    memset(self, 0, sizeof(li_fb));
+    self->minalign = 1;
+}
+
+void li_fb_dtor(li_fb* self) {
+    assert(self);
+    li_dealloc(self->begin);
+    li_fb_ctor(self);
+}
+
+void li_fb_clear(li_fb* self) {
+    assert(self);
+    self->size = 0;
+    self->minalign = 1;
+    self->fields = 0;
+    self->status = LI_SUCCESS;
+}
+
+// Make room for count bytes in front of the contents, moving the contents
+// to the end of a larger allocation if necessary
+
+static li_byte* li_fb_push(li_fb* self, size_t count) {
+    if (self->status)
+        return NULL;
+    if (self->capacity - self->size < count) {
+        size_t capacity = MAX(MAX(2 * self->capacity, self->size + count), (size_t) 256);
+        li_byte* p = li_alloc(capacity);
+        if (!p) {
+            self->status = LI_BAD_ALLOC;
+            return NULL;
+        }
+        memcpy(p + capacity - self->size, self->begin + self->capacity - self->size, self->size);
+        li_dealloc(self->begin);
+        self->begin = p;
+        self->capacity = capacity;
+    }
+    self->size += count;
+    return self->begin + self->capacity - self->size;
+}
+
+static void li_fb_put(li_fb* self, const void* src, size_t count) {
+    li_byte* p = li_fb_push(self, count);
+    if (p && count)
+        memcpy(p, src, count);
+}
+
+// Pad so that once additional bytes are pushed the size is a multiple of
+// align
+
+static void li_fb_prep(li_fb* self, size_t align, size_t additional) {
+    self->minalign = MAX(self->minalign, align);
+    size_t padding = (0 - (self->size + additional)) & (align - 1);
+    li_byte* p = li_fb_push(self, padding);
+    if (p)
+        memset(p, 0, padding);
+}
+
+// An offset stored at the next position, pointing to ref
+
+static void li_fb_put_ref(li_fb* self, li_fb_ref ref) {
+    li_fb_prep(self, sizeof(uint32_t), 0);
+    assert(ref <= self->size);
+    uint32_t offset = (uint32_t) (self->size - ref + sizeof(uint32_t));
+    li_fb_put(self, &offset, sizeof(offset));
+}
+
+static li_fb_ref li_fb_here(li_fb* self) {
+    return (li_fb_ref) self->size;
+}
+
+li_fb_ref li_fb_string(li_fb* self, const char* src, size_t count) {
+    assert(self && (src || !count));
+    li_fb_prep(self, sizeof(uint32_t), count + 1);
+    li_byte* p = li_fb_push(self, count + 1);
+    if (p) {
+        memcpy(p, src, count);
+        p[count] = 0;
+    }
+    uint32_t length = (uint32_t) count;
+    li_fb_put(self, &length, sizeof(length));
+    return li_fb_here(self);
+}
+
+li_fb_ref li_fb_structs(li_fb* self, const void* src, size_t count, size_t size, size_t align) {
+    assert(self && (src || !count));
+    li_fb_prep(self, sizeof(uint32_t), count * size);
+    li_fb_prep(self, align, count * size);
+    li_fb_put(self, src, count * size);
+    uint32_t length = (uint32_t) count;
+    li_fb_put(self, &length, sizeof(length));
+    return li_fb_here(self);
+}
+
+li_fb_ref li_fb_refs(li_fb* self, const li_fb_ref* src, size_t count) {
+    assert(self && (src || !count));
+    li_fb_prep(self, sizeof(uint32_t), count * sizeof(uint32_t));
+    for (size_t i = count; i--; )
+        li_fb_put_ref(self, src[i]);
+    uint32_t length = (uint32_t) count;
+    li_fb_put(self, &length, sizeof(length));
+    return li_fb_here(self);
+}
+
+void li_fb_table(li_fb* self) {
+    assert(self && !self->fields);
+    memset(self->slots, 0, sizeof(self->slots));
+    self->table = li_fb_here(self);
+}
+
+static void li_fb_add(li_fb* self, size_t field, const void* value, size_t size) {
+    assert(field < LI_FB_FIELDS_MAX);
+    li_fb_prep(self, size, 0);
+    li_fb_put(self, value, size);
+    self->slots[field] = li_fb_here(self);
+    self->fields = MAX(self->fields, field + 1);
+}
+
+void li_fb_add_bool(li_fb* self, size_t field, bool value) {
+    uint8_t x = value;
+    li_fb_add(self, field, &x, sizeof(x));
+}
+
+void li_fb_add_u8(li_fb* self, size_t field, uint8_t value) {
+    li_fb_add(self, field, &value, sizeof(value));
+}
+
+void li_fb_add_i16(li_fb* self, size_t field, int16_t value) {
+    li_fb_add(self, field, &value, sizeof(value));
+}
+
+void li_fb_add_i32(li_fb* self, size_t field, int32_t value) {
+    li_fb_add(self, field, &value, sizeof(value));
+}
+
+void li_fb_add_i64(li_fb* self, size_t field, int64_t value) {
+    li_fb_add(self, field, &value, sizeof(value));
+}
+
+void li_fb_add_ref(li_fb* self, size_t field, li_fb_ref value) {
+    assert(field < LI_FB_FIELDS_MAX);
+    li_fb_put_ref(self, value);
+    self->slots[field] = li_fb_here(self);
+    self->fields = MAX(self->fields, field + 1);
+}
+
+// The table starts with the signed distance back to its vtable, which is
+// written immediately in front of it:
+//
+// [vtable size][table size][offset of field 0]...[vtable offset][fields]...
+
+li_fb_ref li_fb_end(li_fb* self) {
+    assert(self);
+    int32_t placeholder = 0;
+    li_fb_prep(self, sizeof(int32_t), 0);
+    li_fb_put(self, &placeholder, sizeof(placeholder));
+    li_fb_ref table = li_fb_here(self);
+    for (size_t i = self->fields; i--; ) {
+        uint16_t offset = (uint16_t) (self->slots[i] ? table - self->slots[i] : 0);
+        li_fb_put(self, &offset, sizeof(offset));
+    }
+    uint16_t header[2] = {
+        (uint16_t) ((self->fields + 2) * sizeof(uint16_t)),
+        (uint16_t) (table - self->table)
+    };
+    li_fb_put(self, header, sizeof(header));
+    if (!self->status) {
+        int32_t vtable = (int32_t) (self->size - table);
+        memcpy(self->begin + self->capacity - table, &vtable, sizeof(vtable));
+    }
+    self->fields = 0;
+    return table;
+}
+
+li_status li_fb_finish(li_fb* self, li_fb_ref root) {
+    assert(self);
+    li_fb_prep(self, self->minalign, sizeof(uint32_t));
+    li_fb_put_ref(self, root);
+    return self->status;
+}
+
+const void* li_fb_data(const li_fb* self) {
+    assert(self);
+    return self->begin + self->capacity - self->size;
+}
+
+size_t li_fb_size(const li_fb* self) {
+    assert(self);
+    return self->size;
+}
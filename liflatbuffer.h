@@ -0,0 +1,88 @@
+//
+//  liflatbuffer.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef liflatbuffer_h
+#define liflatbuffer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_fb builds a FlatBuffer, as used by Arrow for its metadata, without
+    // a schema compiler.  As with the reference builder the buffer is built
+    // back to front, so children are finished before the tables that refer
+    // to them, and only one table can be open at a time.  Assumes a
+    // little-endian host.  Errors are sticky and reported by li_fb_finish.
+    //
+    // li_fb fb;
+    // li_fb_ctor(&fb);
+    // li_fb_ref name = li_fb_string(&fb, "t", 1);
+    // li_fb_table(&fb);
+    // li_fb_add_ref(&fb, 0, name);
+    // li_fb_add_bool(&fb, 1, false);
+    // li_fb_ref field = li_fb_end(&fb);
+    // li_fb_finish(&fb, field);
+    // fwrite(li_fb_data(&fb), 1, li_fb_size(&fb), file);
+    // li_fb_dtor(&fb);
+
+#define LI_FB_FIELDS_MAX 16
+
+    typedef uint32_t li_fb_ref; // Position of an object, counted from the end
+
+    typedef struct li_fb {
+        li_byte* begin;     // Contents are the last size bytes
+        size_t capacity;
+        size_t size;
+        size_t minalign;    // Largest alignment used
+        li_fb_ref slots[LI_FB_FIELDS_MAX]; // Fields of the open table, or 0
+        size_t fields;      // One more than the highest field added
+        li_fb_ref table;    // Size when the open table was started
+        li_status status;
+    } li_fb;
+
+    void li_fb_ctor(li_fb* self);
+    void li_fb_dtor(li_fb* self);
+
+    // Start a new buffer, keeping the allocation
+    void li_fb_clear(li_fb* self);
+
+    li_fb_ref li_fb_string(li_fb* self, const char* src, size_t count);
+
+    // A vector of count structs of the given size and alignment, laid out
+    // as they will be in the buffer
+    li_fb_ref li_fb_structs(li_fb* self, const void* src, size_t count, size_t size, size_t align);
+
+    // A vector of tables or strings
+    li_fb_ref li_fb_refs(li_fb* self, const li_fb_ref* src, size_t count);
+
+    void li_fb_table(li_fb* self);
+    void li_fb_add_bool(li_fb* self, size_t field, bool value);
+    void li_fb_add_u8(li_fb* self, size_t field, uint8_t value);
+    void li_fb_add_i16(li_fb* self, size_t field, int16_t value);
+    void li_fb_add_i32(li_fb* self, size_t field, int32_t value);
+    void li_fb_add_i64(li_fb* self, size_t field, int64_t value);
+    void li_fb_add_ref(li_fb* self, size_t field, li_fb_ref value);
+    li_fb_ref li_fb_end(li_fb* self);
+
+    // Add the root offset.  The size is then a multiple of the largest
+    // alignment used.
+    li_status li_fb_finish(li_fb* self, li_fb_ref root);
+
+    const void* li_fb_data(const li_fb* self);
+    size_t li_fb_size(const li_fb* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* liflatbuffer_h */
@@ -0,0 +1,434 @@
+//
+//  lifmt.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lifmt.h"
+
+#include <assert.h>
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// A double is m·2^e with m < 2^53.  To print it with a decimal exponent k we
+// need round(m·2^e / 10^k) = round(m·5^-k·2^(e-k)).  For the exponents that
+// occur in practice both the numerator and denominator of that fraction fit
+// in 128 bits, so we can round exactly without arbitrary precision.
+
+typedef unsigned __int128 li_u128;
+
+static const uint64_t li_pow10[20] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+// 5^27 is the largest power of five that fits in 64 bits
+#define LI_POW5_64 27
+#define LI_POW5_MAX (2 * LI_POW5_64)
+
+static const uint64_t li_pow5_64[LI_POW5_64 + 1] = {
+    1ull, 5ull, 25ull, 125ull, 625ull, 3125ull, 15625ull, 78125ull, 390625ull,
+    1953125ull, 9765625ull, 48828125ull, 244140625ull, 1220703125ull,
+    6103515625ull, 30517578125ull, 152587890625ull, 762939453125ull,
+    3814697265625ull, 19073486328125ull, 95367431640625ull,
+    476837158203125ull, 2384185791015625ull, 11920928955078125ull,
+    59604644775390625ull, 298023223876953125ull, 1490116119384765625ull,
+    7450580596923828125ull,
+};
+
+static li_u128 li_pow5(int k) {
+    assert((k >= 0) && (k <= LI_POW5_MAX));
+    if (k <= LI_POW5_64)
+        return li_pow5_64[k];
+    return (li_u128) li_pow5_64[LI_POW5_64] * li_pow5_64[k - LI_POW5_64];
+}
+
+static int li_bits(li_u128 x) {
+    uint64_t hi = (uint64_t) (x >> 64);
+    uint64_t lo = (uint64_t) x;
+    if (hi)
+        return 128 - __builtin_clzll(hi);
+    return lo ? 64 - __builtin_clzll(lo) : 0;
+}
+
+// D = round(m·2^e / 10^k), ties to even.  Returns false if the arithmetic
+// would overflow or D doesn't fit in 64 bits.
+
+static bool li_fmt_scaled(uint64_t m, int e, int k, uint64_t* D) {
+    if ((k < -LI_POW5_MAX) || (k > LI_POW5_MAX))
+        return false;
+    li_u128 num = m;
+    li_u128 den = 1;
+    if (k < 0) {
+        if (li_bits(num) + li_bits(li_pow5(-k)) > 127)
+            return false;
+        num *= li_pow5(-k);
+    } else if (k > 0) {
+        den = li_pow5(k);
+    }
+    int a = e - k;
+    li_u128 q, r;
+    if (a >= 0) {
+        if (li_bits(num) + a > 127)
+            return false;
+        num <<= a;
+        q = num / den;
+        r = num % den;
+    } else if (den == 1) {
+        // Dividing by a power of two is a shift
+        int s = -a;
+        if (s > 127) {
+            // num < 2^127, so the quotient is less than a half
+            *D = 0;
+            return true;
+        }
+        den = (li_u128) 1 << s;
+        q = num >> s;
+        r = num & (den - 1);
+    } else {
+        if (li_bits(den) - a > 127)
+            return false;
+        den <<= -a;
+        q = num / den;
+        r = num % den;
+    }
+    // r < den < 2^127, so 2r doesn't overflow
+    li_u128 twice = r << 1;
+    if ((twice > den) || ((twice == den) && (q & 1)))
+        ++q;
+    if (q >> 64)
+        return false;
+    *D = (uint64_t) q;
+    return true;
+}
+
+// Round m·2^e to p + 1 significant digits D·10^(E - p) with
+// 10^p <= D < 10^(p + 1)
+
+static bool li_fmt_significant(uint64_t m, int e, int p, uint64_t* D, int* E) {
+    if (p > 17)
+        return false;
+    // 2^L <= m·2^e < 2^(L + 1), so this estimate is exact or one too small,
+    // and rounding up may carry into one more digit
+    int L = e + li_bits(m) - 1;
+    int guess = (int) floor(L * 0.30102999566398120);
+    for (int i = 0; i != 3; ++i, ++guess) {
+        if (!li_fmt_scaled(m, e, guess - p, D))
+            return false;
+        if (*D < li_pow10[p + 1]) {
+            *E = guess;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compare D·10^k with M·2^f, returning false if 128 bits aren't enough
+
+static bool li_fmt_compare(uint64_t D, int k, uint64_t M, int f, int* result) {
+    if ((k < -LI_POW5_MAX) || (k > LI_POW5_MAX))
+        return false;
+    // D·5^k·2^(k-f) vs M
+    li_u128 l = D;
+    li_u128 r = M;
+    li_u128 p = li_pow5(k < 0 ? -k : k);
+    li_u128* scaled = (k < 0) ? &r : &l;
+    if (li_bits(*scaled) + li_bits(p) > 127)
+        return false;
+    *scaled *= p;
+    int g = k - f;
+    scaled = (g < 0) ? &r : &l;
+    g = (g < 0) ? -g : g;
+    if (li_bits(*scaled) + g > 127)
+        return false;
+    *scaled <<= g;
+    *result = (l > r) - (l < r);
+    return true;
+}
+
+// Would D·10^k read back as m·2^e?  True if it lies between the midpoints to
+// the neighbouring doubles, or on one when m is even (ties round to even).
+
+static bool li_fmt_round_trips(uint64_t D, int k, uint64_t m, int e, bool normal_boundary, bool* result) {
+    int lo, hi;
+    bool even = !(m & 1);
+    if (!li_fmt_compare(D, k, 2 * m + 1, e - 1, &hi))
+        return false;
+    // Below a power of two the next double down is closer
+    if (normal_boundary ? !li_fmt_compare(D, k, 4 * m - 1, e - 2, &lo)
+                        : !li_fmt_compare(D, k, 2 * m - 1, e - 1, &lo))
+        return false;
+    *result = ((lo > 0) || (even && !lo)) && ((hi < 0) || (even && !hi));
+    return true;
+}
+
+static const char li_fmt_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Write exactly n digits of x, with leading zeros
+
+static char* li_fmt_digits(char* dest, uint64_t x, int n) {
+    char* p = dest + n;
+    while (p - dest >= 2) {
+        p -= 2;
+        memcpy(p, li_fmt_pairs + 2 * (x % 100), 2);
+        x /= 100;
+    }
+    if (p != dest)
+        *--p = (char) ('0' + x % 10);
+    return dest + n;
+}
+
+static int li_fmt_count_digits(uint64_t x) {
+    int n = 1;
+    while ((n < 20) && (x >= li_pow10[n]))
+        ++n;
+    return n;
+}
+
+size_t li_fmt_u64(char* dest, uint64_t x) {
+    return (size_t) (li_fmt_digits(dest, x, li_fmt_count_digits(x)) - dest);
+}
+
+// d.ddde+XX from p + 1 digits of D
+
+static char* li_fmt_scientific(char* dest, uint64_t D, int E, int p, char e, bool alternate) {
+    uint64_t lead = D / li_pow10[p];
+    *dest++ = (char) ('0' + lead);
+    if (p || alternate)
+        *dest++ = '.';
+    dest = li_fmt_digits(dest, D - lead * li_pow10[p], p);
+    *dest++ = e;
+    *dest++ = (E < 0) ? '-' : '+';
+    E = (E < 0) ? -E : E;
+    return li_fmt_digits(dest, (uint64_t) E, (E < 100) ? 2 : 3);
+}
+
+// Fewest significant digits that read back as m·2^e
+
+static bool li_fmt_shortest(uint64_t m, int e, bool normal_boundary, uint64_t* D, int* E, int* p) {
+    // 17 significant digits always suffice, and if p digits read back so do
+    // p + 1, so we can bisect
+    int lo = 0;
+    int hi = 16;
+    uint64_t best_D = 0;
+    int best_E = 0;
+    if (!li_fmt_significant(m, e, hi, &best_D, &best_E))
+        return false;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint64_t d;
+        int x;
+        bool ok = false;
+        if (!li_fmt_significant(m, e, mid, &d, &x)
+            || !li_fmt_round_trips(d, x - mid, m, e, normal_boundary, &ok))
+            return false;
+        if (ok) {
+            hi = mid;
+            best_D = d;
+            best_E = x;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    *D = best_D;
+    *E = best_E;
+    *p = hi;
+    return true;
+}
+
+// Let printf handle whatever the fast path can't, then undo any locale
+// specific decimal point
+
+static size_t li_fmt_printf(char* dest, size_t capacity, double x, const li_fmt_spec* spec, int precision) {
+    char format[32];
+    char* q = format;
+    *q++ = '%';
+    if (spec->minus)
+        *q++ = '-';
+    if (spec->plus)
+        *q++ = '+';
+    if (spec->space)
+        *q++ = ' ';
+    if (spec->zero)
+        *q++ = '0';
+    if (spec->alternate)
+        *q++ = '#';
+    snprintf(q, sizeof(format) - (size_t) (q - format), "%d.%d%c",
+             spec->width,
+             precision,
+             spec->shortest ? (spec->conversion == 'E' ? 'E' : 'e') : spec->conversion);
+    int n = snprintf(dest, capacity, format, x);
+    if (n < 0)
+        return 0;
+    const char* point = localeconv()->decimal_point;
+    size_t k = strlen(point);
+    if (((size_t) n < capacity) && ((k != 1) || (*point != '.'))) {
+        char* found = k ? strstr(dest, point) : NULL;
+        if (found) {
+            *found = '.';
+            memmove(found + 1, found + k, (size_t) n - (size_t) (found - dest) - k + 1);
+            n -= (int) k - 1;
+        }
+    }
+    return (size_t) n;
+}
+
+static size_t li_fmt_fallback(char* dest, size_t capacity, double x, const li_fmt_spec* spec) {
+    if (!spec->shortest)
+        return li_fmt_printf(dest, capacity, x, spec, spec->precision);
+    // Search for the shortest form that strtod reads back.  In a locale
+    // where strtod doesn't accept '.' this gives 17 digits, which is still
+    // exact.
+    char buffer[LI_FMT_MAX];
+    li_fmt_spec bare = *spec;
+    bare.width = 0;
+    int p = 0;
+    for (; p != 16; ++p) {
+        li_fmt_printf(buffer, sizeof(buffer), x, &bare, p);
+        if (strtod(buffer, NULL) == x)
+            break;
+    }
+    return li_fmt_printf(dest, capacity, x, spec, p);
+}
+
+size_t li_fmt_double(char* dest, size_t capacity, double x, const li_fmt_spec* spec) {
+    assert(spec);
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bool negative = bits >> 63;
+    int biased = (int) ((bits >> 52) & 0x7FF);
+    uint64_t fraction = bits & ((1ull << 52) - 1);
+    uint64_t m = fraction;
+    int e = -1074;
+    if (biased) {
+        m |= 1ull << 52;
+        e = biased - 1075;
+    }
+    bool upper = (spec->conversion == 'E') || (spec->conversion == 'F');
+
+    char buffer[LI_FMT_MAX];
+    char* begin = buffer + 1; // Room for the sign
+    char* end = begin;
+    bool finite = biased != 0x7FF;
+
+    if (!finite) {
+        memcpy(begin, fraction ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"), 3);
+        end += 3;
+    } else if (spec->shortest) {
+        uint64_t D = 0;
+        int E = 0;
+        int p = 0;
+        if (m && !li_fmt_shortest(m, e, (m == (1ull << 52)) && (biased > 1), &D, &E, &p))
+            return li_fmt_fallback(dest, capacity, x, spec);
+        end = li_fmt_scientific(begin, D, E, p, upper ? 'E' : 'e', spec->alternate);
+    } else if ((spec->conversion == 'e') || (spec->conversion == 'E')) {
+        uint64_t D = 0;
+        int E = 0;
+        int p = spec->precision;
+        if (m ? !li_fmt_significant(m, e, p, &D, &E) : (p > 17))
+            return li_fmt_fallback(dest, capacity, x, spec);
+        end = li_fmt_scientific(begin, D, E, p, upper ? 'E' : 'e', spec->alternate);
+    } else {
+        uint64_t D = 0;
+        int p = spec->precision;
+        if ((p > 19) || (m && !li_fmt_scaled(m, e, -p, &D)))
+            return li_fmt_fallback(dest, capacity, x, spec);
+        uint64_t whole = D / li_pow10[p];
+        end = li_fmt_digits(end, whole, li_fmt_count_digits(whole));
+        if (p || spec->alternate)
+            *end++ = '.';
+        end = li_fmt_digits(end, D - whole * li_pow10[p], p);
+    }
+
+    // Sign, then pad to the field width
+    if (negative)
+        *--begin = '-';
+    else if (spec->plus)
+        *--begin = '+';
+    else if (spec->space)
+        *--begin = ' ';
+    size_t n = (size_t) (end - begin);
+    size_t width = spec->width > 0 ? (size_t) spec->width : 0;
+    size_t pad = (width > n) ? width - n : 0;
+    if (n + pad >= capacity)
+        return n + pad;
+    if (spec->minus) {
+        memcpy(dest, begin, n);
+        memset(dest + n, ' ', pad);
+    } else if (spec->zero && finite) {
+        size_t s = (begin != buffer + 1) ? 1 : 0; // Zeros go after the sign
+        memcpy(dest, begin, s);
+        memset(dest + s, '0', pad);
+        memcpy(dest + s + pad, begin + s, n - s);
+    } else {
+        memset(dest, ' ', pad);
+        memcpy(dest + pad, begin, n);
+    }
+    return n + pad;
+}
+
+bool li_fmt_parse(li_fmt_spec* spec, const char* format) {
+    assert(spec && format);
+    memset(spec, 0, sizeof(li_fmt_spec));
+    if (*format++ != '%')
+        return false;
+    for (;; ++format) {
+        switch (*format) {
+            case '-':
+                spec->minus = true;
+                continue;
+            case '+':
+                spec->plus = true;
+                continue;
+            case ' ':
+                spec->space = true;
+                continue;
+            case '0':
+                spec->zero = true;
+                continue;
+            case '#':
+                spec->alternate = true;
+                continue;
+        }
+        break;
+    }
+    // Bound the numbers so they can't overflow
+    while ((*format >= '0') && (*format <= '9') && (spec->width < 100000))
+        spec->width = spec->width * 10 + (*format++ - '0');
+    spec->precision = 6;
+    if (*format == '.') {
+        ++format;
+        spec->precision = 0;
+        while ((*format >= '0') && (*format <= '9') && (spec->precision < 100000))
+            spec->precision = spec->precision * 10 + (*format++ - '0');
+    }
+    if (*format == 'l')
+        ++format;
+    switch (*format) {
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+            spec->conversion = *format++;
+            break;
+        default:
+            return false;
+    }
+    return !*format;
+}
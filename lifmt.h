@@ -0,0 +1,65 @@
+//
+//  lifmt.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lifmt_h
+#define lifmt_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_fmt formats doubles exactly as printf's %e and %f conversions do in
+    // the C locale, without parsing a format string or consulting the locale
+    // for every number.  Values are rounded from their exact binary value,
+    // ties to even, as glibc does.  Numbers too large or too small for the
+    // 128-bit fast path fall back to snprintf.
+
+    typedef struct li_fmt_spec {
+        char conversion;  // 'e', 'E', 'f' or 'F'
+        int precision;    // Digits after the decimal point
+        int width;        // Minimum field width
+        bool minus;       // '-' left justify
+        bool plus;        // '+' always show sign
+        bool space;       // ' ' space for positive sign
+        bool zero;        // '0' pad with zeros
+        bool alternate;   // '#' always show decimal point
+        bool shortest;    // Ignore precision and use the fewest significant
+                          // digits that read back as the same double, in
+                          // 'e' style
+    } li_fmt_spec;
+
+    inline static void li_fmt_spec_dtor(li_fmt_spec* self) {}
+    li_array_define(li_fmt_spec);
+
+    // Room needed for any number formatted by the fast path, excluding width
+#define LI_FMT_MAX 64
+
+    // Parse a printf conversion specification for a double, like "%.16e" or
+    // "%+09.8f".  Returns false for anything else, including %g and
+    // conversions with '*' or extra text.
+    bool li_fmt_parse(li_fmt_spec* spec, const char* format);
+
+    // Format x into dest like snprintf, without the terminating null.
+    // Returns the length of the formatted number; if it is not less than
+    // capacity nothing useful was written and the caller should retry with
+    // more room.
+    size_t li_fmt_double(char* dest, size_t capacity, double x, const li_fmt_spec* spec);
+
+    // Format an unsigned integer like "%llu"; dest needs 20 bytes
+    size_t li_fmt_u64(char* dest, uint64_t x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lifmt_h */
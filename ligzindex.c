@@ -0,0 +1,516 @@
+//
+//  ligzindex.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "ligzindex.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#define LI_HAVE_PREAD
+#endif
+
+#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
+#define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
+
+#define LI_GZINDEX_INPUT_BYTES (256 << 10)
+#define LI_GZINDEX_OUTPUT_BYTES (1 << 20)
+
+// Output is given to the reader in pieces.  While a checkpoint is waiting
+// for a place to resume decoding, the pieces shrink to what the reader
+// suggests, so that it stops at every message boundary.
+#define LI_GZINDEX_PIECE_BYTES (64 << 10)
+
+
+
+// Building
+
+typedef struct {
+    li_reader* reader;
+    FILE* output;
+    uint64_t written;
+    li_queue header;         // Output until the header has been framed
+    bool framed_header;
+    li_queue points;         // li_gzindex_point for each checkpoint
+    li_gzindex_point point;  // Waiting for the channels to be in phase
+    bool pending;
+} li_gzindexer;
+
+static li_status li_gzindexer_write(li_gzindexer* self, const void* src, size_t count) {
+    if (fwrite(src, 1, count, self->output) != count)
+        return LI_IO_ERROR;
+    self->written += count;
+    return LI_SUCCESS;
+}
+
+// Frame the next count bytes of output
+
+static li_status li_gzindexer_feed(li_gzindexer* self, const li_byte* src, size_t count) {
+    if (!self->framed_header)
+        LI_DOUBT(li_queue_put(&self->header, src, count));
+    while (count) {
+        size_t n = MIN(count, (size_t) LI_GZINDEX_PIECE_BYTES);
+        if (self->pending) {
+            uint64_t suggested = 0;
+            LI_TRUST(li_get(self->reader, LI_SUGGESTED_PUT_U64, 0, &suggested, sizeof(suggested)));
+            n = (size_t) MIN((uint64_t) n, MAX(suggested, (uint64_t) 1));
+        }
+        LI_DOUBT(li_put(self->reader, src, n));
+        src += n;
+        count -= n;
+        uint64_t framed = 0;
+        li_status result = li_get(self->reader, LI_FRAMED_BYTES_U64, 0, &framed, sizeof(framed));
+        if (result == LI_SMALL_SRC)
+            continue; // The header is incomplete
+        LI_DOUBT(result);
+        if (!self->framed_header) {
+            // Keep the header, and make the start of the file checkpoint 0
+            uint64_t bytes = 0;
+            LI_TRUST(li_get(self->reader, LI_HEADER_BYTES_U64, 0, &bytes, sizeof(bytes)));
+            li_queue_unput(&self->header, li_queue_size(&self->header) - (size_t) bytes);
+            li_gzindex_point start;
+            memset(&start, 0, sizeof(start));
+            start.message_offset = bytes;
+            LI_DOUBT(li_queue_put(&self->points, &start, sizeof(start)));
+            self->framed_header = true;
+        }
+        uint8_t in_phase = 0;
+        LI_TRUST(li_get(self->reader, LI_IN_PHASE_U8, 0, &in_phase, sizeof(in_phase)));
+        if (self->pending && in_phase && (framed >= self->point.output_offset)) {
+            self->point.message_offset = framed;
+            LI_TRUST(li_get(self->reader, LI_RECORD_COUNT_U64, 0, &self->point.first_record, sizeof(uint64_t)));
+            LI_DOUBT(li_queue_put(&self->points, &self->point, sizeof(self->point)));
+            self->pending = false;
+        }
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_gzindex_build(FILE* input,
+                           FILE* output,
+                           const li_gzindex_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    assert(input && output);
+    uint64_t span = (options && options->span) ? options->span : LI_GZINDEX_SPAN;
+
+    li_status result = LI_SUCCESS;
+    li_gzindexer self;
+    memset(&self, 0, sizeof(self));
+    self.output = output;
+    li_queue_ctor(&self.header);
+    li_queue_ctor(&self.points);
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    bool inflating = false;
+    li_byte* in = li_alloc(LI_GZINDEX_INPUT_BYTES);
+    li_byte* out = li_alloc(LI_GZINDEX_OUTPUT_BYTES);
+    li_byte* window = li_alloc(LI_GZINDEX_WINDOW_BYTES);
+    uint64_t total_in = 0;
+    uint64_t total_out = 0;
+    uint64_t last = 0;         // Output offset of the last checkpoint
+    uint64_t reported = 0;     // Bytes written that were reported
+    bool ended = false;        // At the end of a gzip member
+
+    self.reader = li_init(malloc, free);
+    result = LI_BAD_ALLOC;
+    if (!self.reader || !in || !out || !window)
+        goto cleanup;
+    li_frame_only(self.reader, true);
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+        goto cleanup;
+    inflating = true;
+
+    result = li_gzindexer_write(&self, LI_GZINDEX_MAGIC "\0\0\0\0", 8);
+    REQUIRE_SUCCESS;
+
+    for (;;) {
+        if (!z.avail_in) {
+            size_t n = fread(in, 1, LI_GZINDEX_INPUT_BYTES, input);
+            if (!n) {
+                result = ferror(input) ? LI_IO_ERROR : LI_SUCCESS;
+                REQUIRE_SUCCESS;
+                // Input that stops part way through a member is truncated
+                REQUIRE_FORMAT(ended);
+                break;
+            }
+            if (callback)
+                callback(user_ptr, n, 0);
+            z.next_in = (Bytef*) in;
+            z.avail_in = (uInt) n;
+        }
+        if (ended) {
+            // Concatenated members are valid gzip; anything else after the
+            // last member is ignored, as gunzip does
+            if (z.next_in[0] != 0x1f)
+                break;
+            result = (inflateReset(&z) == Z_OK) ? LI_SUCCESS : LI_BAD_FORMAT;
+            REQUIRE_SUCCESS;
+            ended = false;
+        }
+        uInt avail_in = z.avail_in;
+        z.next_out = (Bytef*) out;
+        z.avail_out = LI_GZINDEX_OUTPUT_BYTES;
+        int status = inflate(&z, Z_BLOCK);
+        total_in += avail_in - z.avail_in;
+        size_t n = LI_GZINDEX_OUTPUT_BYTES - z.avail_out;
+        total_out += n;
+        result = (status == Z_MEM_ERROR) ? LI_BAD_ALLOC : LI_BAD_FORMAT;
+        if ((status != Z_OK) && (status != Z_STREAM_END) && (status != Z_BUF_ERROR))
+            goto cleanup;
+        result = li_gzindexer_feed(&self, out, n);
+        REQUIRE_SUCCESS;
+        if (status == Z_STREAM_END) {
+            ended = true;
+            continue;
+        }
+
+        // Checkpoints are at the ends of deflate blocks other than the last
+        if ((z.data_type & 128) && !(z.data_type & 64) && self.framed_header
+            && !self.pending && (total_out - last >= span)) {
+            uInt bytes = LI_GZINDEX_WINDOW_BYTES;
+            result = (inflateGetDictionary(&z, (Bytef*) window, &bytes) == Z_OK) ? LI_SUCCESS : LI_BAD_FORMAT;
+            REQUIRE_SUCCESS;
+            memset(&self.point, 0, sizeof(self.point));
+            self.point.input_offset = total_in;
+            self.point.output_offset = total_out;
+            self.point.window_offset = self.written;
+            self.point.window_bytes = bytes;
+            self.point.bits = (uint8_t) (z.data_type & 7);
+            self.pending = true;
+            last = total_out;
+            result = li_gzindexer_write(&self, window, bytes);
+            REQUIRE_SUCCESS;
+        }
+        if (callback && (self.written != reported)) {
+            callback(user_ptr, 0, self.written - reported);
+            reported = self.written;
+        }
+    }
+    REQUIRE_FORMAT(self.framed_header);
+
+    // Checkpoints with no records after them are no use.  Nor is one still
+    // waiting, so it is dropped.
+    uint64_t records = 0;
+    LI_TRUST(li_get(self.reader, LI_RECORD_COUNT_U64, 0, &records, sizeof(records)));
+    while (li_queue_size(&self.points) > sizeof(li_gzindex_point)) {
+        const li_gzindex_point* p = li_queue_end(&self.points);
+        if (p[-1].first_record != records)
+            break;
+        li_queue_unput(&self.points, sizeof(li_gzindex_point));
+    }
+    uint64_t footer = self.written;
+    uint64_t sizes[5] = { span, li_queue_size(&self.points) / sizeof(li_gzindex_point), records, total_out, li_queue_size(&self.header) };
+    result = li_gzindexer_write(&self, sizes, sizeof(sizes));
+    REQUIRE_SUCCESS;
+    result = li_gzindexer_write(&self, li_queue_begin(&self.header), li_queue_size(&self.header));
+    REQUIRE_SUCCESS;
+    result = li_gzindexer_write(&self, li_queue_begin(&self.points), li_queue_size(&self.points));
+    REQUIRE_SUCCESS;
+    result = li_gzindexer_write(&self, &footer, sizeof(footer));
+    REQUIRE_SUCCESS;
+    result = li_gzindexer_write(&self, LI_GZINDEX_MAGIC "\0\0\0\0", 8);
+    REQUIRE_SUCCESS;
+    if (callback && (self.written != reported))
+        callback(user_ptr, 0, self.written - reported);
+
+cleanup:
+
+    if (inflating)
+        inflateEnd(&z);
+    li_dealloc(window);
+    li_dealloc(out);
+    li_dealloc(in);
+    li_queue_dtor(&self.points);
+    li_queue_dtor(&self.header);
+    li_finalize(self.reader);
+    fflush(output);
+    return result;
+}
+
+
+
+// Random access
+
+li_status li_gzindex_ctor(li_gzindex* self, FILE* file) {
+    assert(self && file);
+    memset(self, 0, sizeof(li_gzindex));
+    self->file = file;
+
+    li_byte trailer[16];
+    off_t end = 0;
+    if (fseeko(file, 0, SEEK_END) || ((end = ftello(file)) < 0))
+        return LI_IO_ERROR;
+    if (end < (off_t) (8 + 5 * sizeof(uint64_t) + sizeof(trailer)))
+        return LI_BAD_FORMAT;
+    end -= (off_t) sizeof(trailer);
+    if (fseeko(file, end, SEEK_SET) || (fread(trailer, 1, sizeof(trailer), file) != sizeof(trailer)))
+        return LI_IO_ERROR;
+    uint64_t footer = 0;
+    memcpy(&footer, trailer, sizeof(footer));
+    uint64_t sizes[5];
+    if (memcmp(trailer + 8, LI_GZINDEX_MAGIC, 4) || (footer > (uint64_t) end - sizeof(sizes)))
+        return LI_BAD_FORMAT;
+    if (fseeko(file, (off_t) footer, SEEK_SET) || (fread(sizes, 1, sizeof(sizes), file) != sizeof(sizes)))
+        return LI_IO_ERROR;
+    uint64_t room = (uint64_t) end - footer - sizeof(sizes);
+    if (!sizes[1] || (sizes[4] > room) || (sizes[1] > (room - sizes[4]) / sizeof(li_gzindex_point))
+        || (sizes[4] + sizes[1] * sizeof(li_gzindex_point) != room))
+        return LI_BAD_FORMAT;
+    self->count = sizes[1];
+    self->records = sizes[2];
+    self->output_bytes = sizes[3];
+    self->header_bytes = sizes[4];
+    self->header = li_alloc((size_t) self->header_bytes);
+    self->points = li_alloc((size_t) self->count * sizeof(li_gzindex_point));
+    if (!self->header || !self->points) {
+        li_gzindex_dtor(self);
+        return LI_BAD_ALLOC;
+    }
+    if ((fread(self->header, 1, (size_t) self->header_bytes, file) != self->header_bytes)
+        || (fread(self->points, sizeof(li_gzindex_point), (size_t) self->count, file) != self->count)) {
+        li_gzindex_dtor(self);
+        return LI_IO_ERROR;
+    }
+    for (uint64_t i = 0; i != self->count; ++i) {
+        const li_gzindex_point* p = self->points + i;
+        if ((p->window_offset > footer) || (p->window_bytes > LI_GZINDEX_WINDOW_BYTES)
+            || (p->bits > 7) || (p->message_offset < p->output_offset)
+            || (i && ((p->first_record < p[-1].first_record) || (p->message_offset < p[-1].message_offset)))
+            || (p->first_record > self->records) || (p->message_offset > self->output_bytes)) {
+            li_gzindex_dtor(self);
+            return LI_BAD_FORMAT;
+        }
+    }
+    return LI_SUCCESS;
+}
+
+void li_gzindex_dtor(li_gzindex* self) {
+    assert(self);
+    li_dealloc(self->points);
+    li_dealloc(self->header);
+    self->points = NULL;
+    self->header = NULL;
+    self->count = 0;
+}
+
+uint64_t li_gzindex_find(const li_gzindex* self, uint64_t record) {
+    assert(self);
+    if (record >= self->records)
+        return self->count;
+    uint64_t a = 0;
+    uint64_t b = self->count;
+    while (b - a > 1) {
+        uint64_t c = a + (b - a) / 2;
+        if (self->points[c].first_record <= record)
+            a = c;
+        else
+            b = c;
+    }
+    return a;
+}
+
+typedef struct {
+    FILE* input;
+    z_stream z;
+    li_byte* buffer;        // Compressed input
+    li_byte* scratch;       // Output before the message to resume at
+    const li_byte* header;
+    size_t header_left;
+    uint64_t position;      // Of the next compressed byte to read
+    uint64_t skip;          // Output bytes to discard before resuming
+    uint64_t left;          // Output bytes to return after that
+    bool raw;               // Inflating the rest of a member without its gzip header
+    size_t trailer;         // Bytes of a gzip trailer still to skip
+    bool ended;             // At the end of a member
+    bool done;
+} li_gzsource;
+
+static size_t li_gzsource_pread(li_gzsource* self, void* dest, size_t count) {
+#ifdef LI_HAVE_PREAD
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(fileno(self->input), (char*) dest + total, count - total, (off_t) (self->position + total));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!n)
+            break;
+        total += (size_t) n;
+    }
+    self->position += total;
+    return total;
+#else
+    if (fseeko(self->input, (off_t) self->position, SEEK_SET))
+        return 0;
+    size_t n = fread(dest, 1, count, self->input);
+    self->position += n;
+    return n;
+#endif
+}
+
+static size_t li_gzsource_read(li_source* source, void* dest, size_t count) {
+    li_gzsource* self = source->filter;
+    size_t total = MIN(count, self->header_left);
+    memcpy(dest, self->header, total);
+    self->header += total;
+    self->header_left -= total;
+    while ((total < count) && !self->done && (source->status == LI_SUCCESS)) {
+        if (!self->left) {
+            self->done = true;
+            break;
+        }
+        if (!self->z.avail_in) {
+            size_t n = li_gzsource_pread(self, self->buffer, LI_GZINDEX_INPUT_BYTES);
+            if (!n) {
+                // Input that stops part way through a member is truncated
+                if (!self->ended || self->trailer)
+                    source->status = LI_BAD_FORMAT;
+                self->done = true;
+                break;
+            }
+            self->z.next_in = (Bytef*) self->buffer;
+            self->z.avail_in = (uInt) n;
+        }
+        if (self->trailer) {
+            size_t n = MIN(self->trailer, (size_t) self->z.avail_in);
+            self->z.next_in += n;
+            self->z.avail_in -= (uInt) n;
+            self->trailer -= n;
+            continue;
+        }
+        if (self->ended) {
+            // As li_gzip_fill, concatenated members continue the data
+            if ((self->z.next_in[0] != 0x1f) || (inflateReset2(&self->z, 16 + MAX_WBITS) != Z_OK)) {
+                self->done = true;
+                break;
+            }
+            self->ended = false;
+        }
+        uint64_t want = self->skip ? MIN(self->skip, (uint64_t) LI_GZINDEX_PIECE_BYTES)
+                                   : MIN((uint64_t) (count - total), self->left);
+        self->z.next_out = (Bytef*) (self->skip ? self->scratch : (li_byte*) dest + total);
+        self->z.avail_out = (uInt) MIN(want, (uint64_t) UINT_MAX);
+        uInt avail_out = self->z.avail_out;
+        int status = inflate(&self->z, Z_NO_FLUSH);
+        size_t n = avail_out - self->z.avail_out;
+        if (self->skip) {
+            self->skip -= n;
+        } else {
+            total += n;
+            self->left -= n;
+        }
+        if (status == Z_STREAM_END) {
+            // Without its header, zlib leaves the trailer of a member to us
+            self->trailer = self->raw ? 8 : 0;
+            self->raw = false;
+            self->ended = true;
+        } else if (status == Z_MEM_ERROR) {
+            source->status = LI_BAD_ALLOC;
+        } else if ((status != Z_OK) && (status != Z_BUF_ERROR)) {
+            source->status = LI_BAD_FORMAT;
+        }
+    }
+    source->offset += total;
+    return total;
+}
+
+static void li_gzsource_close(li_source* source) {
+    li_gzsource* self = source->filter;
+    inflateEnd(&self->z);
+    li_dealloc(self->scratch);
+    li_dealloc(self->buffer);
+    li_dealloc(self);
+    source->filter = NULL;
+}
+
+li_status li_gzindex_source(const li_gzindex* self, FILE* input, li_source* dest, uint64_t first, uint64_t count) {
+    assert(self && input && dest && (first < self->count) && (count <= self->count - first));
+    memset(dest, 0, sizeof(li_source));
+    dest->file = input;
+    dest->fd = -1;
+#ifdef LI_HAVE_PREAD
+    dest->kind = LI_SOURCE_PREAD;
+#else
+    dest->kind = LI_SOURCE_STREAM;
+#endif
+    dest->compressed = true;
+    const li_gzindex_point* p = self->points + first;
+    dest->row = p->first_record;
+
+    li_gzsource* gz = li_alloc(sizeof(li_gzsource));
+    li_byte* window = first ? li_alloc(LI_GZINDEX_WINDOW_BYTES) : NULL;
+    li_status result = LI_BAD_ALLOC;
+    if (!gz || (first && !window))
+        goto failure;
+    memset(gz, 0, sizeof(li_gzsource));
+    gz->input = input;
+    gz->header = self->header;
+    gz->header_left = (size_t) self->header_bytes;
+    gz->skip = p->message_offset - p->output_offset;
+    gz->left = (first + count == self->count) ? UINT64_MAX
+        : self->points[first + count].message_offset - p->message_offset;
+    gz->raw = first != 0;
+    gz->buffer = li_alloc(LI_GZINDEX_INPUT_BYTES);
+    gz->scratch = li_alloc(LI_GZINDEX_PIECE_BYTES);
+    if (!gz->buffer || !gz->scratch)
+        goto failure;
+    if (inflateInit2(&gz->z, gz->raw ? -MAX_WBITS : 16 + MAX_WBITS) != Z_OK)
+        goto failure;
+    dest->filter = gz;
+    dest->read = li_gzsource_read;
+    dest->close = li_gzsource_close;
+    if (!first)
+        return LI_SUCCESS;
+
+    // Prime inflate with the bits of the byte before the checkpoint and
+    // the window before it
+    gz->position = p->input_offset - (p->bits ? 1 : 0);
+    if (p->bits) {
+        li_byte c = 0;
+        result = LI_IO_ERROR;
+        if (li_gzsource_pread(gz, &c, 1) != 1)
+            goto closing;
+        result = LI_BAD_FORMAT;
+        if (inflatePrime(&gz->z, p->bits, (uint8_t) c >> (8 - p->bits)) != Z_OK)
+            goto closing;
+    }
+    result = LI_IO_ERROR;
+    if (fseeko(self->file, (off_t) p->window_offset, SEEK_SET)
+        || (fread(window, 1, p->window_bytes, self->file) != p->window_bytes))
+        goto closing;
+    result = LI_BAD_FORMAT;
+    if (inflateSetDictionary(&gz->z, (Bytef*) window, p->window_bytes) != Z_OK)
+        goto closing;
+    li_dealloc(window);
+    return LI_SUCCESS;
+
+closing:
+    li_dealloc(window);
+    li_source_dtor(dest);
+    dest->status = result;
+    return result;
+
+failure:
+    if (gz) {
+        li_dealloc(gz->scratch);
+        li_dealloc(gz->buffer);
+    }
+    li_dealloc(gz);
+    li_dealloc(window);
+    dest->status = result;
+    return result;
+}
@@ -0,0 +1,112 @@
+//
+//  ligzindex.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef ligzindex_h
+#define ligzindex_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lireader.h"
+#include "lisource.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // A gzip index (.gzi) lets an ordinary gzip compressed binary log file
+    // be read from the middle, as zlib's zran example does.  One pass
+    // through the file records checkpoints at deflate block boundaries
+    // roughly every span bytes of output, each with the 32 KiB window
+    // inflate needs to resume there.  The .li file is framed at the same
+    // time, and each checkpoint also records the first message boundary
+    // after it where every channel has framed the same whole number of
+    // records, so decoding the header followed by the data from there
+    // gives exactly the records that follow.
+    //
+    //     "LGZ1", u32 reserved
+    //     window of each checkpoint
+    //     u64 span, checkpoints, records, output bytes, header bytes
+    //     magic number and header of the .li file
+    //     li_gzindex_point for each checkpoint
+    //     u64 offset of the span field, "LGZ1", u32 reserved
+    //
+    // Checkpoint 0 is the start of the file and has no window.
+
+#define LI_GZINDEX_MAGIC "LGZ1"
+#define LI_GZINDEX_SPAN (8 << 20) // Default output bytes between checkpoints
+#define LI_GZINDEX_WINDOW_BYTES 32768
+
+    typedef struct li_gzindex_point {
+        uint64_t input_offset;   // Of the first whole compressed byte
+        uint64_t output_offset;  // Of the .li data inflated from there
+        uint64_t message_offset; // Of the .li data where decoding resumes
+        uint64_t first_record;   // Row number of the record there
+        uint64_t window_offset;  // Of the window in the index file
+        uint32_t window_bytes;
+        uint8_t bits;            // Of the byte before input_offset still to inflate
+        uint8_t reserved[3];
+    } li_gzindex_point;
+
+    // Options for building an index.  Zero initialization gives the
+    // defaults.
+
+    typedef struct li_gzindex_options {
+        uint64_t span; // Output bytes between checkpoints, or 0 for
+                       // LI_GZINDEX_SPAN
+    } li_gzindex_options;
+
+    // Read a gzip compressed binary log file from its start and write an
+    // index of it to output, which need not be seekable.  options may be
+    // NULL.  Optionally provide a callback that will report whenever bytes
+    // are read from input or written to output.  user_ptr is passed
+    // unchanged to the callback.
+
+    li_status li_gzindex_build(FILE* input,
+                               FILE* output,
+                               const li_gzindex_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // li_gzindex holds an index read back into memory
+
+    typedef struct li_gzindex {
+        FILE* file;              // The index file
+        li_gzindex_point* points;
+        uint64_t count;          // Checkpoints, including the start
+        uint64_t records;
+        uint64_t output_bytes;   // Of the whole .li file
+        li_byte* header;         // Magic number and header of the .li file
+        uint64_t header_bytes;
+    } li_gzindex;
+
+    // Read an index.  file must be seekable, and stay open while the
+    // li_gzindex is in use.
+    li_status li_gzindex_ctor(li_gzindex* self, FILE* file);
+    void li_gzindex_dtor(li_gzindex* self);
+
+    // The last checkpoint at or before a record, or count if there is none
+    uint64_t li_gzindex_find(const li_gzindex* self, uint64_t record);
+
+    // Construct a source reading the header then the .li data of the
+    // gzip compressed file input from checkpoint first up to checkpoint
+    // first + count, or the end of the file if that is self->count.  Its
+    // row is the first record of checkpoint first, so li_convert numbers
+    // rows as in the whole file.  The source reads input with positioned
+    // reads where available, so sources over the same file may be used on
+    // separate threads to decode parts of it in parallel, though they must
+    // be constructed on one thread at a time as the window is read from
+    // the index file then.
+    li_status li_gzindex_source(const li_gzindex* self, FILE* input, li_source* dest, uint64_t first, uint64_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ligzindex_h */
@@ -0,0 +1,502 @@
+//
+//  lilic.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lilic.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "lipipeline.h"
+
+size_t li_lic_packed_bytes(size_t count, unsigned width) {
+    return (count * width + 63) / 64 * 8;
+}
+
+static unsigned li_lic_bits(uint64_t x) {
+    unsigned n = 0;
+    for (; x; x >>= 1)
+        ++n;
+    return n;
+}
+
+static uint64_t li_lic_zigzag(uint64_t x) {
+    return (x << 1) ^ (uint64_t) ((int64_t) x >> 63);
+}
+
+static uint64_t li_lic_unzigzag(uint64_t x) {
+    return (x >> 1) ^ (0 - (x & 1));
+}
+
+// Pack values LSB first into little-endian words
+
+static void li_lic_pack(uint8_t* dest, const uint64_t* src, size_t stride, size_t count, unsigned width, uint64_t base, bool delta) {
+    uint64_t word = 0;
+    unsigned bits = 0;
+    uint64_t previous = base;
+    for (size_t i = 0; i != count; ++i, src += stride) {
+        uint64_t x = *src - previous;
+        if (delta) {
+            x = li_lic_zigzag(x);
+            previous = *src;
+        }
+        word |= x << bits;
+        bits += width;
+        if (bits >= 64) {
+            memcpy(dest, &word, sizeof(word));
+            dest += sizeof(word);
+            bits -= 64;
+            word = bits ? x >> (width - bits) : 0;
+        }
+    }
+    if (bits)
+        memcpy(dest, &word, sizeof(word));
+}
+
+size_t li_lic_encode(li_lic_entry* entry,
+                     const uint64_t* src,
+                     size_t stride,
+                     size_t count,
+                     bool is_signed,
+                     uint8_t* dest)
+{
+    assert(entry && src && count);
+    uint64_t min = src[0];
+    uint64_t max = src[0];
+    uint64_t changes = 0; // Union of the bits of the zigzag deltas
+    const uint64_t* p = src;
+    for (size_t i = 1; i != count; ++i) {
+        uint64_t x = p[stride];
+        changes |= li_lic_zigzag(x - *p);
+        p += stride;
+        if (is_signed ? ((int64_t) x < (int64_t) min) : (x < min))
+            min = x;
+        if (is_signed ? ((int64_t) x > (int64_t) max) : (x > max))
+            max = x;
+    }
+    unsigned frame = li_lic_bits(max - min);
+    unsigned delta = li_lic_bits(changes);
+
+    memset(entry, 0, sizeof(li_lic_entry));
+    entry->min = min;
+    entry->max = max;
+    if (delta < frame) {
+        entry->encoding = LI_LIC_DELTA;
+        entry->width = (uint8_t) delta;
+        entry->base = src[0];
+        li_lic_pack(dest, src + stride, stride, count - 1, delta, src[0], true);
+        return li_lic_packed_bytes(count - 1, delta);
+    }
+    entry->encoding = LI_LIC_FRAME;
+    entry->width = (uint8_t) frame;
+    entry->base = min;
+    li_lic_pack(dest, src, stride, count, frame, min, false);
+    return li_lic_packed_bytes(count, frame);
+}
+
+// Unpack count values of width bits, adding them to base, or for deltas
+// to the previous value.  src must be followed by 8 readable bytes.
+
+#define LI_LIC_UNPACK(GET)\
+do {\
+    if (delta) {\
+        for (size_t i = 0; i != count; ++i, bit += width)\
+            dest[i] = base += li_lic_unzigzag(GET);\
+    } else {\
+        for (size_t i = 0; i != count; ++i, bit += width)\
+            dest[i] = base + (GET);\
+    }\
+} while (false)
+
+static uint64_t li_lic_get_narrow(const uint8_t* src, size_t bit, uint64_t mask) {
+    // The value lies within the 8 bytes starting at its first byte
+    uint64_t word;
+    memcpy(&word, src + (bit >> 3), sizeof(word));
+    return (word >> (bit & 7)) & mask;
+}
+
+static uint64_t li_lic_get_wide(const uint8_t* src, size_t bit, uint64_t mask) {
+    uint64_t words[2];
+    memcpy(words, src + (bit >> 6) * 8, sizeof(words));
+    unsigned shift = bit & 63;
+    uint64_t x = words[0] >> shift;
+    if (shift)
+        x |= words[1] << (64 - shift);
+    return x & mask;
+}
+
+static void li_lic_unpack(uint64_t* dest, const uint8_t* src, size_t count, unsigned width, uint64_t base, bool delta) {
+    uint64_t mask = (width == 64) ? ~(uint64_t) 0 : ((uint64_t) 1 << width) - 1;
+    size_t bit = 0;
+    if (!width)
+        LI_LIC_UNPACK(0);
+    else if (width <= 56)
+        LI_LIC_UNPACK(li_lic_get_narrow(src, bit, mask));
+    else
+        LI_LIC_UNPACK(li_lic_get_wide(src, bit, mask));
+}
+
+#undef LI_LIC_UNPACK
+
+void li_lic_column_dtor(li_lic_column* self) {
+    li_array_dtor(Operation)(&self->ops);
+}
+
+li_status li_lic_columns(li_array(li_lic_column)* dest,
+                         li_array(li_metadata_channel)* channels)
+{
+    assert(dest && channels);
+    li_array_clear(li_lic_column)(dest);
+    li_status result = LI_SUCCESS;
+    LI_FOR(li_metadata_channel, c, channels) {
+        li_array(Record) recs = li_parse_Record_list(c->record_format);
+        li_array(li_array_Operation) procs = li_parse_Operation_list_list(c->proc_format, c->calibration);
+        li_array(Operation)* proc = li_array_begin(li_array_Operation)(&procs);
+        LI_FOR(Record, r, &recs) {
+            if (r->literal.type || (r->type == 'p'))
+                continue;
+            if (proc == li_array_end(li_array_Operation)(&procs)) {
+                result = LI_BAD_FORMAT;
+                break;
+            }
+            li_lic_column x;
+            x.channel = c->number;
+            x.type = r->type;
+            x.width = r->width;
+            x.ops = *proc;
+            li_array_ctor(Operation)(proc++); // x owns the operations
+            x.monotonic = (r->type != 'f');
+            LI_FOR(Operation, o, &x.ops)
+                x.monotonic = x.monotonic && strchr("*/+-", o->op);
+            result = li_array_push(li_lic_column)(dest, x);
+            if (result != LI_SUCCESS) {
+                li_lic_column_dtor(&x);
+                break;
+            }
+        }
+        li_array_dtor(li_array_Operation)(&procs);
+        li_array_dtor(Record)(&recs);
+        LI_DOUBT(result);
+    }
+    return result;
+}
+
+// Convert raw values to doubles and calibrate them one operation at a time,
+// with the same arithmetic as li_reader
+
+static void li_lic_calibrate(const li_lic_column* column, const uint64_t* src, double* dest, size_t count) {
+    switch (column->type) {
+        case 's':
+            for (size_t i = 0; i != count; ++i)
+                dest[i] = (double) (int64_t) src[i];
+            break;
+        case 'f':
+            for (size_t i = 0; i != count; ++i) {
+                if (column->width == 32) {
+                    float x;
+                    uint32_t y = (uint32_t) src[i];
+                    memcpy(&x, &y, sizeof(x));
+                    dest[i] = x;
+                } else {
+                    memcpy(dest + i, src + i, sizeof(double));
+                }
+            }
+            break;
+        default:
+            for (size_t i = 0; i != count; ++i)
+                dest[i] = (double) src[i];
+            break;
+    }
+    for (const Operation* o = column->ops.begin; o != column->ops.end; ++o) {
+        double v = o->value;
+        switch (o->op) {
+            case '*':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = dest[i] * v;
+                break;
+            case '/':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = dest[i] / v;
+                break;
+            case '+':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = dest[i] + v;
+                break;
+            case '-':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = dest[i] - v;
+                break;
+            case '&':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = ((intmax_t) dest[i]) & ((intmax_t) v);
+                break;
+            case 's':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = sqrt(dest[i]);
+                break;
+            case '^':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = pow(dest[i], v);
+                break;
+            case 'f':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = floor(dest[i]);
+                break;
+            case 'c':
+                for (size_t i = 0; i != count; ++i)
+                    dest[i] = ceil(dest[i]);
+                break;
+            default:
+                assert(false);
+                break;
+        }
+    }
+}
+
+struct li_lic {
+    FILE* input;
+    li_lic_info info;
+    li_string csv_format;
+    li_string csv_header;
+    li_array(li_metadata_channel) channels;
+    li_array(li_lic_column) columns;
+    li_lic_entry* index;  // blocks * columns, block-major
+    li_block packed;      // Packed values of one column of one block
+    uint64_t* values;     // Unpacked values of one column of one block
+};
+
+// Take count bytes from the front of the footer
+
+static bool li_lic_take(const uint8_t** begin, const uint8_t* end, void* dest, size_t count) {
+    if ((size_t) (end - *begin) < count)
+        return false;
+    memcpy(dest, *begin, count);
+    *begin += count;
+    return true;
+}
+
+static bool li_lic_take_string(const uint8_t** begin, const uint8_t* end, li_string* dest) {
+    uint64_t n = 0;
+    if (!li_lic_take(begin, end, &n, sizeof(n)) || ((uint64_t) (end - *begin) < n))
+        return false;
+    li_string_dtor(dest);
+    *dest = li_string_from_range((const char*) *begin, (const char*) *begin + n);
+    *begin += n;
+    return *dest;
+}
+
+li_status li_lic_open(li_lic** dest, FILE* input) {
+    assert(dest && input);
+    *dest = NULL;
+
+    li_lic* self = li_alloc(sizeof(li_lic));
+    if (!self)
+        return LI_BAD_ALLOC;
+    memset(self, 0, sizeof(li_lic));
+    self->input = input;
+    li_array_ctor(li_metadata_channel)(&self->channels);
+    li_array_ctor(li_lic_column)(&self->columns);
+
+    li_status result = LI_SUCCESS;
+    uint8_t* footer = NULL;
+
+    // The trailer gives the offset of the footer
+    uint8_t trailer[12];
+    off_t end = 0;
+    uint64_t offset = 0;
+    if (fseeko(input, 0, SEEK_END) || ((end = ftello(input)) < (off_t) sizeof(trailer))
+        || fseeko(input, end - (off_t) sizeof(trailer), SEEK_SET)
+        || (fread(trailer, 1, sizeof(trailer), input) != sizeof(trailer))) {
+        result = (end < (off_t) sizeof(trailer)) ? LI_BAD_FORMAT : LI_IO_ERROR;
+        goto cleanup;
+    }
+    memcpy(&offset, trailer, sizeof(offset));
+    end -= (off_t) sizeof(trailer);
+    if (memcmp(trailer + 8, LI_LIC_MAGIC, 4) || (offset < 8) || (offset > (uint64_t) end)) {
+        result = LI_BAD_FORMAT;
+        goto cleanup;
+    }
+    size_t n = (size_t) ((uint64_t) end - offset);
+    footer = li_alloc(MAX(n, (size_t) 1));
+    if (!footer) {
+        result = LI_BAD_ALLOC;
+        goto cleanup;
+    }
+    if (fseeko(input, (off_t) offset, SEEK_SET) || (fread(footer, 1, n, input) != n)) {
+        result = LI_IO_ERROR;
+        goto cleanup;
+    }
+
+    const uint8_t* p = footer;
+    const uint8_t* q = footer + n;
+    uint64_t sizes[4]; // rows, block_rows, columns, channels
+    li_lic_info* info = &self->info;
+    result = LI_BAD_FORMAT;
+    if (!li_lic_take(&p, q, sizes, sizeof(sizes))
+        || !li_lic_take(&p, q, &info->time_step, sizeof(double))
+        || !li_lic_take(&p, q, &info->start_offset, sizeof(double))
+        || !li_lic_take(&p, q, &info->start_time, sizeof(uint64_t))
+        || !sizes[1] || (sizes[1] > SIZE_MAX / sizeof(uint64_t)) || (sizes[3] > 8))
+        goto cleanup;
+    info->rows = sizes[0];
+    info->block_rows = (size_t) sizes[1];
+    info->blocks = (sizes[0] + sizes[1] - 1) / sizes[1];
+    info->columns = (size_t) sizes[2];
+    for (uint64_t i = 0; i != sizes[3]; ++i) {
+        li_metadata_channel c;
+        memset(&c, 0, sizeof(c));
+        uint64_t number = 0;
+        bool ok = li_lic_take(&p, q, &number, sizeof(number))
+            && li_lic_take(&p, q, &c.calibration, sizeof(double))
+            && li_lic_take_string(&p, q, &c.record_format)
+            && li_lic_take_string(&p, q, &c.proc_format);
+        c.number = (int) number;
+        if (!ok || li_array_push(li_metadata_channel)(&self->channels, c)) {
+            li_metadata_channel_dtor(&c);
+            goto cleanup;
+        }
+    }
+    if (!li_lic_take_string(&p, q, &self->csv_format) || !li_lic_take_string(&p, q, &self->csv_header))
+        goto cleanup;
+    info->csv_format = self->csv_format;
+    info->csv_header = self->csv_header;
+
+    result = li_lic_columns(&self->columns, &self->channels);
+    if (result != LI_SUCCESS)
+        goto cleanup;
+    result = LI_BAD_FORMAT;
+    if (li_array_size(li_lic_column)(&self->columns) != info->columns)
+        goto cleanup;
+    if (info->columns && (info->blocks > (uint64_t) (q - p) / sizeof(li_lic_entry) / info->columns))
+        goto cleanup;
+    size_t entries = (size_t) info->blocks * info->columns;
+    if ((size_t) (q - p) != entries * sizeof(li_lic_entry))
+        goto cleanup;
+
+    result = LI_BAD_ALLOC;
+    self->index = li_alloc(MAX(entries, (size_t) 1) * sizeof(li_lic_entry));
+    self->values = li_alloc(info->block_rows * sizeof(uint64_t));
+    if (!self->index || !self->values
+        || li_block_ctor(&self->packed, li_lic_packed_bytes(info->block_rows, 64) + 8))
+        goto cleanup;
+    memcpy(self->index, p, entries * sizeof(li_lic_entry));
+
+    // Check the packed columns lie within the file
+    result = LI_BAD_FORMAT;
+    for (size_t i = 0; i != entries; ++i) {
+        li_lic_entry* e = self->index + i;
+        size_t rows = li_lic_block_size(self, i / info->columns);
+        size_t packed = (e->encoding == LI_LIC_DELTA) ? rows - 1 : rows;
+        if ((e->encoding > LI_LIC_DELTA) || (e->width > 64) || (e->offset > offset)
+            || (li_lic_packed_bytes(packed, e->width) > offset - e->offset))
+            goto cleanup;
+    }
+
+    result = LI_SUCCESS;
+    *dest = self;
+    self = NULL;
+
+cleanup:
+
+    li_dealloc(footer);
+    li_lic_close(self);
+    return result;
+}
+
+void li_lic_close(li_lic* self) {
+    if (!self)
+        return;
+    li_dealloc(self->values);
+    li_block_dtor(&self->packed);
+    li_dealloc(self->index);
+    li_array_dtor(li_lic_column)(&self->columns);
+    li_array_dtor(li_metadata_channel)(&self->channels);
+    li_string_dtor(&self->csv_header);
+    li_string_dtor(&self->csv_format);
+    li_dealloc(self);
+}
+
+const li_lic_info* li_lic_get_info(const li_lic* self) {
+    assert(self);
+    return &self->info;
+}
+
+const li_lic_column* li_lic_get_column(const li_lic* self, size_t column) {
+    assert(self && (column < self->info.columns));
+    return self->columns.begin + column;
+}
+
+size_t li_lic_block_size(const li_lic* self, uint64_t block) {
+    assert(self && (block < self->info.blocks));
+    uint64_t first = block * self->info.block_rows;
+    return (size_t) MIN(self->info.rows - first, (uint64_t) self->info.block_rows);
+}
+
+// Unpack a column of a block into self->values
+
+static li_status li_lic_unpack_block(li_lic* self, size_t column, uint64_t block) {
+    if ((column >= self->info.columns) || (block >= self->info.blocks))
+        return LI_INVALID_ARGUMENT;
+    const li_lic_entry* e = self->index + block * self->info.columns + column;
+    size_t rows = li_lic_block_size(self, block);
+    uint64_t* v = self->values;
+    if (e->encoding == LI_LIC_DELTA) {
+        --rows;
+        ++v;
+    }
+    size_t n = li_lic_packed_bytes(rows, e->width);
+    if (n && (fseeko(self->input, (off_t) e->offset, SEEK_SET)
+              || (fread(self->packed.begin, 1, n, self->input) != n)))
+        return LI_IO_ERROR;
+    memset(self->packed.begin + n, 0, 8);
+    if (e->encoding == LI_LIC_DELTA)
+        self->values[0] = e->base;
+    li_lic_unpack(v, (const uint8_t*) self->packed.begin, rows, e->width, e->base, e->encoding == LI_LIC_DELTA);
+    return LI_SUCCESS;
+}
+
+li_status li_lic_decode(li_lic* self, size_t column, uint64_t block, double* dest) {
+    assert(self && dest);
+    LI_DOUBT(li_lic_unpack_block(self, column, block));
+    li_lic_calibrate(self->columns.begin + column, self->values, dest, li_lic_block_size(self, block));
+    return LI_SUCCESS;
+}
+
+li_status li_lic_decode_raw(li_lic* self, size_t column, uint64_t block, int64_t* dest) {
+    assert(self && dest);
+    LI_DOUBT(li_lic_unpack_block(self, column, block));
+    memcpy(dest, self->values, li_lic_block_size(self, block) * sizeof(uint64_t));
+    return LI_SUCCESS;
+}
+
+li_status li_lic_bounds(li_lic* self, size_t column, uint64_t block, double* min, double* max) {
+    assert(self && min && max);
+    if ((column >= self->info.columns) || (block >= self->info.blocks))
+        return LI_INVALID_ARGUMENT;
+    const li_lic_column* c = self->columns.begin + column;
+    if (c->monotonic) {
+        const li_lic_entry* e = self->index + block * self->info.columns + column;
+        uint64_t x[2] = { e->min, e->max };
+        double y[2];
+        li_lic_calibrate(c, x, y, 2);
+        *min = MIN(y[0], y[1]);
+        *max = MAX(y[0], y[1]);
+        return LI_SUCCESS;
+    }
+    LI_DOUBT(li_lic_unpack_block(self, column, block));
+    size_t rows = li_lic_block_size(self, block);
+    double* y = (double*) self->packed.begin; // Big enough, and free again
+    li_lic_calibrate(c, self->values, y, rows);
+    *min = *max = y[0];
+    for (size_t i = 1; i != rows; ++i) {
+        *min = MIN(*min, y[i]);
+        *max = MAX(*max, y[i]);
+    }
+    return LI_SUCCESS;
+}
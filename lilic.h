@@ -0,0 +1,162 @@
+//
+//  lilic.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lilic_h
+#define lilic_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "liparse.h"
+#include "lireader.h"
+#include "lisink.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // An LIC file is a columnar archive of a binary log file.  It keeps the
+    // raw integer fields of the records rather than the doubles they are
+    // calibrated to, with a column for each value of a record, so it is
+    // both smaller than the .li file and lossless.  Rows are grouped into
+    // blocks of block_rows, the last of which may be short.  Each column of
+    // each block is bit-packed separately, either as offsets from the least
+    // value of the block (frame of reference) or as zigzag encoded
+    // differences between consecutive values, whichever needs fewer bits.
+    // A footer holds the header of the log file, including the record and
+    // calibration strings of each channel, and indexes the packed columns
+    // with their least and greatest values so that queries can skip blocks.
+    //
+    //     "LIC1", u32 reserved
+    //     packed columns, for each block for each column
+    //     footer: u64 rows, block_rows, columns, channels
+    //             f64 time_step, start_offset, u64 start_time
+    //             for each channel: u64 number, f64 calibration,
+    //                               string record, string proc
+    //             string csv format, string csv header
+    //             li_lic_entry for each block for each column
+    //     u64 offset of the footer, "LIC1"
+    //
+    // Strings are a u64 length followed by that many bytes.  Everything is
+    // little-endian.
+
+#define LI_LIC_MAGIC "LIC1"
+#define LI_LIC_BLOCK_ROWS 4096
+
+    typedef enum li_lic_encoding {
+        LI_LIC_FRAME = 0, // Offsets from base, the least value
+        LI_LIC_DELTA = 1, // base is the first value, followed by the
+                          // zigzag encoded difference from the previous
+                          // value for each of the others
+    } li_lic_encoding;
+
+    // Where and how one column of one block is packed
+
+    typedef struct li_lic_entry {
+        uint64_t offset;     // Of the packed values in the file
+        uint64_t min;        // Least and greatest values, compared as
+        uint64_t max;        // signed for signed fields and as unsigned
+                             // otherwise, even for floating point fields
+        uint64_t base;
+        uint8_t encoding;    // li_lic_encoding
+        uint8_t width;       // Bits for each packed value
+        uint8_t reserved[6];
+    } li_lic_entry;
+
+    // Bytes taken by count packed values of width bits, a multiple of 8
+
+    size_t li_lic_packed_bytes(size_t count, unsigned width);
+
+    // Pick the encoding needing fewer bits for count values, the first at
+    // src and each stride after the last, and pack them into dest, which
+    // must have room for li_lic_packed_bytes(count, 64) bytes.  Fills in all
+    // of entry but offset and returns the number of bytes packed.
+
+    size_t li_lic_encode(li_lic_entry* entry,
+                         const uint64_t* src,
+                         size_t stride,
+                         size_t count,
+                         bool is_signed,
+                         uint8_t* dest);
+
+    // A column of an LIC file: one value of a record, with the field it is
+    // stored as and the operations calibrating it
+
+    typedef struct li_lic_column {
+        int channel;
+        char type;                // 's', 'u', 'b' or 'f' as in the record
+                                  // string
+        size_t width;             // Bits of the field
+        li_array(Operation) ops;
+        bool monotonic;           // ops only add, subtract, multiply and
+                                  // divide, so preserve the order of values
+    } li_lic_column;
+
+    void li_lic_column_dtor(li_lic_column* self);
+    li_array_define(li_lic_column)
+
+    // The columns described by the record and proc strings of channels,
+    // which are in record order.  Literal and padding fields have no column.
+
+    li_status li_lic_columns(li_array(li_lic_column)* dest,
+                             li_array(li_metadata_channel)* channels);
+
+    // li_lic reads an LIC file, decoding selected columns of selected
+    // blocks.  It may only be used by one thread at a time; open the file
+    // once for each thread to decode in parallel.
+
+    typedef struct li_lic li_lic;
+
+    typedef struct li_lic_info {
+        uint64_t rows;
+        size_t block_rows;
+        uint64_t blocks;
+        size_t columns;           // Values in each record
+        double time_step;
+        double start_offset;
+        uint64_t start_time;
+        const char* csv_format;
+        const char* csv_header;
+    } li_lic_info;
+
+    // Read the footer of an LIC file.  input must be open for binary
+    // reading and seekable, and must stay open until li_lic_close, which
+    // doesn't close it.  On failure *dest is NULL.
+
+    li_status li_lic_open(li_lic** dest, FILE* input);
+    void li_lic_close(li_lic* self); // Accepts NULL
+
+    const li_lic_info* li_lic_get_info(const li_lic* self);
+    const li_lic_column* li_lic_get_column(const li_lic* self, size_t column);
+
+    // Rows in a block, block_rows for all but the last
+
+    size_t li_lic_block_size(const li_lic* self, uint64_t block);
+
+    // Decode a column of a block into dest, which needs room for
+    // li_lic_block_size doubles.  The values are exactly those of
+    // LI_RECORD_F64V.
+
+    li_status li_lic_decode(li_lic* self, size_t column, uint64_t block, double* dest);
+
+    // As above, giving the raw fields as LI_RAW_RECORD_I64V does
+
+    li_status li_lic_decode_raw(li_lic* self, size_t column, uint64_t block, int64_t* dest);
+
+    // The least and greatest calibrated values of a column of a block.
+    // These come from the index when the calibration preserves order, and
+    // otherwise by decoding the block.
+
+    li_status li_lic_bounds(li_lic* self, size_t column, uint64_t block, double* min, double* max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lilic_h */
@@ -0,0 +1,503 @@
+//
+//  lipack.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lipack.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "lipipeline.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#define LI_HAVE_PREAD
+#endif
+
+#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
+#define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
+
+// Input is given to the reader in pieces, after each of which we look for a
+// place to end the block.  Once a block is long enough the pieces shrink to
+// what the reader suggests, so that it stops at every message boundary.
+#define LI_PACK_PIECE_BYTES (64 << 10)
+#define LI_PACK_INPUT_BYTES (256 << 10)
+
+
+
+// Packing
+
+typedef struct {
+    li_pipeline pipe;
+    li_block* out;
+    z_stream z;
+    li_block scratch;    // One compressed block
+    li_queue pending;    // Input from start that is not yet in a block
+    uint64_t start;      // Input offset of pending
+    li_queue index;      // li_pack_entry for each block written
+    uint64_t offset;     // Bytes written
+    uint64_t records;    // Records before pending
+} li_packer;
+
+static void li_packer_write(li_packer* self, const void* src, size_t count) {
+    const li_byte* p = src;
+    while (count) {
+        li_block* b = self->out;
+        if (b->size == b->capacity) {
+            li_pipeline_submit(&self->pipe, b);
+            b = self->out = li_pipeline_acquire(&self->pipe);
+        }
+        size_t n = MIN(count, b->capacity - b->size);
+        memcpy(b->begin + b->size, p, n);
+        b->size += n;
+        p += n;
+        count -= n;
+    }
+    self->offset += (uint64_t) (p - (const li_byte*) src);
+}
+
+// Deflate the input up to end as a block completing records records
+
+static li_status li_packer_block(li_packer* self, uint64_t end, uint64_t records) {
+    assert((end > self->start) && (records >= self->records));
+    size_t n = (size_t) (end - self->start);
+    assert(n <= li_queue_size(&self->pending));
+    LI_DOUBT(li_block_reserve(&self->scratch, (size_t) deflateBound(&self->z, (uLong) n)));
+    if (deflateReset(&self->z) != Z_OK)
+        return LI_BAD_ALLOC;
+    self->z.next_in = li_queue_begin(&self->pending);
+    self->z.avail_in = (uInt) n;
+    self->z.next_out = (Bytef*) self->scratch.begin;
+    self->z.avail_out = (uInt) self->scratch.capacity;
+    if (deflate(&self->z, Z_FINISH) != Z_STREAM_END)
+        return LI_BAD_ALLOC;
+    uint32_t bytes = (uint32_t) (self->scratch.capacity - self->z.avail_out);
+
+    li_pack_entry e;
+    e.offset = self->offset;
+    e.bytes = bytes;
+    e.input_offset = self->start;
+    e.input_bytes = n;
+    e.first_record = self->records;
+    e.records = records - self->records;
+    LI_DOUBT(li_queue_put(&self->index, &e, sizeof(e)));
+    li_packer_write(self, &bytes, sizeof(bytes));
+    li_packer_write(self, self->scratch.begin, bytes);
+
+    li_queue_drop(&self->pending, n);
+    self->start = end;
+    self->records = records;
+    return LI_SUCCESS;
+}
+
+// Records whose data every channel has framed.  *phased is set if no
+// channel has framed any more than that.
+
+static uint64_t li_packer_records(li_reader* r, bool* phased) {
+    uint64_t records = 0;
+    uint8_t in_phase = 0;
+    LI_TRUST(li_get(r, LI_RECORD_COUNT_U64, 0, &records, sizeof(records)));
+    LI_TRUST(li_get(r, LI_IN_PHASE_U8, 0, &in_phase, sizeof(in_phase)));
+    *phased = in_phase;
+    return records;
+}
+
+li_status li_source_to_pack(li_source* input,
+                            FILE* output,
+                            const li_pack_options* options,
+                            void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                            void* user_ptr)
+{
+    assert(input && output);
+    size_t block_bytes = (options && options->block_bytes) ? options->block_bytes : LI_PACK_BLOCK_BYTES;
+    int level = (options && options->level) ? MAX(options->level, Z_NO_COMPRESSION) : 6;
+
+    li_status result = LI_SUCCESS;
+    li_packer self;
+    memset(&self, 0, sizeof(self));
+    li_queue_ctor(&self.pending);
+    li_queue_ctor(&self.index);
+    uint64_t total = 0;            // Bytes read
+    uint64_t reported = 0;         // Bytes written that were reported
+    bool deflating = false;
+    bool header = false;
+
+    li_status piped = li_pipeline_ctor(&self.pipe, input, output, NULL, NULL);
+    bool piping = true;
+    li_reader* r = li_init(malloc, free);
+    if (!r) {
+        result = LI_BAD_ALLOC;
+        goto cleanup;
+    }
+    li_frame_only(r, true);
+    result = piped;
+    REQUIRE_SUCCESS;
+    self.out = li_pipeline_acquire(&self.pipe);
+    result = LI_BAD_ALLOC;
+    if (deflateInit2(&self.z, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        goto cleanup;
+    deflating = true;
+    result = li_block_ctor(&self.scratch, LI_PIPELINE_BLOCK_BYTES);
+    REQUIRE_SUCCESS;
+
+    li_packer_write(&self, LI_PACK_MAGIC "\0\0\0\0", 8);
+
+    for (li_block* in; (in = li_pipeline_read(&self.pipe)); li_pipeline_recycle(&self.pipe, in)) {
+        if (callback)
+            callback(user_ptr, in->size, 0);
+        result = li_queue_put(&self.pending, in->begin, in->size);
+        REQUIRE_SUCCESS;
+        for (size_t i = 0, n = 0; i < in->size; i += n) {
+            n = MIN(in->size - i, (size_t) LI_PACK_PIECE_BYTES);
+            if (header && (total - self.start >= block_bytes)) {
+                // The block is long enough, so go message by message until
+                // the channels are in phase
+                uint64_t suggested = 0;
+                LI_TRUST(li_get(r, LI_SUGGESTED_PUT_U64, 0, &suggested, sizeof(suggested)));
+                n = (size_t) MIN((uint64_t) n, MAX(suggested, (uint64_t) 1));
+            }
+            result = li_put(r, in->begin + i, n);
+            REQUIRE_SUCCESS;
+            total += n;
+            uint64_t framed = 0;
+            result = li_get(r, LI_FRAMED_BYTES_U64, 0, &framed, sizeof(framed));
+            if (result == LI_SMALL_SRC)
+                continue; // The header is incomplete
+            REQUIRE_SUCCESS;
+            if (!header) {
+                // The header is a block of its own
+                uint64_t bytes = 0;
+                LI_TRUST(li_get(r, LI_HEADER_BYTES_U64, 0, &bytes, sizeof(bytes)));
+                result = li_packer_block(&self, bytes, 0);
+                REQUIRE_SUCCESS;
+                header = true;
+            }
+            bool phased = false;
+            uint64_t records = li_packer_records(r, &phased);
+            if (phased && (framed - self.start >= block_bytes)) {
+                result = li_packer_block(&self, framed, records);
+                REQUIRE_SUCCESS;
+            }
+        }
+        if (callback && (self.offset != reported)) {
+            callback(user_ptr, 0, self.offset - reported);
+            reported = self.offset;
+        }
+    }
+    REQUIRE_FORMAT(header);
+
+    // Whatever is left, including any incomplete message, is the last block
+    if (total > self.start) {
+        bool phased = false;
+        uint64_t records = li_packer_records(r, &phased);
+        result = li_packer_block(&self, total, records);
+        REQUIRE_SUCCESS;
+    }
+    uint32_t end = 0;
+    li_packer_write(&self, &end, sizeof(end));
+    uint64_t index = self.offset;
+    li_packer_write(&self, li_queue_begin(&self.index), li_queue_size(&self.index));
+    li_packer_write(&self, &index, sizeof(index));
+    li_packer_write(&self, LI_PACK_MAGIC "\0\0\0\0", 8);
+    if (callback && (self.offset != reported))
+        callback(user_ptr, 0, self.offset - reported);
+
+    li_pipeline_submit(&self.pipe, self.out);
+    self.out = NULL;
+    piping = false;
+    result = li_pipeline_dtor(&self.pipe);
+
+cleanup:
+
+    if (piping) {
+        if (self.out)
+            li_pipeline_submit(&self.pipe, self.out);
+        li_pipeline_dtor(&self.pipe);
+    }
+    if (deflating)
+        deflateEnd(&self.z);
+    li_block_dtor(&self.scratch);
+    li_queue_dtor(&self.index);
+    li_queue_dtor(&self.pending);
+    li_finalize(r);
+    fflush(output);
+    return result;
+}
+
+
+
+// Unpacking
+
+typedef struct {
+    li_source inner;        // Packed bytes, read in order if there is no pack
+    const li_pack* pack;    // Otherwise blocks are read where the index says
+    uint64_t next;          // Next block of pack to read, after the header
+    uint64_t last;          // End of the blocks of pack to read
+    bool header;            // The header block has been read
+    uint64_t position;      // Of the next compressed byte in the file
+    uint64_t left;          // Compressed bytes of this block not yet read
+    bool inflating;         // In the middle of a block
+    bool done;              // Every block has been read
+    z_stream z;
+    li_byte* input;
+} li_unpack;
+
+static size_t li_unpack_pread(li_unpack* self, void* dest, size_t count) {
+    FILE* file = self->pack->file;
+#ifdef LI_HAVE_PREAD
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(fileno(file), (char*) dest + total, count - total, (off_t) (self->position + total));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!n)
+            break;
+        total += (size_t) n;
+    }
+    return total;
+#else
+    if (fseeko(file, (off_t) self->position, SEEK_SET))
+        return 0;
+    return fread(dest, 1, count, file);
+#endif
+}
+
+// Start the next block, returning false at the end
+
+static bool li_unpack_next(li_source* source) {
+    li_unpack* self = source->filter;
+    if (self->done)
+        return false;
+    if (self->pack) {
+        const li_pack_entry* e = self->pack->entries;
+        if (!self->header) {
+            self->header = true;
+        } else if (self->next != self->last) {
+            e += self->next++;
+        } else {
+            self->done = true;
+            return false;
+        }
+        self->position = e->offset + sizeof(uint32_t);
+        self->left = e->bytes;
+    } else {
+        uint32_t bytes = 0;
+        size_t n = li_source_read(&self->inner, &bytes, sizeof(bytes));
+        if (n != sizeof(bytes)) {
+            source->status = (self->inner.status != LI_SUCCESS) ? self->inner.status : LI_BAD_FORMAT;
+            return false;
+        }
+        if (!bytes) {
+            self->done = true;
+            return false;
+        }
+        self->left = bytes;
+    }
+    self->inflating = true;
+    return true;
+}
+
+static size_t li_unpack_read(li_source* source, void* dest, size_t count) {
+    li_unpack* self = source->filter;
+    self->z.next_out = dest;
+    self->z.avail_out = (uInt) MIN(count, (size_t) UINT_MAX);
+    while (self->z.avail_out && (source->status == LI_SUCCESS)) {
+        if (!self->inflating && !li_unpack_next(source))
+            break;
+        if (!self->z.avail_in && self->left) {
+            size_t want = (size_t) MIN(self->left, (uint64_t) LI_PACK_INPUT_BYTES);
+            size_t n = self->pack
+                ? li_unpack_pread(self, self->input, want)
+                : li_source_read(&self->inner, self->input, want);
+            if (n != want) {
+                // Short reads of the index's blocks are errors, but of
+                // sequential input mean it was truncated
+                if (self->inner.status != LI_SUCCESS)
+                    source->status = self->inner.status;
+                else
+                    source->status = self->pack ? LI_IO_ERROR : LI_BAD_FORMAT;
+                break;
+            }
+            self->position += n;
+            self->left -= n;
+            self->z.next_in = (Bytef*) self->input;
+            self->z.avail_in = (uInt) n;
+        }
+        int status = inflate(&self->z, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) {
+            // Each block is exactly one stream
+            if (self->left || self->z.avail_in || (inflateReset(&self->z) != Z_OK)) {
+                source->status = LI_BAD_FORMAT;
+                break;
+            }
+            self->inflating = false;
+        } else if (status == Z_MEM_ERROR) {
+            source->status = LI_BAD_ALLOC;
+        } else if (status != Z_OK) {
+            source->status = LI_BAD_FORMAT;
+        }
+    }
+    size_t n = count - self->z.avail_out;
+    source->offset += n;
+    return n;
+}
+
+static void li_unpack_close(li_source* source) {
+    li_unpack* self = source->filter;
+    inflateEnd(&self->z);
+    li_dealloc(self->input);
+    if (!self->pack)
+        li_source_dtor(&self->inner);
+    li_dealloc(self);
+    source->filter = NULL;
+}
+
+// Make source a filter inflating the blocks of pack, or of its own input
+
+static li_status li_unpack_ctor(li_source* source, const li_pack* pack) {
+    li_unpack* self = li_alloc(sizeof(li_unpack));
+    if (!self)
+        return LI_BAD_ALLOC;
+    memset(self, 0, sizeof(li_unpack));
+    self->pack = pack;
+    self->input = li_alloc(LI_PACK_INPUT_BYTES);
+    if (!self->input || (inflateInit2(&self->z, -MAX_WBITS) != Z_OK)) {
+        li_dealloc(self->input);
+        li_dealloc(self);
+        return LI_BAD_ALLOC;
+    }
+    if (!pack)
+        self->inner = *source;
+    source->filter = self;
+    source->read = li_unpack_read;
+    source->close = li_unpack_close;
+    source->unread_size = 0;
+    source->offset = 0;
+    source->compressed = true;
+    return LI_SUCCESS;
+}
+
+li_status li_source_unpack(li_source* self) {
+    assert(self);
+    li_status result = li_unpack_ctor(self, NULL);
+    if (result != LI_SUCCESS) {
+        li_source_dtor(self);
+        self->close = NULL;
+        self->status = result;
+        return result;
+    }
+    // Skip the magic number
+    li_byte magic[8];
+    li_unpack* unpack = self->filter;
+    if (li_source_read(&unpack->inner, magic, sizeof(magic)) != sizeof(magic))
+        self->status = LI_BAD_FORMAT;
+    return self->status;
+}
+
+
+
+// Random access
+
+li_status li_pack_ctor(li_pack* self, FILE* file) {
+    assert(self && file);
+    memset(self, 0, sizeof(li_pack));
+    self->file = file;
+
+    li_byte trailer[16];
+    off_t end = 0;
+    if (fseeko(file, 0, SEEK_END) || ((end = ftello(file)) < 0))
+        return LI_IO_ERROR;
+    if (end < (off_t) (8 + sizeof(uint32_t) + sizeof(trailer)))
+        return LI_BAD_FORMAT;
+    end -= (off_t) sizeof(trailer);
+    if (fseeko(file, end, SEEK_SET) || (fread(trailer, 1, sizeof(trailer), file) != sizeof(trailer)))
+        return LI_IO_ERROR;
+    uint64_t index = 0;
+    memcpy(&index, trailer, sizeof(index));
+    if (memcmp(trailer + 8, LI_PACK_MAGIC, 4) || (index > (uint64_t) end)
+        || (((uint64_t) end - index) % sizeof(li_pack_entry)))
+        return LI_BAD_FORMAT;
+    uint64_t blocks = ((uint64_t) end - index) / sizeof(li_pack_entry);
+    if (!blocks || (blocks > SIZE_MAX / sizeof(li_pack_entry)))
+        return LI_BAD_FORMAT;
+    self->entries = li_alloc((size_t) blocks * sizeof(li_pack_entry));
+    if (!self->entries)
+        return LI_BAD_ALLOC;
+    self->blocks = blocks;
+    if (fseeko(file, (off_t) index, SEEK_SET)
+        || (fread(self->entries, sizeof(li_pack_entry), (size_t) blocks, file) != (size_t) blocks)) {
+        li_pack_dtor(self);
+        return LI_IO_ERROR;
+    }
+    for (uint64_t i = 0; i != blocks; ++i) {
+        const li_pack_entry* e = self->entries + i;
+        if ((e->offset > index) || (e->bytes > index - e->offset)
+            || (e->first_record != self->records)) {
+            li_pack_dtor(self);
+            return LI_BAD_FORMAT;
+        }
+        self->records += e->records;
+    }
+    return LI_SUCCESS;
+}
+
+void li_pack_dtor(li_pack* self) {
+    assert(self);
+    li_dealloc(self->entries);
+    self->entries = NULL;
+    self->blocks = 0;
+    self->records = 0;
+}
+
+uint64_t li_pack_find(const li_pack* self, uint64_t record) {
+    assert(self);
+    if (record >= self->records)
+        return self->blocks;
+    // The last block starting at or before record
+    uint64_t a = 1;
+    uint64_t b = self->blocks;
+    while (b - a > 1) {
+        uint64_t c = a + (b - a) / 2;
+        if (self->entries[c].first_record <= record)
+            a = c;
+        else
+            b = c;
+    }
+    // Skip blocks completing no records
+    while (record >= self->entries[a].first_record + self->entries[a].records)
+        ++a;
+    return a;
+}
+
+li_status li_pack_source(const li_pack* self, li_source* dest, uint64_t first, uint64_t count) {
+    assert(self && dest && first && (first <= self->blocks) && (count <= self->blocks - first));
+    memset(dest, 0, sizeof(li_source));
+    dest->file = self->file;
+    dest->fd = -1;
+#ifdef LI_HAVE_PREAD
+    dest->kind = LI_SOURCE_PREAD;
+#else
+    dest->kind = LI_SOURCE_STREAM;
+#endif
+    dest->row = (first < self->blocks) ? self->entries[first].first_record : self->records;
+    li_status result = li_unpack_ctor(dest, self);
+    if (result != LI_SUCCESS) {
+        dest->status = result;
+        return result;
+    }
+    li_unpack* unpack = dest->filter;
+    unpack->next = first;
+    unpack->last = first + count;
+    return LI_SUCCESS;
+}
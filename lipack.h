@@ -0,0 +1,106 @@
+//
+//  lipack.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lipack_h
+#define lipack_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lireader.h"
+#include "lisource.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // A packed .li file (.liz) is a binary log file cut into blocks that
+    // are deflated independently, so unlike a gzipped file it can be read
+    // from any block.  The first block is the magic number and header; the
+    // others end on message boundaries where every channel has framed the
+    // same whole number of records, so decoding the header followed by any
+    // run of blocks gives exactly their records.  An index at the end maps
+    // each block to its records and its place in the .li file.
+    //
+    //     "LIZ1", u32 reserved
+    //     for each block: u32 compressed bytes, raw deflate stream
+    //     u32 0
+    //     li_pack_entry for each block
+    //     u64 offset of the index, "LIZ1", u32 reserved
+    //
+    // The blocks can also be inflated in order without the index, so
+    // li_source_ctor reads packed files, even from pipes, as .li files.
+
+#define LI_PACK_MAGIC "LIZ1"
+#define LI_PACK_BLOCK_BYTES (1 << 20) // Of .li data in each block
+
+    typedef struct li_pack_entry {
+        uint64_t offset;        // Of the compressed stream in the packed file
+        uint64_t bytes;         // Compressed
+        uint64_t input_offset;  // Of the block in the .li file
+        uint64_t input_bytes;
+        uint64_t first_record;  // Row number of the first record
+        uint64_t records;       // Records completed by the block
+    } li_pack_entry;
+
+    // Options for packing.  Zero initialization gives the defaults.
+
+    typedef struct li_pack_options {
+        size_t block_bytes; // Least .li bytes in a block, or 0 for
+                            // LI_PACK_BLOCK_BYTES
+        int level;          // zlib compression level, 0 for 6, or negative
+                            // to store blocks without compressing them
+    } li_pack_options;
+
+    // Re-frame the binary log file read from input into a packed file,
+    // without decoding records.  The output is written sequentially and
+    // need not be seekable.  options may be NULL.  Optionally provide a
+    // callback that will report whenever bytes are read from input or
+    // written to output.  user_ptr is passed unchanged to the callback.
+
+    li_status li_source_to_pack(li_source* input,
+                                FILE* output,
+                                const li_pack_options* options,
+                                void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                                void* user_ptr);
+
+    // li_pack holds the index of a packed file
+
+    typedef struct li_pack {
+        FILE* file;
+        li_pack_entry* entries;
+        uint64_t blocks;        // Including the header
+        uint64_t records;
+    } li_pack;
+
+    // Read the index of a packed file.  file must be seekable, and stay
+    // open while the li_pack and any sources made from it are in use.
+    li_status li_pack_ctor(li_pack* self, FILE* file);
+    void li_pack_dtor(li_pack* self);
+
+    // The block holding the start of a record, or blocks if there is none
+    uint64_t li_pack_find(const li_pack* self, uint64_t record);
+
+    // Construct a source reading the header block then count blocks from
+    // first, which must not be 0.  Its row is the first record of block
+    // first, so li_convert numbers rows as in the whole file.  Sources made
+    // from the same li_pack read with positioned reads where available, so
+    // each may be used on its own thread to decode parts of the file in
+    // parallel.
+    li_status li_pack_source(const li_pack* self, li_source* dest, uint64_t first, uint64_t count);
+
+    // Replace a source whose first bytes are LI_PACK_MAGIC with one that
+    // inflates every block in order.  Used by li_source_ctor.
+    li_status li_source_unpack(li_source* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lipack_h */
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -430,8 +431,50 @@ void li_string_rstrip(li_string* self, const li_utf8* chars) {
     *++p = 0;
 }
 
-
-
-
-
-
+li_status li_parse_header_names(li_queue* dest, const char* csvHeader, size_t columns) {
+    // Find the last non-empty line and skip the comment marker
+    const char* line = csvHeader;
+    const char* line_end = csvHeader;
+    for (const char* p = csvHeader; *p; ) {
+        const char* q = p + strcspn(p, "\r\n");
+        if (q != p) {
+            line = p;
+            line_end = q;
+        }
+        p = q + strspn(q, "\r\n");
+    }
+    while ((line != line_end) && ((*line == '%') || isspace((unsigned char) *line)))
+        ++line;
+
+    size_t first = li_queue_size(dest);
+    const char* p = line;
+    for (size_t i = 0; i != columns; ++i) {
+        // Trim the next comma-separated field
+        const char* begin = p;
+        const char* end = p;
+        if (p != line_end) {
+            end = memchr(p, ',', (size_t) (line_end - p));
+            if (!end)
+                end = line_end;
+            p = (end == line_end) ? end : end + 1;
+            while ((begin != end) && isspace((unsigned char) *begin))
+                ++begin;
+            while ((end != begin) && isspace((unsigned char) end[-1]))
+                --end;
+        }
+        size_t mark = li_queue_size(dest);
+        LI_DOUBT(li_queue_put(dest, begin, (size_t) (end - begin)));
+        LI_DOUBT(li_queue_put(dest, "", 1));
+        const char* name = (const char*) li_queue_begin(dest) + mark;
+        bool unique = *name;
+        for (const char* q = (const char*) li_queue_begin(dest) + first; unique && (q != name); q += strlen(q) + 1)
+            unique = strcmp(q, name);
+        if (!unique) {
+            char generic[32];
+            snprintf(generic, sizeof(generic), "f%llu", (unsigned long long) i);
+            li_queue_unput(dest, li_queue_size(dest) - mark);
+            LI_DOUBT(li_queue_put(dest, generic, strlen(generic) + 1));
+        }
+    }
+    return LI_SUCCESS;
+}
@@ -68,6 +68,12 @@ extern "C" {
     li_array(Replacement) li_parse_Replacement_list(char* fmt);
     
     
+    // Column names from the last non-empty line of a CSV header, which is
+    // like "% Time (s), Channel 1 (V), Channel 2 (V)".  Each of the
+    // columns' names is put to dest followed by a null.  Missing, empty or
+    // repeated names are replaced by f0, f1, ... as numpy does.
+    li_status li_parse_header_names(li_queue* dest, const char* csvHeader, size_t columns);
+
     li_array(li_string) li_string_split(li_string* self, const li_utf8* delimiters);
     void li_string_lstrip(li_string* self, const li_utf8* chars);
     void li_string_rstrip(li_string* self, const li_utf8* chars);
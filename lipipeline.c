@@ -0,0 +1,339 @@
+//
+//  lipipeline.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lipipeline.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Atomics use the GCC/Clang builtins, which are available in gnu99 on all the
+// platforms we build for
+
+#define LI_LOAD(P) __atomic_load_n(P, __ATOMIC_ACQUIRE)
+#define LI_STORE(P, X) __atomic_store_n(P, X, __ATOMIC_RELEASE)
+#define LI_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+
+
+// li_spsc operations
+
+li_status li_spsc_ctor(li_spsc* self, size_t capacity) {
+    assert(self);
+    memset(self, 0, sizeof(li_spsc));
+    size_t n = 1;
+    while (n < capacity)
+        n *= 2;
+    self->slots = li_alloc(n * sizeof(void*));
+    if (!self->slots)
+        return LI_BAD_ALLOC;
+    self->mask = n - 1;
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    return LI_SUCCESS;
+}
+
+void li_spsc_dtor(li_spsc* self) {
+    assert(self);
+    if (self->slots) {
+        pthread_cond_destroy(&self->cond);
+        pthread_mutex_destroy(&self->mutex);
+        li_dealloc(self->slots);
+        self->slots = NULL;
+    }
+}
+
+// Raw operations that don't wake the other thread
+
+static bool li_spsc_push_(li_spsc* self, void* item) {
+    size_t tail = self->tail;
+    if (tail - LI_LOAD(&self->head) > self->mask)
+        return false;
+    self->slots[tail & self->mask] = item;
+    LI_STORE(&self->tail, tail + 1);
+    return true;
+}
+
+static bool li_spsc_pop_(li_spsc* self, void** item) {
+    size_t head = self->head;
+    if (head == LI_LOAD(&self->tail))
+        return false;
+    *item = self->slots[head & self->mask];
+    LI_STORE(&self->head, head + 1);
+    return true;
+}
+
+// Wake the other thread if it is sleeping on the queue.  The fence pairs with
+// the fence in li_spsc_wait so that either the waiter sees our update or we
+// see the waiter.
+
+static void li_spsc_notify(li_spsc* self) {
+    LI_FENCE();
+    if (__atomic_load_n(&self->waiters, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&self->mutex);
+        pthread_cond_broadcast(&self->cond);
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+// Sleep until op succeeds.  We hold the mutex while we succeed, so we wake
+// the other thread directly rather than through li_spsc_notify.
+
+static void li_spsc_wait(li_spsc* self, bool (*op)(li_spsc*, void**), void** item) {
+    __atomic_fetch_add(&self->waiters, 1, __ATOMIC_RELAXED);
+    LI_FENCE();
+    pthread_mutex_lock(&self->mutex);
+    while (!op(self, item))
+        pthread_cond_wait(&self->cond, &self->mutex);
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+    __atomic_fetch_sub(&self->waiters, 1, __ATOMIC_RELAXED);
+}
+
+static bool li_spsc_push_indirect(li_spsc* self, void** item) {
+    return li_spsc_push_(self, *item);
+}
+
+bool li_spsc_try_push(li_spsc* self, void* item) {
+    assert(self);
+    if (!li_spsc_push_(self, item))
+        return false;
+    li_spsc_notify(self);
+    return true;
+}
+
+bool li_spsc_try_pop(li_spsc* self, void** item) {
+    assert(self && item);
+    if (!li_spsc_pop_(self, item))
+        return false;
+    li_spsc_notify(self);
+    return true;
+}
+
+void li_spsc_push(li_spsc* self, void* item) {
+    if (!li_spsc_try_push(self, item))
+        li_spsc_wait(self, li_spsc_push_indirect, &item);
+}
+
+void* li_spsc_pop(li_spsc* self) {
+    void* item = NULL;
+    if (!li_spsc_try_pop(self, &item))
+        li_spsc_wait(self, li_spsc_pop_, &item);
+    return item;
+}
+
+
+
+size_t li_thread_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = (long) info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (n > 1) ? (size_t) n : 1;
+}
+
+
+
+// li_block operations
+
+li_status li_block_ctor(li_block* self, size_t capacity) {
+    assert(self);
+    self->size = 0;
+    self->capacity = 0;
+    self->begin = li_alloc(capacity);
+    if (!self->begin)
+        return LI_BAD_ALLOC;
+    self->capacity = capacity;
+    return LI_SUCCESS;
+}
+
+void li_block_dtor(li_block* self) {
+    assert(self);
+    li_dealloc(self->begin);
+    self->begin = NULL;
+    self->capacity = 0;
+    self->size = 0;
+}
+
+li_status li_block_reserve(li_block* self, size_t capacity) {
+    assert(self);
+    if (capacity <= self->capacity)
+        return LI_SUCCESS;
+    li_byte* p = li_alloc(capacity);
+    if (!p)
+        return LI_BAD_ALLOC;
+    li_dealloc(self->begin);
+    self->begin = p;
+    self->capacity = capacity;
+    self->size = 0;
+    return LI_SUCCESS;
+}
+
+
+
+// li_pipeline stages
+
+void li_pipeline_fail(li_pipeline* self, li_status status) {
+    li_status expected = LI_SUCCESS;
+    if (status != LI_SUCCESS)
+        __atomic_compare_exchange_n(&self->status, &expected, status, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+li_status li_pipeline_status(li_pipeline* self) {
+    return __atomic_load_n(&self->status, __ATOMIC_ACQUIRE);
+}
+
+static void* li_pipeline_reader(void* ptr) {
+    li_pipeline* self = ptr;
+    while (!LI_LOAD(&self->cancel)) {
+        li_block* block = li_spsc_pop(&self->read_free);
+        block->size = li_source_read(self->input, block->begin, block->capacity);
+        if (!block->size) {
+            li_pipeline_fail(self, li_source_status(self->input));
+            // The empty block stays out of circulation; we are done with it
+            break;
+        }
+        li_spsc_push(&self->read_full, block);
+    }
+    // NULL marks the end of input
+    li_spsc_push(&self->read_full, NULL);
+    return NULL;
+}
+
+static void* li_pipeline_writer(void* ptr) {
+    li_pipeline* self = ptr;
+    li_block* block;
+    while ((block = li_spsc_pop(&self->write_full))) {
+        // After an error we keep draining blocks so the decoder never stalls
+        if (block->size && (li_pipeline_status(self) == LI_SUCCESS)) {
+            li_status result = LI_SUCCESS;
+            if (self->write)
+                result = self->write(self->user, block->begin, block->size);
+            else if (fwrite(block->begin, 1, block->size, self->output) != block->size)
+                result = LI_IO_ERROR;
+            li_pipeline_fail(self, result);
+        }
+        block->size = 0;
+        li_spsc_push(&self->write_free, block);
+    }
+    return NULL;
+}
+
+li_status li_pipeline_ctor(li_pipeline* self,
+                           li_source* input,
+                           FILE* output,
+                           li_write_function write,
+                           void* user)
+{
+    assert(self);
+    memset(self, 0, sizeof(li_pipeline));
+    self->input = input;
+    self->output = output;
+    self->write = write;
+    self->user = user;
+
+    // Queues hold every block plus the end-of-stream marker
+    LI_DOUBT(li_spsc_ctor(&self->read_free, LI_PIPELINE_BLOCKS + 1));
+    LI_DOUBT(li_spsc_ctor(&self->read_full, LI_PIPELINE_BLOCKS + 1));
+    LI_DOUBT(li_spsc_ctor(&self->write_free, LI_PIPELINE_BLOCKS + 1));
+    LI_DOUBT(li_spsc_ctor(&self->write_full, LI_PIPELINE_BLOCKS + 1));
+
+    for (int i = 0; i != 2 * LI_PIPELINE_BLOCKS; ++i)
+        LI_DOUBT(li_block_ctor(self->blocks + i, LI_PIPELINE_BLOCK_BYTES));
+    for (int i = 0; i != LI_PIPELINE_BLOCKS; ++i) {
+        li_spsc_push(&self->read_free, self->blocks + i);
+        li_spsc_push(&self->write_free, self->blocks + LI_PIPELINE_BLOCKS + i);
+    }
+
+    if (input) {
+        if (pthread_create(&self->reader, NULL, li_pipeline_reader, self))
+            return LI_BAD_ALLOC;
+        self->reader_started = true;
+    }
+    if (output || write) {
+        if (pthread_create(&self->writer, NULL, li_pipeline_writer, self))
+            return LI_BAD_ALLOC;
+        self->writer_started = true;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_pipeline_dtor(li_pipeline* self) {
+    assert(self);
+    if (self->reader_started) {
+        // Ask the reader to stop, and keep handing blocks back until it
+        // acknowledges with the end-of-input marker
+        LI_STORE(&self->cancel, 1);
+        while (li_pipeline_read(self))
+            ;
+        pthread_join(self->reader, NULL);
+    }
+    if (self->writer_started) {
+        li_spsc_push(&self->write_full, NULL);
+        pthread_join(self->writer, NULL);
+    }
+    for (int i = 0; i != 2 * LI_PIPELINE_BLOCKS; ++i)
+        li_block_dtor(self->blocks + i);
+    li_spsc_dtor(&self->write_full);
+    li_spsc_dtor(&self->write_free);
+    li_spsc_dtor(&self->read_full);
+    li_spsc_dtor(&self->read_free);
+    return li_pipeline_status(self);
+}
+
+li_block* li_pipeline_read(li_pipeline* self) {
+    assert(self);
+    if (self->input_done || !self->reader_started)
+        return NULL;
+    li_block* block;
+    while ((block = li_spsc_pop(&self->read_full)) && LI_LOAD(&self->cancel))
+        li_pipeline_recycle(self, block); // Draining after cancellation
+    if (!block)
+        self->input_done = true;
+    return block;
+}
+
+void li_pipeline_recycle(li_pipeline* self, li_block* block) {
+    assert(self && block);
+    block->size = 0;
+    li_spsc_push(&self->read_free, block);
+}
+
+li_block* li_pipeline_acquire(li_pipeline* self) {
+    assert(self);
+    return li_spsc_pop(&self->write_free);
+}
+
+void li_pipeline_submit(li_pipeline* self, li_block* block) {
+    assert(self && block);
+    li_spsc_push(&self->write_full, block);
+}
+
+li_status li_pipeline_flush(li_pipeline* self, li_block** out) {
+    assert(self && out && self->writer_started);
+    if (*out)
+        li_pipeline_submit(self, *out);
+    // Once every block is free again the writer has written them all
+    li_block* blocks[LI_PIPELINE_BLOCKS];
+    for (int i = 0; i != LI_PIPELINE_BLOCKS; ++i)
+        blocks[i] = li_spsc_pop(&self->write_free);
+    for (int i = 1; i != LI_PIPELINE_BLOCKS; ++i)
+        li_spsc_push(&self->write_free, blocks[i]);
+    *out = blocks[0];
+    if (self->output && !self->write && fflush(self->output))
+        li_pipeline_fail(self, LI_IO_ERROR);
+    return li_pipeline_status(self);
+}
@@ -0,0 +1,150 @@
+//
+//  lipipeline.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lipipeline_h
+#define lipipeline_h
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "lireader.h"
+#include "lisource.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_spsc is a bounded lock-free queue of pointers with exactly one
+    // producer thread and one consumer thread.  The _try_ operations never
+    // block.  _push and _pop try once and then sleep until the other thread
+    // makes progress; the mutex is only touched when a thread is waiting.
+
+#define LI_CACHE_LINE 64
+
+    typedef struct {
+        void** slots;
+        size_t mask;      // capacity - 1, capacity is a power of two
+        size_t head;      // next slot to pop, only written by the consumer
+        char pad0[LI_CACHE_LINE - sizeof(size_t)];
+        size_t tail;      // next slot to push, only written by the producer
+        char pad1[LI_CACHE_LINE - sizeof(size_t)];
+        int waiters;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+    } li_spsc;
+
+    li_status li_spsc_ctor(li_spsc* self, size_t capacity);
+    void li_spsc_dtor(li_spsc* self);
+
+    bool li_spsc_try_push(li_spsc* self, void* item);
+    bool li_spsc_try_pop(li_spsc* self, void** item);
+
+    void li_spsc_push(li_spsc* self, void* item); // Blocks while full
+    void* li_spsc_pop(li_spsc* self);             // Blocks while empty
+
+
+
+    // Number of processors available, or 1 if it can't be determined
+    size_t li_thread_count(void);
+
+
+
+    // li_block is a fixed buffer that is passed between pipeline stages and
+    // recycled rather than freed
+
+    typedef struct {
+        li_byte* begin;
+        size_t size;     // Bytes in use
+        size_t capacity; // Bytes allocated
+    } li_block;
+
+    li_status li_block_ctor(li_block* self, size_t capacity);
+    void li_block_dtor(li_block* self);
+    li_status li_block_reserve(li_block* self, size_t capacity); // Discards contents if it must grow
+
+    li_array_define(li_block);
+
+
+
+    // li_pipeline overlaps input, decoding and output.  A reader thread fills
+    // input blocks from an li_source, the calling thread decodes them and
+    // formats output blocks, and a writer thread drains output blocks to a
+    // FILE (or to a user-supplied write function).  Blocks circulate
+    // between the stages through SPSC queues, so steady-state conversion
+    // performs no allocation.
+    // Either end may be left out: with no input there is no reader thread,
+    // and with neither output nor write function there is no writer thread.
+    //
+    // li_pipeline pipe;
+    // li_pipeline_ctor(&pipe, input, output, NULL, NULL);
+    // li_block* out = li_pipeline_acquire(&pipe);
+    // for (li_block* in; (in = li_pipeline_read(&pipe)); li_pipeline_recycle(&pipe, in))
+    //     ... decode in, append to out, li_pipeline_submit and _acquire when full ...
+    // li_pipeline_submit(&pipe, out);
+    // result = li_pipeline_dtor(&pipe);
+
+#define LI_PIPELINE_BLOCKS 4
+#define LI_PIPELINE_BLOCK_BYTES (1 << 20)
+
+    typedef li_status (*li_write_function)(void* user, const void* src, size_t count);
+
+    typedef struct {
+        li_source* input;
+        FILE* output;
+        li_write_function write; // Optional, replaces fwrite to output
+        void* user;
+
+        li_block blocks[2 * LI_PIPELINE_BLOCKS];
+        li_spsc read_free;   // decode -> reader
+        li_spsc read_full;   // reader -> decode
+        li_spsc write_free;  // writer -> decode
+        li_spsc write_full;  // decode -> writer
+
+        pthread_t reader;
+        pthread_t writer;
+        bool reader_started;
+        bool writer_started;
+        bool input_done;     // decode thread has seen the end of input
+
+        int cancel;          // Set by the decode thread to stop the reader early
+        li_status status;    // First error reported by any stage
+    } li_pipeline;
+
+    li_status li_pipeline_ctor(li_pipeline* self,
+                               li_source* input,
+                               FILE* output,
+                               li_write_function write,
+                               void* user);
+
+    // Stop the reader, drain the writer, join both threads and release all
+    // blocks.  Returns the first error any stage encountered.
+    li_status li_pipeline_dtor(li_pipeline* self);
+
+    // Next block of input, or NULL at end of input (or after an error)
+    li_block* li_pipeline_read(li_pipeline* self);
+    void li_pipeline_recycle(li_pipeline* self, li_block* block);
+
+    // Empty output block, and hand a filled output block to the writer
+    li_block* li_pipeline_acquire(li_pipeline* self);
+    void li_pipeline_submit(li_pipeline* self, li_block* block);
+
+    // Submit *out, wait for the writer to write every block submitted and
+    // flush the output, then acquire an empty block into *out.  The caller
+    // must hold no other output block.
+    li_status li_pipeline_flush(li_pipeline* self, li_block** out);
+
+    // Record an error from any stage; the first one wins
+    void li_pipeline_fail(li_pipeline* self, li_status status);
+    li_status li_pipeline_status(li_pipeline* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lipipeline_h */
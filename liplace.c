@@ -0,0 +1,254 @@
+//
+//  liplace.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "liplace.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define LI_HAVE_PWRITE
+#endif
+
+bool li_file_placeable(FILE* file) {
+    assert(file);
+#ifdef LI_HAVE_PWRITE
+    struct stat st;
+    int fd = fileno(file);
+    return (fd >= 0) && !fstat(fd, &st) && S_ISREG(st.st_mode);
+#else
+    (void) file;
+    return false;
+#endif
+}
+
+li_status li_file_resize(FILE* file, uint64_t bytes) {
+    assert(file);
+#ifdef LI_HAVE_PWRITE
+    int fd = fileno(file);
+    if (fflush(file) || ftruncate(fd, (off_t) bytes))
+        return LI_IO_ERROR;
+#ifdef __linux__
+    // Not every file system can reserve space; those that can't will
+    // allocate it as we write
+    int error = bytes ? posix_fallocate(fd, 0, (off_t) bytes) : 0;
+    if (error && (error != EINVAL) && (error != EOPNOTSUPP))
+        return LI_IO_ERROR;
+#endif
+    return LI_SUCCESS;
+#else
+    (void) bytes;
+    return LI_UNIMPLEMENTED;
+#endif
+}
+
+li_status li_file_sync(FILE* file) {
+    assert(file);
+    if (fflush(file))
+        return LI_IO_ERROR;
+#ifdef LI_HAVE_PWRITE
+    // Pipes and character devices can't be synced, and need not be
+    if (fsync(fileno(file)) && (errno != EINVAL) && (errno != EROFS))
+        return LI_IO_ERROR;
+#endif
+    return LI_SUCCESS;
+}
+
+li_status li_file_pwrite(FILE* file, const void* src, size_t count, uint64_t offset) {
+    assert(file && (src || !count));
+#ifdef LI_HAVE_PWRITE
+    int fd = fileno(file);
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pwrite(fd, (const char*) src + total, count - total, (off_t) (offset + total));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return LI_IO_ERROR;
+        }
+        total += (size_t) n;
+    }
+    return LI_SUCCESS;
+#else
+    (void) src;
+    (void) count;
+    (void) offset;
+    return LI_UNIMPLEMENTED;
+#endif
+}
+
+li_status li_file_pread(FILE* file, void* dest, size_t count, uint64_t offset) {
+    assert(file && (dest || !count));
+#ifdef LI_HAVE_PWRITE
+    int fd = fileno(file);
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(fd, (char*) dest + total, count - total, (off_t) (offset + total));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return LI_IO_ERROR;
+        }
+        if (!n)
+            return LI_IO_ERROR;
+        total += (size_t) n;
+    }
+    return LI_SUCCESS;
+#else
+    (void) dest;
+    (void) count;
+    (void) offset;
+    return LI_UNIMPLEMENTED;
+#endif
+}
+
+static void* li_place_worker_main(void* ptr) {
+    li_place_worker* self = ptr;
+    li_placer* placer = self->placer;
+    li_place_batch* batch;
+    while ((batch = li_spsc_pop(&self->todo))) {
+        batch->status = placer->place(placer->user, &self->scratch, (const double*) batch->records.begin,
+                                      batch->row, batch->count);
+        li_spsc_push(&self->done, batch);
+    }
+    return NULL;
+}
+
+void li_placer_ctor(li_placer* self) {
+    assert(self);
+    memset(self, 0, sizeof(li_placer));
+}
+
+// Stop the workers once they have placed everything queued, keeping the
+// first failure
+
+static void li_placer_stop(li_placer* self) {
+    for (size_t i = 0; self->workers && (i != self->threads); ++i) {
+        li_place_worker* w = self->workers + i;
+        if (!w->started)
+            continue;
+        li_spsc_push(&w->todo, NULL);
+        pthread_join(w->thread, NULL);
+        w->started = false;
+        for (int j = 0; j != LI_PLACE_DEPTH; ++j)
+            if (!self->status)
+                self->status = w->batches[j].status;
+    }
+}
+
+void li_placer_dtor(li_placer* self) {
+    assert(self);
+    li_placer_stop(self);
+    if (self->workers) {
+        for (size_t i = 0; i != self->threads; ++i) {
+            li_place_worker* w = self->workers + i;
+            for (int j = 0; j != LI_PLACE_DEPTH; ++j)
+                li_block_dtor(&w->batches[j].records);
+            li_block_dtor(&w->scratch);
+            li_spsc_dtor(&w->done);
+            li_spsc_dtor(&w->todo);
+        }
+        li_dealloc(self->workers);
+    }
+    li_block_dtor(&self->scratch);
+    li_placer_ctor(self);
+}
+
+li_status li_placer_start(li_placer* self,
+                          size_t threads,
+                          size_t record_doubles,
+                          li_place_function place,
+                          void* user)
+{
+    assert(self && place);
+    li_placer_dtor(self);
+    self->place = place;
+    self->user = user;
+    self->record_bytes = MAX(record_doubles, (size_t) 1) * sizeof(double);
+    if (!threads)
+        threads = MIN(li_thread_count() - 1, LI_PLACE_THREADS_MAX);
+    if (threads <= 1) {
+        self->threads = 1;
+        return LI_SUCCESS;
+    }
+
+    self->workers = li_alloc(threads * sizeof(li_place_worker));
+    if (!self->workers)
+        return LI_BAD_ALLOC;
+    memset(self->workers, 0, threads * sizeof(li_place_worker));
+    self->threads = threads;
+    for (size_t i = 0; i != threads; ++i) {
+        li_place_worker* w = self->workers + i;
+        w->placer = self;
+        LI_DOUBT(li_spsc_ctor(&w->todo, LI_PLACE_DEPTH + 1)); // Room for the stop signal
+        LI_DOUBT(li_spsc_ctor(&w->done, LI_PLACE_DEPTH));
+        for (int j = 0; j != LI_PLACE_DEPTH; ++j)
+            li_spsc_push(&w->done, w->batches + j);
+        if (pthread_create(&w->thread, NULL, li_place_worker_main, w))
+            return LI_BAD_ALLOC;
+        w->started = true;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_placer_put(li_placer* self, const double* records, uint64_t row, size_t count) {
+    assert(self && self->place && (records || !count));
+    if (self->status || !count)
+        return self->status;
+    if (!self->workers)
+        return self->status = self->place(self->user, &self->scratch, records, row, count);
+
+    // Blocks are dealt to the workers in turn
+    li_place_worker* w = self->workers + self->dispatched % self->threads;
+    li_place_batch* batch = li_spsc_pop(&w->done);
+    if (batch->status) {
+        self->status = batch->status;
+        li_spsc_push(&w->done, batch);
+        return self->status;
+    }
+    size_t bytes = count * self->record_bytes;
+    if ((self->status = li_block_reserve(&batch->records, bytes))) {
+        li_spsc_push(&w->done, batch);
+        return self->status;
+    }
+    memcpy(batch->records.begin, records, bytes);
+    batch->records.size = bytes;
+    batch->row = row;
+    batch->count = count;
+    li_spsc_push(&w->todo, batch);
+    ++self->dispatched;
+    return LI_SUCCESS;
+}
+
+li_status li_placer_flush(li_placer* self) {
+    assert(self);
+    if (!self->workers)
+        return self->status;
+    for (size_t i = 0; i != self->threads; ++i) {
+        li_place_worker* w = self->workers + i;
+        li_place_batch* batches[LI_PLACE_DEPTH];
+        for (int j = 0; j != LI_PLACE_DEPTH; ++j) {
+            batches[j] = li_spsc_pop(&w->done);
+            if (!self->status)
+                self->status = batches[j]->status;
+        }
+        for (int j = 0; j != LI_PLACE_DEPTH; ++j)
+            li_spsc_push(&w->done, batches[j]);
+    }
+    return self->status;
+}
+
+li_status li_placer_finish(li_placer* self) {
+    assert(self);
+    li_placer_stop(self);
+    return self->status;
+}
@@ -0,0 +1,118 @@
+//
+//  liplace.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef liplace_h
+#define liplace_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lipipeline.h"
+#include "lireader.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // When the number of rows is known before converting, outputs with a
+    // fixed layout (NPY, uncompressed MAT) can be sized up front and each
+    // block of rows written straight to its place with positioned writes.
+    // Blocks then need not be written in order, so li_placer formats and
+    // writes them on a pool of threads, and nothing is staged in temporary
+    // files or copied at the end.
+
+    // Can file be sized and written with positioned writes?  Only regular
+    // files on systems with pwrite can.
+    bool li_file_placeable(FILE* file);
+
+    // Set the size of file to bytes, reserving its blocks where the file
+    // system can so later writes don't fail for lack of space.  Flushes
+    // file first.
+    li_status li_file_resize(FILE* file, uint64_t bytes);
+
+    // Write count bytes of src at offset, leaving the file position alone.
+    // Safe to call from several threads at once.
+    li_status li_file_pwrite(FILE* file, const void* src, size_t count, uint64_t offset);
+
+    // Read count bytes at offset into dest, leaving the file position
+    // alone.  Reading past the end of file is LI_IO_ERROR.
+    li_status li_file_pread(FILE* file, void* dest, size_t count, uint64_t offset);
+
+    // Flush file and have the system write it to storage, so what was
+    // written survives a crash
+    li_status li_file_sync(FILE* file);
+
+    // Format and write count records, starting with row number row, to
+    // their place in the output.  scratch belongs to the calling thread.
+
+    typedef li_status (*li_place_function)(void* user, li_block* scratch, const double* records, uint64_t row, size_t count);
+
+#define LI_PLACE_DEPTH 2       // Blocks of records queued for each worker
+#define LI_PLACE_THREADS_MAX 8
+
+    typedef struct li_place_batch {
+        li_block records;
+        uint64_t row;
+        size_t count;
+        li_status status;
+    } li_place_batch;
+
+    typedef struct li_placer li_placer;
+
+    typedef struct li_place_worker {
+        li_placer* placer;
+        pthread_t thread;
+        bool started;
+        li_spsc todo;
+        li_spsc done;
+        li_place_batch batches[LI_PLACE_DEPTH];
+        li_block scratch;
+    } li_place_worker;
+
+    struct li_placer {
+        li_place_function place;
+        void* user;
+        size_t record_bytes;
+        size_t threads;
+        li_place_worker* workers; // NULL to place on the calling thread
+        li_block scratch;         // For placing on the calling thread
+        uint64_t dispatched;
+        li_status status;         // First failure
+    };
+
+    void li_placer_ctor(li_placer* self);
+    void li_placer_dtor(li_placer* self);
+
+    // Start threads workers, or one for each processor but ours if 0, to
+    // call place with blocks of records of record_doubles each.  With one
+    // thread, blocks are placed by li_placer_put itself.
+    li_status li_placer_start(li_placer* self,
+                              size_t threads,
+                              size_t record_doubles,
+                              li_place_function place,
+                              void* user);
+
+    // Copy count records and queue them to be placed, waiting for a worker
+    // if all are busy.  Returns the first failure of any block so far.
+    li_status li_placer_put(li_placer* self, const double* records, uint64_t row, size_t count);
+
+    // Wait until every block queued so far is placed, returning the first
+    // failure.  The workers carry on.
+    li_status li_placer_flush(li_placer* self);
+
+    // Wait until every block is placed and stop the workers, returning the
+    // first failure
+    li_status li_placer_finish(li_placer* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* liplace_h */
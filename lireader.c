@@ -24,6 +24,7 @@
 #include "liutility.h"
 
 #include "capnp_c.h"
+#include "capnp_priv.h"
 #include "li.capnp.h"
 
 
@@ -89,6 +90,9 @@ typedef struct {
     li_array(li_array_Operation) procs;
     size_t rec_bytes;
     li_queue queue;
+    uint64_t framed;   // Payload bytes framed for this channel
+    uint64_t skip;     // Payload bytes to drop instead of queueing
+    double** tables;   // For each of recs, the value of every code, or NULL
 } Parsed;
 
 static void Parsed_ctor(Parsed* self) {
@@ -96,11 +100,19 @@ static void Parsed_ctor(Parsed* self) {
     li_array_ctor(li_array_Operation)(&self->procs);
     li_queue_ctor(&self->queue);
     self->rec_bytes = 0;
+    self->framed = 0;
+    self->skip = 0;
+    self->tables = NULL;
     li_array_ctor(Record)(&self->recs);
     
 }
 
 static void Parsed_dtor(Parsed* self) {
+    if (self->tables) {
+        for (size_t i = 0; i != li_array_size(Record)(&self->recs); ++i)
+            li_dealloc(self->tables[i]);
+        li_dealloc(self->tables);
+    }
     li_queue_dtor(&self->queue);
     li_array_dtor(li_array_Operation)(&self->procs);
     li_array_dtor(Record)(&self->recs);
@@ -114,10 +126,29 @@ struct li_reader {
     li_queue queue;
     uint64_t suggested_put;
     char version;
+    bool packed;       // Cap'n Proto messages use the packed encoding
+    li_queue scratch;  // Packed messages are inflated into here
+    size_t incomplete; // Queue size when we last failed to inflate a whole message
     li_header header;
     li_array(Parsed) parsed;
     size_t bytes_per_output;
+    uint64_t* raw;     // Fields of the last record, bytes_per_output in size
     uint64_t records_read;
+    uint64_t dropped;  // Payload bytes of every channel dropped to find
+                       // where the first record starts
+    bool frame_only;   // Discard payloads instead of queueing them
+    bool found;        // Where the first record starts is known, so
+                       // framing only need no longer queue payloads
+    uint64_t framed;   // Input bytes consumed as whole messages
+    uint64_t message;  // Offset of the last message framed
+    uint64_t header_bytes;
+    size_t table_bytes; // Memory the lookup tables may use
+    bool derived;      // parsed was built for this header
+    uint64_t hash;     // Of the channels of this header
+    li_array(li_header_channel) plan_channels; // From which parsed was built,
+    uint64_t plan_hash;                        // if kept by li_reader_reset
+    const char* problem; // First found with the input, once state is BAD
+    uint64_t problem_offset;
 };
 
 
@@ -132,11 +163,12 @@ char* li_status_string_[] = {
     "Small source buffer",
     "Small destination buffer",
     "Bad format",
-    "Unimplemented"
+    "Unimplemented",
+    "I/O error"
 };
 
 const char* li_status_string(li_status status) {
-    return li_status_string_[MIN(status, LI_UNIMPLEMENTED)];
+    return li_status_string_[MIN(status, LI_IO_ERROR)];
 }
 
 
@@ -171,14 +203,34 @@ static void li_reader_ctor(li_reader* self) {
     li_header_ctor(&self->header);
     li_array_ctor(Parsed)(&self->parsed);
     li_queue_ctor(&self->queue);
+    li_queue_ctor(&self->scratch);
     self->state = INIT;
     self->suggested_put = 3;
     self->version = 0;
+    self->packed = false;
+    self->incomplete = 0;
+    self->raw = NULL;
     self->records_read = 0;
+    self->dropped = 0;
+    self->found = false;
+    self->frame_only = false;
+    self->framed = 0;
+    self->message = 0;
+    self->header_bytes = 0;
+    self->table_bytes = LI_TABLE_BYTES;
+    self->derived = false;
+    self->hash = 0;
+    li_array_ctor(li_header_channel)(&self->plan_channels);
+    self->plan_hash = 0;
+    self->problem = NULL;
+    self->problem_offset = 0;
 }
 
 static void li_reader_dtor(li_reader* self) {
+    li_array_dtor(li_header_channel)(&self->plan_channels);
+    li_dealloc(self->raw);
     li_array_dtor(Parsed)(&self->parsed);
+    li_queue_dtor(&self->scratch);
     li_queue_dtor(&self->queue);
     li_header_dtor(&self->header);
 }
@@ -201,6 +253,162 @@ void li_finalize(struct li_reader* self) {
     li_dealloc = free;
 }
 
+void li_frame_only(li_reader* self, bool enable) {
+    assert(self);
+    self->frame_only = enable;
+}
+
+void li_table_bytes(li_reader* self, size_t bytes) {
+    assert(self);
+    self->table_bytes = bytes;
+    // The tables of a kept plan were built for another budget
+    li_array_dtor(li_header_channel)(&self->plan_channels);
+    li_array_ctor(li_header_channel)(&self->plan_channels);
+}
+
+void li_reader_reset(li_reader* self) {
+    assert(self);
+    // Keep the plan decoding this header, and the channels it was built
+    // from, for the next header to reuse if it matches.  If the header was
+    // never parsed, any older plan is still intact.
+    if (self->derived) {
+        li_array_dtor(li_header_channel)(&self->plan_channels);
+        self->plan_channels = self->header.channels;
+        li_array_ctor(li_header_channel)(&self->header.channels);
+        self->plan_hash = self->hash;
+    }
+    li_header_dtor(&self->header);
+    li_header_ctor(&self->header);
+    LI_FOR(Parsed, p, &self->parsed) {
+        li_queue_clear(&p->queue);
+        p->framed = 0;
+        p->skip = 0;
+    }
+    li_queue_clear(&self->queue);
+    li_queue_clear(&self->scratch);
+    self->state = INIT;
+    self->suggested_put = 3;
+    self->version = 0;
+    self->packed = false;
+    self->incomplete = 0;
+    self->records_read = 0;
+    self->dropped = 0;
+    self->found = false;
+    self->framed = 0;
+    self->message = 0;
+    self->header_bytes = 0;
+    self->derived = false;
+    self->problem = NULL;
+    self->problem_offset = 0;
+}
+
+// The input is not a valid file.  Only the first problem is kept, since
+// the parser stops there.
+static void li_reader_fail(li_reader* self, const char* problem, uint64_t offset) {
+    if (self->state != BAD) {
+        self->state = BAD;
+        self->problem = problem;
+        self->problem_offset = offset;
+    }
+}
+
+const char* li_problem(const li_reader* self, uint64_t* offset) {
+    if (!self || (self->state != BAD))
+        return NULL;
+    if (offset)
+        *offset = self->problem_offset;
+    return self->problem;
+}
+
+li_status li_skip(li_reader* self, uint64_t count) {
+    if (!self)
+        return LI_INVALID_ARGUMENT;
+    if (self->state != BODY)
+        return (self->state == BAD) ? LI_BAD_FORMAT : LI_SMALL_SRC;
+    LI_FOR(Parsed, p, &self->parsed) {
+        // Some of the records may already be queued
+        uint64_t bytes = count * p->rec_bytes;
+        size_t n = (size_t) MIN(bytes, (uint64_t) li_queue_size(&p->queue));
+        li_queue_drop(&p->queue, n);
+        p->skip += bytes - n;
+    }
+    return LI_SUCCESS;
+}
+
+// The state of decoding is the input framed and records decoded, then for
+// each channel its number, payload framed and to skip, and the payload it
+// has queued, all as native uint64_t
+
+static size_t li_reader_state_bytes(li_reader* self) {
+    size_t n = 3 * sizeof(uint64_t);
+    LI_FOR(Parsed, p, &self->parsed)
+        n += 4 * sizeof(uint64_t) + li_queue_size(&p->queue);
+    return n;
+}
+
+static void li_reader_state(li_reader* self, li_byte* dest) {
+    uint64_t head[3] = { self->framed, self->records_read, li_array_size(Parsed)(&self->parsed) };
+    memcpy(dest, head, sizeof(head));
+    dest += sizeof(head);
+    LI_FOR(Parsed, p, &self->parsed) {
+        uint64_t x[4] = { (uint64_t) p->number, p->framed, p->skip, li_queue_size(&p->queue) };
+        memcpy(dest, x, sizeof(x));
+        dest += sizeof(x);
+        memcpy(dest, li_queue_begin(&p->queue), (size_t) x[3]);
+        dest += x[3];
+    }
+}
+
+li_status li_restore(li_reader* self, const void* src, size_t count) {
+    if (!self || (!src && count))
+        return LI_INVALID_ARGUMENT;
+    if (self->state != BODY)
+        return (self->state == BAD) ? LI_BAD_FORMAT : LI_SMALL_SRC;
+    if (li_queue_size(&self->queue) || self->records_read)
+        return LI_INVALID_ARGUMENT;
+
+    // Check it all fits before changing anything
+    const li_byte* begin = src;
+    const li_byte* end = begin + count;
+    uint64_t head[3];
+    if (count < sizeof(head))
+        return LI_BAD_FORMAT;
+    memcpy(head, begin, sizeof(head));
+    if ((head[0] < self->header_bytes) || (head[2] != li_array_size(Parsed)(&self->parsed)))
+        return LI_BAD_FORMAT;
+    const li_byte* q = begin + sizeof(head);
+    LI_FOR(Parsed, p, &self->parsed) {
+        uint64_t x[4];
+        if ((size_t) (end - q) < sizeof(x))
+            return LI_BAD_FORMAT;
+        memcpy(x, q, sizeof(x));
+        q += sizeof(x);
+        if ((x[0] != (uint64_t) p->number) || (x[3] > (uint64_t) (end - q)))
+            return LI_BAD_FORMAT;
+        q += x[3];
+    }
+    if (q != end)
+        return LI_BAD_FORMAT;
+
+    q = begin + sizeof(head);
+    LI_FOR(Parsed, p, &self->parsed) {
+        uint64_t x[4];
+        memcpy(x, q, sizeof(x));
+        q += sizeof(x);
+        li_queue_clear(&p->queue);
+        LI_DOUBT(li_queue_put(&p->queue, q, (size_t) x[3]));
+        q += x[3];
+        p->framed = x[1];
+        p->skip = x[2];
+    }
+    self->framed = head[0];
+    self->message = head[0];
+    self->records_read = head[1];
+    self->incomplete = 0;
+    li_queue_clear(&self->scratch);
+    return LI_SUCCESS;
+}
+
 li_status li_put(struct li_reader* self, const void* src, size_t count) {
     return li_queue_put(&self->queue, src, count);
 }
@@ -222,11 +430,101 @@ static char* binary_description_string(li_queue* self) {
     return s;
 }
 
+// Integer fields of LI_TABLE_BITS or fewer have few enough codes that we
+// can apply the operations to each of them once, however costly, and look
+// the values up as we decode.  Tables are built while the budget lasts.
+
+double Operations_apply(li_array(Operation)* ops, double d);
+
+static void li_reader_tables(Parsed* self, size_t* budget) {
+    size_t count = li_array_size(Record)(&self->recs);
+    self->tables = li_alloc(MAX(count, (size_t) 1) * sizeof(double*));
+    if (!self->tables)
+        return; // Decode directly
+    memset(self->tables, 0, MAX(count, (size_t) 1) * sizeof(double*));
+    li_array(Operation)* proc_iter = self->procs.begin;
+    for (size_t i = 0; (i != count) && (proc_iter != self->procs.end); ++i) {
+        const Record* r = self->recs.begin + i;
+        if (r->literal.type || (r->type == 'p'))
+            continue;
+        li_array(Operation)* ops = proc_iter++;
+        if (((r->type != 'u') && (r->type != 's') && (r->type != 'b')) || (r->width > LI_TABLE_BITS))
+            continue;
+        size_t codes = (size_t) 1 << r->width;
+        if (codes * sizeof(double) > *budget)
+            continue;
+        double* table = li_alloc(codes * sizeof(double));
+        if (!table)
+            continue;
+        for (size_t code = 0; code != codes; ++code) {
+            li_number x;
+            li_number_ctor(&x);
+            x.u64 = code;
+            x.type = r->type;
+            x.width = r->width;
+            li_number_fix_sign(&x);
+            table[code] = Operations_apply(ops, li_number_double(x));
+        }
+        self->tables[i] = table;
+        *budget -= codes * sizeof(double);
+    }
+}
+
+// FNV-1a hash of the parts of the channels of a header the decode plan is
+// built from, which leave out the start time and the like that differ
+// between files of a batch
+
+static uint64_t li_reader_hash_bytes(uint64_t h, const void* src, size_t count) {
+    const li_byte* p = src;
+    for (size_t i = 0; i != count; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static uint64_t li_reader_hash(li_array(li_header_channel)* channels) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    LI_FOR(li_header_channel, p, channels) {
+        h = li_reader_hash_bytes(h, &p->number, sizeof(p->number));
+        h = li_reader_hash_bytes(h, &p->calibration, sizeof(p->calibration));
+        h = li_reader_hash_bytes(h, p->recordFmt, strlen(p->recordFmt) + 1);
+        h = li_reader_hash_bytes(h, p->procFmt, strlen(p->procFmt) + 1);
+    }
+    return h;
+}
+
+static bool li_reader_same_channels(li_array(li_header_channel)* a, li_array(li_header_channel)* b) {
+    if (li_array_size(li_header_channel)(a) != li_array_size(li_header_channel)(b))
+        return false;
+    for (li_header_channel *p = a->begin, *q = b->begin; p != a->end; ++p, ++q)
+        if ((p->number != q->number)
+            || memcmp(&p->calibration, &q->calibration, sizeof(double))
+            || strcmp(p->recordFmt, q->recordFmt)
+            || strcmp(p->procFmt, q->procFmt))
+            return false;
+    return true;
+}
+
 void li_reader_Header_derived(li_reader* self) {
     
     // Header is now valid, compute derived quantities
     
+    self->header_bytes = self->framed;
+    self->hash = li_reader_hash(&self->header.channels);
+    self->derived = true;
+
+    // A reader reset between files of a batch reuses the plan of the last
+    // header if the channels are the same
+    if (li_array_size(li_header_channel)(&self->plan_channels)
+        && (self->hash == self->plan_hash)
+        && li_reader_same_channels(&self->header.channels, &self->plan_channels))
+        return;
+
+    li_array_dtor(Parsed)(&self->parsed);
+    li_array_ctor(Parsed)(&self->parsed);
+    li_dealloc(self->raw);
+    self->raw = NULL;
     self->bytes_per_output = 0;
+    size_t budget = self->table_bytes;
  
     LI_FOR(li_header_channel, p, &self->header.channels) {
     
@@ -240,13 +538,22 @@ void li_reader_Header_derived(li_reader* self) {
         LI_FOR(Record, r, &x.recs)
             bits += r->width;
         x.rec_bytes = bits / 8;
+        if (bits % 8)
+            li_reader_fail(self, "record is not a whole number of bytes", self->message);
         
         x.procs = li_parse_Operation_list_list(p->procFmt, p->calibration);
         self->bytes_per_output += li_array_size(li_array_Operation)(&x.procs) * 8;
+        li_reader_tables(&x, &budget);
         
         li_array_push(Parsed)(&self->parsed, x);
     }    
-    assert(self->bytes_per_output);
+    if (!self->bytes_per_output)
+        li_reader_fail(self, "header describes no fields", self->message);
+    
+    // If this fails only LI_RAW_RECORD_I64V is unavailable
+    self->raw = li_alloc(self->bytes_per_output);
+    if (self->raw)
+        memset(self->raw, 0, self->bytes_per_output);
 }
 
 
@@ -295,6 +602,8 @@ void li_reader_Header1(li_reader* self) {
     
     self->state = BODY;
     self->suggested_put = 3;
+    self->message = self->framed;
+    self->framed += 2 + (size_t) length;
     
     li_reader_Header_derived(self);
     
@@ -304,17 +613,23 @@ uint32_t pad8(uint32_t x) {
     return (x + 7) & ~((uint32_t) 7);
 }
 
-// Read a Cap'n proto message into an LIFileElement
-bool li_reader_FileElement(li_reader* self, struct capn* pc, struct LIFileElement* pfe) {
-
-    assert(self);
+// Find a whole unpacked Cap'n Proto message at the front of the queue, and
+// consume it.  The message remains valid until the next li_put.
+static bool li_reader_Unpacked(li_reader* self, uint8_t** message, size_t* size) {
     
     void* begin = li_queue_begin(&self->queue);
     size_t n = li_queue_size(&self->queue);
-    if (li_queue_size(&self->queue) < 4)
+    if (li_queue_size(&self->queue) < 4) {
+        self->suggested_put = 4;
         return false;
+    }
     uint32_t segments = 0;
     li_queue_get(&self->queue, &segments, 4);
+    if (segments > 1023) {
+        li_reader_fail(self, "message has too many segments", self->framed);
+        self->queue.begin = begin;
+        return false;
+    }
     segments += 1;
     uint32_t padded = pad8(4 + segments * 4);
     if (n < padded) {
@@ -322,14 +637,14 @@ bool li_reader_FileElement(li_reader* self, struct capn* pc, struct LIFileElemen
         self->queue.begin = begin;
         return false;
     }
-    uint32_t payload = 0;
+    uint64_t payload = 0;
     for (uint32_t i = 0; i != segments; ++i) {
         uint32_t m;
         li_queue_get(&self->queue, &m, 4);
         payload += m;
     }
     payload *= 8;
-    size_t total = padded + payload;
+    uint64_t total = padded + payload;
     if (n < total) {
         self->suggested_put = total;
         self->queue.begin = begin;
@@ -337,18 +652,115 @@ bool li_reader_FileElement(li_reader* self, struct capn* pc, struct LIFileElemen
     }
     // We now have enough data to read the whole Cap'n Proto message
     
-    capn_init_mem(pc, (uint8_t*) begin, total, 0);
+    // Rewind the queue then drop all the data Cap'n Proto will consume
+    self->queue.begin = begin;
+    li_queue_drop(&self->queue, (size_t) total);
+    self->message = self->framed;
+    self->framed += total;
+    
+    *message = begin;
+    *size = (size_t) total;
+    return true;
+}
+
+// Inflate the next count bytes of a packed message onto the end of out
+static bool li_reader_inflate(struct capn_stream* z, li_queue* out, size_t count) {
+    if (li_queue_will_put(out, count) != LI_SUCCESS)
+        return false;
+    z->next_out = li_queue_end(out);
+    z->avail_out = count;
+    if (capn_inflate(z) || z->avail_out)
+        return false;
+    out->end += count;
+    return true;
+}
+
+// Inflate a whole packed Cap'n Proto message from the front of the queue into
+// the scratch buffer, and consume it.  The length of a packed message isn't
+// known until it has been inflated, so if the queue runs out we start again
+// after the next li_put.
+static bool li_reader_Packed(li_reader* self, uint8_t** message, size_t* size) {
+    
+    size_t n = li_queue_size(&self->queue);
+    if (n <= self->incomplete)
+        return false; // Nothing new since the last attempt
+    struct capn_stream z;
+    memset(&z, 0, sizeof(z));
+    z.next_in = li_queue_begin(&self->queue);
+    z.avail_in = n;
+    li_queue_clear(&self->scratch);
+    
+    uint32_t segments = 0;
+    if (!li_reader_inflate(&z, &self->scratch, 4))
+        goto more;
+    memcpy(&segments, li_queue_begin(&self->scratch), 4);
+    if (segments > 1023) {
+        li_reader_fail(self, "message has too many segments", self->framed);
+        return false;
+    }
+    segments += 1;
+    uint32_t padded = pad8(4 + segments * 4);
+    if (!li_reader_inflate(&z, &self->scratch, padded - 4))
+        goto more;
+    uint64_t payload = 0;
+    for (uint32_t i = 0; i != segments; ++i) {
+        uint32_t m;
+        memcpy(&m, (uint8_t*) li_queue_begin(&self->scratch) + 4 + i * 4, 4);
+        payload += m;
+    }
+    payload *= 8;
+    if (!li_reader_inflate(&z, &self->scratch, (size_t) payload))
+        goto more;
+    
+    // Each message is packed independently, so nothing may be left over
+    if (z.avail_buf || z.zeros || z.raw) {
+        li_reader_fail(self, "packed message has trailing bytes", self->framed);
+        return false;
+    }
+    size_t consumed = (size_t) (z.next_in - (const uint8_t*) li_queue_begin(&self->queue));
+    li_queue_drop(&self->queue, consumed);
+    self->message = self->framed;
+    self->framed += consumed;
+    self->incomplete = 0;
+    
+    *message = li_queue_begin(&self->scratch);
+    *size = li_queue_size(&self->scratch);
+    return true;
+    
+more:
+    // Ask for geometrically more data so that retries cost amortized O(1)
+    self->incomplete = n;
+    self->suggested_put = MAX(2 * n, 8);
+    return false;
+}
+
+// Read a Cap'n proto message into an LIFileElement
+bool li_reader_FileElement(li_reader* self, struct capn* pc, struct LIFileElement* pfe) {
+
+    assert(self);
+    
+    uint8_t* message = NULL;
+    size_t total = 0;
+    if (!(self->packed
+          ? li_reader_Packed(self, &message, &total)
+          : li_reader_Unpacked(self, &message, &total)))
+        return false;
+    
+    if (capn_init_mem(pc, message, total, 0)) {
+        li_reader_fail(self, "bad segment table", self->message);
+        return false;
+    }
     
     LIFileElement_list fel;
     fel.p = capn_root(pc);
-    assert(fel.p.len == 1);
+    if (fel.p.len != 1) {
+        capn_free(pc);
+        li_reader_fail(self, "message is not a file element", self->message);
+        return false;
+    }
     
     get_LIFileElement(pfe, fel, 0);
 
-    // Rewind the queue then drop all the daa Cap'n Proto consumed
-    self->queue.begin = begin;
-    li_queue_drop(&self->queue, total);
-
     return true;
     
 }
@@ -358,13 +770,31 @@ void li_reader_Header2(li_reader* self) {
     struct capn captain;
     struct LIFileElement file_element;
     
+    // An unpacked message starts with a small segment count.  A packed one
+    // starts with a tag byte, nonzero bytes of the segment table and the
+    // nonzero tag of the root pointer, which always read as a larger number.
+    uint32_t first = 0;
+    if (li_queue_size(&self->queue) < 4)
+        return;
+    memcpy(&first, li_queue_begin(&self->queue), 4);
+    self->packed = first > 0xFFFF;
+    
     if (!li_reader_FileElement(self, &captain, &file_element))
         return;
     
-    assert(file_element.which == LIFileElement_header);
+    if (file_element.which != LIFileElement_header) {
+        capn_free(&captain);
+        li_reader_fail(self, "first message is not a header", self->message);
+        return;
+    }
     
     struct LIHeader h;
     read_LIHeader(&h, file_element.header);
+    if (!h.csvFmt.str || !h.csvHeader.str) {
+        capn_free(&captain);
+        li_reader_fail(self, "header is incomplete", self->message);
+        return;
+    }
     
     self->header.instrumentId = h.instrumentId;
     self->header.instrumentVer = h.instrumentVer;
@@ -376,6 +806,11 @@ void li_reader_Header2(li_reader* self) {
     for (int i = 0; i != h.channels.p.len; ++i) {
         struct LIHeader_Channel hc;
         get_LIHeader_Channel(&hc, h.channels, i);
+        if (!hc.recordFmt.str || !hc.procFmt.str || (hc.number < 1) || (hc.number > 8)) {
+            capn_free(&captain);
+            li_reader_fail(self, "header has a bad channel", self->message);
+            return;
+        }
         li_header_channel c;
         li_header_channel_ctor(&c);
         c.number = hc.number;
@@ -421,11 +856,21 @@ void li_reader_Data1(li_reader* self) {
         bool flag = false;
         LI_FOR(Parsed, p, &self->parsed)
             if (p->number == channel) {
-                li_queue_put(&p->queue, self->queue.begin, length);
+                size_t skip = (size_t) MIN(p->skip, (uint64_t) length);
+                p->skip -= skip;
+                if (!self->frame_only || !self->found)
+                    li_queue_put(&p->queue, self->queue.begin + skip, length - skip);
                 li_queue_drop(&self->queue, length);
+                p->framed += length;
                 flag = true;
             }
-        assert(flag);
+        if (!flag) {
+            li_queue_unget(&self->queue, 3);
+            li_reader_fail(self, "data for a channel not in the header", self->framed);
+            return;
+        }
+        self->message = self->framed;
+        self->framed += total;
     }
 }
 
@@ -438,11 +883,17 @@ void li_reader_Data2(li_reader* self) {
         if (!li_reader_FileElement(self, &captain, &file_element))
             return;
         
-        assert(file_element.which == LIFileElement_data);
-        
         struct LIData d;
-        read_LIData(&d, file_element.data);
-        capn_resolve(&d.data.p);
+        if (file_element.which == LIFileElement_data) {
+            read_LIData(&d, file_element.data);
+            capn_resolve(&d.data.p);
+        }
+        if ((file_element.which != LIFileElement_data) || (d.data.p.len && !d.data.p.data)) {
+            capn_free(&captain);
+            li_reader_fail(self, (file_element.which != LIFileElement_data)
+                           ? "message is not data" : "data is out of bounds", self->message);
+            return;
+        }
         
         int ch = d.channel;
         
@@ -452,12 +903,18 @@ void li_reader_Data2(li_reader* self) {
         bool flag = false;
         LI_FOR(Parsed, p, &self->parsed)
             if (p->number == ch) {
-                li_queue_put(&p->queue, d.data.p.data, (size_t) d.data.p.len);
+                size_t skip = (size_t) MIN(p->skip, (uint64_t) d.data.p.len);
+                p->skip -= skip;
+                if (!self->frame_only || !self->found)
+                    li_queue_put(&p->queue, d.data.p.data + skip, (size_t) d.data.p.len - skip);
+                p->framed += (size_t) d.data.p.len;
                 flag = true;
             }
-        assert(flag);
-
         capn_free(&captain);
+        if (!flag) {
+            li_reader_fail(self, "data for a channel not in the header", self->message);
+            return;
+        }
     }
 }
 
@@ -505,6 +962,178 @@ double Operations_apply(li_array(Operation)* ops, double d) {
     return d;
 }
 
+// Decode one record of a channel from rec_bytes of payload, appending its
+// values to *output and, if raw is not NULL, its fields to *raw.  Returns
+// false if a literal field doesn't match, as when the payload is
+// misaligned.  Reads only the parsed header, so may be called from any
+// thread.
+
+static bool li_reader_decode(const Parsed* p, const void* payload, double** output, uint64_t** raw) {
+    li_bit_queue bits;
+    li_bit_queue_ctor(&bits);
+    li_bit_queue_put(&bits, payload, p->rec_bytes * LI_BITS_PER_BYTE);
+    bool aligned = true;
+    li_array(Operation)* proc_iter = p->procs.begin;
+    for (const Record* r = p->recs.begin; aligned && (r != p->recs.end); ++r) {
+        li_number x;
+        li_number_ctor(&x);
+        li_bit_queue_get(&bits, &x, r->width);
+        uint64_t code = x.u64;
+        x.type = r->type;
+        x.width = r->width;
+        li_number_fix_sign(&x);
+        if (r->literal.type) {
+            aligned = li_number_equal(x, r->literal);
+        } else if (r->type != 'p') {
+            const double* table = p->tables ? p->tables[r - p->recs.begin] : NULL;
+            if (table)
+                *(*output)++ = table[code];
+            else
+                *(*output)++ = Operations_apply(proc_iter, li_number_double(x));
+            ++proc_iter;
+            if (raw)
+                *(*raw)++ = x.u64;
+        }
+        li_number_dtor(&x);
+    }
+    li_bit_queue_dtor(&bits);
+    return aligned;
+}
+
+static Parsed* li_reader_channel(const li_reader* self, size_t index) {
+    LI_FOR(Parsed, p, (li_array(Parsed)*) &self->parsed)
+        if ((size_t) p->number == index)
+            return p;
+    return NULL;
+}
+
+li_status li_take_records(li_reader* self, size_t index, uint64_t count, void* dest, size_t bytes) {
+    if (!self)
+        return LI_INVALID_ARGUMENT;
+    if (self->state == BAD)
+        return LI_BAD_FORMAT;
+    if (self->state != BODY)
+        return LI_SMALL_SRC;
+    Parsed* p = li_reader_channel(self, index);
+    if (!p || !self->records_read)
+        return LI_INVALID_ARGUMENT;
+    uint64_t n = count * p->rec_bytes;
+    if (bytes < n)
+        return LI_SMALL_DEST;
+    return li_queue_get(&p->queue, dest, (size_t) n);
+}
+
+li_status li_decode_records(const li_reader* self,
+                            size_t index,
+                            const void* payload,
+                            uint64_t count,
+                            double* dest,
+                            int64_t* raw,
+                            size_t stride)
+{
+    // The state may be changing on another thread, but the parsed header
+    // is fixed once there is any payload to take
+    if (!self || (!dest && count))
+        return LI_INVALID_ARGUMENT;
+    const Parsed* p = li_reader_channel(self, index);
+    if (!p)
+        return LI_INVALID_ARGUMENT;
+    const li_byte* src = payload;
+    for (uint64_t i = 0; i != count; ++i, src += p->rec_bytes, dest += stride) {
+        double* output = dest;
+        uint64_t* fields = (uint64_t*) raw;
+        if (!li_reader_decode(p, src, &output, raw ? &fields : NULL))
+            return LI_BAD_FORMAT;
+        if (raw)
+            raw += stride;
+    }
+    return LI_SUCCESS;
+}
+
+
+// Compare the literal fields of one record of a channel, as
+// li_reader_decode does, without computing its values
+
+static bool li_reader_check(const Parsed* p, const void* payload) {
+    // Fields after the last literal need not be read
+    const Record* end = p->recs.begin;
+    LI_FOR(Record, r, (li_array(Record)*) &p->recs)
+        if (r->literal.type)
+            end = r + 1;
+    li_bit_queue bits;
+    li_bit_queue_ctor(&bits);
+    li_bit_queue_put(&bits, payload, p->rec_bytes * LI_BITS_PER_BYTE);
+    bool aligned = true;
+    for (const Record* r = p->recs.begin; aligned && (r != end); ++r) {
+        li_number x;
+        li_number_ctor(&x);
+        li_bit_queue_get(&bits, &x, r->width);
+        if (r->literal.type) {
+            x.type = r->type;
+            x.width = r->width;
+            li_number_fix_sign(&x);
+            aligned = li_number_equal(x, r->literal);
+        }
+        li_number_dtor(&x);
+    }
+    li_bit_queue_dtor(&bits);
+    return aligned;
+}
+
+// Drop a byte of every channel at a time until the queued payloads start
+// with a record whose literal fields all match, as RECORD_F64V does.
+// Returns false if a channel runs out of payload first.
+
+static bool li_reader_align(li_reader* self, uint64_t* skipped) {
+    for (;;) {
+        LI_FOR(Parsed, p, &self->parsed)
+            if (li_queue_size(&p->queue) < p->rec_bytes)
+                return false;
+        bool aligned = true;
+        LI_FOR(Parsed, p, &self->parsed)
+            aligned = aligned && li_reader_check(p, p->queue.begin);
+        if (aligned)
+            return true;
+        LI_FOR(Parsed, p, &self->parsed)
+            li_queue_drop(&p->queue, 1);
+        ++*skipped;
+        ++self->dropped;
+    }
+}
+
+li_status li_check_records(li_reader* self, uint64_t* checked, uint64_t* skipped) {
+    if (!self || !checked || !skipped)
+        return LI_INVALID_ARGUMENT;
+    *checked = 0;
+    *skipped = 0;
+    uint64_t n = 0;
+    li_status result = li_get(self, LI_RECORDS_QUEUED_U64, 0, &n, sizeof(n));
+    if (result != LI_SUCCESS)
+        return result;
+    
+    // Find where the first record starts
+    if (n && !self->records_read) {
+        li_reader_align(self, skipped);
+        LI_TRUST(li_get(self, LI_RECORDS_QUEUED_U64, 0, &n, sizeof(n)));
+    }
+    
+    uint64_t i = 0;
+    for (; i != n; ++i) {
+        bool aligned = true;
+        LI_FOR(Parsed, p, &self->parsed)
+            aligned = aligned && li_reader_check(p, (li_byte*) p->queue.begin + i * p->rec_bytes);
+        if (!aligned) {
+            li_reader_fail(self, "sync field mismatch", self->message);
+            result = LI_BAD_FORMAT;
+            break;
+        }
+    }
+    LI_FOR(Parsed, p, &self->parsed)
+        li_queue_drop(&p->queue, (size_t) (i * p->rec_bytes));
+    self->records_read += i;
+    *checked = i;
+    return result;
+}
 
 li_status li_get(struct li_reader* self,
                       enum li_target target,
@@ -547,12 +1176,13 @@ return LI_SUCCESS;\
             li_queue_get(&self->queue, buffer, 2);
             for (int i = 0; i != 2; ++i) {
                 if (buffer[i] != magic[i]) {
-                    self->state = BAD;
+                    li_reader_fail(self, "not a binary log file", 0);
                     li_queue_unget(&self->queue, 2);
                     return LI_BAD_FORMAT;
                 }
             }
             li_queue_get(&self->queue, &self->version, 1);
+            self->framed = 3;
             switch (self->version) {
                 case '1':
                     self->suggested_put = 2;
@@ -587,6 +1217,18 @@ return LI_SUCCESS;\
                 li_reader_Data2(self);
                 break;
         }
+        if (self->state == BAD)
+            return LI_BAD_FORMAT;
+        
+        // Framing only, the payloads are queued just until the first
+        // record is found, so the bytes dropped before it aren't counted
+        if (self->frame_only && !self->found) {
+            uint64_t skipped = 0;
+            self->found = self->records_read || li_reader_align(self, &skipped);
+            if (self->found)
+                LI_FOR(Parsed, p, &self->parsed)
+                    li_queue_clear(&p->queue);
+        }
         
         if (target == LI_CHANNEL_SELECT_U8) {
             uint8_t x = 0;
@@ -650,6 +1292,104 @@ return LI_SUCCESS;\
             return LI_INVALID_ARGUMENT;
         }
         
+        if (target == LI_HEADER_BYTES_U64) {
+            uint64_t x = self->header_bytes;
+            PUT(x);
+        }
+        
+        if (target == LI_FRAMED_BYTES_U64) {
+            uint64_t x = self->framed;
+            PUT(x);
+        }
+        
+        if ((target == LI_FRAMED_BYTES_FOR_INDEX_U64) || (target == LI_RECORD_BYTES_FOR_INDEX_U64)) {
+            LI_FOR(Parsed, p, &self->parsed)
+                if ((size_t) p->number == index) {
+                    uint64_t x = (target == LI_FRAMED_BYTES_FOR_INDEX_U64) ? p->framed : p->rec_bytes;
+                    PUT(x);
+                }
+            // We didn't find the requested channel
+            return LI_INVALID_ARGUMENT;
+        }
+        
+        if ((target == LI_RECORD_COUNT_U64) || (target == LI_IN_PHASE_U8)) {
+            uint64_t least = UINT64_MAX;
+            uint64_t most = 0;
+            bool whole = true;
+            LI_FOR(Parsed, p, &self->parsed) {
+                if (!p->rec_bytes)
+                    continue;
+                // Bytes dropped before the first record are not records
+                uint64_t framed = p->framed - MIN(self->dropped, p->framed);
+                whole = whole && !(framed % p->rec_bytes);
+                least = MIN(least, framed / p->rec_bytes);
+                most = MAX(most, framed / p->rec_bytes);
+            }
+            if (least == UINT64_MAX)
+                least = 0;
+            if (target == LI_RECORD_COUNT_U64)
+                PUT(least);
+            // Until the first record is found, the count may yet change
+            bool settled = self->found || !self->frame_only;
+            uint8_t x = settled && whole && (least == most);
+            PUT(x);
+        }
+        
+        if (target == LI_RECORDS_QUEUED_U64) {
+            uint64_t x = self->parsed.begin != self->parsed.end ? UINT64_MAX : 0;
+            LI_FOR(Parsed, p, &self->parsed)
+                if (p->rec_bytes)
+                    x = MIN(x, li_queue_size(&p->queue) / p->rec_bytes);
+            if (x == UINT64_MAX)
+                x = 0;
+            PUT(x);
+        }
+        
+        if (target == LI_STATE_BYTES_U64) {
+            uint64_t x = li_reader_state_bytes(self);
+            PUT(x);
+        }
+        
+        if (target == LI_STATE_U8V) {
+            if (count < li_reader_state_bytes(self))
+                return LI_SMALL_DEST;
+            li_reader_state(self, dest);
+            return LI_SUCCESS;
+        }
+        
+        if (target == LI_RAW_RECORD_I64V) {
+            if (count < self->bytes_per_output)
+                return LI_SMALL_DEST;
+            if (!self->raw)
+                return LI_BAD_ALLOC;
+            memcpy(dest, self->raw, self->bytes_per_output);
+            return LI_SUCCESS;
+        }
+        
+        if ((target == LI_CALIBRATION_F64)
+            || (target == LI_REC_STRING_BYTES_U64) || (target == LI_REC_STRING_UTF8V)
+            || (target == LI_PROC_STRING_BYTES_U64) || (target == LI_PROC_STRING_UTF8V)) {
+            LI_FOR(li_header_channel, p, &self->header.channels)
+                if ((size_t) p->number == index) {
+                    if (target == LI_CALIBRATION_F64) {
+                        double x = p->calibration;
+                        PUT(x);
+                    }
+                    const char* s = ((target == LI_REC_STRING_BYTES_U64) || (target == LI_REC_STRING_UTF8V))
+                        ? p->recordFmt : p->procFmt;
+                    if ((target == LI_REC_STRING_BYTES_U64) || (target == LI_PROC_STRING_BYTES_U64)) {
+                        uint64_t x = strlen(s) + 1;
+                        PUT(x);
+                    }
+                    if (strlen(s) + 1 > count)
+                        return LI_SMALL_DEST;
+                    strcpy(dest, s);
+                    return LI_SUCCESS;
+                }
+            // We didn't find the requested channel
+            return LI_INVALID_ARGUMENT;
+        }
+        
         if (target == LI_RECORD_F64V) {
             
         misalignment_resume_point:
@@ -657,6 +1397,7 @@ return LI_SUCCESS;\
             if (count < self->bytes_per_output)
                 return LI_SMALL_DEST;
             double* output = dest;
+            uint64_t* raw = self->raw;
             
             // Check that we have enough data for each channel to parse a record
             LI_FOR(Parsed, p, &self->parsed)
@@ -664,40 +1405,20 @@ return LI_SUCCESS;\
                     return LI_SMALL_SRC;
             
             LI_FOR(Parsed, p, &self->parsed) {
-                li_bit_queue bits;
-                li_bit_queue_ctor(&bits);
-                li_bit_queue_put(&bits, p->queue.begin, p->rec_bytes * LI_BITS_PER_BYTE);
+                bool aligned = li_reader_decode(p, p->queue.begin, &output, raw ? &raw : NULL);
                 li_queue_drop(&p->queue, p->rec_bytes);
-                
-                li_array(Operation)* proc_iter = li_array_begin(li_array_Operation)(&p->procs);
-                LI_FOR(Record, r, &p->recs) {
-                    li_number x;
-                    li_number_ctor(&x);
-                    li_bit_queue_get(&bits, &x, r->width);
-                    x.type = r->type;
-                    x.width = r->width;
-                    li_number_fix_sign(&x);
-                    if (r->literal.type) {
-                        if (!li_number_equal(x, r->literal)) {
-                            if(self->records_read) {
-                                self->state = BAD;
-                                return LI_BAD_FORMAT;
-                            }
-                            for (Parsed* q = li_array_Parsed_begin(&self->parsed); q <= p; ++q)
-                                li_queue_unget(&q->queue, q->rec_bytes);
-                            LI_FOR(Parsed, q, &self->parsed)
-                                li_queue_drop(&q->queue, 1);
-                            li_bit_queue_dtor(&bits);
-                            li_number_dtor(&x);
-                            goto misalignment_resume_point;
-                        }
-                    } else if (r->type != 'p') {
-                        double y = li_number_double(x);
-                        double z = Operations_apply(proc_iter++, y);
-                        *output++ = z;
+                if (!aligned) {
+                    if(self->records_read) {
+                        li_reader_fail(self, "sync field mismatch", self->message);
+                        return LI_BAD_FORMAT;
                     }
+                    for (Parsed* q = li_array_Parsed_begin(&self->parsed); q <= p; ++q)
+                        li_queue_unget(&q->queue, q->rec_bytes);
+                    LI_FOR(Parsed, q, &self->parsed)
+                        li_queue_drop(&q->queue, 1);
+                    ++self->dropped;
+                    goto misalignment_resume_point;
                 }
-                li_bit_queue_dtor(&bits);
             }
             assert((output - (double*) dest) == (self->bytes_per_output/sizeof(double)));
             ++(self->records_read);
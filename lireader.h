@@ -13,7 +13,9 @@
 extern "C" {
 #endif
     
+#include <stdbool.h> // for bool
 #include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
     
     // Status codes returned by
     
@@ -25,6 +27,7 @@ extern "C" {
         LI_SMALL_DEST = 4,       // The destination buffer is too small to return the requested target in.
         LI_BAD_FORMAT = 5,       // The data isn't a valid Liquid Instruments binary log file
         LI_UNIMPLEMENTED = 6,    // Unsupported feature
+        LI_IO_ERROR = 7,         // Reading or writing a file failed
     } li_status;
     
     // Quantities that can be extracted from the file
@@ -44,6 +47,21 @@ extern "C" {
         LI_HDR_STRING_UTF8V = 11,      // ... UTF8 string specifying CSV header
         LI_START_OFFSET_F64 = 12,      // Sample time offset
         LI_COUNT_FOR_INDEX_U64 = 13,   // Number of records in channel[index], ncessary to interpret packing into RECORD_BYTES
+        LI_RAW_RECORD_I64V = 14,       // Array of 64-bit integers with the raw fields behind the values of the record last returned by RECORD_F64V, before calibration.  Floating point fields give their bits.
+        LI_CALIBRATION_F64 = 15,       // Calibration of channel[index]
+        LI_REC_STRING_BYTES_U64 = 16,  // Size (including null terminating character) of ...
+        LI_REC_STRING_UTF8V = 17,      // ... UTF8 string specifying the fields of records of channel[index]
+        LI_PROC_STRING_BYTES_U64 = 18, // Size (including null terminating character) of ...
+        LI_PROC_STRING_UTF8V = 19,     // ... UTF8 string specifying the operations that calibrate the fields of channel[index]
+        LI_HEADER_BYTES_U64 = 20,      // Bytes of input up to the end of the header, where data messages start
+        LI_FRAMED_BYTES_U64 = 21,      // Bytes of input consumed as whole messages so far, so always at a message boundary
+        LI_FRAMED_BYTES_FOR_INDEX_U64 = 22, // Payload bytes of the data messages framed so far for channel[index]
+        LI_RECORD_BYTES_FOR_INDEX_U64 = 23, // Bytes of each record of channel[index] in the payload
+        LI_RECORD_COUNT_U64 = 24,      // Records in the input so far, decoded or not: those whose payload every channel has framed, after any bytes dropped to find the first record.  Fast with li_frame_only
+        LI_IN_PHASE_U8 = 25,           // 1 if every channel has framed exactly LI_RECORD_COUNT_U64 records, so decoding can resume from LI_FRAMED_BYTES_U64 with only the header before it, else 0
+        LI_RECORDS_QUEUED_U64 = 26,    // Whole records every channel has queued, ready to decode with RECORD_F64V or li_take_records
+        LI_STATE_BYTES_U64 = 27,       // Size of ...
+        LI_STATE_U8V = 28,             // ... the state of decoding at LI_FRAMED_BYTES_U64, for li_restore: the payload each channel has queued or is to skip
     } li_target;
     
     // Forward declaration of the opaque reader object.
@@ -59,6 +77,16 @@ extern "C" {
                        void (*dealloc)(void*));
     
     
+    // Return a reader to the state of li_init to read another file, keeping
+    // its buffers and settings.  The plan for decoding the last file's
+    // header is also kept, and used again if the next file's channels have
+    // the same numbers, calibrations and record and operation strings, as
+    // they do for a batch of files from one instrument.  This saves parsing
+    // them and building lookup tables for every file.
+    
+    void li_reader_reset(li_reader* reader);
+    
+    
     // Finalize a reader object and release all memory allocated during its use
     
     void li_finalize(li_reader* reader);
@@ -82,6 +110,97 @@ extern "C" {
                      size_t count);
     
     
+    // Only walk the framing of the file, discarding the payloads of data
+    // messages instead of keeping them to decode.  This is much faster when
+    // only the structure of the file is wanted, as with the FRAMED targets;
+    // RECORD_F64V then finds no records.  Payloads are still kept until
+    // the first record is found, so that the bytes dropped before it
+    // aren't counted; until then the channels are not IN_PHASE.
+    
+    void li_frame_only(li_reader* reader, bool enable);
+    
+    
+    // Integer fields of LI_TABLE_BITS or fewer are decoded by looking up
+    // the calibrated value of each code in a table built when the header
+    // is parsed.  Set the memory the tables of a reader may use, or 0 to
+    // decode every field directly; this must be called before the header
+    // is parsed.
+
+#define LI_TABLE_BITS 16
+#define LI_TABLE_BYTES ((size_t) 4 << 20)
+
+    void li_table_bytes(li_reader* reader, size_t bytes);
+    
+    
+    // Discard the next count records of every channel without decoding
+    // them, dropping their payloads as they are framed.  The header must
+    // have been parsed; returns LI_SMALL_SRC if it has not.
+    
+    li_status li_skip(li_reader* reader, uint64_t count);
+    
+    
+    // Move the payload of the next count records of channel[index] out of
+    // the reader into dest, which holds bytes, to be decoded elsewhere with
+    // li_decode_records.  Take the same number of records from every
+    // channel to keep them in step.  A record must first have been decoded
+    // with RECORD_F64V, which finds where records start in a misaligned
+    // file; returns LI_INVALID_ARGUMENT before then.
+
+    li_status li_take_records(li_reader* reader,
+                              size_t index,
+                              uint64_t count,
+                              void* dest,
+                              size_t bytes);
+
+
+    // Decode count records of channel[index] from payload taken with
+    // li_take_records.  The values of each record are written to dest,
+    // which then advances by stride doubles, and likewise its raw fields to
+    // raw if not NULL, as LI_RAW_RECORD_I64V gives them.  Only the header of
+    // the reader is used, so each channel may be decoded on a thread of its
+    // own while the reader goes on framing.
+
+    li_status li_decode_records(const li_reader* reader,
+                                size_t index,
+                                const void* payload,
+                                uint64_t count,
+                                double* dest,
+                                int64_t* raw,
+                                size_t stride);
+
+
+    // Check the literal fields of every record all channels have queued,
+    // without computing any values, and discard the records.  Sets
+    // *checked to the records that matched.  The first record of a
+    // misaligned file is found by dropping bytes from every channel, as
+    // RECORD_F64V does, and *skipped is set to how many were dropped.
+    // Returns LI_BAD_FORMAT at the first record that doesn't match.
+    
+    li_status li_check_records(li_reader* reader,
+                               uint64_t* checked,
+                               uint64_t* skipped);
+    
+    
+    // Restore the state of decoding LI_STATE_U8V gave, so a reader that
+    // has been given the same header, and nothing after it, resumes from
+    // LI_FRAMED_BYTES_U64 of the input the state was taken from; put the
+    // input from there on.  Returns LI_SMALL_SRC if the header hasn't been
+    // parsed, and LI_BAD_FORMAT if the state doesn't fit it.
+    
+    li_status li_restore(li_reader* reader,
+                         const void* src,
+                         size_t count);
+    
+    
+    // Once li_get has returned LI_BAD_FORMAT, describe the problem found
+    // with the input and set *offset to where it is: the start of the
+    // message at fault, or for a record whose literal fields don't match,
+    // of the last message framed before it was found.  Returns NULL if no
+    // problem has been found.
+    
+    const char* li_problem(const li_reader* reader, uint64_t* offset);
+    
+    
     // Return a human-readable interpretation of an li_status code
     
     const char* li_status_string(li_status status);
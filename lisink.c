@@ -0,0 +1,701 @@
+//
+//  lisink.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lisink.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "licheckpoint.h"
+#include "lidecode.h"
+#include "lipipeline.h"
+#include "liutility.h"
+
+#define REQUIRE_ALLOC(X) do { if (! X) { result = LI_BAD_ALLOC; LI_ON_ERROR; goto cleanup; } } while(false)
+#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
+#define CONTINUE_SMALL_AFTER(CLEANUP)  { if (result != LI_SUCCESS) { { CLEANUP; } if (result == LI_SMALL_SRC) continue; else { LI_ON_ERROR; goto cleanup; } } }
+#define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
+
+uint64_t li_metadata_row_at(const li_metadata* self, double t) {
+    if (t <= self->start_offset)
+        return 0;
+    double x = floor((t - self->start_offset) / self->time_step);
+    if (!(self->time_step > 0) || !(x < 18446744073709551616.0))
+        return UINT64_MAX;
+    uint64_t row = (x > 0) ? (uint64_t) x : 0;
+    // Division rounds, so settle the boundary with the same arithmetic as
+    // the time column
+    while (row && (self->start_offset + self->time_step * (double) (row - 1) >= t))
+        --row;
+    while ((row != UINT64_MAX) && (self->start_offset + self->time_step * (double) row < t))
+        ++row;
+    return row;
+}
+
+void li_metadata_row(const li_metadata* self, const double* record, uint64_t row, double* dest) {
+    double t = self->start_offset + self->time_step * (double) row;
+    for (const Replacement* p = self->replacements->begin; p != self->replacements->end; ++p) {
+        double d = 0;
+        switch (p->identifier[0]) {
+            case 't':
+                d = t;
+                break;
+            case 'n':
+                d = (double) row;
+                break;
+            case 'c':
+                d = record[p->index];
+                break;
+            default:
+                assert(false);
+                break;
+        }
+        *dest++ = d;
+    }
+}
+
+void li_metadata_channel_dtor(li_metadata_channel* self) {
+    li_string_dtor(&self->record_format);
+    li_string_dtor(&self->proc_format);
+}
+
+void li_sink_release(li_sink* self) {
+    if (self)
+        self->release(self);
+}
+
+// Decoded records are gathered into a ring of batches.  Each batch is handed
+// to every sink in turn, directly for sinks on the decoding thread and
+// through a queue for threaded sinks, and is reused once every threaded sink
+// has handed it back.
+
+typedef struct {
+    li_block records;
+    li_block raw;       // Raw fields of the records, if any sink wants them
+    uint64_t row;       // Row number of the first record
+    size_t count;       // Records in the batch
+} li_sink_batch;
+
+static li_status li_sink_consume(li_sink* sink, const li_sink_batch* batch) {
+    if (sink->consume_raw)
+        return sink->consume_raw(sink, (const int64_t*) batch->raw.begin, batch->row, batch->count);
+    return sink->consume(sink, (const double*) batch->records.begin, batch->row, batch->count);
+}
+
+typedef struct {
+    li_sink* sink;
+    const li_metadata* metadata;
+    const li_sink_state* state; // To resume from, or NULL to begin
+    li_spsc todo;       // decode -> sink, then NULL to stop
+    li_spsc done;       // sink -> decode
+    pthread_t thread;
+    bool started;
+    bool stopped;       // Has been sent NULL
+    bool abandon;       // Stop without finishing
+    li_status status;   // Read once every batch is handed back, or the
+                        // thread is joined
+    uint64_t reported;  // Bytes written that were reported to the callback
+} li_sink_runner;
+
+static void* li_sink_main(void* ptr) {
+    li_sink_runner* self = ptr;
+    li_sink* sink = self->sink;
+    if (self->state)
+        self->status = sink->resume(sink, self->metadata, self->state);
+    else
+        self->status = sink->begin(sink, self->metadata);
+    li_sink_batch* batch;
+    // After an error keep handing batches back, so the decoder never waits
+    while ((batch = li_spsc_pop(&self->todo))) {
+        if (self->status == LI_SUCCESS)
+            self->status = li_sink_consume(sink, batch);
+        li_spsc_push(&self->done, batch);
+    }
+    if ((self->status == LI_SUCCESS) && !self->abandon)
+        self->status = sink->finish(sink);
+    return NULL;
+}
+
+typedef struct {
+    li_sink_runner* runners;
+    size_t count;
+    li_sink_batch batches[LI_SINK_BATCHES];
+    uint64_t dispatched;
+    uint64_t recycled;
+} li_sink_fanout;
+
+static li_sink_batch* li_sink_next(li_sink_fanout* self) {
+    return self->batches + self->dispatched % LI_SINK_BATCHES;
+}
+
+static li_status li_sink_dispatch(li_sink_fanout* self) {
+    li_sink_batch* batch = li_sink_next(self);
+    for (size_t i = 0; i != self->count; ++i) {
+        li_sink_runner* q = self->runners + i;
+        if (q->started)
+            li_spsc_push(&q->todo, batch);
+        else
+            LI_DOUBT(li_sink_consume(q->sink, batch));
+    }
+    // Make sure the next batch is free
+    if (++self->dispatched - self->recycled == LI_SINK_BATCHES) {
+        for (size_t i = 0; i != self->count; ++i)
+            if (self->runners[i].started)
+                li_spsc_pop(&self->runners[i].done);
+        ++self->recycled;
+    }
+    li_sink_next(self)->count = 0;
+    return LI_SUCCESS;
+}
+
+// Save progress to path once every record decoded so far is in a batch that
+// has been dispatched.  The threaded sinks hand back every batch first, so
+// they are idle while each sink writes its output through.
+
+static li_status li_sink_checkpoint(li_sink_fanout* self, li_reader* reader, li_checkpoint* checkpoint, const char* path) {
+    while (self->recycled != self->dispatched) {
+        for (size_t i = 0; i != self->count; ++i)
+            if (self->runners[i].started)
+                li_spsc_pop(&self->runners[i].done);
+        ++self->recycled;
+    }
+    for (size_t i = 0; i != self->count; ++i) {
+        li_sink_runner* q = self->runners + i;
+        LI_DOUBT(q->status);
+        LI_DOUBT(q->sink->checkpoint(q->sink, checkpoint->sinks + i));
+        checkpoint->sinks[i].row = checkpoint->row;
+    }
+    uint64_t bytes = 0;
+    LI_DOUBT(li_get(reader, LI_FRAMED_BYTES_U64, 0, &checkpoint->offset, sizeof(uint64_t)));
+    LI_DOUBT(li_get(reader, LI_STATE_BYTES_U64, 0, &bytes, sizeof(bytes)));
+    LI_DOUBT(li_block_reserve(&checkpoint->state, MAX((size_t) bytes, (size_t) 1)));
+    LI_DOUBT(li_get(reader, LI_STATE_U8V, 0, checkpoint->state.begin, checkpoint->state.capacity));
+    checkpoint->state.size = (size_t) bytes;
+    return li_checkpoint_save(checkpoint, path);
+}
+
+// Read the header again from input, which must match the one saved, and
+// restore the reader to where checkpoint was taken, skipping input up to
+// there
+
+static li_status li_sink_resume(li_source* input, li_reader* reader, const li_checkpoint* checkpoint) {
+    const li_block* header = &checkpoint->header;
+    if (checkpoint->offset < header->size)
+        return LI_BAD_FORMAT;
+    li_block block;
+    LI_DOUBT(li_block_ctor(&block, MAX(header->size, (size_t) 1)));
+    size_t n;
+    while ((block.size < header->size)
+           && (n = li_source_read(input, block.begin + block.size, header->size - block.size)))
+        block.size += n;
+    li_status result = li_source_status(input);
+    if ((result == LI_SUCCESS) && ((block.size != header->size) || memcmp(block.begin, header->begin, block.size)))
+        result = LI_BAD_FORMAT;
+    if (result == LI_SUCCESS)
+        result = li_put(reader, block.begin, block.size);
+    li_block_dtor(&block);
+    LI_DOUBT(result);
+
+    uint64_t bytes = 0;
+    result = li_get(reader, LI_HEADER_BYTES_U64, 0, &bytes, sizeof(bytes));
+    if ((result == LI_SMALL_SRC) || ((result == LI_SUCCESS) && (bytes != header->size)))
+        return LI_BAD_FORMAT;
+    LI_DOUBT(result);
+    LI_DOUBT(li_restore(reader, checkpoint->state.begin, checkpoint->state.size));
+    return li_source_skip(input, checkpoint->offset - header->size);
+}
+
+// Report bytes written by sinks on this thread, or by all sinks once they
+// are joined
+
+static void li_sink_report(li_sink_fanout* self,
+                           bool joined,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i != self->count; ++i) {
+        li_sink_runner* q = self->runners + i;
+        if (joined || !q->sink->threaded) {
+            n += q->sink->written - q->reported;
+            q->reported = q->sink->written;
+        }
+    }
+    if (callback && n)
+        callback(user_ptr, 0, n);
+}
+
+li_status li_convert(li_source* input,
+                     li_sink** sinks,
+                     size_t count,
+                     const li_convert_options* options,
+                     void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                     void* user_ptr)
+{
+    assert(input && (sinks || !count));
+
+    li_status result = LI_SUCCESS;
+
+    uint64_t first = options ? options->first : 0;
+    uint64_t last = UINT64_MAX;
+    if (options && (options->count <= UINT64_MAX - first))
+        last = first + options->count;
+    bool done = (first == last) || (last <= input->row);
+    uint64_t rows = input->row; // Row number of the next record
+
+    li_array(Replacement) replacements;
+    li_array_ctor(Replacement)(&replacements);
+
+    li_string csvFmt;
+    li_string_ctor(&csvFmt);
+
+    li_string csvHeader;
+    li_string_ctor(&csvHeader);
+
+    li_array(li_metadata_channel) channels;
+    li_array_ctor(li_metadata_channel)(&channels);
+
+    li_metadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    metadata.replacements = &replacements;
+    metadata.channels = &channels;
+    bool raw = false; // Does any sink want raw fields?
+    size_t record_bytes = 0;
+    size_t batch_rows = 0;
+
+    li_sink_fanout fanout;
+    memset(&fanout, 0, sizeof(fanout));
+
+    // Once records are found to be aligned, channels may be decoded on
+    // threads of their own
+    li_decode_pool decoding;
+    li_decode_pool_ctor(&decoding);
+    bool aligned = false;
+
+    // Reading happens on its own thread; this thread decodes
+    li_pipeline pipe;
+    li_block* in = NULL;
+    bool piping = false;
+
+    // Progress is saved every interval bytes of input.  Until the header is
+    // parsed, input is kept to save with it.
+    const char* path = options ? options->checkpoint : NULL;
+    uint64_t interval = (options && options->checkpoint_bytes) ? options->checkpoint_bytes : LI_CHECKPOINT_BYTES;
+    uint64_t unsaved = 0;
+    li_checkpoint checkpoint;
+    li_checkpoint_ctor(&checkpoint);
+    bool resuming = false;
+    li_queue head;
+    li_queue_ctor(&head);
+
+    li_reader* reuse = options ? options->reader : NULL;
+    li_reader* r = reuse ? reuse : li_init(malloc, free);
+    REQUIRE_ALLOC(r);
+    if (reuse)
+        li_reader_reset(r);
+
+    if (path) {
+        for (size_t i = 0; i != count; ++i)
+            if (!sinks[i]->checkpoint || !sinks[i]->resume) {
+                result = LI_UNIMPLEMENTED;
+                goto cleanup;
+            }
+        FILE* file = options->resume ? fopen(path, "rb") : NULL;
+        if (file) {
+            result = li_checkpoint_load(&checkpoint, file);
+            fclose(file);
+            REQUIRE_SUCCESS;
+            REQUIRE_FORMAT(checkpoint.count == count);
+            result = li_sink_resume(input, r, &checkpoint);
+            REQUIRE_SUCCESS;
+            resuming = true;
+        } else {
+            checkpoint.sinks = li_alloc(MAX(count, (size_t) 1) * sizeof(li_sink_state));
+            REQUIRE_ALLOC(checkpoint.sinks);
+            memset(checkpoint.sinks, 0, MAX(count, (size_t) 1) * sizeof(li_sink_state));
+            checkpoint.count = count;
+        }
+    }
+
+    result = li_pipeline_ctor(&pipe, input, NULL, NULL, NULL);
+    piping = true;
+    REQUIRE_SUCCESS;
+    fanout.runners = li_alloc(MAX(count, (size_t) 1) * sizeof(li_sink_runner));
+    REQUIRE_ALLOC(fanout.runners);
+    memset(fanout.runners, 0, MAX(count, (size_t) 1) * sizeof(li_sink_runner));
+    fanout.count = count;
+    for (size_t i = 0; i != count; ++i) {
+        fanout.runners[i].sink = sinks[i];
+        fanout.runners[i].metadata = &metadata;
+        raw = raw || sinks[i]->consume_raw;
+    }
+
+    // When resuming, the header is already in the reader, so go round once
+    // even if no input is left
+    for (bool primed = resuming; (in = li_pipeline_read(&pipe)) || primed; primed = false) {
+        if (in) {
+            uint64_t n = in->size;
+            if (callback)
+                callback(user_ptr, n, 0);
+            if (path && !record_bytes && !resuming) {
+                result = li_queue_put(&head, in->begin, (size_t) n);
+                REQUIRE_SUCCESS;
+            }
+            unsaved += n;
+            // Give n bytes to the reader and return the block to the reader thread
+            result = li_put(r, in->begin, (size_t) n);
+            li_pipeline_recycle(&pipe, in);
+            REQUIRE_SUCCESS;
+        }
+
+        if (!record_bytes) {
+
+            // As li_reader doesn't parse the header until all of it is
+            // available, if the first get succeeds all following gets for
+            // metadata will succeed.
+
+            uint64_t bytes = 0;
+            result = li_get(r, LI_RECORD_BYTES_U64, 0, &bytes, sizeof(bytes));
+            CONTINUE_SMALL_AFTER();
+            REQUIRE_FORMAT(bytes >= sizeof(double));
+            record_bytes = (size_t) bytes;
+
+            LI_TRUST(li_get(r, LI_TIME_STEP_F64, 0, &metadata.time_step, sizeof(double)));
+            LI_TRUST(li_get(r, LI_START_OFFSET_F64, 0, &metadata.start_offset, sizeof(double)));
+            LI_TRUST(li_get(r, LI_START_TIME_U64, 0, &metadata.start_time, sizeof(uint64_t)));
+            if (options && options->timed) {
+                first = li_metadata_row_at(&metadata, options->from);
+                last = li_metadata_row_at(&metadata, options->to);
+            }
+            if (options && options->records) {
+                last = MIN(last, input->row + options->records);
+                uint64_t begin = MAX(first, rows);
+                metadata.rows = (last > begin) ? (last - begin) : 0;
+            }
+            if (resuming) {
+                first = checkpoint.first;
+                last = checkpoint.last;
+                metadata.rows = checkpoint.rows;
+                rows = checkpoint.row;
+                aligned = checkpoint.aligned;
+            } else if (path) {
+                LI_TRUST(li_get(r, LI_HEADER_BYTES_U64, 0, &bytes, sizeof(bytes)));
+                REQUIRE_FORMAT(bytes <= li_queue_size(&head));
+                result = li_block_ctor(&checkpoint.header, MAX((size_t) bytes, (size_t) 1));
+                REQUIRE_SUCCESS;
+                memcpy(checkpoint.header.begin, li_queue_begin(&head), (size_t) bytes);
+                checkpoint.header.size = (size_t) bytes;
+                li_queue_clear(&head);
+            }
+
+            for (int i = 1; i != 9; ++i) {
+                li_metadata_channel c;
+                memset(&c, 0, sizeof(c));
+                c.number = i;
+                // Fails for channels that don't exist
+                if (li_get(r, LI_CALIBRATION_F64, (size_t) i, &c.calibration, sizeof(double)) != LI_SUCCESS)
+                    continue;
+                result = li_array_push(li_metadata_channel)(&channels, c);
+                REQUIRE_SUCCESS;
+                li_metadata_channel* p = li_array_end(li_metadata_channel)(&channels) - 1;
+                p->record_format = li_string_copy("");
+                p->proc_format = li_string_copy("");
+                REQUIRE_ALLOC(p->record_format && p->proc_format);
+                LI_TRUST(li_get(r, LI_REC_STRING_BYTES_U64, (size_t) i, &bytes, sizeof(bytes)));
+                result = li_string_resize(&p->record_format, (size_t) bytes - 1, 'x');
+                REQUIRE_SUCCESS;
+                LI_TRUST(li_get(r, LI_REC_STRING_UTF8V, (size_t) i, p->record_format, (size_t) bytes));
+                LI_TRUST(li_get(r, LI_PROC_STRING_BYTES_U64, (size_t) i, &bytes, sizeof(bytes)));
+                result = li_string_resize(&p->proc_format, (size_t) bytes - 1, 'x');
+                REQUIRE_SUCCESS;
+                LI_TRUST(li_get(r, LI_PROC_STRING_UTF8V, (size_t) i, p->proc_format, (size_t) bytes));
+            }
+
+            LI_TRUST(li_get(r, LI_FMT_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
+            LI_TRUST(li_string_resize(&csvFmt, (size_t) bytes - 1, 'x'));
+            LI_TRUST(li_get(r, LI_FMT_STRING_UTF8V, 0, csvFmt, (size_t) bytes));
+
+            li_array_dtor(Replacement)(&replacements);
+            replacements = li_parse_Replacement_list(csvFmt);
+            // Replacement list is tuples like {"ch2", 3, ".16e"}
+            // We need to convert into a flat index into the record
+            // To do this we need to know how many items per channel
+            uint64_t deltas[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+            for (size_t i = 1; i != 9; ++i) {
+                // Allowed to fail for channels that don't exist, leaving deltas[i] unchanged
+                li_get(r, LI_COUNT_FOR_INDEX_U64, i, deltas + i, sizeof(uint64_t));
+                // Cumulative sum
+                deltas[i] += deltas[i - 1];
+            }
+            LI_FOR (Replacement, p, &replacements) {
+                if (p->identifier
+                    && (p->identifier[0] == 'c')
+                    && (p->identifier[1] == 'h')
+                    && isdigit(p->identifier[2])
+                    && !p->identifier[3]) {
+                    p->index += deltas[(p->identifier[2] - '0') - 1];
+                    // Index now reflects where channel starts in packed data
+                }
+                assert(p->index < record_bytes / sizeof(double));
+            }
+
+            LI_TRUST(li_get(r, LI_HDR_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
+            LI_TRUST(li_string_resize(&csvHeader, (size_t) bytes - 1, 'x'));
+            LI_TRUST(li_get(r, LI_HDR_STRING_UTF8V, 0, csvHeader, (size_t) bytes));
+
+            metadata.record_doubles = record_bytes / sizeof(double);
+            metadata.columns = li_array_size(Replacement)(&replacements);
+            metadata.csv_format = csvFmt;
+            metadata.csv_header = csvHeader;
+
+            batch_rows = MAX(LI_SINK_BATCH_BYTES / record_bytes, (size_t) 1);
+            for (int i = 0; i != LI_SINK_BATCHES; ++i) {
+                result = li_block_ctor(&fanout.batches[i].records, batch_rows * record_bytes);
+                REQUIRE_SUCCESS;
+                if (raw) {
+                    result = li_block_ctor(&fanout.batches[i].raw, batch_rows * record_bytes);
+                    REQUIRE_SUCCESS;
+                }
+            }
+
+            // Threaded sinks begin on their own threads
+            for (size_t i = 0; i != count; ++i) {
+                li_sink_runner* q = fanout.runners + i;
+                if (resuming) {
+                    q->state = checkpoint.sinks + i;
+                    q->reported = q->state->written;
+                }
+                if (q->sink->threaded) {
+                    result = li_spsc_ctor(&q->todo, LI_SINK_BATCHES + 1); // Room for the stop signal
+                    REQUIRE_SUCCESS;
+                    result = li_spsc_ctor(&q->done, LI_SINK_BATCHES);
+                    REQUIRE_SUCCESS;
+                    REQUIRE_ALLOC(!pthread_create(&q->thread, NULL, li_sink_main, q));
+                    q->started = true;
+                } else {
+                    if (q->state)
+                        result = q->sink->resume(q->sink, &metadata, q->state);
+                    else
+                        result = q->sink->begin(q->sink, &metadata);
+                    REQUIRE_SUCCESS;
+                }
+            }
+
+            if (options && options->channel_threads) {
+                result = li_decode_pool_start(&decoding, r, metadata.record_doubles);
+                REQUIRE_SUCCESS;
+            }
+            done = (first >= last) || (rows >= last);
+        }
+
+        if (record_bytes) {
+            while (!done) {
+                li_sink_batch* batch = li_sink_next(&fanout);
+                if (decoding.workers && aligned) {
+                    // Hand every record queued, up to the end of the batch,
+                    // to the channel workers
+                    uint64_t queued = 0;
+                    result = li_get(r, LI_RECORDS_QUEUED_U64, 0, &queued, sizeof(queued));
+                    REQUIRE_SUCCESS;
+                    if (!queued) {
+                        result = LI_SMALL_SRC;
+                        break;
+                    }
+                    size_t n = (size_t) MIN(MIN(queued, (uint64_t) (batch_rows - batch->count)), last - rows);
+                    if (!batch->count)
+                        batch->row = rows;
+                    result = li_decode_pool_put(&decoding, r, n,
+                                                (double*) batch->records.begin + batch->count * metadata.record_doubles,
+                                                raw ? (int64_t*) batch->raw.begin + batch->count * metadata.record_doubles : NULL);
+                    REQUIRE_SUCCESS;
+                    rows += n;
+                    done = (rows >= last);
+                    batch->count += n;
+                    if (batch->count == batch_rows) {
+                        result = li_decode_pool_wait(&decoding);
+                        REQUIRE_SUCCESS;
+                        result = li_sink_dispatch(&fanout);
+                        REQUIRE_SUCCESS;
+                    }
+                    continue;
+                }
+                result = li_get(r, LI_RECORD_F64V, 0, batch->records.begin + batch->count * record_bytes, record_bytes);
+                if (result != LI_SUCCESS)
+                    break;
+                aligned = true;
+                if (raw) {
+                    result = li_get(r, LI_RAW_RECORD_I64V, 0, batch->raw.begin + batch->count * record_bytes, record_bytes);
+                    REQUIRE_SUCCESS;
+                }
+                uint64_t row = rows++;
+                if (row < first) {
+                    // Records before the first are only framed, never
+                    // decoded, once this one has shown where they start
+                    LI_TRUST(li_skip(r, first - rows));
+                    rows = first;
+                    continue; // Overwritten by the next record
+                }
+                done = (rows >= last);
+                if (!batch->count)
+                    batch->row = row;
+                if (++batch->count == batch_rows) {
+                    result = li_sink_dispatch(&fanout);
+                    REQUIRE_SUCCESS;
+                }
+            }
+            li_sink_report(&fanout, false, callback, user_ptr);
+            if (done)
+                break; // Stop reading early
+            if (result != LI_SMALL_SRC) // We left the loop because of an error
+                goto cleanup;
+
+            // Every record queued is decoded, so what remains in the reader
+            // is part of a record
+            if (path && (unsaved >= interval)) {
+                if (decoding.workers) {
+                    result = li_decode_pool_wait(&decoding);
+                    REQUIRE_SUCCESS;
+                }
+                if (li_sink_next(&fanout)->count) {
+                    result = li_sink_dispatch(&fanout);
+                    REQUIRE_SUCCESS;
+                }
+                // Until a batch is dispatched, threaded sinks may still be
+                // beginning
+                if (fanout.dispatched) {
+                    checkpoint.row = rows;
+                    checkpoint.first = first;
+                    checkpoint.last = last;
+                    checkpoint.rows = metadata.rows;
+                    checkpoint.aligned = aligned;
+                    result = li_sink_checkpoint(&fanout, r, &checkpoint, path);
+                    REQUIRE_SUCCESS;
+                    unsaved = 0;
+                }
+            }
+        }
+    }
+    // Stop the reader and check it reached the end of input
+    piping = false;
+    result = li_pipeline_dtor(&pipe);
+    REQUIRE_SUCCESS;
+    REQUIRE_FORMAT(record_bytes);
+    // Input with no records isn't valid, though a window with none is
+    REQUIRE_FORMAT(aligned || (first >= last) || (rows >= last));
+    if (decoding.workers) {
+        result = li_decode_pool_wait(&decoding);
+        REQUIRE_SUCCESS;
+    }
+    if (li_sink_next(&fanout)->count) {
+        result = li_sink_dispatch(&fanout);
+        REQUIRE_SUCCESS;
+    }
+
+    // Let the threaded sinks finish while we finish the others
+    for (size_t i = 0; i != count; ++i) {
+        li_sink_runner* q = fanout.runners + i;
+        if (q->started) {
+            li_spsc_push(&q->todo, NULL);
+            q->stopped = true;
+        }
+    }
+    for (size_t i = 0; i != count; ++i) {
+        li_sink_runner* q = fanout.runners + i;
+        if (!q->started) {
+            result = q->sink->finish(q->sink);
+            REQUIRE_SUCCESS;
+        }
+    }
+
+cleanup:
+
+    if (piping)
+        li_pipeline_dtor(&pipe);
+    li_decode_pool_dtor(&decoding); // Before the batches it decodes into
+
+    for (size_t i = 0; i != fanout.count; ++i) {
+        li_sink_runner* q = fanout.runners + i;
+        if (q->started) {
+            if (!q->stopped) {
+                q->abandon = true;
+                li_spsc_push(&q->todo, NULL);
+            }
+            pthread_join(q->thread, NULL);
+            if (result == LI_SUCCESS)
+                result = q->status;
+        }
+        li_spsc_dtor(&q->done);
+        li_spsc_dtor(&q->todo);
+    }
+    if (fanout.runners)
+        li_sink_report(&fanout, true, callback, user_ptr);
+    if (path && (result == LI_SUCCESS))
+        remove(path); // The outputs are complete
+
+    for (int i = 0; i != LI_SINK_BATCHES; ++i) {
+        li_block_dtor(&fanout.batches[i].records);
+        li_block_dtor(&fanout.batches[i].raw);
+    }
+    li_dealloc(fanout.runners);
+    li_array_dtor(li_metadata_channel)(&channels);
+    li_array_dtor(Replacement)(&replacements);
+    li_string_dtor(&csvHeader);
+    li_string_dtor(&csvFmt);
+    li_queue_dtor(&head);
+    li_checkpoint_dtor(&checkpoint);
+    if (!reuse)
+        li_finalize(r);
+
+    return result;
+}
+
+li_status li_count_records(li_source* input,
+                           uint64_t* records,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    assert(input && records);
+    *records = 0;
+    li_status result = LI_SUCCESS;
+    li_pipeline pipe;
+    li_status piped = li_pipeline_ctor(&pipe, input, NULL, NULL, NULL);
+    bool piping = true;
+    li_reader* r = li_init(malloc, free);
+    REQUIRE_ALLOC(r);
+    result = piped;
+    REQUIRE_SUCCESS;
+    li_frame_only(r, true);
+
+    for (li_block* in; (in = li_pipeline_read(&pipe)); ) {
+        if (callback)
+            callback(user_ptr, in->size, 0);
+        result = li_put(r, in->begin, in->size);
+        li_pipeline_recycle(&pipe, in);
+        REQUIRE_SUCCESS;
+        // Frame what we have so the reader's queue stays small
+        result = li_get(r, LI_RECORD_COUNT_U64, 0, records, sizeof(uint64_t));
+        if (result == LI_SMALL_SRC)
+            continue; // The header is incomplete
+        REQUIRE_SUCCESS;
+    }
+    piping = false;
+    result = li_pipeline_dtor(&pipe);
+    REQUIRE_SUCCESS;
+    result = li_get(r, LI_RECORD_COUNT_U64, 0, records, sizeof(uint64_t));
+    REQUIRE_FORMAT(result != LI_SMALL_SRC);
+
+cleanup:
+
+    if (piping)
+        li_pipeline_dtor(&pipe);
+    li_finalize(r);
+    return result;
+}
@@ -0,0 +1,180 @@
+//
+//  lisink.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lisink_h
+#define lisink_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "liparse.h"
+#include "lireader.h"
+#include "lisource.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // A channel of a binary log file, with the strings of its header
+
+    typedef struct li_metadata_channel {
+        int number;
+        double calibration;
+        li_string record_format;                    // Fields of each record
+        li_string proc_format;                      // Operations calibrating
+                                                    // each field
+    } li_metadata_channel;
+
+    void li_metadata_channel_dtor(li_metadata_channel* self);
+
+    li_array_define(li_metadata_channel)
+
+    // The header of a binary log file, as the sinks see it.  The indices of
+    // the channel replacements are flat indices into a decoded record.
+
+    typedef struct li_metadata {
+        double time_step;
+        double start_offset;
+        uint64_t start_time;                        // Crude, in whole seconds
+        size_t record_doubles;                      // Doubles in each record
+        size_t columns;                             // Values in each row, one
+                                                    // for each replacement
+        const char* csv_header;
+        const char* csv_format;
+        li_array(Replacement)* replacements;        // Formats as in the file,
+                                                    // not to be modified
+        li_array(li_metadata_channel)* channels;    // In record order, not to
+                                                    // be modified
+        uint64_t rows;                              // Rows the sinks will be
+                                                    // given, if known before
+                                                    // converting, else 0
+    } li_metadata;
+
+    // Fill dest with one value for each replacement of the given record:
+    // the time, the row number n, or a channel value
+
+    void li_metadata_row(const li_metadata* self, const double* record, uint64_t row, double* dest);
+
+    // The first row at or after t seconds, timed as by li_metadata_row.
+    // Only time_step and start_offset are used.
+
+    uint64_t li_metadata_row_at(const li_metadata* self, double t);
+
+    // li_sink consumes the decoded records of one conversion, writing them
+    // in some output format.  li_convert calls begin once the header has
+    // been parsed (the metadata stays valid until finish), consume with
+    // blocks of consecutive records, and finish at the end of input.  Once
+    // a call fails the sink gets no more calls, and li_convert returns the
+    // first error.  Set threaded to have all three called on a thread of
+    // the sink's own, so several sinks write their outputs concurrently; a
+    // sink on the decoding thread that fails stops the whole conversion.
+    // written counts output bytes, and is read by li_convert only between
+    // calls, or after finish for a threaded sink.  A sink that stores the
+    // fields of the records as they are in the file sets consume_raw, which
+    // is called instead of consume with record_doubles raw fields for each
+    // record, as LI_RAW_RECORD_I64V returns them.
+    //
+    // A sink whose output can be carried on by a later run sets checkpoint
+    // and resume.  li_convert calls checkpoint between calls to consume, on
+    // the decoding thread, to write everything consumed so far through to
+    // storage and describe the output in state.  resume is called instead
+    // of begin to carry on from a state checkpoint gave, with the output
+    // files it had, which may have had more written to them since; these
+    // must be opened for update rather than truncated.
+
+    typedef struct li_sink_state {
+        uint64_t row;       // Row number of the next record, filled in by
+                            // li_convert
+        uint64_t rows;      // Consumed
+        uint64_t written;
+        uint64_t offset;    // Of the end of the output, if it grows
+        uint64_t token;     // For the sink to check it resumes the same
+                            // layout, such as the bytes of its header
+    } li_sink_state;
+
+    typedef struct li_sink li_sink;
+
+    struct li_sink {
+        li_status (*begin)(li_sink* self, const li_metadata* metadata);
+        li_status (*consume)(li_sink* self, const double* records, uint64_t row, size_t count);
+        li_status (*consume_raw)(li_sink* self, const int64_t* fields, uint64_t row, size_t count);
+        li_status (*finish)(li_sink* self);
+        li_status (*checkpoint)(li_sink* self, li_sink_state* state);
+        li_status (*resume)(li_sink* self, const li_metadata* metadata, const li_sink_state* state);
+        void (*release)(li_sink* self); // Frees the sink, finished or not
+        bool threaded;
+        uint64_t written;
+    };
+
+    void li_sink_release(li_sink* self); // Accepts NULL
+
+    // Which records to convert, by row number or by time
+
+    typedef struct li_convert_options {
+        uint64_t first;     // Row number of the first record
+        uint64_t count;     // Number of records, or UINT64_MAX for the rest
+        bool timed;         // Use from and to instead of first and count
+        double from;        // Seconds, as in the time column, of the first record
+        double to;          // Seconds after the last record (exclusive)
+        uint64_t records;   // Records in input, if known as from
+                            // li_count_records, else 0
+        bool channel_threads; // Decode each channel on a thread of its own
+        li_reader* reader;  // Reset and used instead of a new reader, so a
+                            // batch of files can share its buffers and
+                            // decode plan, or NULL
+        const char* checkpoint; // Path to save progress to, or NULL
+        uint64_t checkpoint_bytes; // Input between checkpoints, or 0 for
+                            // LI_CHECKPOINT_BYTES
+        bool resume;        // Carry on from the checkpoint, if there is one
+    } li_convert_options;
+
+    // Decode input once and hand the records to each of count sinks.
+    // Records before the first are framed but not decoded, and reading
+    // stops as soon as the requested records are decoded; records past the
+    // end of input are not an error.  When options give the number of
+    // records in input, li_convert reads no further than that and tells
+    // the sinks how many rows they will get, so they can size their
+    // outputs up front.  options may be NULL to convert every record.
+    // Optionally provide a callback that will report whenever bytes are
+    // read from input or written by a sink.  user_ptr is passed unchanged to
+    // the callback.
+    //
+    // With a checkpoint path in options, progress is saved there (see
+    // licheckpoint.h) every checkpoint_bytes of input, and removed once the
+    // conversion succeeds.  Every sink must support checkpoints, or
+    // li_convert returns LI_UNIMPLEMENTED.  To resume, run the conversion
+    // again with resume set, the same input and options, and sinks given
+    // the same output files; input up to the checkpoint is then skipped
+    // without being read where the source allows, and the outputs end up
+    // as an uninterrupted run would have left them.
+
+#define LI_SINK_BATCHES 4                  // Blocks of records in flight
+#define LI_SINK_BATCH_BYTES (1 << 20)
+#define LI_CHECKPOINT_BYTES (256 << 20)
+
+    li_status li_convert(li_source* input,
+                         li_sink** sinks,
+                         size_t count,
+                         const li_convert_options* options,
+                         void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                         void* user_ptr);
+
+    // Count the records of input by walking the framing of its messages,
+    // without decoding them, at about the speed input can be read.  Useful
+    // for progress reporting, or sizing outputs before converting.  The
+    // callback reports bytes read from input.
+
+    li_status li_count_records(li_source* input,
+                               uint64_t* records,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lisink_h */
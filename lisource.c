@@ -0,0 +1,433 @@
+//
+//  lisource.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "lisource.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "lipack.h"
+#include "lipipeline.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LI_HAVE_POSIX_IO
+#endif
+
+// How far ahead of the read position we ask the kernel to prefetch
+#define LI_READAHEAD_BYTES (8 << 20)
+
+// Buffers circulating between the inflating thread and the reader
+#define LI_GZIP_BLOCKS 4
+#define LI_GZIP_BLOCK_BYTES (1 << 20)
+#define LI_GZIP_INPUT_BYTES (256 << 10)
+
+
+
+// Streaming with stdio works for any FILE, including pipes and stdin
+
+static size_t li_source_stream_read(li_source* self, void* dest, size_t count) {
+    size_t n = fread(dest, 1, count, self->file);
+    if (!n && ferror(self->file))
+        self->status = LI_IO_ERROR;
+    self->offset += n;
+    return n;
+}
+
+
+
+#ifdef LI_HAVE_POSIX_IO
+
+// Keep the kernel's prefetch a window ahead of the reader
+
+static void li_source_advise(li_source* self) {
+#ifdef POSIX_FADV_WILLNEED
+    while (self->advised < MIN(self->offset + LI_READAHEAD_BYTES, self->size)) {
+        posix_fadvise(self->fd, (off_t) self->advised, LI_READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+        self->advised += LI_READAHEAD_BYTES;
+    }
+#endif
+}
+
+static size_t li_source_pread_read(li_source* self, void* dest, size_t count) {
+    li_source_advise(self);
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(self->fd, (char*) dest + total, count - total, (off_t) self->offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            self->status = LI_IO_ERROR;
+            break;
+        }
+        if (!n)
+            break;
+        total += (size_t) n;
+        self->offset += (uint64_t) n;
+    }
+    return total;
+}
+
+static size_t li_source_mmap_read(li_source* self, void* dest, size_t count) {
+    size_t n = (size_t) MIN((uint64_t) count, self->size - self->offset);
+    memcpy(dest, self->map + self->offset, n);
+    self->offset += n;
+    return n;
+}
+
+static void li_source_mmap_close(li_source* self) {
+    munmap((void*) self->map, (size_t) self->size);
+    self->map = NULL;
+}
+
+#endif
+
+
+
+// Gzip compressed input is inflated by its own thread into a ring of blocks,
+// so decompression overlaps decoding.  The raw source moves inside the filter
+// state and the outer source reads from the ring.
+
+typedef struct {
+    li_source inner;
+    z_stream z;
+    li_byte* input;
+    bool input_done;
+
+    li_block blocks[LI_GZIP_BLOCKS];
+    li_spsc free;         // reader -> inflater
+    li_spsc full;         // inflater -> reader
+    li_block* current;    // Block the reader is consuming
+    size_t position;      // Next byte of current
+    bool done;            // Reader has seen the end of the inflated data
+
+    pthread_t thread;
+    bool started;
+    int cancel;
+    li_status status;     // Written by the inflater, read after the end marker
+} li_gzip;
+
+// Make sure there is compressed input available, returning false at its end
+
+static bool li_gzip_refill(li_gzip* self) {
+    if (self->z.avail_in)
+        return true;
+    if (self->input_done)
+        return false;
+    size_t n = li_source_read(&self->inner, self->input, LI_GZIP_INPUT_BYTES);
+    if (!n) {
+        self->input_done = true;
+        return false;
+    }
+    self->z.next_in = (Bytef*) self->input;
+    self->z.avail_in = (uInt) n;
+    return true;
+}
+
+static li_status li_gzip_fill(li_gzip* self, li_block* block, bool* end) {
+    self->z.next_out = (Bytef*) block->begin;
+    self->z.avail_out = (uInt) block->capacity;
+    while (self->z.avail_out) {
+        if (!li_gzip_refill(self)) {
+            *end = true;
+            // Input that stops part way through a member is truncated
+            return self->inner.status != LI_SUCCESS ? self->inner.status : LI_BAD_FORMAT;
+        }
+        int result = inflate(&self->z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            // Concatenated members are valid gzip; anything else after the
+            // last member is ignored, as gunzip does
+            if (!li_gzip_refill(self) || (self->z.next_in[0] != 0x1f)) {
+                *end = true;
+                return self->inner.status;
+            }
+            if (inflateReset(&self->z) != Z_OK)
+                return LI_BAD_FORMAT;
+        } else if (result == Z_MEM_ERROR) {
+            return LI_BAD_ALLOC;
+        } else if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+            return LI_BAD_FORMAT;
+        }
+    }
+    return LI_SUCCESS;
+}
+
+static void* li_gzip_inflater(void* ptr) {
+    li_gzip* self = ptr;
+    bool end = false;
+    while (!end && !__atomic_load_n(&self->cancel, __ATOMIC_ACQUIRE)) {
+        li_block* block = li_spsc_pop(&self->free);
+        li_status result = li_gzip_fill(self, block, &end);
+        block->size = block->capacity - self->z.avail_out;
+        if (result != LI_SUCCESS) {
+            self->status = result;
+            end = true;
+        }
+        if (block->size)
+            li_spsc_push(&self->full, block);
+    }
+    // NULL marks the end of input; the queue publishes status with it
+    li_spsc_push(&self->full, NULL);
+    return NULL;
+}
+
+static size_t li_gzip_read(li_source* self, void* dest, size_t count) {
+    li_gzip* gz = self->filter;
+    size_t total = 0;
+    while ((total < count) && !gz->done) {
+        if (!gz->current) {
+            gz->current = li_spsc_pop(&gz->full);
+            gz->position = 0;
+            if (!gz->current) {
+                gz->done = true;
+                self->status = gz->status;
+                break;
+            }
+        }
+        size_t n = MIN(count - total, gz->current->size - gz->position);
+        memcpy((char*) dest + total, gz->current->begin + gz->position, n);
+        gz->position += n;
+        total += n;
+        self->offset += n;
+        if (gz->position == gz->current->size) {
+            li_spsc_push(&gz->free, gz->current);
+            gz->current = NULL;
+        }
+    }
+    return total;
+}
+
+static void li_gzip_close(li_source* self) {
+    li_gzip* gz = self->filter;
+    if (gz->started) {
+        // Stop the inflater and hand blocks back until it acknowledges
+        __atomic_store_n(&gz->cancel, 1, __ATOMIC_RELEASE);
+        if (gz->current)
+            li_spsc_push(&gz->free, gz->current);
+        while (!gz->done) {
+            li_block* block = li_spsc_pop(&gz->full);
+            if (block)
+                li_spsc_push(&gz->free, block);
+            else
+                gz->done = true;
+        }
+        pthread_join(gz->thread, NULL);
+    }
+    inflateEnd(&gz->z);
+    for (int i = 0; i != LI_GZIP_BLOCKS; ++i)
+        li_block_dtor(gz->blocks + i);
+    li_spsc_dtor(&gz->full);
+    li_spsc_dtor(&gz->free);
+    li_dealloc(gz->input);
+    li_source_dtor(&gz->inner);
+    li_dealloc(gz);
+    self->filter = NULL;
+}
+
+// Replace self with a filter that inflates it.  On failure everything is
+// released and self is left in the error state.
+
+static li_status li_source_gzip(li_source* self) {
+    li_gzip* gz = li_alloc(sizeof(li_gzip));
+    if (!gz)
+        return LI_BAD_ALLOC;
+    memset(gz, 0, sizeof(li_gzip));
+    gz->inner = *self;
+
+    li_status result = LI_BAD_ALLOC;
+    if (inflateInit2(&gz->z, 16 + MAX_WBITS) != Z_OK) {
+        li_dealloc(gz);
+        return result;
+    }
+    // Offsets count inflated bytes from here on
+    self->filter = gz;
+    self->read = li_gzip_read;
+    self->close = li_gzip_close;
+    self->unread_size = 0;
+    self->offset = 0;
+    self->compressed = true;
+
+    // From here li_gzip_close releases whatever has been acquired
+    if (!(gz->input = li_alloc(LI_GZIP_INPUT_BYTES)))
+        goto failure;
+    if ((result = li_spsc_ctor(&gz->free, LI_GZIP_BLOCKS + 1)) != LI_SUCCESS)
+        goto failure;
+    if ((result = li_spsc_ctor(&gz->full, LI_GZIP_BLOCKS + 1)) != LI_SUCCESS)
+        goto failure;
+    for (int i = 0; i != LI_GZIP_BLOCKS; ++i) {
+        if ((result = li_block_ctor(gz->blocks + i, LI_GZIP_BLOCK_BYTES)) != LI_SUCCESS)
+            goto failure;
+        li_spsc_push(&gz->free, gz->blocks + i);
+    }
+    result = LI_BAD_ALLOC;
+    if (pthread_create(&gz->thread, NULL, li_gzip_inflater, gz))
+        goto failure;
+    gz->started = true;
+    return LI_SUCCESS;
+
+failure:
+    li_gzip_close(self);
+    self->close = NULL;
+    self->status = result;
+    return result;
+}
+
+
+
+// Construct the raw source for an uncompressed file
+
+static void li_source_open(li_source* self, FILE* file, li_source_kind kind) {
+    memset(self, 0, sizeof(li_source));
+    self->file = file;
+    self->fd = -1;
+    self->kind = LI_SOURCE_STREAM;
+    self->read = li_source_stream_read;
+
+#ifdef LI_HAVE_POSIX_IO
+    if (kind == LI_SOURCE_STREAM)
+        return;
+
+    // Positioned reads and mapping need a regular file
+    struct stat st;
+    int fd = fileno(file);
+    off_t position = ftello(file);
+    if ((fd < 0) || (position < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    self->fd = fd;
+    self->offset = (uint64_t) position;
+    self->advised = self->offset;
+    self->size = (uint64_t) st.st_size;
+
+    if ((kind == LI_SOURCE_MMAP) && (self->size > 0) && (self->size <= SIZE_MAX)) {
+        void* p = mmap(NULL, (size_t) self->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(p, (size_t) self->size, MADV_SEQUENTIAL);
+#endif
+            self->map = p;
+            self->kind = LI_SOURCE_MMAP;
+            self->read = li_source_mmap_read;
+            self->close = li_source_mmap_close;
+            return;
+        }
+        // Fall back to positioned reads, for example on 32-bit systems
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, (off_t) self->offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    self->kind = LI_SOURCE_PREAD;
+    self->read = li_source_pread_read;
+#else
+    (void) kind;
+#endif
+}
+
+li_status li_source_ctor(li_source* self, FILE* file, li_source_kind kind) {
+    assert(self && file);
+    li_source_open(self, file, kind);
+
+    // Sniff the gzip and packed magic numbers.  Pipes can't seek back, so
+    // the bytes are kept and returned by the first read.
+    while (self->unread_size < sizeof(self->unread)) {
+        size_t n = self->read(self, self->unread + self->unread_size,
+                              sizeof(self->unread) - self->unread_size);
+        if (!n)
+            break;
+        self->unread_size += n;
+    }
+    const unsigned char* magic = (const unsigned char*) self->unread;
+    if ((self->unread_size >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b))
+        return li_source_gzip(self);
+    if ((self->unread_size == 4) && !memcmp(magic, LI_PACK_MAGIC, 4))
+        return li_source_unpack(self);
+    return self->status;
+}
+
+void li_source_dtor(li_source* self) {
+    assert(self);
+    if (self->close)
+        self->close(self);
+    self->close = NULL;
+}
+
+size_t li_source_read(li_source* self, void* dest, size_t count) {
+    assert(self && self->read && (dest || !count));
+    if (self->status != LI_SUCCESS)
+        return 0;
+    size_t n = MIN(count, self->unread_size);
+    if (n) {
+        memcpy(dest, self->unread, n);
+        memmove(self->unread, self->unread + n, self->unread_size - n);
+        self->unread_size -= n;
+    }
+    return n + self->read(self, (char*) dest + n, count - n);
+}
+
+li_status li_source_skip(li_source* self, uint64_t count) {
+    assert(self && self->read);
+    if (self->status != LI_SUCCESS)
+        return self->status;
+    size_t n = (size_t) MIN(count, (uint64_t) self->unread_size);
+    memmove(self->unread, self->unread + n, self->unread_size - n);
+    self->unread_size -= n;
+    count -= n;
+    if (!self->compressed && ((self->kind == LI_SOURCE_PREAD) || (self->kind == LI_SOURCE_MMAP))) {
+        if (count > self->size - MIN(self->offset, self->size))
+            return LI_BAD_FORMAT;
+        self->offset += count;
+        self->advised = MAX(self->advised, self->offset);
+        return LI_SUCCESS;
+    }
+    li_byte buffer[64 << 10];
+    while (count) {
+        n = self->read(self, buffer, (size_t) MIN(count, (uint64_t) sizeof(buffer)));
+        if (!n)
+            return self->status ? self->status : LI_BAD_FORMAT;
+        count -= n;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_source_status(li_source* self) {
+    assert(self);
+    return self->status;
+}
+
+const char* li_source_kind_name(li_source_kind kind) {
+    switch (kind) {
+        case LI_SOURCE_AUTO:
+            return "auto";
+        case LI_SOURCE_STREAM:
+            return "stream";
+        case LI_SOURCE_PREAD:
+            return "pread";
+        case LI_SOURCE_MMAP:
+            return "mmap";
+    }
+    return "unknown";
+}
+
+li_status li_source_evict(FILE* file) {
+#if defined(LI_HAVE_POSIX_IO) && defined(POSIX_FADV_DONTNEED)
+    int fd = fileno(file);
+    if ((fd < 0) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+        return LI_IO_ERROR;
+    return LI_SUCCESS;
+#else
+    (void) file;
+    return LI_UNIMPLEMENTED;
+#endif
+}
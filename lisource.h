@@ -0,0 +1,92 @@
+//
+//  lisource.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef lisource_h
+#define lisource_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lireader.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // li_source supplies the raw bytes of a binary log file to the
+    // converters in large blocks, independent of how much data the reader
+    // suggests it needs next.  Several strategies are available because the
+    // best one depends on the storage: pipes can only be streamed, while
+    // seekable files can be read with positioned reads plus readahead hints,
+    // or mapped into memory.
+    //
+    // Input that starts with the gzip magic number is transparently inflated
+    // on a separate thread, so decompression overlaps decoding.  Packed
+    // files (see lipack.h) are inflated block by block.
+
+    typedef enum li_source_kind {
+        LI_SOURCE_AUTO = 0,   // PREAD for regular files, STREAM otherwise
+        LI_SOURCE_STREAM = 1, // fread; works for pipes and stdin
+        LI_SOURCE_PREAD = 2,  // Large positioned reads with readahead hints
+        LI_SOURCE_MMAP = 3,   // Memory mapped with MADV_SEQUENTIAL
+    } li_source_kind;
+
+    typedef struct li_source li_source;
+
+    struct li_source {
+        li_source_kind kind;  // Strategy actually in use after construction
+        FILE* file;
+        int fd;
+        uint64_t offset;      // Next byte to read
+        uint64_t size;        // Size of seekable files
+        uint64_t advised;     // End of the range we have asked the kernel to prefetch
+        const li_byte* map;   // Mapping of the whole file
+        li_status status;     // First error encountered
+
+        li_byte unread[4];    // Bytes examined during construction but not yet returned
+        size_t unread_size;
+        bool compressed;      // Input is gzip compressed or packed
+        void* filter;         // State of the decompressing filter
+        uint64_t row;         // Row number of the first record in the input
+
+        // Read up to count bytes, returning 0 only at the end of input or
+        // after an error
+        size_t (*read)(li_source* self, void* dest, size_t count);
+        void (*close)(li_source* self);
+    };
+
+    // Construct a source reading file from its current position.  If the
+    // requested kind is unavailable for this file or platform, falls back to
+    // the next best kind.  Detects and inflates gzip compressed and packed
+    // input.  Does not take ownership of the file.
+    li_status li_source_ctor(li_source* self, FILE* file, li_source_kind kind);
+    void li_source_dtor(li_source* self);
+
+    size_t li_source_read(li_source* self, void* dest, size_t count);
+
+    // Pass over the next count bytes of input, as if they were read.
+    // Uncompressed files that can be read with positioned reads or mapping
+    // skip without reading, so a conversion can resume far into its input.
+    // Returns LI_BAD_FORMAT if input ends first.
+    li_status li_source_skip(li_source* self, uint64_t count);
+
+    li_status li_source_status(li_source* self);
+
+    const char* li_source_kind_name(li_source_kind kind);
+
+    // Ask the operating system to evict the file from its page cache, so
+    // that the next read comes from storage (used for cold-cache benchmarks).
+    // Returns LI_UNIMPLEMENTED if the platform can't do this.
+    li_status li_source_evict(FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lisource_h */
@@ -0,0 +1,612 @@
+//
+//  litoarrow.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "lireader.h"
+#include "litoarrow.h"
+
+#include "liutility.h"
+#include "liparse.h"
+#include "liflatbuffer.h"
+#include "lipipeline.h"
+#include "lisink.h"
+
+// An Arrow IPC file is the magic "ARROW1" padded to 8 bytes, a stream of
+// messages (the schema, then a record batch at a time), an end-of-stream
+// marker, and a footer that repeats the schema and locates each batch.  A
+// message is a continuation marker, the size of its FlatBuffer metadata,
+// the metadata padded to 8 bytes, and a body holding the buffers of each
+// column in turn.  See Schema.fbs, Message.fbs and File.fbs in the Arrow
+// format specification for the tables and field numbers used here.
+
+#define LI_ARROW_MAGIC "ARROW1"
+#define LI_ARROW_CONTINUATION 0xFFFFFFFF
+#define LI_ARROW_V5 4                 // MetadataVersion
+
+enum {
+    LI_ARROW_SCHEMA = 1,              // MessageHeader
+    LI_ARROW_RECORD_BATCH = 3,
+};
+
+enum {
+    LI_ARROW_INT = 2,                 // Type
+    LI_ARROW_FLOATING_POINT = 3,
+};
+
+#define LI_ARROW_DOUBLE 2             // Precision
+
+// Block, FieldNode and Buffer structs
+
+typedef struct {
+    int64_t offset;     // Of the message in the file
+    int32_t metadata;   // Bytes of prefix and padded metadata
+    int32_t padding;
+    int64_t body;       // Bytes of body
+} li_arrow_block;
+
+typedef struct {
+    int64_t length;
+    int64_t null_count;
+} li_arrow_node;
+
+typedef struct {
+    int64_t offset;     // In the body
+    int64_t length;
+} li_arrow_buffer;
+
+// The writer thread receives blocks of whole rows and transposes them into
+// a batch, which is written once full
+
+typedef struct {
+    FILE* output;
+    size_t columns;
+    const char* names;      // Null-terminated name of each column in turn
+    const char* types;      // 'l' for int64 or 'd' for float64
+    size_t batch_rows;
+    li_block batch;         // Values of each column in turn
+    size_t rows;            // Rows in the batch
+    li_fb fb;
+    li_queue blocks;        // li_arrow_block of each batch written
+    uint64_t offset;        // Bytes written
+} li_arrow_writer;
+
+static li_status li_arrow_put(li_arrow_writer* self, const void* src, size_t count) {
+    if (fwrite(src, 1, count, self->output) != count)
+        return LI_IO_ERROR;
+    self->offset += count;
+    return LI_SUCCESS;
+}
+
+static li_status li_arrow_pad(li_arrow_writer* self) {
+    static const char zeros[8] = { 0 };
+    return li_arrow_put(self, zeros, (size_t) (0 - self->offset) & 7);
+}
+
+static li_fb_ref li_arrow_schema(li_arrow_writer* self) {
+    li_fb* fb = &self->fb;
+    li_fb_ref* fields = li_alloc(MAX(self->columns, 1) * sizeof(li_fb_ref));
+    if (!fields) {
+        fb->status = LI_BAD_ALLOC;
+        return 0;
+    }
+    const char* name = self->names;
+    for (size_t i = 0; i != self->columns; ++i, name += strlen(name) + 1) {
+        li_fb_ref n = li_fb_string(fb, name, strlen(name));
+        li_fb_table(fb);
+        if (self->types[i] == 'l') {
+            li_fb_add_i32(fb, 0, 64);           // Int.bitWidth
+            li_fb_add_bool(fb, 1, true);        // Int.is_signed
+        } else {
+            li_fb_add_i16(fb, 0, LI_ARROW_DOUBLE); // FloatingPoint.precision
+        }
+        li_fb_ref type = li_fb_end(fb);
+        li_fb_ref children = li_fb_refs(fb, NULL, 0);
+        li_fb_table(fb);
+        li_fb_add_ref(fb, 0, n);                // Field.name
+        li_fb_add_bool(fb, 1, false);           // Field.nullable
+        li_fb_add_u8(fb, 2, (self->types[i] == 'l') ? LI_ARROW_INT : LI_ARROW_FLOATING_POINT);
+        li_fb_add_ref(fb, 3, type);             // Field.type
+        li_fb_add_ref(fb, 5, children);         // Field.children
+        fields[i] = li_fb_end(fb);
+    }
+    li_fb_ref vector = li_fb_refs(fb, fields, self->columns);
+    li_dealloc(fields);
+    li_fb_table(fb);
+    li_fb_add_i16(fb, 0, 0);                    // Schema.endianness, Little
+    li_fb_add_ref(fb, 1, vector);               // Schema.fields
+    return li_fb_end(fb);
+}
+
+// Wrap the header table already in fb in a message and write its metadata,
+// recording where it is
+
+static li_status li_arrow_message(li_arrow_writer* self, uint8_t type, li_fb_ref header, uint64_t body, li_arrow_block* block) {
+    li_fb* fb = &self->fb;
+    li_fb_table(fb);
+    li_fb_add_i16(fb, 0, LI_ARROW_V5);          // Message.version
+    li_fb_add_u8(fb, 1, type);                  // Message.header_type
+    li_fb_add_ref(fb, 2, header);               // Message.header
+    li_fb_add_i64(fb, 3, (int64_t) body);       // Message.bodyLength
+    LI_DOUBT(li_fb_finish(fb, li_fb_end(fb)));
+    uint32_t prefix[2] = {
+        LI_ARROW_CONTINUATION,
+        (uint32_t) ((li_fb_size(fb) + 7) & ~(size_t) 7)
+    };
+    if (block) {
+        block->offset = (int64_t) self->offset;
+        block->metadata = (int32_t) (sizeof(prefix) + prefix[1]);
+        block->padding = 0;
+        block->body = (int64_t) body;
+    }
+    LI_DOUBT(li_arrow_put(self, prefix, sizeof(prefix)));
+    LI_DOUBT(li_arrow_put(self, li_fb_data(fb), li_fb_size(fb)));
+    return li_arrow_pad(self);
+}
+
+static li_status li_arrow_begin(li_arrow_writer* self) {
+    static const char magic[8] = LI_ARROW_MAGIC;
+    LI_DOUBT(li_arrow_put(self, magic, sizeof(magic)));
+    li_fb_clear(&self->fb);
+    return li_arrow_message(self, LI_ARROW_SCHEMA, li_arrow_schema(self), 0, NULL);
+}
+
+// Write the batch.  There are no nulls, so each column has an empty
+// validity buffer and a data buffer.
+
+static li_status li_arrow_flush(li_arrow_writer* self) {
+    if (!self->rows)
+        return LI_SUCCESS;
+    li_fb* fb = &self->fb;
+    li_fb_clear(fb);
+    size_t columns = self->columns;
+    uint64_t column_bytes = self->rows * sizeof(double);
+    li_arrow_node* nodes = li_alloc(columns * sizeof(li_arrow_node));
+    li_arrow_buffer* buffers = li_alloc(2 * columns * sizeof(li_arrow_buffer));
+    if (nodes && buffers) {
+        for (size_t j = 0; j != columns; ++j) {
+            nodes[j].length = (int64_t) self->rows;
+            nodes[j].null_count = 0;
+            buffers[2 * j].offset = (int64_t) (j * column_bytes);
+            buffers[2 * j].length = 0;
+            buffers[2 * j + 1].offset = (int64_t) (j * column_bytes);
+            buffers[2 * j + 1].length = (int64_t) column_bytes;
+        }
+        li_fb_ref b = li_fb_structs(fb, buffers, 2 * columns, sizeof(li_arrow_buffer), 8);
+        li_fb_ref n = li_fb_structs(fb, nodes, columns, sizeof(li_arrow_node), 8);
+        li_fb_table(fb);
+        li_fb_add_i64(fb, 0, (int64_t) self->rows); // RecordBatch.length
+        li_fb_add_ref(fb, 1, n);                    // RecordBatch.nodes
+        li_fb_add_ref(fb, 2, b);                    // RecordBatch.buffers
+    } else {
+        fb->status = LI_BAD_ALLOC;
+    }
+    li_dealloc(buffers);
+    li_dealloc(nodes);
+    li_fb_ref header = li_fb_end(fb);
+    li_arrow_block block;
+    LI_DOUBT(li_arrow_message(self, LI_ARROW_RECORD_BATCH, header, columns * column_bytes, &block));
+    LI_DOUBT(li_queue_put(&self->blocks, &block, sizeof(block)));
+    for (size_t j = 0; j != columns; ++j)
+        LI_DOUBT(li_arrow_put(self, self->batch.begin + j * self->batch_rows * sizeof(double), (size_t) column_bytes));
+    self->rows = 0;
+    return LI_SUCCESS;
+}
+
+static li_status li_arrow_write(void* user, const void* src, size_t count) {
+    li_arrow_writer* self = user;
+    size_t columns = self->columns;
+    size_t rows = count / (columns * sizeof(double));
+    assert(rows * columns * sizeof(double) == count);
+    if (!self->offset)
+        LI_DOUBT(li_arrow_begin(self));
+    const double* values = src;
+    for (size_t i = 0; i != rows; ++i, values += columns) {
+        li_byte* p = self->batch.begin + self->rows * sizeof(double);
+        for (size_t j = 0; j != columns; ++j, p += self->batch_rows * sizeof(double)) {
+            if (self->types[j] == 'l') {
+                int64_t x = (int64_t) values[j];
+                memcpy(p, &x, sizeof(x));
+            } else {
+                memcpy(p, values + j, sizeof(double));
+            }
+        }
+        if (++self->rows == self->batch_rows)
+            LI_DOUBT(li_arrow_flush(self));
+    }
+    return LI_SUCCESS;
+}
+
+static li_status li_arrow_finish(li_arrow_writer* self) {
+    if (!self->offset)
+        LI_DOUBT(li_arrow_begin(self));
+    LI_DOUBT(li_arrow_flush(self));
+    uint32_t eos[2] = { LI_ARROW_CONTINUATION, 0 };
+    LI_DOUBT(li_arrow_put(self, eos, sizeof(eos)));
+
+    li_fb* fb = &self->fb;
+    li_fb_clear(fb);
+    li_fb_ref schema = li_arrow_schema(self);
+    li_fb_ref dictionaries = li_fb_structs(fb, NULL, 0, sizeof(li_arrow_block), 8);
+    li_fb_ref batches = li_fb_structs(fb, li_queue_begin(&self->blocks),
+                                      li_queue_size(&self->blocks) / sizeof(li_arrow_block),
+                                      sizeof(li_arrow_block), 8);
+    li_fb_table(fb);
+    li_fb_add_i16(fb, 0, LI_ARROW_V5);          // Footer.version
+    li_fb_add_ref(fb, 1, schema);               // Footer.schema
+    li_fb_add_ref(fb, 2, dictionaries);         // Footer.dictionaries
+    li_fb_add_ref(fb, 3, batches);              // Footer.recordBatches
+    LI_DOUBT(li_fb_finish(fb, li_fb_end(fb)));
+    LI_DOUBT(li_arrow_put(self, li_fb_data(fb), li_fb_size(fb)));
+    int32_t size = (int32_t) li_fb_size(fb);
+    LI_DOUBT(li_arrow_put(self, &size, sizeof(size)));
+    return li_arrow_put(self, LI_ARROW_MAGIC, strlen(LI_ARROW_MAGIC));
+}
+
+li_status li_to_arrow(FILE* input,
+                      FILE* output,
+                      void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                      void* user_ptr)
+{
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_arrow(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
+
+// Arrow C Data Interface export.  The writer thread transposes decoded rows
+// into a growing array for each column, whose storage is then handed to the
+// exported children.
+
+li_array_define(li_array_double);
+
+typedef struct {
+    li_array(li_array_double) columns;
+} li_arrow_gatherer;
+
+static li_status li_arrow_gather(void* user, const void* src, size_t count) {
+    li_arrow_gatherer* self = user;
+    size_t columns = li_array_size(li_array_double)(&self->columns);
+    size_t rows = count / (columns * sizeof(double));
+    assert(rows * columns * sizeof(double) == count);
+    const double* values = src;
+    for (size_t j = 0; j != columns; ++j) {
+        li_array(double)* c = self->columns.begin + j;
+        size_t n = li_array_size(double)(c);
+        LI_DOUBT(li_array_resize(double)(c, n + rows, 0.0));
+        double* p = c->begin + n;
+        for (size_t i = 0; i != rows; ++i)
+            p[i] = values[i * columns + j];
+    }
+    return LI_SUCCESS;
+}
+
+static void li_arrow_release_schema_child(struct ArrowSchema* self) {
+    li_dealloc((void*) self->name);
+    self->release = NULL;
+}
+
+static void li_arrow_release_schema(struct ArrowSchema* self) {
+    for (int64_t i = 0; i != self->n_children; ++i)
+        if (self->children[i]->release)
+            self->children[i]->release(self->children[i]);
+    li_dealloc(self->children);
+    li_dealloc(self->private_data); // The children
+    self->release = NULL;
+}
+
+static void li_arrow_release_array_child(struct ArrowArray* self) {
+    li_dealloc((void*) self->buffers[1]);
+    li_dealloc(self->buffers);
+    self->release = NULL;
+}
+
+static void li_arrow_release_array(struct ArrowArray* self) {
+    for (int64_t i = 0; i != self->n_children; ++i)
+        if (self->children[i]->release)
+            self->children[i]->release(self->children[i]);
+    li_dealloc(self->children);
+    li_dealloc(self->private_data); // The children
+    li_dealloc(self->buffers);
+    self->release = NULL;
+}
+
+// Export the gathered columns, taking ownership of their storage.  Either
+// both structs are exported or neither is.
+
+static li_status li_arrow_export(li_arrow_gatherer* gatherer,
+                                 const char* names,
+                                 const char* types,
+                                 struct ArrowSchema* schema,
+                                 struct ArrowArray* array)
+{
+    size_t columns = li_array_size(li_array_double)(&gatherer->columns);
+    size_t rows = columns ? li_array_size(double)(gatherer->columns.begin) : 0;
+
+    memset(schema, 0, sizeof(struct ArrowSchema));
+    memset(array, 0, sizeof(struct ArrowArray));
+    schema->format = "+s";
+    schema->name = "";
+    schema->n_children = (int64_t) columns;
+    schema->children = li_alloc(columns * sizeof(struct ArrowSchema*));
+    schema->private_data = li_alloc(columns * sizeof(struct ArrowSchema));
+    schema->release = li_arrow_release_schema;
+    array->length = (int64_t) rows;
+    array->n_buffers = 1; // No validity bitmap
+    array->n_children = (int64_t) columns;
+    array->buffers = li_alloc(sizeof(void*));
+    array->children = li_alloc(columns * sizeof(struct ArrowArray*));
+    array->private_data = li_alloc(columns * sizeof(struct ArrowArray));
+    array->release = li_arrow_release_array;
+    bool ok = schema->children && schema->private_data && array->buffers && array->children && array->private_data;
+    if (ok) {
+        // Until filled in, the children have nothing to release
+        memset(schema->private_data, 0, columns * sizeof(struct ArrowSchema));
+        memset(array->private_data, 0, columns * sizeof(struct ArrowArray));
+        array->buffers[0] = NULL;
+    } else {
+        // Release only the allocations above
+        schema->n_children = array->n_children = 0;
+    }
+    const char* name = names;
+    for (size_t j = 0; ok && (j != columns); ++j, name += strlen(name) + 1) {
+        struct ArrowSchema* s = schema->children[j] = (struct ArrowSchema*) schema->private_data + j;
+        struct ArrowArray* a = array->children[j] = (struct ArrowArray*) array->private_data + j;
+        size_t n = strlen(name) + 1;
+        char* copy = li_alloc(n);
+        const void** buffers = li_alloc(2 * sizeof(void*));
+        if (!copy || !buffers) {
+            li_dealloc(buffers);
+            li_dealloc(copy);
+            ok = false;
+            break;
+        }
+        memcpy(copy, name, n);
+        s->format = (types[j] == 'l') ? "l" : "g";
+        s->name = copy;
+        s->release = li_arrow_release_schema_child;
+
+        // Take the storage of the column, converting in place if needed
+        li_array(double)* c = gatherer->columns.begin + j;
+        if (types[j] == 'l') {
+            LI_FOR(double, p, c) {
+                int64_t x = (int64_t) *p;
+                memcpy(p, &x, sizeof(x));
+            }
+        }
+        buffers[0] = NULL;
+        buffers[1] = c->begin;
+        li_array_ctor(double)(c);
+        a->length = (int64_t) rows;
+        a->n_buffers = 2;
+        a->buffers = buffers;
+        a->release = li_arrow_release_array_child;
+    }
+    if (!ok) {
+        schema->release(schema);
+        array->release(array);
+        return LI_BAD_ALLOC;
+    }
+    return LI_SUCCESS;
+}
+
+// Arrow output as an li_sink.  Rows are sent to the writer thread of a
+// pipeline in blocks, and either written in record batches or gathered into
+// columns for export.
+
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_arrow_options options;
+    const li_metadata* metadata;
+    li_queue names;
+    char* types;
+    li_arrow_writer writer;
+    li_arrow_gatherer gatherer;
+    struct ArrowSchema* schema;
+    struct ArrowArray* array;
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+    uint64_t rows;
+} li_arrow_sink;
+
+// Name and type the columns, and start the pipeline
+
+static li_status li_arrow_sink_start(li_arrow_sink* self, const li_metadata* metadata, li_write_function write, void* user) {
+    self->metadata = metadata;
+    size_t columns = metadata->columns;
+    if (!columns)
+        return LI_BAD_FORMAT;
+    LI_DOUBT(li_parse_header_names(&self->names, metadata->csv_header, columns));
+    self->types = li_alloc(columns);
+    if (!self->types)
+        return LI_BAD_ALLOC;
+    for (size_t j = 0; j != columns; ++j)
+        self->types[j] = (metadata->replacements->begin[j].identifier[0] == 'n') ? 'l' : 'd';
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, NULL, write, user);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+    return LI_SUCCESS;
+}
+
+static li_status li_arrow_sink_consume(li_sink* base, const double* records, uint64_t row, size_t count) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    size_t row_bytes = self->metadata->columns * sizeof(double);
+    size_t record_doubles = self->metadata->record_doubles;
+    for (size_t i = 0; i != count; ++i, records += record_doubles) {
+        // Blocks hold whole rows
+        li_block* out = self->out;
+        if (out->capacity - out->size < row_bytes) {
+            if (out->size) {
+                li_pipeline_submit(&self->pipe, out);
+                out = self->out = li_pipeline_acquire(&self->pipe);
+            }
+            LI_DOUBT(li_block_reserve(out, row_bytes));
+        }
+        li_metadata_row(self->metadata, records, row + i, (double*) (out->begin + out->size));
+        out->size += row_bytes;
+    }
+    self->rows += count;
+    // Values are written as they are batched; the metadata is reported at
+    // the end
+    if (self->output)
+        base->written += count * row_bytes;
+    return LI_SUCCESS;
+}
+
+// Wait for the writer thread to finish with the rows it has
+
+static li_status li_arrow_sink_drain(li_arrow_sink* self) {
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    return li_pipeline_dtor(&self->pipe);
+}
+
+static li_status li_arrow_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    li_arrow_writer* writer = &self->writer;
+    LI_DOUBT(li_arrow_sink_start(self, metadata, li_arrow_write, writer));
+    // The writer thread doesn't look at these until it gets the first block
+    writer->output = self->output;
+    writer->batch_rows = self->options.batch_rows ? self->options.batch_rows : LI_ARROW_BATCH_ROWS;
+    writer->columns = metadata->columns;
+    writer->names = li_queue_begin(&self->names);
+    writer->types = self->types;
+    return li_block_ctor(&writer->batch, writer->batch_rows * metadata->columns * sizeof(double));
+}
+
+static li_status li_arrow_sink_finish(li_sink* base) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    LI_DOUBT(li_arrow_sink_drain(self));
+    LI_DOUBT(li_arrow_finish(&self->writer));
+    base->written = self->writer.offset;
+    return LI_SUCCESS;
+}
+
+static void li_arrow_sink_release(li_sink* base) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    li_queue_dtor(&self->writer.blocks);
+    li_fb_dtor(&self->writer.fb);
+    li_block_dtor(&self->writer.batch);
+    li_array_dtor(li_array_double)(&self->gatherer.columns);
+    li_dealloc(self->types);
+    li_queue_dtor(&self->names);
+    li_dealloc(self);
+}
+
+static li_arrow_sink* li_arrow_sink_alloc(void) {
+    li_arrow_sink* self = li_alloc(sizeof(li_arrow_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_arrow_sink));
+    self->base.consume = li_arrow_sink_consume;
+    self->base.release = li_arrow_sink_release;
+    li_queue_ctor(&self->names);
+    li_fb_ctor(&self->writer.fb);
+    li_queue_ctor(&self->writer.blocks);
+    li_array_ctor(li_array_double)(&self->gatherer.columns);
+    return self;
+}
+
+li_sink* li_arrow_sink_new(FILE* output, const li_arrow_options* options) {
+    li_arrow_sink* self = li_arrow_sink_alloc();
+    if (!self)
+        return NULL;
+    self->base.begin = li_arrow_sink_begin;
+    self->base.finish = li_arrow_sink_finish;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    return &self->base;
+}
+
+li_status li_source_to_arrow(li_source* input,
+                             FILE* output,
+                             const li_arrow_options* options,
+                             void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                             void* user_ptr)
+{
+    li_sink* sink = li_arrow_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
+    fflush(output);
+    return result;
+}
+
+static li_status li_arrow_gatherer_begin(li_sink* base, const li_metadata* metadata) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    // The writer thread doesn't look at the columns until it gets the first
+    // block
+    for (size_t j = 0; j != metadata->columns; ++j) {
+        li_array(double) c;
+        li_array_ctor(double)(&c);
+        LI_DOUBT(li_array_push(li_array_double)(&self->gatherer.columns, c));
+    }
+    return li_arrow_sink_start(self, metadata, li_arrow_gather, &self->gatherer);
+}
+
+static li_status li_arrow_gatherer_finish(li_sink* base) {
+    li_arrow_sink* self = (li_arrow_sink*) base;
+    LI_DOUBT(li_arrow_sink_drain(self));
+    // We read the header, if not necessarily any rows in the range
+    return li_arrow_export(&self->gatherer, li_queue_begin(&self->names), self->types, self->schema, self->array);
+}
+
+li_status li_export_arrow(FILE* input,
+                          uint64_t first,
+                          uint64_t count,
+                          struct ArrowSchema* schema,
+                          struct ArrowArray* array)
+{
+    assert(schema && array);
+    schema->release = NULL;
+    array->release = NULL;
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_export_arrow(&source, first, count, schema, array);
+    li_source_dtor(&source);
+    return result;
+}
+
+li_status li_source_export_arrow(li_source* input,
+                                 uint64_t first,
+                                 uint64_t count,
+                                 struct ArrowSchema* schema,
+                                 struct ArrowArray* array)
+{
+    assert(input && schema && array);
+    schema->release = NULL;
+    array->release = NULL;
+    li_arrow_sink* sink = li_arrow_sink_alloc();
+    if (!sink)
+        return LI_BAD_ALLOC;
+    sink->base.begin = li_arrow_gatherer_begin;
+    sink->base.finish = li_arrow_gatherer_finish;
+    sink->schema = schema;
+    sink->array = array;
+    li_convert_options options = { .first = first, .count = count };
+    li_sink* base = &sink->base;
+    li_status result = li_convert(input, &base, 1, &options, NULL, NULL);
+    li_sink_release(base);
+    return result;
+}
@@ -0,0 +1,132 @@
+//
+//  litoarrow.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef litoarrow_h
+#define litoarrow_h
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for uint64_t
+
+#include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Read a Liquid Instruments binary log file and write an Arrow IPC file
+    // (Feather version 2), which pyarrow, polars and R arrow can memory-map
+    // without parsing.  There is a field for each column, named from the CSV
+    // header; the row number n is int64 and everything else is float64.
+    // Rows are written in record batches as they are decoded, and the
+    // output need not be seekable.  Optionally provide a callback that will
+    // report whenever bytes are read from input or written to output.
+    // user_ptr is passed unchanged to the callback.
+
+    li_status li_to_arrow(FILE* input,
+                          FILE* output,
+                          void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                          void* user_ptr);
+
+    // Options for Arrow output.  Zero initialization gives the defaults.
+
+#define LI_ARROW_BATCH_ROWS (1 << 16)
+
+    typedef struct li_arrow_options {
+        size_t batch_rows; // Rows per record batch, or 0 for
+                           // LI_ARROW_BATCH_ROWS
+    } li_arrow_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_arrow(li_source* input,
+                                 FILE* output,
+                                 const li_arrow_options* options,
+                                 void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                                 void* user_ptr);
+
+    // An li_sink writing an Arrow IPC file to output, for converting to
+    // several formats at once with li_convert.  options may be NULL.
+    // Returns NULL if out of memory.
+
+    li_sink* li_arrow_sink_new(FILE* output, const li_arrow_options* options);
+
+    // The Arrow C Data Interface, as specified by Apache Arrow, lets any Arrow
+    // implementation adopt these structs without copying the buffers.  The
+    // guard is shared with arrow/c/abi.h and other copies.
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+    struct ArrowSchema {
+        // Array type description
+        const char* format;
+        const char* name;
+        const char* metadata;
+        int64_t flags;
+        int64_t n_children;
+        struct ArrowSchema** children;
+        struct ArrowSchema* dictionary;
+
+        // Release callback
+        void (*release)(struct ArrowSchema*);
+        // Opaque producer-specific data
+        void* private_data;
+    };
+
+    struct ArrowArray {
+        // Array data description
+        int64_t length;
+        int64_t null_count;
+        int64_t offset;
+        int64_t n_buffers;
+        int64_t n_children;
+        const void** buffers;
+        struct ArrowArray** children;
+        struct ArrowArray* dictionary;
+
+        // Release callback
+        void (*release)(struct ArrowArray*);
+        // Opaque producer-specific data
+        void* private_data;
+    };
+
+#endif /* ARROW_C_DATA_INTERFACE */
+
+    // Decode count records starting from record first (count may be
+    // UINT64_MAX for all of them) into a column buffer for each column, and
+    // export them as a struct array with a child for each column, typed and
+    // named as for li_to_arrow.  Each child owns its buffer, so consumers may
+    // move children out independently.  On success the caller must
+    // eventually call schema->release and array->release; on failure
+    // both release members are NULL.  Records past the end of the input are
+    // not an error, so the array may be shorter than count.
+
+    li_status li_export_arrow(FILE* input,
+                              uint64_t first,
+                              uint64_t count,
+                              struct ArrowSchema* schema,
+                              struct ArrowArray* array);
+
+    // As above, reading from any li_source
+
+    li_status li_source_export_arrow(li_source* input,
+                                     uint64_t first,
+                                     uint64_t count,
+                                     struct ArrowSchema* schema,
+                                     struct ArrowArray* array);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* litoarrow_h */
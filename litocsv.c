@@ -9,194 +9,210 @@
 #include "litocsv.h"
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 
+#include "licsv.h"
 #include "linumber.h"
 #include "liparse.h"
+#include "lipipeline.h"
+#include "liplace.h"
 #include "lireader.h"
+#include "lisink.h"
 #include "liutility.h"
 
-#define REQUIRE_ALLOC(X) do { if (! X) { result = LI_BAD_ALLOC; LI_ON_ERROR; goto cleanup; } } while(false)
-#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
-#define CONTINUE_SMALL_AFTER(CLEANUP) { if (result != LI_SUCCESS) { { CLEANUP; } if (result == LI_SMALL_SRC) { continue; } else { LI_ON_ERROR; goto cleanup; } } }
-#define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
+// Append formatted text to the current output block, handing full blocks to
+// the writer thread.  Returns the number of bytes appended.
+
+static size_t li_csv_printf(li_pipeline* pipe, li_block** out, const char* format, ...) {
+    for (;;) {
+        li_block* b = *out;
+        size_t room = b->capacity - b->size;
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf((char*) b->begin + b->size, room, format, args);
+        va_end(args);
+        if (n < 0)
+            return 0;
+        if ((size_t) n < room) {
+            b->size += (size_t) n;
+            return (size_t) n;
+        }
+        if (b->size) {
+            li_pipeline_submit(pipe, b);
+            *out = li_pipeline_acquire(pipe);
+        } else if (li_block_reserve(b, (size_t) n + 1)) {
+            li_pipeline_fail(pipe, LI_BAD_ALLOC);
+            return 0;
+        }
+    }
+}
 
 li_status li_to_csv(FILE* input,
                     FILE* output,
                     void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
                     void* user_ptr)
 {
-    // Todo: reduce duplication with li_to_mat
-    
-    // All resource-managing types are at function scope so we can reclaim them
-    // in a single cleanup path
-    li_status result = LI_SUCCESS;
-
-    li_array(li_byte) buffer;
-    li_array_ctor(li_byte)(&buffer);
-
-    double timeStep = 0.0;
-    double startOffset = 0.0;
-    
-    li_array(Replacement) replacements;
-    li_array_ctor(Replacement)(&replacements);
-    
-    li_array(double) doubles;
-    li_array_ctor(double)(&doubles);
-
-    li_string csvFmt;
-    li_string_ctor(&csvFmt);
-
-    li_string csvHeader;
-    li_string_ctor(&csvHeader);
-    
-    long rows = 0;
-    
-    li_reader* r = li_init(malloc, free);
-    REQUIRE_ALLOC(r);
-    
-    while (!feof(input)) {
-        
-        // Ask the reader how much data it wants to complete the next
-        // section of the file
-        uint64_t n = 0;
-        result = li_get(r, LI_SUGGESTED_PUT_U64, 0, &n, sizeof(n));
-        REQUIRE_SUCCESS;
-        
-        if (n > li_array_size(li_byte)(&buffer)) {
-            li_array_resize(li_byte)(&buffer, (size_t) n, 0);
-            REQUIRE_SUCCESS;
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_csv(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
+
+// CSV output as an li_sink.  Rows are formatted by an li_csv_pool into the
+// output blocks of a pipeline, whose writer thread writes them out.
+
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_csv_options options;
+    li_array(Replacement) replacements; // With printf formats
+    li_csv_program program;
+    li_csv_pool pool;
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+    uint64_t rows;                      // Rows consumed
+} li_csv_sink;
+
+// Compile the formats and start the pool and pipeline, as begin and resume
+// both need
+
+static li_status li_csv_sink_start(li_csv_sink* self, const li_metadata* metadata) {
+    // Replacement list is tuples like {"ch2", 3, ".16e"}, and we need
+    // formats like "%.16e"
+    for (const Replacement* p = metadata->replacements->begin; p != metadata->replacements->end; ++p) {
+        Replacement q;
+        Replacement_ctor(&q);
+        q.identifier = li_string_copy(p->identifier);
+        q.index = p->index;
+        if (p->format) {
+            q.format = li_string_copy(p->format);
+            if (q.format && li_string_insert(&q.format, 0, "%"))
+                li_string_dtor(&q.format);
+        } else {
+            q.format = li_string_copy("%.10e");
         }
-        
-        // Read up to read_buffer_size bytes from the file, which is at least
-        // as many as suggested, and set n to the bytes actually read
-        n = fread(li_array_begin(li_byte)(&buffer), 1, li_array_size(li_byte)(&buffer), input);
-        if (callback)
-            callback(user_ptr, n, 0);
-        // Give n bytes to the reader
-        result = li_put(r, li_array_begin(li_byte)(&buffer), (size_t)n);
-        REQUIRE_SUCCESS;
-        
-        if (li_array_empty(double)(&doubles)) {
-            
-            // As li_reader doesn't parse the header until all of it is
-            // available, if the first get succeeds all following gets for
-            // metadata will succeed.
-            
-            uint64_t bytes = 0;
-            result = li_get(r, LI_RECORD_BYTES_U64, 0, &bytes, sizeof(bytes));
-            CONTINUE_SMALL_AFTER();
-            assert(bytes);
-            li_array_resize(double)(&doubles, (size_t) bytes / sizeof(double), 0.0);
-            
-            LI_TRUST(li_get(r, LI_TIME_STEP_F64, 0, &timeStep, sizeof(timeStep)));
-            LI_TRUST(li_get(r, LI_START_OFFSET_F64, 0, &startOffset, sizeof(startOffset)));
-            
-            uint8_t channel_select = 0;
-            LI_TRUST(li_get(r, LI_CHANNEL_SELECT_U8, 0, &channel_select, sizeof(channel_select)));
-
-            LI_TRUST(li_get(r, LI_FMT_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            LI_TRUST(li_string_resize(&csvFmt, (size_t) bytes - 1, 'x'));
-            LI_TRUST(li_get(r, LI_FMT_STRING_UTF8V, 0, csvFmt, (size_t) bytes));
-            
-            li_array_dtor(Replacement)(&replacements);
-            replacements = li_parse_Replacement_list(csvFmt);
-            LI_FOR (Replacement, p, &replacements)
-                if (p->format)
-                    li_string_insert(&p->format, 0, "%");
-                else
-                    p->format = li_string_copy("%.10e");
-            // Replacement list is tuples like {"ch2", 3, "%.16e"}
-            // We need to convert into a flat index into doubles
-            // To do this we need to know how many items per channel
-            uint64_t deltas[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-            for (size_t i = 1; i != 9; ++i) {
-                // Allowed to fail for channels that don't exist, leaving deltas[i] unchanged
-                li_get(r, LI_COUNT_FOR_INDEX_U64, i, deltas + i, sizeof(uint64_t));
-                // Cumulative sum
-                deltas[i] += deltas[i - 1];
-            }
-            LI_FOR (Replacement, p, &replacements) {
-                if (p->identifier
-                    && (p->identifier[0] == 'c')
-                    && (p->identifier[1] == 'h')
-                    && isdigit(p->identifier[2])
-                    && !p->identifier[3]) {
-                    p->index += deltas[(p->identifier[2] - '0') - 1];
-                    // Index now reflects where channel starts in packed data
-                }
-                assert(p->index < li_array_size(double)(&doubles));
-            }
-            
-            LI_TRUST(li_get(r, LI_HDR_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            LI_TRUST(li_string_resize(&csvHeader, (size_t) bytes - 1, 'x'));
-            LI_TRUST(li_get(r, LI_HDR_STRING_UTF8V, 0, csvHeader, (size_t) bytes));
-            
-            n = fprintf(output, "%s", csvHeader);
-            if (callback)
-                callback(user_ptr, 0, n);
+        if (!q.identifier || !q.format || li_array_push(Replacement)(&self->replacements, q)) {
+            Replacement_dtor(&q);
+            return LI_BAD_ALLOC;
         }
+    }
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, self->output, NULL, NULL);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+    size_t columns = metadata->record_doubles;
+    LI_DOUBT(li_csv_compile(&self->program, &self->replacements, columns, self->options.shortest));
+    return li_csv_pool_start(&self->pool, &self->program, columns, metadata->start_offset, metadata->time_step,
+                             self->options.threads, &self->pipe, &self->out);
+}
 
-        if (csvHeader && csvFmt) {
-            // Try to get all the records for the next time
-            n = 0; // Accumulate bytes written
-            while ((result = li_get(r, LI_RECORD_F64V, 0, li_array_begin(double)(&doubles), li_array_size(double)(&doubles) * sizeof(double))) == LI_SUCCESS) {
-                // Compute the relative time
-                double t = startOffset + timeStep * rows++;
-                if (li_array_empty(Replacement)(&replacements)) {
-                    // There's no format string so print time followed by
-                    // everything
-                    n += fprintf(output, "%.10e", t);
-                    LI_FOR(double, p, &doubles)
-                        n += fprintf(output, ", %.16e", *p);
-                } else {
-                    // We have parsed the format string
-                    
-                    Replacement* p = li_array_begin(Replacement)(&replacements);
-                    for (;;) {
-                        switch (*p->identifier) {
-                            case 't':
-                                n += fprintf(output, p->format, t);
-                                break;
-                            case 'n':
-                                n += fprintf(output, "%lu", rows-1);
-                                break;
-                            case 'c':
-                                n += fprintf(output, p->format, doubles.begin[p->index]);
-                                break;
-                        }
-                        ++p;
-                        if (p == li_array_end(Replacement)(&replacements)) {
-                            break;
-                        } else {
-                            n += fprintf(output, ", ");
-                        }
-                    }
-                }
-                // CR+LF line end
-                n += fprintf(output, "\r\n");
-            }
-            if (callback)
-                callback(user_ptr, 0, n);
-            if (result != LI_SMALL_SRC) {
-                // We left the loop because of a serious error
-                goto cleanup;
-            }
-        }
+static li_status li_csv_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    LI_DOUBT(li_csv_sink_start(self, metadata));
+    base->written += li_csv_printf(&self->pipe, &self->out, "%s", metadata->csv_header);
+    return LI_SUCCESS;
+}
+
+static li_status li_csv_sink_consume(li_sink* base, const double* records, uint64_t row, size_t count) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    size_t columns = self->pool.columns;
+    if (!self->rows)
+        self->pool.rows = row; // Number the rows from the first one converted
+    for (size_t i = 0; i != count; ++i, records += columns) {
+        memcpy(li_csv_pool_record(&self->pool), records, columns * sizeof(double));
+        LI_DOUBT(li_csv_pool_commit(&self->pool, &base->written));
     }
-    REQUIRE_FORMAT(rows);
-    result = LI_SUCCESS;    
-
-cleanup:
-    li_array_dtor(Replacement)(&replacements);
-    li_string_dtor(&csvHeader);
-    li_string_dtor(&csvFmt);
-    li_array_dtor(double)(&doubles);
-    li_array_dtor(li_byte)(&buffer);
-    li_finalize(r);
-    return result;
+    self->rows += count;
+    return LI_SUCCESS;
+}
+
+static li_status li_csv_sink_finish(li_sink* base) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    // Wait for the formatter threads to finish
+    LI_DOUBT(li_csv_pool_finish(&self->pool, &base->written));
+    li_csv_pool_dtor(&self->pool);
+    // Flush whatever we have formatted, then wait for the writer to finish
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    return li_pipeline_dtor(&self->pipe);
+}
+
+// Every row consumed is formatted and written, so the output is whole up to
+// the bytes written
+
+static li_status li_csv_sink_checkpoint(li_sink* base, li_sink_state* state) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    LI_DOUBT(li_csv_pool_finish(&self->pool, &base->written));
+    LI_DOUBT(li_pipeline_flush(&self->pipe, &self->out));
+    LI_DOUBT(li_file_sync(self->output));
+    state->rows = self->rows;
+    state->written = base->written;
+    state->offset = base->written;
+    return LI_SUCCESS;
+}
+
+static li_status li_csv_sink_resume(li_sink* base, const li_metadata* metadata, const li_sink_state* state) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    LI_DOUBT(li_file_resize(self->output, state->offset));
+    if (fseek(self->output, 0, SEEK_END))
+        return LI_IO_ERROR;
+    LI_DOUBT(li_csv_sink_start(self, metadata));
+    self->rows = state->rows;
+    self->pool.rows = state->row;
+    base->written = state->written;
+    return LI_SUCCESS;
 }
 
+static void li_csv_sink_release(li_sink* base) {
+    li_csv_sink* self = (li_csv_sink*) base;
+    li_csv_pool_dtor(&self->pool);
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    li_csv_program_dtor(&self->program);
+    li_array_dtor(Replacement)(&self->replacements);
+    li_dealloc(self);
+}
+
+li_sink* li_csv_sink_new(FILE* output, const li_csv_options* options) {
+    li_csv_sink* self = li_alloc(sizeof(li_csv_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_csv_sink));
+    self->base.begin = li_csv_sink_begin;
+    self->base.consume = li_csv_sink_consume;
+    self->base.finish = li_csv_sink_finish;
+    self->base.checkpoint = li_csv_sink_checkpoint;
+    self->base.resume = li_csv_sink_resume;
+    self->base.release = li_csv_sink_release;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    li_array_ctor(Replacement)(&self->replacements);
+    li_csv_program_ctor(&self->program);
+    li_csv_pool_ctor(&self->pool);
+    return &self->base;
+}
+
+li_status li_source_to_csv(li_source* input,
+                           FILE* output,
+                           const li_csv_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    li_sink* sink = li_csv_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
+    return result;
+}
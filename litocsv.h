@@ -9,10 +9,13 @@
 #ifndef litocsv_h
 #define litocsv_h
 
+#include <stdbool.h>
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint64_t
 
 #include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,6 +32,29 @@ extern "C" {
                         void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
                         void* user_ptr);
 
+    // Options for CSV output.  Zero initialization gives the defaults.
+
+    typedef struct li_csv_options {
+        bool shortest;  // Write data values with the fewest digits that read back exactly
+        size_t threads; // Formatting threads, 0 to choose from the number of processors
+    } li_csv_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_csv(li_source* input,
+                               FILE* output,
+                               const li_csv_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // An li_sink writing CSV to output, for converting to several formats
+    // at once with li_convert.  options may be NULL.  Returns NULL if out of
+    // memory.  The sink supports checkpoints when output is a regular file,
+    // which it resumes by cutting off whatever was written after the
+    // checkpoint and appending.
+
+    li_sink* li_csv_sink_new(FILE* output, const li_csv_options* options);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,223 @@
+//
+//  litolic.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "litolic.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lilic.h"
+#include "liparse.h"
+#include "lipipeline.h"
+#include "lisink.h"
+#include "liutility.h"
+
+li_status li_to_lic(FILE* input,
+                    FILE* output,
+                    void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                    void* user_ptr)
+{
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_lic(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
+
+// LIC output as an li_sink.  Raw fields are gathered row by row until a
+// block is full, then each column of the block is packed straight into the
+// output.  The index is kept until the footer is written at the end.
+
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_lic_options options;
+    const li_metadata* metadata;
+    size_t columns;
+    li_array(li_lic_column) types;
+    uint64_t* block;    // block_rows rows of raw fields
+    size_t filled;      // Rows in block
+    li_queue index;     // li_lic_entry for each packed column
+    uint64_t offset;    // Bytes written
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+    uint64_t rows;
+} li_lic_sink;
+
+static void li_lic_sink_write(li_lic_sink* self, const void* src, size_t count) {
+    const li_byte* p = src;
+    while (count) {
+        li_block* b = self->out;
+        if (b->size == b->capacity) {
+            li_pipeline_submit(&self->pipe, b);
+            b = self->out = li_pipeline_acquire(&self->pipe);
+        }
+        size_t n = MIN(count, b->capacity - b->size);
+        memcpy(b->begin + b->size, p, n);
+        b->size += n;
+        p += n;
+        count -= n;
+    }
+    self->offset += (uint64_t) (p - (const li_byte*) src);
+}
+
+static li_status li_lic_sink_flush(li_lic_sink* self) {
+    size_t rows = self->filled;
+    if (!rows)
+        return LI_SUCCESS;
+    size_t most = li_lic_packed_bytes(rows, 64);
+    for (size_t i = 0; i != self->columns; ++i) {
+        li_block* b = self->out;
+        if (b->capacity - b->size < most) {
+            if (b->size) {
+                li_pipeline_submit(&self->pipe, b);
+                b = self->out = li_pipeline_acquire(&self->pipe);
+            }
+            LI_DOUBT(li_block_reserve(b, most));
+        }
+        li_lic_entry e;
+        bool is_signed = self->types.begin[i].type == 's';
+        size_t n = li_lic_encode(&e, self->block + i, self->columns, rows, is_signed, (uint8_t*) (b->begin + b->size));
+        e.offset = self->offset;
+        LI_DOUBT(li_queue_put(&self->index, &e, sizeof(e)));
+        b->size += n;
+        self->offset += n;
+    }
+    self->filled = 0;
+    return LI_SUCCESS;
+}
+
+static void li_lic_sink_string(li_lic_sink* self, const char* s) {
+    uint64_t n = strlen(s);
+    li_lic_sink_write(self, &n, sizeof(n));
+    li_lic_sink_write(self, s, (size_t) n);
+}
+
+static li_status li_lic_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_lic_sink* self = (li_lic_sink*) base;
+    self->metadata = metadata;
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, self->output, NULL, NULL);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+
+    LI_DOUBT(li_lic_columns(&self->types, metadata->channels));
+    self->columns = metadata->record_doubles;
+    if (li_array_size(li_lic_column)(&self->types) != self->columns)
+        return LI_BAD_FORMAT;
+    if (!self->options.block_rows)
+        self->options.block_rows = LI_LIC_BLOCK_ROWS;
+    self->block = li_alloc(self->options.block_rows * self->columns * sizeof(uint64_t));
+    if (!self->block)
+        return LI_BAD_ALLOC;
+
+    li_lic_sink_write(self, LI_LIC_MAGIC "\0\0\0\0", 8);
+    return LI_SUCCESS;
+}
+
+static li_status li_lic_sink_consume_raw(li_sink* base, const int64_t* fields, uint64_t row, size_t count) {
+    li_lic_sink* self = (li_lic_sink*) base;
+    uint64_t before = self->offset;
+    self->rows += count;
+    while (count) {
+        size_t n = MIN(count, self->options.block_rows - self->filled);
+        memcpy(self->block + self->filled * self->columns, fields, n * self->columns * sizeof(uint64_t));
+        fields += n * self->columns;
+        count -= n;
+        if ((self->filled += n) == self->options.block_rows)
+            LI_DOUBT(li_lic_sink_flush(self));
+    }
+    base->written += self->offset - before;
+    return LI_SUCCESS;
+}
+
+static li_status li_lic_sink_finish(li_sink* base) {
+    li_lic_sink* self = (li_lic_sink*) base;
+    uint64_t before = self->offset;
+    LI_DOUBT(li_lic_sink_flush(self));
+
+    const li_metadata* m = self->metadata;
+    uint64_t footer = self->offset;
+    uint64_t sizes[4] = {
+        self->rows,
+        self->options.block_rows,
+        self->columns,
+        li_array_size(li_metadata_channel)(m->channels)
+    };
+    li_lic_sink_write(self, sizes, sizeof(sizes));
+    li_lic_sink_write(self, &m->time_step, sizeof(double));
+    li_lic_sink_write(self, &m->start_offset, sizeof(double));
+    li_lic_sink_write(self, &m->start_time, sizeof(uint64_t));
+    LI_FOR(li_metadata_channel, c, m->channels) {
+        uint64_t number = (uint64_t) c->number;
+        li_lic_sink_write(self, &number, sizeof(number));
+        li_lic_sink_write(self, &c->calibration, sizeof(double));
+        li_lic_sink_string(self, c->record_format);
+        li_lic_sink_string(self, c->proc_format);
+    }
+    li_lic_sink_string(self, m->csv_format);
+    li_lic_sink_string(self, m->csv_header);
+    li_lic_sink_write(self, li_queue_begin(&self->index), li_queue_size(&self->index));
+    li_lic_sink_write(self, &footer, sizeof(footer));
+    li_lic_sink_write(self, LI_LIC_MAGIC, 4);
+    base->written += self->offset - before;
+
+    // Flush whatever we have written, then wait for the writer to finish
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    return li_pipeline_dtor(&self->pipe);
+}
+
+static void li_lic_sink_release(li_sink* base) {
+    li_lic_sink* self = (li_lic_sink*) base;
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    li_queue_dtor(&self->index);
+    li_dealloc(self->block);
+    li_array_dtor(li_lic_column)(&self->types);
+    li_dealloc(self);
+}
+
+li_sink* li_lic_sink_new(FILE* output, const li_lic_options* options) {
+    li_lic_sink* self = li_alloc(sizeof(li_lic_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_lic_sink));
+    self->base.begin = li_lic_sink_begin;
+    self->base.consume_raw = li_lic_sink_consume_raw;
+    self->base.finish = li_lic_sink_finish;
+    self->base.release = li_lic_sink_release;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    li_array_ctor(li_lic_column)(&self->types);
+    li_queue_ctor(&self->index);
+    return &self->base;
+}
+
+li_status li_source_to_lic(li_source* input,
+                           FILE* output,
+                           const li_lic_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    li_sink* sink = li_lic_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
+    fflush(output);
+    return result;
+}
@@ -0,0 +1,58 @@
+//
+//  litolic.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef litolic_h
+#define litolic_h
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for uint64_t
+
+#include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Read a Liquid Instruments binary log file and write an LIC columnar
+    // archive of its raw fields (see lilic.h), which li_lic_open reads back.
+    // The output is written sequentially and need not be seekable.
+    // Optionally provide a callback that will report whenever bytes are read
+    // from input or written to output.  user_ptr is passed unchanged to the
+    // callback.
+
+    li_status li_to_lic(FILE* input,
+                        FILE* output,
+                        void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                        void* user_ptr);
+
+    // Options for LIC output.  Zero initialization gives the defaults.
+
+    typedef struct li_lic_options {
+        size_t block_rows; // Rows per block, or 0 for LI_LIC_BLOCK_ROWS
+    } li_lic_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_lic(li_source* input,
+                               FILE* output,
+                               const li_lic_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // An li_sink writing an LIC archive to output, for converting to several
+    // formats at once with li_convert.  options may be NULL.  Returns NULL
+    // if out of memory.
+
+    li_sink* li_lic_sink_new(FILE* output, const li_lic_options* options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* litolic_h */
@@ -10,210 +10,79 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
-#include <ctype.h>
 #include <time.h>
 
 #include "lireader.h"
 #include "limatlab.h"
+#include "litomat.h"
 
 #include "liutility.h"
 #include "liparse.h"
+#include "licolumns.h"
+#include "lideflate.h"
+#include "lipipeline.h"
+#include "liplace.h"
+#include "lisink.h"
 
 #define REQUIRE_ALLOC(X) do { if (! X) { result = LI_BAD_ALLOC; LI_ON_ERROR; goto cleanup; } } while(false)
 #define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
-#define CONTINUE_SMALL_AFTER(CLEANUP)  { if (result != LI_SUCCESS) { { CLEANUP; } if (result == LI_SMALL_SRC) continue; else { LI_ON_ERROR; goto cleanup; } } }
+#define REQUIRE_IO(X) do { if (!( X )) { result = LI_IO_ERROR; LI_ON_ERROR; goto cleanup; } } while(false)
 #define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
 
-// .mat format is (roughly speaking) transposed relative to .li format.  To
-// reduce peak memory usage, we do the transpose on disk by appending to a
-// temporary file for each column, then concatenating the temporary files to
-// build the main portion of the .mat file
+// .mat format is (roughly speaking) transposed relative to .li format.  The
+// writer thread receives blocks of whole rows, transposes them, and appends
+// one run of values to each column.  Columns are kept in memory up to a
+// budget and spill to temporary files beyond it, and are concatenated to
+// build the main portion of the .mat file.
 
 typedef struct {
-    FILE* fp;
-} pTF;
+    li_columns columns;
+    li_array(double) column;
+} li_mat_writer;
 
-void pTF_ctor(pTF* self) {
-    assert(self);
-    self->fp = tmpfile();
-}
-
-void pTF_dtor(pTF* self) {
-    assert(self);
-    if (self && self->fp)
-        fclose(self->fp);
+static li_status li_mat_write(void* user, const void* src, size_t count) {
+    li_mat_writer* self = user;
+    size_t columns = li_array_size(li_column)(&self->columns.columns);
+    size_t rows = count / (columns * sizeof(double));
+    assert(rows * columns * sizeof(double) == count);
+    LI_DOUBT(li_array_resize(double)(&self->column, rows, 0.0));
+    const double* values = src;
+    for (size_t j = 0; j != columns; ++j) {
+        double* p = li_array_begin(double)(&self->column);
+        for (size_t i = 0; i != rows; ++i)
+            p[i] = values[i * columns + j];
+        LI_DOUBT(li_columns_append(&self->columns, j, p, rows * sizeof(double)));
+    }
+    return LI_SUCCESS;
 }
 
-li_array_define(pTF);
-
-li_status li_to_mat(FILE* input,
-                    FILE* output,
-                    void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
-                    void* user_ptr)
-{
-
-    // Todo: reduce duplication with li_to_mat
-    
-    li_status result = LI_SUCCESS;
-    
-    li_array(li_byte) buffer;
-    li_array_ctor(li_byte)(&buffer);
-    
-    double timeStep = 0.0;
-    double startOffset = 0.0;
-    
-    li_array(Replacement) replacements;
-    li_array_ctor(Replacement)(&replacements);
-    
-    li_array(double) doubles;
-    li_array_ctor(double)(&doubles);
-    
-    li_string csvFmt;
-    li_string_ctor(&csvFmt);
-    
-    li_string csvHeader;
-    li_string_ctor(&csvHeader);
-    
-    long rows = 0;
-    
-    li_array(pTF) files;
-    li_array_ctor(pTF)(&files);
-
-    li_reader* r = li_init(malloc, free);
-    mat_header* mh = NULL;
-
-    REQUIRE_ALLOC(r);
-    
-    while (!feof(input)) {
-        // Ask the reader how much data it wants to complete the next
-        // section of the file
-        uint64_t n = 0;
-        result = li_get(r, LI_SUGGESTED_PUT_U64, 0, &n, sizeof(n));
-        REQUIRE_SUCCESS;
-
-        if (n > li_array_size(li_byte)(&buffer)) {
-            li_array_resize(li_byte)(&buffer, (size_t) n, 0);
-            REQUIRE_SUCCESS;
-        }
-        
-        // Read up to read_buffer_size bytes from the file, which is at least
-        // as many as suggested, and set n to the bytes actually read
-        n = fread(li_array_begin(li_byte)(&buffer), 1, li_array_size(li_byte)(&buffer), input);
-        if (callback)
-            callback(user_ptr, n, 0);
-        // Give n bytes to the reader
-        result = li_put(r, li_array_begin(li_byte)(&buffer), (size_t) n);
-        REQUIRE_SUCCESS;
+// Add bytes to the size of the element opened with token
 
-        if (li_array_empty(double)(&doubles)) {
-            
-            // As li_reader doesn't parse the header until all of it is
-            // available, if the first get succeeds all following gets for
-            // metadata will succeed.
-            
-            uint64_t bytes = 0;
-            result = li_get(r, LI_RECORD_BYTES_U64, 0, &bytes, sizeof(bytes));
-            CONTINUE_SMALL_AFTER();
-            li_array_resize(double)(&doubles, (size_t) bytes / sizeof(double), 0.0);
-            
-            LI_TRUST(li_get(r, LI_TIME_STEP_F64, 0, &timeStep, sizeof(timeStep)));
-            LI_TRUST(li_get(r, LI_START_OFFSET_F64, 0, &startOffset, sizeof(startOffset)));
-            
-            uint8_t channel_select = 0;
-            LI_TRUST(li_get(r, LI_CHANNEL_SELECT_U8, 0, &channel_select, sizeof(channel_select)));
-            
-            LI_TRUST(li_get(r, LI_FMT_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            LI_TRUST(li_string_resize(&csvFmt, (size_t) bytes - 1, 'x'));
-            LI_TRUST(li_get(r, LI_FMT_STRING_UTF8V, 0, csvFmt, (size_t) bytes));
-            
-            li_array_dtor(Replacement)(&replacements);
-            replacements = li_parse_Replacement_list(csvFmt);
-            // Replacement list is tuples like {"ch2", 3, ".16e"}
-            // We need to convert into a flat index into doubles
-            // To do this we need to know how many items per channel
-            uint64_t deltas[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-            for (size_t i = 1; i != 9; ++i) {
-                // Allowed to fail for channels that don't exist, leaving deltas[i] unchanged
-                li_get(r, LI_COUNT_FOR_INDEX_U64, i, deltas + i, sizeof(uint64_t));
-                // Cumulative sum
-                deltas[i] += deltas[i - 1];
-            }
-            LI_FOR (Replacement, p, &replacements) {
-                if (p->identifier
-                    && (p->identifier[0] == 'c')
-                    && (p->identifier[1] == 'h')
-                    && isdigit(p->identifier[2])
-                    && !p->identifier[3]) {
-                    p->index += deltas[(p->identifier[2] - '0') - 1];
-                    // Index now reflects where channel starts in packed data
-                }
-                assert(p->index < li_array_size(double)(&doubles));
-            }
-            
-            LI_TRUST(li_get(r, LI_HDR_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            li_string_resize(&csvHeader, (size_t) bytes - 1, 'x');
-            LI_TRUST(li_get(r, LI_HDR_STRING_UTF8V, 0, csvHeader, (size_t) bytes));
-            
-            LI_FOR(Replacement, p, &replacements) {
-                pTF f;
-                pTF_ctor(&f);
-                li_array_push(pTF)(&files, f);
-            }
-            
-        }
-        
-        if (li_array_size(double)(&doubles)) {
-            while((result = li_get(r, LI_RECORD_F64V, 0, doubles.begin, li_array_size(double)(&doubles) * sizeof(double))) == LI_SUCCESS) {
-                double t = startOffset + timeStep * (rows++);
-                pTF* iter = files.begin;
-                LI_FOR(Replacement, p, &replacements) {
-                    double d = 123456789;
-                    switch (p->identifier[0]) {
-                        case 't':
-                            d = t;
-                            break;
-                        case 'n':
-                            d = rows - 1;
-                            break;
-                        case 'c':
-                            d = doubles.begin[p->index];
-                            break;
-                        default:
-                            d = 0;
-                            assert(false);
-                            break;
-                    }
-#ifndef NDEBUG
-                    size_t m =
-#endif
-                    fwrite(&d, sizeof(double), 1, (iter++)->fp);
-                    assert(m == 1);
-                    // We don't report I/O with the temporary files to callback
-                }
-            }
-            if (result != LI_SMALL_SRC) // We left the loop because of an error
-                goto cleanup;
-        }
+static void li_mat_grow(FILE* file, long token, uint64_t bytes) {
+    long position = ftell(file);
+    int32_t size = 0;
+    fseek(file, token, SEEK_SET);
+    if (fread(&size, sizeof(size), 1, file) == 1) {
+        size += (int32_t) bytes;
+        fseek(file, token, SEEK_SET);
+        fwrite(&size, sizeof(size), 1, file);
     }
-    REQUIRE_FORMAT(rows);
-    // We finished the file and read at least one row
-    result = LI_SUCCESS;
+    fseek(file, position, SEEK_SET);
+}
 
-    // to report incremental progress in file we use ftell
-    long old_offset = 0;
-    long new_offset = 0;
-    
-    mh = mat_header_new(csvHeader);
-    REQUIRE_ALLOC(mh);
-    fwrite(mh, sizeof(mat_header), 1, output);
+// Write the moku variable, leaving out the values of Moku.data but sizing
+// the elements that hold them, so the variable is complete once data_bytes
+// are inserted at *hole.  data_bytes is a multiple of 8, so no padding
+// changes.
 
-    long token = mat_element_open(output, miMATRIX);
-    mat_array_write_flags(output, mxSTRUCT_CLASS);
-    mat_array_write_dims2(output, 1, 1);
-    mat_array_write_name(output, "moku");
+static void li_mat_moku(FILE* file, li_string csvHeader, long rows, size_t columns, uint64_t data_bytes, long* hole) {
+    long token = mat_element_open(file, miMATRIX);
+    mat_array_write_flags(file, mxSTRUCT_CLASS);
+    mat_array_write_dims2(file, 1, 1);
+    mat_array_write_name(file, "moku");
 #define FIELD_NAME_LENGTH 16
     int32_t length = FIELD_NAME_LENGTH;
-    mat_array_write(output, miINT32, sizeof(length), &length);
+    mat_array_write(file, miINT32, sizeof(length), &length);
     char fields[][FIELD_NAME_LENGTH] = {
         "comment",
         "data",
@@ -221,63 +90,36 @@ li_status li_to_mat(FILE* input,
         "version",
         "timestamp"
     };
-    mat_array_write(output, miINT8, sizeof(fields), fields);
+    mat_array_write(file, miINT8, sizeof(fields), fields);
     
     
     // Moku.comment
     {
-        mat_matrix_write_utf8(output, csvHeader);
+        mat_matrix_write_utf8(file, csvHeader);
     }
 
-    if (callback) {
-        new_offset = ftell(output);
-        callback(user_ptr, 0, new_offset - old_offset);
-        old_offset = new_offset;
-    }
-
-    size_t columns = li_array_size(pTF)(&files);
-
     // Moku.data
     {
-        long token2 = mat_element_open(output, miMATRIX);
-        mat_array_write_flags(output, mxDOUBLE_CLASS);
-        mat_array_write_dims2(output, (int32_t) rows, (int32_t) columns);
-        mat_array_write_name(output, "");
+        long token2 = mat_element_open(file, miMATRIX);
+        mat_array_write_flags(file, mxDOUBLE_CLASS);
+        mat_array_write_dims2(file, (int32_t) rows, (int32_t) columns);
+        mat_array_write_name(file, "");
         {
-            long token3 = mat_element_open(output, miDOUBLE);
-            
-            LI_FOR (pTF, p, &files) {
-                fseek(p->fp, 0, SEEK_SET);
-                for (int j = 0; j != rows; ++j) {
-                    // append the column to the output one value at a time
-                    double value;
-#ifndef NDEBUG
-                    size_t n =
-#endif
-                    fread(&value, sizeof(double), 1, p->fp);
-                    assert(n == 1);
-                    fwrite(&value, sizeof(double), 1, output);
-                }
-                // Close early to reduce maximum footprint on disk
-                fclose(p->fp);
-                p->fp = 0;
-                if (callback) {
-                    new_offset = ftell(output);
-                    callback(user_ptr, 0, new_offset - old_offset);
-                    old_offset = new_offset;
-                }
-            }
-            mat_element_close(output, token3);
+            long token3 = mat_element_open(file, miDOUBLE);
+            *hole = ftell(file);
+            mat_element_close(file, token3);
+            li_mat_grow(file, token3, data_bytes);
         }
-        mat_element_close(output, token2);
+        mat_element_close(file, token2);
+        li_mat_grow(file, token2, data_bytes);
     }
     
     // Moku.legend
     {
-        long token2 = mat_element_open(output, miMATRIX);
-        mat_array_write_flags(output, mxCELL_CLASS);
-        mat_array_write_dims1(output, (int32_t) columns);
-        mat_array_write_name(output, "");
+        long token2 = mat_element_open(file, miMATRIX);
+        mat_array_write_flags(file, mxCELL_CLASS);
+        mat_array_write_dims1(file, (int32_t) columns);
+        mat_array_write_name(file, "");
 
         // Assumes header is something like
         // % Free text
@@ -302,44 +144,445 @@ li_status li_to_mat(FILE* input,
         while (li_array_size(li_string)(&names) < columns)
             li_array_push(li_string)(&names, li_string_copy("?"));
         for (size_t i = 0; i != columns; ++i)
-            mat_matrix_write_utf8(output, names.begin[i]);
+            mat_matrix_write_utf8(file, names.begin[i]);
         li_array_dtor(li_string)(&names);
-        mat_element_close(output, token2);
+        mat_element_close(file, token2);
     }
     
     // Moku.version
     {
-        mat_matrix_write_utf8(output, li_version_string());
+        mat_matrix_write_utf8(file, li_version_string());
     }
     
     // Moku.timestamp
     {
-        time_t t = time(NULL);
+        struct tm local;
 #       define N 64
-        char buf[N];
-        strftime(buf, N, "%Y-%m-%d T %H:%M:%S %z", localtime(&t));
-        mat_matrix_write_utf8(output, buf);
+        char buf[N] = "";
+        if (li_localtime(time(NULL), &local))
+            strftime(buf, N, "%Y-%m-%d T %H:%M:%S %z", &local);
+        mat_matrix_write_utf8(file, buf);
+    }
+    
+    mat_element_close(file, token); // close the mat_struct
+    li_mat_grow(file, token, data_bytes);
+}
+
+static li_status li_mat_fwrite(void* user, const void* src, size_t count) {
+    return (fwrite(src, 1, count, (FILE*) user) == count) ? LI_SUCCESS : LI_IO_ERROR;
+}
+
+// Pass bytes [begin, end) of a file to a write function
+
+static li_status li_mat_copy(FILE* file, long begin, long end, li_write_function write, void* user) {
+    char buffer[4096];
+    if (fseek(file, begin, SEEK_SET))
+        return LI_IO_ERROR;
+    while (begin != end) {
+        size_t n = fread(buffer, 1, (size_t) MIN(end - begin, (long) sizeof(buffer)), file);
+        if (!n)
+            return LI_IO_ERROR;
+        LI_DOUBT(write(user, buffer, n));
+        begin += (long) n;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_to_mat(FILE* input,
+                    FILE* output,
+                    void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                    void* user_ptr)
+{
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_mat(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
+
+// Write to a file with positioned writes, advancing through it
+
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+} li_mat_pwriter;
+
+static li_status li_mat_pwrite(void* user, const void* src, size_t count) {
+    li_mat_pwriter* self = user;
+    LI_DOUBT(li_file_pwrite(self->file, src, count, self->offset));
+    self->offset += count;
+    return LI_SUCCESS;
+}
+
+// MAT output as an li_sink.  Rows are transposed into columns on the writer
+// thread of a pipeline, and the file is written once all the rows are known.
+// If they are known at the start, each column has a fixed place in the
+// file, so instead we write everything else first and let a pool of
+// threads write each block of rows into the columns.
+
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_mat_options options;
+    const li_metadata* metadata;
+    li_mat_writer writer;
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+    long rows;
+    bool placed;
+    li_placer placer;
+    uint64_t first_row;
+    uint64_t data_offset;  // Of the first column in output
+} li_mat_sink;
+
+static li_status li_mat_place(void* user, li_block* scratch, const double* records, uint64_t row, size_t count) {
+    li_mat_sink* self = user;
+    size_t columns = self->metadata->columns;
+    size_t record_doubles = self->metadata->record_doubles;
+    LI_DOUBT(li_block_reserve(scratch, (columns + 1) * count * sizeof(double)));
+    double* values = (double*) scratch->begin; // The rows
+    double* column = values + count * columns; // One column of them
+    for (size_t i = 0; i != count; ++i, records += record_doubles)
+        li_metadata_row(self->metadata, records, row + i, values + i * columns);
+    for (size_t j = 0; j != columns; ++j) {
+        for (size_t i = 0; i != count; ++i)
+            column[i] = values[i * columns + j];
+        uint64_t offset = self->data_offset + (j * self->metadata->rows + (row - self->first_row)) * sizeof(double);
+        LI_DOUBT(li_file_pwrite(self->output, column, count * sizeof(double), offset));
+    }
+    return LI_SUCCESS;
+}
+
+// Size the file and write all but the data, leaving the columns to be placed.
+// When resuming that was done before the checkpoint, and is only laid out
+// again, keeping the time the conversion began.
+
+static li_status li_mat_sink_place_begin(li_mat_sink* self, bool resuming) {
+    FILE* output = self->output;
+    li_string csvHeader = (li_string) self->metadata->csv_header;
+    uint64_t rows = self->metadata->rows;
+    size_t columns = self->metadata->columns;
+    uint64_t data_bytes = rows * columns * sizeof(double);
+    li_status result = LI_SUCCESS;
+
+    mat_header* mh = mat_header_new(csvHeader);
+    FILE* moku = NULL;
+    REQUIRE_ALLOC(mh);
+
+    // The rest of the variable is small, so build it first
+    moku = tmpfile();
+    REQUIRE_IO(moku);
+    long hole = 0;
+    li_mat_moku(moku, csvHeader, (long) rows, columns, data_bytes, &hole);
+    long moku_bytes = ftell(moku);
+    REQUIRE_IO(!ferror(moku) && (moku_bytes >= hole));
+
+    uint64_t moku_offset = sizeof(mat_header);
+    self->data_offset = moku_offset + (uint64_t) hole;
+    self->base.written += moku_offset + (uint64_t) moku_bytes;
+    if (!resuming) {
+        result = li_file_resize(output, moku_offset + (uint64_t) moku_bytes + data_bytes);
+        REQUIRE_SUCCESS;
+        result = li_file_pwrite(output, mh, sizeof(mat_header), 0);
+        REQUIRE_SUCCESS;
+        li_mat_pwriter writer = { output, moku_offset };
+        result = li_mat_copy(moku, 0, hole, li_mat_pwrite, &writer);
+        REQUIRE_SUCCESS;
+        writer.offset += data_bytes;
+        result = li_mat_copy(moku, hole, moku_bytes, li_mat_pwrite, &writer);
+        REQUIRE_SUCCESS;
+    }
+
+    self->placed = true;
+    result = li_placer_start(&self->placer, self->options.threads, self->metadata->record_doubles, li_mat_place, self);
+
+cleanup:
+    if (moku)
+        fclose(moku);
+    mat_header_delete(mh);
+    return result;
+}
+
+// Input ended early, so move each column up to where the rows we have put
+// it, write the variable again with their number, and cut off the rest.
+// Only sizes change in the variable, so the data starts where it did.
+
+static li_status li_mat_sink_shrink(li_mat_sink* self) {
+    FILE* output = self->output;
+    li_string csvHeader = (li_string) self->metadata->csv_header;
+    uint64_t rows = (uint64_t) self->rows;
+    size_t columns = self->metadata->columns;
+    uint64_t column_bytes = rows * sizeof(double);
+    uint64_t data_bytes = column_bytes * columns;
+    li_status result = LI_SUCCESS;
+
+    li_block buffer = { 0 };
+    FILE* moku = tmpfile();
+    REQUIRE_IO(moku);
+    long hole = 0;
+    li_mat_moku(moku, csvHeader, (long) rows, columns, data_bytes, &hole);
+    long moku_bytes = ftell(moku);
+    REQUIRE_IO(!ferror(moku) && (moku_bytes >= hole));
+    uint64_t moku_offset = sizeof(mat_header);
+    REQUIRE_FORMAT(moku_offset + (uint64_t) hole == self->data_offset);
+
+    // Columns only move towards the start, so copying each in order from
+    // its start never overwrites what is still to be read
+    result = li_block_ctor(&buffer, (size_t) 1 << 20);
+    REQUIRE_SUCCESS;
+    for (size_t j = 1; j < columns; ++j) {
+        uint64_t from = self->data_offset + j * self->metadata->rows * sizeof(double);
+        uint64_t to = self->data_offset + j * column_bytes;
+        for (uint64_t done = 0; done != column_bytes; ) {
+            size_t n = (size_t) MIN(column_bytes - done, (uint64_t) buffer.capacity);
+            result = li_file_pread(output, buffer.begin, n, from + done);
+            REQUIRE_SUCCESS;
+            result = li_file_pwrite(output, buffer.begin, n, to + done);
+            REQUIRE_SUCCESS;
+            done += n;
+        }
+    }
+
+    li_mat_pwriter writer = { output, moku_offset };
+    result = li_mat_copy(moku, 0, hole, li_mat_pwrite, &writer);
+    REQUIRE_SUCCESS;
+    writer.offset += data_bytes;
+    result = li_mat_copy(moku, hole, moku_bytes, li_mat_pwrite, &writer);
+    REQUIRE_SUCCESS;
+    result = li_file_resize(output, writer.offset);
+
+cleanup:
+    li_block_dtor(&buffer);
+    if (moku)
+        fclose(moku);
+    return result;
+}
+
+static li_status li_mat_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    self->metadata = metadata;
+    if (metadata->rows && !self->options.level && (metadata->rows <= INT32_MAX)
+        && li_file_placeable(self->output))
+        return li_mat_sink_place_begin(self, false);
+    li_columns_dtor(&self->writer.columns);
+    LI_DOUBT(li_columns_ctor(&self->writer.columns, metadata->columns, self->options.memory));
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, NULL, li_mat_write, &self->writer);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+    return LI_SUCCESS;
+}
+
+static li_status li_mat_sink_consume(li_sink* base, const double* records, uint64_t row, size_t count) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    size_t row_bytes = self->metadata->columns * sizeof(double);
+    size_t record_doubles = self->metadata->record_doubles;
+    if (self->placed) {
+        if (!self->rows)
+            self->first_row = row;
+        if (row - self->first_row + count > self->metadata->rows)
+            return LI_BAD_FORMAT;
+        LI_DOUBT(li_placer_put(&self->placer, records, row, count));
+        self->rows += (long) count;
+        base->written += count * row_bytes;
+        return LI_SUCCESS;
     }
+    for (size_t i = 0; i != count; ++i, records += record_doubles) {
+        // Blocks hold whole rows
+        li_block* out = self->out;
+        if (out->capacity - out->size < row_bytes) {
+            if (out->size) {
+                li_pipeline_submit(&self->pipe, out);
+                out = self->out = li_pipeline_acquire(&self->pipe);
+            }
+            LI_DOUBT(li_block_reserve(out, row_bytes));
+        }
+        li_metadata_row(self->metadata, records, row + i, (double*) (out->begin + out->size));
+        out->size += row_bytes;
+        // We don't report I/O with the temporary files to callback
+    }
+    self->rows += (long) count;
+    return LI_SUCCESS;
+}
+
+static li_status li_mat_sink_finish(li_sink* base) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    if (self->placed) {
+        // The layout was fixed by the number of rows, which input may not
+        // have had
+        LI_DOUBT(li_placer_finish(&self->placer));
+        if ((uint64_t) self->rows == self->metadata->rows)
+            return LI_SUCCESS;
+        return li_mat_sink_shrink(self);
+    }
+    li_mat_writer* writer = &self->writer;
+    FILE* output = self->output;
+    const li_mat_options* options = &self->options;
+    li_string csvHeader = (li_string) self->metadata->csv_header;
+    long rows = self->rows;
+
+    mat_header* mh = NULL;
+    FILE* moku = NULL;
+    li_deflate deflate;
+    memset(&deflate, 0, sizeof(deflate));
+
+    // Wait for the writer to finish filling the temporary files
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    li_status result = li_pipeline_dtor(&self->pipe);
+    REQUIRE_SUCCESS;
+
+    // to report incremental progress in file we use ftell
+    long old_offset = 0;
+    long new_offset = 0;
     
-    mat_element_close(output, token); // close the mat_struct
+    mh = mat_header_new(csvHeader);
+    REQUIRE_ALLOC(mh);
+    fwrite(mh, sizeof(mat_header), 1, output);
+
+    size_t columns = li_array_size(li_column)(&writer->columns.columns);
+    uint64_t data_bytes = (uint64_t) rows * columns * sizeof(double);
+
+    // The rest of the variable is small, so build it first
+    moku = tmpfile();
+    REQUIRE_IO(moku);
+    long hole = 0;
+    li_mat_moku(moku, csvHeader, rows, columns, data_bytes, &hole);
+    long moku_bytes = ftell(moku);
+
+    // Either write the variable directly, or compress it into an miCOMPRESSED
+    // element as it is written
+    int level = options->level;
+    long compressed_token = 0;
+    li_write_function write = li_mat_fwrite;
+    void* user = output;
+    if (level) {
+        compressed_token = mat_element_open(output, miCOMPRESSED);
+        result = li_deflate_ctor(&deflate, level, LI_DEFLATE_ZLIB, options->threads, li_mat_fwrite, output);
+        REQUIRE_SUCCESS;
+        write = li_deflate_write;
+        user = &deflate;
+    }
 
-    if (callback) {
+    result = li_mat_copy(moku, 0, hole, write, user);
+    REQUIRE_SUCCESS;
+    for (size_t j = 0; j != columns; ++j) {
+        assert(li_columns_size(&writer->columns, j) == rows * sizeof(double));
+        if (level)
+            result = li_columns_read(&writer->columns, j, write, user);
+        else
+            result = li_columns_write(&writer->columns, j, output);
+        REQUIRE_SUCCESS;
+        // Release early to reduce maximum footprint
+        li_columns_release(&writer->columns, j);
         new_offset = ftell(output);
-        callback(user_ptr, 0, new_offset - old_offset);
+        base->written += new_offset - old_offset;
         old_offset = new_offset;
     }
+    result = li_mat_copy(moku, hole, moku_bytes, write, user);
+    REQUIRE_SUCCESS;
 
-cleanup:
+    if (level) {
+        result = li_deflate_finish(&deflate);
+        REQUIRE_SUCCESS;
+        // Compressed elements are not padded
+        long position = ftell(output);
+        int32_t size = (int32_t) deflate.bytes_out;
+        fseek(output, compressed_token, SEEK_SET);
+        fwrite(&size, sizeof(size), 1, output);
+        fseek(output, position, SEEK_SET);
+    }
+    REQUIRE_IO(!ferror(output));
 
+    new_offset = ftell(output);
+    base->written += new_offset - old_offset;
+
+cleanup:
+    li_deflate_dtor(&deflate);
+    if (moku)
+        fclose(moku);
     mat_header_delete(mh);
-    li_array_dtor(pTF)(&files);
-    li_array_dtor(Replacement)(&replacements);
-    li_string_dtor(&csvHeader);
-    li_string_dtor(&csvFmt);
-    li_array_dtor(double)(&doubles);
-    li_array_dtor(li_byte)(&buffer);
-    li_finalize(r);
-    
+    return result;
+}
+
+// Only placed output can be checkpointed; otherwise the columns are in
+// temporary files that don't outlive the process
+
+static li_status li_mat_sink_checkpoint(li_sink* base, li_sink_state* state) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    if (!self->placed)
+        return LI_UNIMPLEMENTED;
+    LI_DOUBT(li_placer_flush(&self->placer));
+    LI_DOUBT(li_file_sync(self->output));
+    state->rows = (uint64_t) self->rows;
+    state->written = base->written;
+    state->token = self->data_offset;
+    return LI_SUCCESS;
+}
+
+static li_status li_mat_sink_resume(li_sink* base, const li_metadata* metadata, const li_sink_state* state) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    self->metadata = metadata;
+    if (!metadata->rows || self->options.level || (metadata->rows > INT32_MAX)
+        || !li_file_placeable(self->output))
+        return LI_UNIMPLEMENTED;
+    LI_DOUBT(li_mat_sink_place_begin(self, true));
+    if (self->data_offset != state->token)
+        return LI_BAD_FORMAT;
+    self->rows = (long) state->rows;
+    self->first_row = state->row - state->rows;
+    base->written = state->written;
+    return LI_SUCCESS;
+}
+
+static void li_mat_sink_release(li_sink* base) {
+    li_mat_sink* self = (li_mat_sink*) base;
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    li_placer_dtor(&self->placer);
+    li_array_dtor(double)(&self->writer.column);
+    li_columns_dtor(&self->writer.columns);
+    li_dealloc(self);
+}
+
+li_sink* li_mat_sink_new(FILE* output, const li_mat_options* options) {
+    li_mat_sink* self = li_alloc(sizeof(li_mat_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_mat_sink));
+    self->base.begin = li_mat_sink_begin;
+    self->base.consume = li_mat_sink_consume;
+    self->base.finish = li_mat_sink_finish;
+    self->base.checkpoint = li_mat_sink_checkpoint;
+    self->base.resume = li_mat_sink_resume;
+    self->base.release = li_mat_sink_release;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    li_columns_ctor(&self->writer.columns, 0, 0);
+    li_array_ctor(double)(&self->writer.column);
+    li_placer_ctor(&self->placer);
+    return &self->base;
+}
+
+li_status li_source_to_mat(li_source* input,
+                           FILE* output,
+                           const li_mat_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    li_sink* sink = li_mat_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
+
     fflush(output);
     
     // Read the file back
@@ -347,5 +590,4 @@ cleanup:
     // mat_file_print(output);
     
     return result;
-    
 }
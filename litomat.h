@@ -13,6 +13,8 @@
 #include <stdint.h> // for uint64_t
 
 #include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,6 +28,37 @@ extern "C" {
                         FILE* output,
                         void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
                         void* user_ptr);
+
+    // Options for MAT output.  Zero initialization gives the defaults.
+
+    typedef struct li_mat_options {
+        size_t memory;  // Bytes of memory for transposing before spilling to
+                        // temporary files, or 0 for the default
+        int level;      // zlib compression level 1-9 to write the variable
+                        // as an miCOMPRESSED element, or 0 to not compress
+        size_t threads; // Compression threads, or threads writing columns
+                        // in place (see below), or 0 for all processors
+    } li_mat_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_mat(li_source* input,
+                               FILE* output,
+                               const li_mat_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // An li_sink writing a MAT-file to output, for converting to several
+    // formats at once with li_convert.  output must be seekable.  options
+    // may be NULL.  Returns NULL if out of memory.  When li_convert knows
+    // how many rows there will be, output is a regular file and the
+    // variable is not compressed, the file is sized up front and blocks of
+    // rows are written straight into each column by several threads,
+    // instead of being gathered in temporary files and copied at the end.
+    // Only then does the sink support checkpoints; otherwise checkpoint
+    // returns LI_UNIMPLEMENTED.
+
+    li_sink* li_mat_sink_new(FILE* output, const li_mat_options* options);
     
     
 #ifdef __cplusplus
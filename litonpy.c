@@ -10,196 +10,344 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
-#include <ctype.h>
-#include <time.h>
 
 #include "lireader.h"
+#include "litonpy.h"
 
 #include "liutility.h"
 #include "liparse.h"
+#include "lipipeline.h"
+#include "liplace.h"
+#include "lisink.h"
 
-#define REQUIRE_ALLOC(X) do { if (! X) { result = LI_BAD_ALLOC; LI_ON_ERROR; goto cleanup; } } while(false)
-#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
-#define CONTINUE_SMALL_AFTER(CLEANUP)  { if (result != LI_SUCCESS) { { CLEANUP; } if (result == LI_SMALL_SRC) continue; else { LI_ON_ERROR; goto cleanup; } } }
-#define REQUIRE_FORMAT(X) do { if (!( X )) { result = LI_BAD_FORMAT; LI_ON_ERROR; goto cleanup; } } while(false)
+size_t li_npy_header(char* dest,
+                     size_t total,
+                     const char* descr,
+                     uint64_t rows,
+                     size_t columns)
+{
+    char shape[64];
+    if (columns)
+        snprintf(shape, sizeof(shape), "(%llu, %llu)", (unsigned long long) rows, (unsigned long long) columns);
+    else
+        snprintf(shape, sizeof(shape), "(%llu,)", (unsigned long long) rows);
+    const char* format = "{'descr': %s, 'fortran_order': False, 'shape': %s, }";
+    size_t n = (size_t) snprintf(NULL, 0, format, descr, shape);
+    
+    // Magic, version and length, then the dictionary terminated by a newline
+    size_t prefix = 10;
+    size_t needed = (prefix + n + 1 + LI_NPY_ALIGN - 1) / LI_NPY_ALIGN * LI_NPY_ALIGN;
+    if (needed - prefix > 0xFFFF) {
+        prefix = 12;
+        needed = (prefix + n + 1 + LI_NPY_ALIGN - 1) / LI_NPY_ALIGN * LI_NPY_ALIGN;
+    }
+    if (needed > total)
+        return needed;
+    
+    size_t length = total - 10;
+    memcpy(dest, "\x93NUMPY\x01\x00", 8);
+    if (length > 0xFFFF) {
+        prefix = 12;
+        length = total - prefix;
+        dest[6] = 2;
+        for (int i = 0; i != 4; ++i)
+            dest[8 + i] = (char) (length >> (8 * i));
+    } else {
+        prefix = 10;
+        dest[8] = (char) length;
+        dest[9] = (char) (length >> 8);
+    }
+    // snprintf needs room for its terminator, which we then overwrite
+    snprintf(dest + prefix, total - prefix, format, descr, shape);
+    memset(dest + prefix + n, ' ', total - prefix - n - 1);
+    dest[total - 1] = '\n';
+    return total;
+}
 
 li_status li_to_npy(FILE* input,
                     FILE* output,
                     void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
                     void* user_ptr)
 {
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_npy(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
 
-    // Todo: reduce duplication with li_to_mat
-    
-    li_status result = LI_SUCCESS;
-    
-    li_array(li_byte) buffer;
-    li_array_ctor(li_byte)(&buffer);
-    
-    double timeStep = 0.0;
-    double startOffset = 0.0;
-    
-    li_array(Replacement) replacements;
-    li_array_ctor(Replacement)(&replacements);
-    
-    li_array(double) doubles;
-    li_array_ctor(double)(&doubles);
-    
-    li_string csvFmt;
-    li_string_ctor(&csvFmt);
-    
-    li_string csvHeader;
-    li_string_ctor(&csvHeader);
-    
-    long rows = 0;
+// Append s to dest as the body of a Python string literal, escaping quotes
+// and replacing anything outside printable ASCII
 
-    li_reader* r = li_init(malloc, free);
+static li_status li_npy_quote(li_queue* dest, const char* begin, const char* end) {
+    for (; begin != end; ++begin) {
+        char c = *begin;
+        if ((c == '\'') || (c == '\\'))
+            LI_DOUBT(li_queue_put(dest, "\\", 1));
+        if ((c < ' ') || (c > '~'))
+            c = '_';
+        LI_DOUBT(li_queue_put(dest, &c, 1));
+    }
+    return LI_SUCCESS;
+}
 
-    REQUIRE_ALLOC(r);
+// Build the dtype descr as a null-terminated string.  For a structured array
+// the field names come from the CSV header.
 
-#define NPY_HDR_SIZE 96
-    // We need to know rows and columns to write the .npy header, so skip over it
-    fseek(output, NPY_HDR_SIZE, SEEK_SET);
+static li_status li_npy_descr(li_queue* dest, const char* csvHeader, size_t columns, bool structured) {
+    li_queue_clear(dest);
+    if (!structured)
+        return li_queue_put(dest, "'<f8'", 6);
 
-    while (!feof(input)) {
-        // Ask the reader how much data it wants to complete the next
-        // section of the file
-        uint64_t n = 0;
-        result = li_get(r, LI_SUGGESTED_PUT_U64, 0, &n, sizeof(n));
-        REQUIRE_SUCCESS;
+    li_queue names; // Each name is followed by a null
+    li_queue_ctor(&names);
+    li_status result = li_parse_header_names(&names, csvHeader, columns);
+    if (result == LI_SUCCESS)
+        result = li_queue_put(dest, "[", 1);
+    const char* name = li_queue_begin(&names);
+    for (size_t i = 0; (i != columns) && (result == LI_SUCCESS); ++i, name += strlen(name) + 1) {
+        if (i)
+            result = li_queue_put(dest, ", ", 2);
+        if (result == LI_SUCCESS)
+            result = li_queue_put(dest, "('", 2);
+        if (result == LI_SUCCESS)
+            result = li_npy_quote(dest, name, name + strlen(name));
+        if (result == LI_SUCCESS)
+            result = li_queue_put(dest, "', '<f8')", 9);
+    }
+    li_queue_dtor(&names);
+    LI_DOUBT(result);
+    return li_queue_put(dest, "]", 2);
+}
 
-        if (n > li_array_size(li_byte)(&buffer)) {
-            li_array_resize(li_byte)(&buffer, (size_t) n, 0);
-            REQUIRE_SUCCESS;
-        }
-        
-        // Read up to read_buffer_size bytes from the file, which is at least
-        // as many as suggested, and set n to the bytes actually read
-        n = fread(li_array_begin(li_byte)(&buffer), 1, li_array_size(li_byte)(&buffer), input);
-        if (callback)
-            callback(user_ptr, n, 0);
-        // Give n bytes to the reader
-        result = li_put(r, li_array_begin(li_byte)(&buffer), (size_t) n);
-        REQUIRE_SUCCESS;
-
-        if (li_array_empty(double)(&doubles)) {
-            
-            // As li_reader doesn't parse the header until all of it is
-            // available, if the first get succeeds all following gets for
-            // metadata will succeed.
-            
-            uint64_t bytes = 0;
-            result = li_get(r, LI_RECORD_BYTES_U64, 0, &bytes, sizeof(bytes));
-            CONTINUE_SMALL_AFTER();
-            li_array_resize(double)(&doubles, (size_t) bytes / sizeof(double), 0.0);
-            
-            LI_TRUST(li_get(r, LI_TIME_STEP_F64, 0, &timeStep, sizeof(timeStep)));
-            LI_TRUST(li_get(r, LI_START_OFFSET_F64, 0, &startOffset, sizeof(startOffset)));
-            
-            uint8_t channel_select = 0;
-            LI_TRUST(li_get(r, LI_CHANNEL_SELECT_U8, 0, &channel_select, sizeof(channel_select)));
-            
-            LI_TRUST(li_get(r, LI_FMT_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            LI_TRUST(li_string_resize(&csvFmt, (size_t) bytes - 1, 'x'));
-            LI_TRUST(li_get(r, LI_FMT_STRING_UTF8V, 0, csvFmt, (size_t) bytes));
-            
-            li_array_dtor(Replacement)(&replacements);
-            replacements = li_parse_Replacement_list(csvFmt);
-            // Replacement list is tuples like {"ch2", 3, ".16e"}
-            // We need to convert into a flat index into doubles
-            // To do this we need to know how many items per channel
-            uint64_t deltas[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-            for (size_t i = 1; i != 9; ++i) {
-                // Allowed to fail for channels that don't exist, leaving deltas[i] unchanged
-                li_get(r, LI_COUNT_FOR_INDEX_U64, i, deltas + i, sizeof(uint64_t));
-                // Cumulative sum
-                deltas[i] += deltas[i - 1];
-            }
-            LI_FOR (Replacement, p, &replacements) {
-                if (p->identifier
-                    && (p->identifier[0] == 'c')
-                    && (p->identifier[1] == 'h')
-                    && isdigit(p->identifier[2])
-                    && !p->identifier[3]) {
-                    p->index += deltas[(p->identifier[2] - '0') - 1];
-                    // Index now reflects where channel starts in packed data
-                }
-                assert(p->index < li_array_size(double)(&doubles));
-            }
-            
-            LI_TRUST(li_get(r, LI_HDR_STRING_BYTES_U64, 0, &bytes, sizeof(bytes)));
-            li_string_resize(&csvHeader, (size_t) bytes - 1, 'x');
-            LI_TRUST(li_get(r, LI_HDR_STRING_UTF8V, 0, csvHeader, (size_t) bytes));
+// NPY output as an li_sink.  We need to know the number of rows to write
+// the header, so we write a placeholder with room for any number and
+// rewrite it at the end.  If the number of rows is known at the start,
+// the data has a fixed place in the file, so instead we size the file and
+// let a pool of threads write each block of rows at its offset.
 
-        }
-        
-        if (li_array_size(double)(&doubles)) {
-            long bytes_written = 0;
-            while((result = li_get(r, LI_RECORD_F64V, 0, doubles.begin, li_array_size(double)(&doubles) * sizeof(double))) == LI_SUCCESS) {
-                double t = startOffset + timeStep * (rows++);
-                LI_FOR(Replacement, p, &replacements) {
-                    double d = 123456789;
-                    switch (p->identifier[0]) {
-                        case 't':
-                            d = t;
-                            break;
-                        case 'n':
-                            d = rows - 1;
-                            break;
-                        case 'c':
-                            d = doubles.begin[p->index];
-                            break;
-                        default:
-                            d = 0;
-                            assert(false);
-                            break;
-                    }
-#ifndef NDEBUG
-                    size_t m =
-#endif
-                    fwrite(&d, sizeof(double), 1, output);
-                    assert(m == 1);
-                    bytes_written += sizeof(double);
-                    // We don't report I/O with the temporary files to callback
-                }
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_npy_options options;
+    const li_metadata* metadata;
+    size_t columns;
+    li_queue descr;
+    char* header;
+    size_t header_size;
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+    uint64_t rows;
+    bool placed;
+    li_placer placer;
+    uint64_t first_row;
+} li_npy_sink;
+
+static li_status li_npy_place(void* user, li_block* scratch, const double* records, uint64_t row, size_t count) {
+    li_npy_sink* self = user;
+    size_t row_bytes = self->columns * sizeof(double);
+    size_t record_doubles = self->metadata->record_doubles;
+    LI_DOUBT(li_block_reserve(scratch, count * row_bytes));
+    double* dest = (double*) scratch->begin;
+    for (size_t i = 0; i != count; ++i, records += record_doubles, dest += self->columns)
+        li_metadata_row(self->metadata, records, row + i, dest);
+    uint64_t offset = self->header_size + (row - self->first_row) * row_bytes;
+    return li_file_pwrite(self->output, scratch->begin, count * row_bytes, offset);
+}
+
+// Work out the layout of the file from the metadata, as begin and resume
+// both need
+
+static li_status li_npy_sink_layout(li_npy_sink* self, const li_metadata* metadata) {
+    self->metadata = metadata;
+    self->columns = metadata->columns;
+    bool structured = self->options.structured;
+    LI_DOUBT(li_npy_descr(&self->descr, metadata->csv_header, self->columns, structured));
+    size_t columns = structured ? 0 : self->columns; // A 1-D array of records
+    self->header_size = li_npy_header(NULL, 0, li_queue_begin(&self->descr), UINT64_MAX, columns);
+    self->header = li_alloc(self->header_size);
+    if (!self->header)
+        return LI_BAD_ALLOC;
+    self->placed = metadata->rows && li_file_placeable(self->output);
+    return LI_SUCCESS;
+}
+
+// Size the file for every row and start placing them
+
+static li_status li_npy_sink_place(li_npy_sink* self) {
+    li_npy_header(self->header, self->header_size, li_queue_begin(&self->descr), self->metadata->rows,
+                  self->options.structured ? 0 : self->columns);
+    uint64_t data_bytes = self->metadata->rows * self->columns * sizeof(double);
+    LI_DOUBT(li_file_resize(self->output, self->header_size + data_bytes));
+    LI_DOUBT(li_file_pwrite(self->output, self->header, self->header_size, 0));
+    return li_placer_start(&self->placer, self->options.threads, self->metadata->record_doubles, li_npy_place, self);
+}
+
+static li_status li_npy_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    LI_DOUBT(li_npy_sink_layout(self, metadata));
+    size_t columns = self->options.structured ? 0 : self->columns;
+    if (self->placed) {
+        base->written += self->header_size;
+        return li_npy_sink_place(self);
+    }
+
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, self->output, NULL, NULL);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+    li_npy_header(self->header, self->header_size, li_queue_begin(&self->descr), 0, columns);
+    LI_DOUBT(li_block_reserve(self->out, self->header_size));
+    memcpy(self->out->begin, self->header, self->header_size);
+    self->out->size = self->header_size;
+    base->written += self->header_size;
+    return LI_SUCCESS;
+}
+
+static li_status li_npy_sink_consume(li_sink* base, const double* records, uint64_t row, size_t count) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    size_t row_bytes = self->columns * sizeof(double);
+    size_t record_doubles = self->metadata->record_doubles;
+    if (self->placed) {
+        if (!self->rows)
+            self->first_row = row;
+        if (row - self->first_row + count > self->metadata->rows)
+            return LI_BAD_FORMAT;
+        LI_DOUBT(li_placer_put(&self->placer, records, row, count));
+        self->rows += count;
+        base->written += count * row_bytes;
+        return LI_SUCCESS;
+    }
+    for (size_t i = 0; i != count; ++i, records += record_doubles) {
+        // Blocks hold whole rows
+        li_block* out = self->out;
+        if (out->capacity - out->size < row_bytes) {
+            if (out->size) {
+                li_pipeline_submit(&self->pipe, out);
+                out = self->out = li_pipeline_acquire(&self->pipe);
             }
-            if (result != LI_SMALL_SRC) // We left the loop because of an error
-                goto cleanup;
-            if (callback)
-                callback(user_ptr, 0, bytes_written);
+            LI_DOUBT(li_block_reserve(out, row_bytes));
         }
+        li_metadata_row(self->metadata, records, row + i, (double*) (out->begin + out->size));
+        out->size += row_bytes;
     }
-    REQUIRE_FORMAT(rows);
-    // We finished the file and read at least one row
-    result = LI_SUCCESS;
+    self->rows += count;
+    base->written += count * row_bytes;
+    return LI_SUCCESS;
+}
 
-    long columns = li_array_size(Replacement)(&replacements);
+static li_status li_npy_sink_finish(li_sink* base) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    if (self->placed) {
+        LI_DOUBT(li_placer_finish(&self->placer));
+        if (self->rows == self->metadata->rows)
+            return LI_SUCCESS;
+        // Input ended early, so shrink the array to the rows we have
+        li_npy_header(self->header, self->header_size, li_queue_begin(&self->descr), self->rows,
+                      self->options.structured ? 0 : self->columns);
+        LI_DOUBT(li_file_pwrite(self->output, self->header, self->header_size, 0));
+        return li_file_resize(self->output, self->header_size + self->rows * self->columns * sizeof(double));
+    }
+    // Wait for the writer to finish before we seek back to the header
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    LI_DOUBT(li_pipeline_dtor(&self->pipe));
 
     // We can now write the header
 
-    fseek(output, 0, SEEK_SET);
-    fwrite("\x93NUMPY\x01\x00", 1, 8, output);
-    uint16_t HEADER_LEN = NPY_HDR_SIZE - 10;
-    fwrite(&HEADER_LEN, 2, 1, output);
-    fprintf(output, "{'descr': '<f8', 'fortran_order': False, 'shape': (%ld, %ld), }", rows, columns);
-    for (long i = ftell(output); i != NPY_HDR_SIZE - 1; ++i)
-        fwrite(" ", 1, 1, output);
-    fwrite("\n", 1, 1, output);
-
-    if (callback)
-        callback(user_ptr, 0, NPY_HDR_SIZE);
-
-cleanup:
-
-    li_array_dtor(Replacement)(&replacements);
-    li_string_dtor(&csvHeader);
-    li_string_dtor(&csvFmt);
-    li_array_dtor(double)(&doubles);
-    li_array_dtor(li_byte)(&buffer);
-    li_finalize(r);
-    
+    li_npy_header(self->header, self->header_size, li_queue_begin(&self->descr), self->rows,
+                  self->options.structured ? 0 : self->columns);
+    if (fseek(self->output, 0, SEEK_SET)
+        || (fwrite(self->header, 1, self->header_size, self->output) != self->header_size))
+        return LI_IO_ERROR;
+    return LI_SUCCESS;
+}
+
+// The header stays a placeholder until finish, but every row consumed is
+// in place after it
+
+static li_status li_npy_sink_checkpoint(li_sink* base, li_sink_state* state) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    if (self->placed)
+        LI_DOUBT(li_placer_flush(&self->placer));
+    else
+        LI_DOUBT(li_pipeline_flush(&self->pipe, &self->out));
+    LI_DOUBT(li_file_sync(self->output));
+    state->rows = self->rows;
+    state->written = base->written;
+    state->offset = self->header_size + self->rows * self->columns * sizeof(double);
+    state->token = self->header_size;
+    return LI_SUCCESS;
+}
+
+static li_status li_npy_sink_resume(li_sink* base, const li_metadata* metadata, const li_sink_state* state) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    LI_DOUBT(li_npy_sink_layout(self, metadata));
+    if (self->header_size != state->token)
+        return LI_BAD_FORMAT;
+    self->rows = state->rows;
+    self->first_row = state->row - state->rows;
+    base->written = state->written;
+    if (self->placed)
+        return li_npy_sink_place(self);
+
+    // Append after the rows written before the checkpoint
+    LI_DOUBT(li_file_resize(self->output, state->offset));
+    if (fseek(self->output, 0, SEEK_END))
+        return LI_IO_ERROR;
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, self->output, NULL, NULL);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+    return LI_SUCCESS;
+}
+
+static void li_npy_sink_release(li_sink* base) {
+    li_npy_sink* self = (li_npy_sink*) base;
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    li_placer_dtor(&self->placer);
+    li_dealloc(self->header);
+    li_queue_dtor(&self->descr);
+    li_dealloc(self);
+}
+
+li_sink* li_npy_sink_new(FILE* output, const li_npy_options* options) {
+    li_npy_sink* self = li_alloc(sizeof(li_npy_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_npy_sink));
+    self->base.begin = li_npy_sink_begin;
+    self->base.consume = li_npy_sink_consume;
+    self->base.finish = li_npy_sink_finish;
+    self->base.checkpoint = li_npy_sink_checkpoint;
+    self->base.resume = li_npy_sink_resume;
+    self->base.release = li_npy_sink_release;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    li_queue_ctor(&self->descr);
+    li_placer_ctor(&self->placer);
+    return &self->base;
+}
+
+li_status li_source_to_npy(li_source* input,
+                           FILE* output,
+                           const li_npy_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    li_sink* sink = li_npy_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
     fflush(output);
-    
     return result;
-    
 }
@@ -9,26 +9,73 @@
 #ifndef litonpy_h
 #define litonpy_h
 
+#include <stdbool.h>
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint64_t
 
 #include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
     
-    // Read a Liquid Instruments binary log file file and write a v1.0 NumPy
-    // (NPY) file.  Files must be open for binary reading and
-    // writing respectively.  Optionally provide a callback that will report
-    // whenever bytes are read from input or written to output.  user_ptr is
-    // passed unchanged to the callback.
+    // Read a Liquid Instruments binary log file file and write a NumPy (NPY)
+    // file.  The header is padded so the data is 64-byte aligned, and is
+    // version 2.0 only if it is too large for version 1.0.  Files must be
+    // open for binary reading and writing respectively.  Optionally provide
+    // a callback that will report whenever bytes are read from input or
+    // written to output.  user_ptr is passed unchanged to the callback.
     
     li_status li_to_npy(FILE* input,
                         FILE* output,
                         void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
                         void* user_ptr);
 
+    // Options for NPY output.  Zero initialization gives the defaults.
+
+    typedef struct li_npy_options {
+        bool structured; // Write a structured array with a field for each
+                         // column, named from the CSV header, instead of a
+                         // 2-D array
+        size_t threads;  // Threads writing rows in place when the number
+                         // of rows is known, or 0 for all processors
+    } li_npy_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_npy(li_source* input,
+                               FILE* output,
+                               const li_npy_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // An li_sink writing NPY to output, for converting to several formats
+    // at once with li_convert.  output must be seekable.  options may be
+    // NULL.  Returns NULL if out of memory.  When li_convert knows how many
+    // rows there will be and output is a regular file, the file is sized
+    // up front and blocks of rows are written in place by several threads.
+    // The sink supports checkpoints when output is a regular file.
+
+    li_sink* li_npy_sink_new(FILE* output, const li_npy_options* options);
+
+    // Format an NPY header for an array of rows by columns of descr (like
+    // "'<f8'"), or a 1-D array of rows if columns is 0, into dest, padded
+    // with spaces to total bytes.  Returns the size the header needs, which
+    // may be larger than total, in which case nothing is written.  Headers
+    // are padded to a multiple of LI_NPY_ALIGN bytes, and the version depends
+    // only on total, so a header measured with rows = UINT64_MAX can be
+    // rewritten in place with the actual number of rows.
+
+#define LI_NPY_ALIGN 64
+
+    size_t li_npy_header(char* dest,
+                         size_t total,
+                         const char* descr,
+                         uint64_t rows,
+                         size_t columns);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,484 @@
+//
+//  litonpz.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "litonpz.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "licolumns.h"
+#include "liparse.h"
+#include "lipipeline.h"
+#include "lisink.h"
+#include "litonpy.h"
+#include "liutility.h"
+
+// A ZIP member must be contiguous, so the values of each column are gathered
+// in an li_columns, and the archive is written once all the rows are known
+
+typedef struct li_npz_column {
+    li_string name;       // Member name, without .npy
+    char identifier;      // 't', 'n' or 'c'
+    size_t index;         // Position in the record of a 'c' value
+
+    // Recorded while writing the member, for the central directory
+    uint64_t offset;      // Of the local header
+    uint64_t size;
+    uint64_t compressed;
+    uint32_t crc;
+    bool zip64;
+} li_npz_column;
+
+static void li_npz_column_dtor(li_npz_column* self) {
+    li_string_dtor(&self->name);
+}
+
+li_array_define(li_npz_column);
+
+
+
+// Writing the archive.  All output goes through the pipeline, and every
+// member is followed by a data descriptor holding its CRC and sizes, so the
+// output is never revisited and need not be seekable.
+
+typedef struct li_npz_writer {
+    li_pipeline* pipe;
+    li_block** out;
+    uint64_t position;    // Bytes written
+    int level;            // 0 to store members
+    z_stream z;
+    bool deflating;       // z is initialized
+    uint16_t time;        // DOS format modification time
+    uint16_t date;
+    uint32_t crc;         // Of the current member
+    uint64_t compressed;  // Bytes of the current member
+} li_npz_writer;
+
+static li_byte* li_npz_u16(li_byte* p, uint16_t x) {
+    p[0] = (li_byte) x;
+    p[1] = (li_byte) (x >> 8);
+    return p + 2;
+}
+
+static li_byte* li_npz_u32(li_byte* p, uint32_t x) {
+    return li_npz_u16(li_npz_u16(p, (uint16_t) x), (uint16_t) (x >> 16));
+}
+
+static li_byte* li_npz_u64(li_byte* p, uint64_t x) {
+    return li_npz_u32(li_npz_u32(p, (uint32_t) x), (uint32_t) (x >> 32));
+}
+
+static li_status li_npz_put(li_npz_writer* self, const void* src, size_t count) {
+    const li_byte* p = src;
+    while (count) {
+        li_block* b = *self->out;
+        if (b->size == b->capacity) {
+            li_pipeline_submit(self->pipe, b);
+            b = *self->out = li_pipeline_acquire(self->pipe);
+        }
+        size_t n = MIN(count, b->capacity - b->size);
+        memcpy(b->begin + b->size, p, n);
+        b->size += n;
+        self->position += n;
+        self->compressed += n;
+        p += n;
+        count -= n;
+    }
+    return LI_SUCCESS;
+}
+
+// Deflate straight into the output blocks
+
+static li_status li_npz_deflate(li_npz_writer* self, const void* src, size_t count, int flush) {
+    z_stream* z = &self->z;
+    z->next_in = (Bytef*) src;
+    z->avail_in = (uInt) count;
+    for (;;) {
+        li_block* b = *self->out;
+        if (b->size == b->capacity) {
+            li_pipeline_submit(self->pipe, b);
+            b = *self->out = li_pipeline_acquire(self->pipe);
+        }
+        z->next_out = (Bytef*) (b->begin + b->size);
+        z->avail_out = (uInt) MIN(b->capacity - b->size, UINT_MAX);
+        int status = deflate(z, flush);
+        size_t n = (size_t) ((li_byte*) z->next_out - (b->begin + b->size));
+        b->size += n;
+        self->position += n;
+        self->compressed += n;
+        if (status == Z_STREAM_END)
+            return LI_SUCCESS;
+        if ((status != Z_OK) && (status != Z_BUF_ERROR))
+            return LI_BAD_ALLOC;
+        if ((flush == Z_NO_FLUSH) && !z->avail_in && z->avail_out)
+            return LI_SUCCESS;
+    }
+}
+
+// Member contents
+
+static li_status li_npz_data(void* user, const void* src, size_t count) {
+    li_npz_writer* self = user;
+    self->crc = (uint32_t) crc32(self->crc, src, (uInt) count);
+    if (self->level)
+        return li_npz_deflate(self, src, count, Z_NO_FLUSH);
+    return li_npz_put(self, src, count);
+}
+
+static li_status li_npz_member(li_npz_writer* self, li_npz_column* column, li_columns* values, size_t k, uint64_t rows) {
+    char header[4 * LI_NPY_ALIGN];
+    size_t header_size = li_npy_header(NULL, 0, "'<f8'", rows, 0);
+    assert(header_size <= sizeof(header));
+    li_npy_header(header, header_size, "'<f8'", rows, 0);
+
+    column->offset = self->position;
+    column->size = header_size + li_columns_size(values, k);
+    uint64_t bound = column->size;
+    if (self->level) // As deflateBound, for the worst case of stored blocks
+        bound += (bound >> 12) + (bound >> 14) + (bound >> 25) + 13;
+    column->zip64 = (bound >= 0xFFFFFFFF);
+
+    // Local file header; the CRC and sizes follow the data
+    size_t name_size = li_string_size(&column->name) + 4;
+    li_byte local[30 + 20];
+    li_byte* p = local;
+    p = li_npz_u32(p, 0x04034b50);
+    p = li_npz_u16(p, column->zip64 ? 45 : 20);
+    p = li_npz_u16(p, 0x0008);
+    p = li_npz_u16(p, self->level ? 8 : 0);
+    p = li_npz_u16(p, self->time);
+    p = li_npz_u16(p, self->date);
+    p = li_npz_u32(p, 0);
+    p = li_npz_u32(p, column->zip64 ? 0xFFFFFFFF : 0);
+    p = li_npz_u32(p, column->zip64 ? 0xFFFFFFFF : 0);
+    p = li_npz_u16(p, (uint16_t) name_size);
+    p = li_npz_u16(p, column->zip64 ? 20 : 0);
+    LI_DOUBT(li_npz_put(self, local, (size_t) (p - local)));
+    LI_DOUBT(li_npz_put(self, column->name, name_size - 4));
+    LI_DOUBT(li_npz_put(self, ".npy", 4));
+    if (column->zip64) {
+        p = local;
+        p = li_npz_u16(p, 0x0001);
+        p = li_npz_u16(p, 16);
+        p = li_npz_u64(p, 0);
+        p = li_npz_u64(p, 0);
+        LI_DOUBT(li_npz_put(self, local, (size_t) (p - local)));
+    }
+
+    self->crc = (uint32_t) crc32(0, NULL, 0);
+    self->compressed = 0;
+    if (self->level && (deflateReset(&self->z) != Z_OK))
+        return LI_BAD_ALLOC;
+    LI_DOUBT(li_npz_data(self, header, header_size));
+    LI_DOUBT(li_columns_read(values, k, li_npz_data, self));
+    if (self->level)
+        LI_DOUBT(li_npz_deflate(self, NULL, 0, Z_FINISH));
+    column->crc = self->crc;
+    column->compressed = self->compressed;
+
+    // Data descriptor
+    p = local;
+    p = li_npz_u32(p, 0x08074b50);
+    p = li_npz_u32(p, column->crc);
+    if (column->zip64) {
+        p = li_npz_u64(p, column->compressed);
+        p = li_npz_u64(p, column->size);
+    } else {
+        p = li_npz_u32(p, (uint32_t) column->compressed);
+        p = li_npz_u32(p, (uint32_t) column->size);
+    }
+    return li_npz_put(self, local, (size_t) (p - local));
+}
+
+static li_status li_npz_directory(li_npz_writer* self, li_array(li_npz_column)* columns) {
+    uint64_t start = self->position;
+    uint64_t entries = li_array_size(li_npz_column)(columns);
+    li_byte buffer[96]; // Enough for the zip64 end record and its locator
+    li_byte* p;
+    LI_FOR(li_npz_column, c, columns) {
+        bool far = (c->offset >= 0xFFFFFFFF);
+        uint16_t extra = (c->zip64 ? 16 : 0) + (far ? 8 : 0);
+        p = buffer;
+        p = li_npz_u32(p, 0x02014b50);
+        p = li_npz_u16(p, 45);
+        p = li_npz_u16(p, (c->zip64 || far) ? 45 : 20);
+        p = li_npz_u16(p, 0x0008);
+        p = li_npz_u16(p, self->level ? 8 : 0);
+        p = li_npz_u16(p, self->time);
+        p = li_npz_u16(p, self->date);
+        p = li_npz_u32(p, c->crc);
+        p = li_npz_u32(p, c->zip64 ? 0xFFFFFFFF : (uint32_t) c->compressed);
+        p = li_npz_u32(p, c->zip64 ? 0xFFFFFFFF : (uint32_t) c->size);
+        p = li_npz_u16(p, (uint16_t) (li_string_size(&c->name) + 4));
+        p = li_npz_u16(p, extra ? extra + 4 : 0);
+        p = li_npz_u16(p, 0); // Comment
+        p = li_npz_u16(p, 0); // Disk
+        p = li_npz_u16(p, 0); // Internal attributes
+        p = li_npz_u32(p, 0); // External attributes
+        p = li_npz_u32(p, far ? 0xFFFFFFFF : (uint32_t) c->offset);
+        LI_DOUBT(li_npz_put(self, buffer, (size_t) (p - buffer)));
+        LI_DOUBT(li_npz_put(self, c->name, li_string_size(&c->name)));
+        LI_DOUBT(li_npz_put(self, ".npy", 4));
+        if (extra) {
+            // Zip64 fields appear only for those marked 0xFFFFFFFF above,
+            // in this order
+            p = buffer;
+            p = li_npz_u16(p, 0x0001);
+            p = li_npz_u16(p, extra);
+            if (c->zip64) {
+                p = li_npz_u64(p, c->size);
+                p = li_npz_u64(p, c->compressed);
+            }
+            if (far)
+                p = li_npz_u64(p, c->offset);
+            LI_DOUBT(li_npz_put(self, buffer, (size_t) (p - buffer)));
+        }
+    }
+    uint64_t end = self->position;
+    uint64_t size = end - start;
+
+    if ((entries >= 0xFFFF) || (size >= 0xFFFFFFFF) || (start >= 0xFFFFFFFF)) {
+        // Zip64 end of central directory record and locator
+        p = buffer;
+        p = li_npz_u32(p, 0x06064b50);
+        p = li_npz_u64(p, 44);
+        p = li_npz_u16(p, 45);
+        p = li_npz_u16(p, 45);
+        p = li_npz_u32(p, 0);
+        p = li_npz_u32(p, 0);
+        p = li_npz_u64(p, entries);
+        p = li_npz_u64(p, entries);
+        p = li_npz_u64(p, size);
+        p = li_npz_u64(p, start);
+        p = li_npz_u32(p, 0x07064b50);
+        p = li_npz_u32(p, 0);
+        p = li_npz_u64(p, end);
+        p = li_npz_u32(p, 1);
+        LI_DOUBT(li_npz_put(self, buffer, (size_t) (p - buffer)));
+    }
+    p = buffer;
+    p = li_npz_u32(p, 0x06054b50);
+    p = li_npz_u16(p, 0);
+    p = li_npz_u16(p, 0);
+    p = li_npz_u16(p, (uint16_t) MIN(entries, 0xFFFF));
+    p = li_npz_u16(p, (uint16_t) MIN(entries, 0xFFFF));
+    p = li_npz_u32(p, (uint32_t) MIN(size, 0xFFFFFFFF));
+    p = li_npz_u32(p, (uint32_t) MIN(start, 0xFFFFFFFF));
+    p = li_npz_u16(p, 0);
+    return li_npz_put(self, buffer, (size_t) (p - buffer));
+}
+
+// Name the members after the replacements, as {ch1} -> ch1 but
+// {ch1[0]}, {ch1[1]} -> ch1_0, ch1_1.  Any names still repeated get the
+// column number appended.
+
+static li_status li_npz_name(li_array(li_npz_column)* columns, li_array(Replacement)* replacements) {
+    size_t i = 0;
+    LI_FOR(Replacement, p, replacements) {
+        li_npz_column* c = li_array_begin(li_npz_column)(columns) + i;
+        size_t uses = 0;
+        LI_FOR(Replacement, q, replacements)
+            uses += !strcmp(p->identifier, q->identifier);
+        char suffix[48] = "";
+        if (uses > 1)
+            snprintf(suffix, sizeof(suffix), "_%llu", (unsigned long long) p->index);
+        for (li_npz_column* d = li_array_begin(li_npz_column)(columns); d != c; ++d) {
+            size_t n = strlen(p->identifier);
+            if (!strncmp(d->name, p->identifier, n) && !strcmp(d->name + n, suffix)) {
+                snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_%llu", (unsigned long long) i);
+                break;
+            }
+        }
+        c->name = li_string_copy(p->identifier);
+        if (!c->name || li_string_insert(&c->name, li_string_size(&c->name), suffix))
+            return LI_BAD_ALLOC;
+        ++i;
+    }
+    return LI_SUCCESS;
+}
+
+li_status li_to_npz(FILE* input,
+                    FILE* output,
+                    void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                    void* user_ptr)
+{
+    li_source source;
+    li_status result = li_source_ctor(&source, input, LI_SOURCE_AUTO);
+    if (result == LI_SUCCESS)
+        result = li_source_to_npz(&source, output, NULL, callback, user_ptr);
+    li_source_dtor(&source);
+    return result;
+}
+
+// NPZ output as an li_sink.  The values of each column are gathered as rows
+// are consumed, and the archive is written by finish.
+
+typedef struct {
+    li_sink base;
+    FILE* output;
+    li_npz_options options;
+    const li_metadata* metadata;
+    li_array(li_npz_column) columns;
+    li_columns values;
+    li_array(double) rows_buffer;   // Rows of the current block
+    li_array(double) column;        // Values of one column of the block
+    uint64_t rows;
+    li_npz_writer writer;
+    li_pipeline pipe;
+    bool piping;
+    li_block* out;
+} li_npz_sink;
+
+static li_status li_npz_sink_begin(li_sink* base, const li_metadata* metadata) {
+    li_npz_sink* self = (li_npz_sink*) base;
+    self->metadata = metadata;
+
+    // One column for each replacement, named from the indices as they are
+    // in the format, before they became flat indices into the record
+    li_string format = li_string_copy(metadata->csv_format);
+    if (!format)
+        return LI_BAD_ALLOC;
+    li_array(Replacement) replacements = li_parse_Replacement_list(format);
+    li_status result = li_array_resize(li_npz_column)(&self->columns, li_array_size(Replacement)(&replacements), (li_npz_column) { 0 });
+    if (result == LI_SUCCESS)
+        result = li_npz_name(&self->columns, &replacements);
+    li_array_dtor(Replacement)(&replacements);
+    li_string_dtor(&format);
+    LI_DOUBT(result);
+    if (li_array_size(li_npz_column)(&self->columns) != metadata->columns)
+        return LI_BAD_FORMAT;
+
+    li_npz_column* c = li_array_begin(li_npz_column)(&self->columns);
+    LI_FOR(Replacement, p, metadata->replacements) {
+        c->identifier = p->identifier[0];
+        c->index = p->index;
+        ++c;
+    }
+    li_columns_dtor(&self->values);
+    return li_columns_ctor(&self->values, metadata->columns, self->options.memory);
+}
+
+static li_status li_npz_sink_consume(li_sink* base, const double* records, uint64_t row, size_t count) {
+    li_npz_sink* self = (li_npz_sink*) base;
+    size_t columns = self->metadata->columns;
+    size_t record_doubles = self->metadata->record_doubles;
+    LI_DOUBT(li_array_resize(double)(&self->rows_buffer, count * columns, 0.0));
+    LI_DOUBT(li_array_resize(double)(&self->column, count, 0.0));
+    double* q = self->rows_buffer.begin;
+    for (size_t i = 0; i != count; ++i, records += record_doubles, q += columns)
+        li_metadata_row(self->metadata, records, row + i, q);
+    // Append a run of values to each column
+    for (size_t k = 0; k != columns; ++k) {
+        for (size_t i = 0; i != count; ++i)
+            self->column.begin[i] = self->rows_buffer.begin[i * columns + k];
+        LI_DOUBT(li_columns_append(&self->values, k, self->column.begin, count * sizeof(double)));
+    }
+    self->rows += count;
+    return LI_SUCCESS;
+}
+
+static li_status li_npz_sink_finish(li_sink* base) {
+    li_npz_sink* self = (li_npz_sink*) base;
+    li_npz_writer* writer = &self->writer;
+
+    // We can now write the archive, through a pipeline so that compression
+    // overlaps writing
+
+    li_status result = li_pipeline_ctor(&self->pipe, NULL, self->output, NULL, NULL);
+    self->piping = true;
+    LI_DOUBT(result);
+    self->out = li_pipeline_acquire(&self->pipe);
+
+    struct tm tm;
+    struct tm* local = li_localtime(time(NULL), &tm);
+    writer->date = (0 << 9) | (1 << 5) | 1; // 1980-01-01 if we don't know better
+    if (local && (local->tm_year >= 80)) {
+        writer->time = (uint16_t) ((local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2));
+        writer->date = (uint16_t) (((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday);
+    }
+    writer->pipe = &self->pipe;
+    writer->out = &self->out;
+    writer->level = self->options.level;
+    if (writer->level) {
+        if ((writer->level < 1) || (writer->level > 9))
+            return LI_BAD_FORMAT;
+        if (deflateInit2(&writer->z, writer->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return LI_BAD_ALLOC;
+        writer->deflating = true;
+    }
+    uint64_t written = 0;
+    for (size_t k = 0; k != li_array_size(li_npz_column)(&self->columns); ++k) {
+        LI_DOUBT(li_npz_member(writer, self->columns.begin + k, &self->values, k, self->rows));
+        // Release the values as soon as they are written
+        li_columns_release(&self->values, k);
+        base->written += writer->position - written;
+        written = writer->position;
+    }
+    result = li_npz_directory(writer, &self->columns);
+    base->written += writer->position - written;
+    LI_DOUBT(result);
+
+    // Flush whatever we have written, then wait for the writer to finish
+    li_pipeline_submit(&self->pipe, self->out);
+    self->out = NULL;
+    self->piping = false;
+    return li_pipeline_dtor(&self->pipe);
+}
+
+static void li_npz_sink_release(li_sink* base) {
+    li_npz_sink* self = (li_npz_sink*) base;
+    if (self->piping) {
+        if (self->out)
+            li_pipeline_submit(&self->pipe, self->out);
+        li_pipeline_dtor(&self->pipe);
+    }
+    if (self->writer.deflating)
+        deflateEnd(&self->writer.z);
+    li_array_dtor(double)(&self->column);
+    li_array_dtor(double)(&self->rows_buffer);
+    li_columns_dtor(&self->values);
+    li_array_dtor(li_npz_column)(&self->columns);
+    li_dealloc(self);
+}
+
+li_sink* li_npz_sink_new(FILE* output, const li_npz_options* options) {
+    li_npz_sink* self = li_alloc(sizeof(li_npz_sink));
+    if (!self)
+        return NULL;
+    memset(self, 0, sizeof(li_npz_sink));
+    self->base.begin = li_npz_sink_begin;
+    self->base.consume = li_npz_sink_consume;
+    self->base.finish = li_npz_sink_finish;
+    self->base.release = li_npz_sink_release;
+    self->output = output;
+    if (options)
+        self->options = *options;
+    li_array_ctor(li_npz_column)(&self->columns);
+    li_columns_ctor(&self->values, 0, 0);
+    li_array_ctor(double)(&self->rows_buffer);
+    li_array_ctor(double)(&self->column);
+    return &self->base;
+}
+
+li_status li_source_to_npz(li_source* input,
+                           FILE* output,
+                           const li_npz_options* options,
+                           void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                           void* user_ptr)
+{
+    li_sink* sink = li_npz_sink_new(output, options);
+    if (!sink)
+        return LI_BAD_ALLOC;
+    li_status result = li_convert(input, &sink, 1, NULL, callback, user_ptr);
+    li_sink_release(sink);
+    return result;
+}
@@ -0,0 +1,62 @@
+//
+//  litonpz.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef litonpz_h
+#define litonpz_h
+
+#include <stdio.h> // for FILE
+#include <stdint.h> // for uint64_t
+
+#include "lireader.h"
+#include "lisink.h"
+#include "lisource.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Read a Liquid Instruments binary log file and write a NumPy archive
+    // (NPZ) holding one 1-D .npy member per column, named from the CSV
+    // format: t, n, ch1, ch2, or ch1_0, ch1_1 when a channel has several
+    // values.  np.load(file)['ch2'] then reads only that column.  The output
+    // is written sequentially and need not be seekable.  Optionally provide
+    // a callback that will report whenever bytes are read from input or
+    // written to output.  user_ptr is passed unchanged to the callback.
+
+    li_status li_to_npz(FILE* input,
+                        FILE* output,
+                        void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                        void* user_ptr);
+
+    // Options for NPZ output.  Zero initialization gives the defaults.
+
+    typedef struct li_npz_options {
+        int level;     // zlib compression level 1-9 to deflate members, or 0
+                       // to store them
+        size_t memory; // Bytes of memory for gathering columns before
+                       // spilling to temporary files, or 0 for the default
+    } li_npz_options;
+
+    // As above, reading from any li_source.  options may be NULL.
+
+    li_status li_source_to_npz(li_source* input,
+                               FILE* output,
+                               const li_npz_options* options,
+                               void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                               void* user_ptr);
+
+    // An li_sink writing NPZ to output, for converting to several formats
+    // at once with li_convert.  options may be NULL.  Returns NULL if out of
+    // memory.
+
+    li_sink* li_npz_sink_new(FILE* output, const li_npz_options* options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* litonpz_h */
@@ -297,16 +297,10 @@ li_status li_string_insert(li_string* self, size_t pos, const li_utf8* zstr) {
     return LI_SUCCESS;
 }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
+struct tm* li_localtime(time_t t, struct tm* dest) {
+#ifdef _WIN32
+    return localtime_s(dest, &t) ? NULL : dest;
+#else
+    return localtime_r(&t, dest);
+#endif
+}
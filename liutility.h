@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "lireader.h"
 
@@ -268,6 +269,13 @@ extern "C" {
     
     
     
+    // localtime that is safe to call from several threads at once, as sinks
+    // may finish concurrently.  Returns dest, or NULL on failure.
+
+    struct tm* li_localtime(time_t t, struct tm* dest);
+
+
+
 
     // Helper macros to implement functions using li_status error codes
 
@@ -0,0 +1,432 @@
+//
+//  liverify.c
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#include "liverify.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lipipeline.h"
+
+#define REQUIRE_ALLOC(X) do { if (! X) { result = LI_BAD_ALLOC; LI_ON_ERROR; goto cleanup; } } while(false)
+#define REQUIRE_SUCCESS do { if (result != LI_SUCCESS) { LI_ON_ERROR; goto cleanup; } } while(false)
+
+// Input is framed in pieces, after each of which we look for a place to end
+// the range.  Once a range is long enough the pieces shrink to what the
+// reader suggests, so that it stops at every message boundary.
+#define LI_VERIFY_PIECE_BYTES (64 << 10)
+
+// A range of input, and what checking it found
+
+typedef struct {
+    li_block bytes;
+    uint64_t offset;         // Of the range in the input
+    uint64_t index;          // Ranges before this one
+    bool last;               // The range ends the input
+    bool pending;            // Dispatched but not yet collected
+    const char* problem;
+    uint64_t problem_offset; // In the input
+    uint64_t records;        // Checked
+    uint64_t skipped;        // Bytes of each channel before the first record
+    li_status status;        // Failure to check, other than a problem
+} li_verify_range;
+
+typedef struct li_verifier li_verifier;
+
+typedef struct {
+    li_verifier* verifier;
+    li_reader* reader;
+    li_spsc todo;
+    li_spsc done;
+    li_verify_range ranges[LI_VERIFY_DEPTH];
+    pthread_t thread;
+    bool started;
+} li_verify_worker;
+
+struct li_verifier {
+    li_block header;           // Input up to where data messages start
+    size_t threads;
+    li_verify_worker* workers; // NULL to check on the calling thread
+    li_reader* reader;         // Checks on the calling thread
+    li_verify_range range;
+    uint64_t dispatched;
+    uint64_t collected;
+    li_verify_report* report;  // Records and problem of the ranges collected
+    li_status status;          // First failure to check
+};
+
+// Put count bytes into the reader and check the records they complete.  If
+// fine, they are put in pieces no larger than the reader suggests, so a
+// record that doesn't match is found soon after the message holding it.
+
+static li_status li_verify_put(li_reader* r, const li_byte* src, size_t count, bool fine,
+                               uint64_t* records, uint64_t* skipped)
+{
+    while (count) {
+        size_t n = count;
+        if (fine) {
+            uint64_t suggested = 0;
+            LI_TRUST(li_get(r, LI_SUGGESTED_PUT_U64, 0, &suggested, sizeof(suggested)));
+            n = (size_t) MIN((uint64_t) n, MAX(suggested, (uint64_t) 1));
+        }
+        LI_DOUBT(li_put(r, src, n));
+        src += n;
+        count -= n;
+        uint64_t checked = 0;
+        uint64_t dropped = 0;
+        li_status result = li_check_records(r, &checked, &dropped);
+        *records += checked;
+        *skipped += dropped;
+        if ((result != LI_SUCCESS) && (result != LI_SMALL_SRC))
+            return result;
+    }
+    return LI_SUCCESS;
+}
+
+static void li_verify_check(li_reader* r, const li_block* header, const li_byte* src, size_t count,
+                            li_verify_range* range, bool fine)
+{
+    li_reader_reset(r);
+    range->problem = NULL;
+    range->records = 0;
+    range->skipped = 0;
+    range->status = LI_SUCCESS;
+    uint64_t skipped = 0;
+    li_status result = li_verify_put(r, header->begin, header->size, false, &range->records, &skipped);
+    if (result == LI_SUCCESS)
+        result = li_verify_put(r, src, count, fine, &range->records, &skipped);
+    range->skipped = skipped;
+    if (result == LI_BAD_FORMAT) {
+        // The reader saw the header followed by the range
+        uint64_t offset = 0;
+        range->problem = li_problem(r, &offset);
+        range->problem_offset = (offset < header->size) ? offset : (range->offset + (offset - header->size));
+        return;
+    }
+    if (result != LI_SUCCESS) {
+        range->status = result;
+        return;
+    }
+
+    // Only the first record of the file may need finding, as converting
+    // finds it however many bytes come before it; later ranges start at a
+    // record
+    if (skipped && range->index) {
+        range->problem = "sync field mismatch";
+        range->problem_offset = range->offset;
+        return;
+    }
+    // The last range must leave no channel part way through a record
+    for (size_t i = 1; range->last && (i != 9); ++i) {
+        uint64_t bytes = 0;
+        uint64_t framed = 0;
+        if ((li_get(r, LI_RECORD_BYTES_FOR_INDEX_U64, i, &bytes, sizeof(bytes)) != LI_SUCCESS) || !bytes)
+            continue;
+        LI_TRUST(li_get(r, LI_FRAMED_BYTES_FOR_INDEX_U64, i, &framed, sizeof(framed)));
+        if ((framed < skipped) || (framed - skipped != range->records * bytes)) {
+            range->problem = "file ends part way through a record";
+            range->problem_offset = range->offset + count;
+            return;
+        }
+    }
+}
+
+// Check a range, then if there is a problem check it again finely to
+// find where it is
+
+static void li_verify_range_check(li_reader* r, const li_block* header, const li_byte* src, size_t count,
+                                  li_verify_range* range)
+{
+    li_verify_check(r, header, src, count, range, false);
+    if (range->problem)
+        li_verify_check(r, header, src, count, range, true);
+}
+
+static void* li_verify_worker_main(void* ptr) {
+    li_verify_worker* self = ptr;
+    li_verify_range* range;
+    while ((range = li_spsc_pop(&self->todo))) {
+        li_verify_range_check(self->reader, &self->verifier->header, range->bytes.begin, range->bytes.size, range);
+        li_spsc_push(&self->done, range);
+    }
+    return NULL;
+}
+
+// Add what checking a range found to the report.  Ranges are collected in
+// the order they were dispatched, so the first problem collected is the
+// first in the input.
+
+static void li_verifier_collect(li_verifier* self, li_verify_range* range) {
+    range->pending = false;
+    ++self->collected;
+    if (!self->status)
+        self->status = range->status;
+    if (self->status || self->report->problem)
+        return;
+    self->report->records += range->records;
+    self->report->skipped += range->skipped;
+    if (range->problem) {
+        self->report->problem = range->problem;
+        self->report->offset = range->problem_offset;
+    }
+}
+
+static void li_verifier_ctor(li_verifier* self, li_verify_report* report) {
+    memset(self, 0, sizeof(li_verifier));
+    self->report = report;
+}
+
+static void li_verifier_dtor(li_verifier* self) {
+    if (self->workers) {
+        for (size_t i = 0; i != self->threads; ++i) {
+            li_verify_worker* w = self->workers + i;
+            if (w->started) {
+                li_spsc_push(&w->todo, NULL);
+                pthread_join(w->thread, NULL);
+            }
+            for (int j = 0; j != LI_VERIFY_DEPTH; ++j)
+                li_block_dtor(&w->ranges[j].bytes);
+            if (w->reader)
+                li_finalize(w->reader);
+            li_spsc_dtor(&w->done);
+            li_spsc_dtor(&w->todo);
+        }
+        li_dealloc(self->workers);
+    }
+    if (self->reader)
+        li_finalize(self->reader);
+    li_block_dtor(&self->header);
+}
+
+// The checking readers have no use for lookup tables, as they compute no
+// values
+
+static li_reader* li_verifier_reader(void) {
+    li_reader* r = li_init(malloc, free);
+    if (r)
+        li_table_bytes(r, 0);
+    return r;
+}
+
+static li_status li_verifier_start(li_verifier* self, size_t threads) {
+    if (threads <= 1) {
+        self->threads = 1;
+        self->reader = li_verifier_reader();
+        return self->reader ? LI_SUCCESS : LI_BAD_ALLOC;
+    }
+    self->workers = li_alloc(threads * sizeof(li_verify_worker));
+    if (!self->workers)
+        return LI_BAD_ALLOC;
+    memset(self->workers, 0, threads * sizeof(li_verify_worker));
+    self->threads = threads;
+    for (size_t i = 0; i != threads; ++i) {
+        li_verify_worker* w = self->workers + i;
+        w->verifier = self;
+        w->reader = li_verifier_reader();
+        if (!w->reader)
+            return LI_BAD_ALLOC;
+        LI_DOUBT(li_spsc_ctor(&w->todo, LI_VERIFY_DEPTH + 1)); // Room for the stop signal
+        LI_DOUBT(li_spsc_ctor(&w->done, LI_VERIFY_DEPTH));
+        for (int j = 0; j != LI_VERIFY_DEPTH; ++j)
+            li_spsc_push(&w->done, w->ranges + j);
+        if (pthread_create(&w->thread, NULL, li_verify_worker_main, w))
+            return LI_BAD_ALLOC;
+        w->started = true;
+    }
+    return LI_SUCCESS;
+}
+
+// Check the count bytes of input at offset, which start at a message
+// boundary where the channels are in phase
+
+static li_status li_verifier_put(li_verifier* self, const void* src, size_t count, uint64_t offset, bool last) {
+    if (!self->workers) {
+        li_verify_range* range = &self->range;
+        range->offset = offset;
+        range->index = self->dispatched++;
+        range->last = last;
+        li_verify_range_check(self->reader, &self->header, src, count, range);
+        li_verifier_collect(self, range);
+        return self->status;
+    }
+
+    // Ranges are dealt to the workers in turn
+    li_verify_worker* w = self->workers + self->dispatched % self->threads;
+    li_verify_range* range = li_spsc_pop(&w->done);
+    if (range->pending)
+        li_verifier_collect(self, range);
+    li_status result = self->status;
+    if (result == LI_SUCCESS)
+        result = li_block_reserve(&range->bytes, MAX(count, (size_t) 1));
+    if (result != LI_SUCCESS) {
+        li_spsc_push(&w->done, range);
+        return self->status = result;
+    }
+    memcpy(range->bytes.begin, src, count);
+    range->bytes.size = count;
+    range->offset = offset;
+    range->index = self->dispatched++;
+    range->last = last;
+    range->pending = true;
+    li_spsc_push(&w->todo, range);
+    return LI_SUCCESS;
+}
+
+// Wait for every range to be checked and collect them
+
+static li_status li_verifier_finish(li_verifier* self) {
+    for (size_t i = 0; self->workers && (i != self->threads); ++i) {
+        li_verify_worker* w = self->workers + i;
+        li_spsc_push(&w->todo, NULL);
+        pthread_join(w->thread, NULL);
+        w->started = false;
+    }
+    // Every range is now done, after any the last put left there
+    while (self->workers && (self->collected != self->dispatched)) {
+        li_verify_worker* w = self->workers + self->collected % self->threads;
+        li_verify_range* range = li_spsc_pop(&w->done);
+        if (range->pending)
+            li_verifier_collect(self, range);
+        li_spsc_push(&w->done, range);
+    }
+    return self->status;
+}
+
+li_status li_verify(li_source* input,
+                    const li_verify_options* options,
+                    li_verify_report* report,
+                    void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                    void* user_ptr)
+{
+    assert(input && report);
+    memset(report, 0, sizeof(li_verify_report));
+    size_t range_bytes = (options && options->range_bytes) ? options->range_bytes : LI_VERIFY_RANGE_BYTES;
+    size_t threads = options ? options->threads : 0;
+    if (!threads)
+        threads = MIN(li_thread_count() - 1, (size_t) LI_VERIFY_THREADS_MAX);
+
+    li_status result = LI_SUCCESS;
+    li_verifier self;
+    li_verifier_ctor(&self, report);
+    li_queue pending;        // Input from start that is not yet in a range
+    li_queue_ctor(&pending);
+    uint64_t start = 0;
+    uint64_t framed = 0;
+    bool header = false;
+    const char* problem = NULL; // Found by framing
+    uint64_t offset = 0;
+
+    li_pipeline pipe;
+    li_status piped = li_pipeline_ctor(&pipe, input, NULL, NULL, NULL);
+    bool piping = true;
+    li_reader* r = li_init(malloc, free);
+    REQUIRE_ALLOC(r);
+    result = piped;
+    REQUIRE_SUCCESS;
+    li_frame_only(r, true);
+    li_table_bytes(r, 0);
+    result = li_verifier_start(&self, threads);
+    REQUIRE_SUCCESS;
+
+    // Frame the input, stopping at the first problem found by framing it or
+    // by checking a range
+    for (li_block* in; !problem && !report->problem && (in = li_pipeline_read(&pipe)); li_pipeline_recycle(&pipe, in)) {
+        if (callback)
+            callback(user_ptr, in->size, 0);
+        result = li_queue_put(&pending, in->begin, in->size);
+        REQUIRE_SUCCESS;
+        for (size_t i = 0, n = 0; !problem && (i < in->size); i += n) {
+            n = MIN(in->size - i, (size_t) LI_VERIFY_PIECE_BYTES);
+            if (header && (report->bytes - start >= range_bytes)) {
+                // The range is long enough, so go message by message until
+                // the channels are in phase
+                uint64_t suggested = 0;
+                LI_TRUST(li_get(r, LI_SUGGESTED_PUT_U64, 0, &suggested, sizeof(suggested)));
+                n = (size_t) MIN((uint64_t) n, MAX(suggested, (uint64_t) 1));
+            }
+            uint64_t before = report->bytes;
+            result = li_put(r, in->begin + i, n);
+            REQUIRE_SUCCESS;
+            report->bytes += n;
+            if ((before < 3) && (report->bytes >= 3)) {
+                // The reader takes any version after the magic number to
+                // be the latest
+                const li_byte* p = li_queue_begin(&pending);
+                if ((p[0] == 'L') && (p[1] == 'I') && (p[2] != '1') && (p[2] != '2')) {
+                    problem = "unknown file version";
+                    offset = 2;
+                    break;
+                }
+            }
+            result = li_get(r, LI_FRAMED_BYTES_U64, 0, &framed, sizeof(framed));
+            if (result == LI_SMALL_SRC)
+                continue; // The header is incomplete
+            if (result == LI_BAD_FORMAT) {
+                problem = li_problem(r, &offset);
+                result = LI_SUCCESS;
+                break;
+            }
+            REQUIRE_SUCCESS;
+            if (!header) {
+                uint64_t bytes = 0;
+                LI_TRUST(li_get(r, LI_HEADER_BYTES_U64, 0, &bytes, sizeof(bytes)));
+                result = li_block_reserve(&self.header, (size_t) bytes);
+                REQUIRE_SUCCESS;
+                memcpy(self.header.begin, li_queue_begin(&pending), (size_t) bytes);
+                self.header.size = (size_t) bytes;
+                li_queue_drop(&pending, (size_t) bytes);
+                start = bytes;
+                header = true;
+            }
+            uint8_t in_phase = 0;
+            LI_TRUST(li_get(r, LI_IN_PHASE_U8, 0, &in_phase, sizeof(in_phase)));
+            if (in_phase && (framed - start >= range_bytes)) {
+                result = li_verifier_put(&self, li_queue_begin(&pending), (size_t) (framed - start), start, false);
+                REQUIRE_SUCCESS;
+                li_queue_drop(&pending, (size_t) (framed - start));
+                start = framed;
+            }
+        }
+    }
+    piping = false;
+    result = li_pipeline_dtor(&pipe);
+    REQUIRE_SUCCESS;
+
+    if (!problem && !header) {
+        problem = "file ends within the header";
+        offset = MIN(report->bytes, (uint64_t) 3);
+    } else if (!problem && (framed != report->bytes)) {
+        problem = "file ends part way through a message";
+        offset = framed;
+    }
+    if (header && !report->problem) {
+        // Check the whole messages before the problem, or the rest of the
+        // input
+        uint64_t end = problem ? MAX(offset, start) : report->bytes;
+        result = li_verifier_put(&self, li_queue_begin(&pending), (size_t) (end - start), start, !problem);
+        REQUIRE_SUCCESS;
+    }
+    result = li_verifier_finish(&self);
+    REQUIRE_SUCCESS;
+    if (problem && (!report->problem || (offset < report->offset))) {
+        report->problem = problem;
+        report->offset = offset;
+    }
+    result = report->problem ? LI_BAD_FORMAT : LI_SUCCESS;
+
+cleanup:
+
+    if (piping)
+        li_pipeline_dtor(&pipe);
+    li_verifier_dtor(&self);
+    li_queue_dtor(&pending);
+    if (r)
+        li_finalize(r);
+    return result;
+}
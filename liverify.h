@@ -0,0 +1,77 @@
+//
+//  liverify.h
+//  liquidreader
+//
+//  Copyright © 2018 Liquid Instruments. All rights reserved.
+//
+
+#ifndef liverify_h
+#define liverify_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lireader.h"
+#include "lisource.h"
+#include "liutility.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Verifying a binary log file checks everything the reader relies on,
+    // without converting it: the magic number and version, the header, the
+    // framing of every message (for Cap'n Proto messages, the segment
+    // table and the bounds of the pointers followed), that data comes only
+    // for channels in the header, and that the literal fields of every
+    // record match, which shows the records of each channel are still
+    // aligned.
+    //
+    // The framing is walked on the calling thread, which cuts the input
+    // into ranges at message boundaries where every channel has framed the
+    // same whole number of records, as packing does.  Decoding the header
+    // followed by any range then gives exactly its records, so the ranges
+    // are checked on a pool of threads.
+
+#define LI_VERIFY_RANGE_BYTES (4 << 20) // Of input in each range
+#define LI_VERIFY_DEPTH 2               // Ranges queued for each worker
+#define LI_VERIFY_THREADS_MAX 16
+
+    // Options for verifying.  Zero initialization gives the defaults.
+
+    typedef struct li_verify_options {
+        size_t threads;     // Checking ranges, or 0 for one for each
+                            // processor but ours.  With one, ranges are
+                            // checked on the calling thread.
+        size_t range_bytes; // Least input bytes in a range, or 0 for
+                            // LI_VERIFY_RANGE_BYTES
+    } li_verify_options;
+
+    typedef struct li_verify_report {
+        const char* problem; // The first found, or NULL if there is none
+        uint64_t offset;     // Of the problem in the input, after any
+                             // decompression
+        uint64_t records;    // Checked before the problem
+        uint64_t skipped;    // Bytes of each channel before the first
+                             // record, which converting drops too
+        uint64_t bytes;      // Input read
+    } li_verify_report;
+
+    // Verify the binary log file read from input, filling in report.
+    // Returns LI_BAD_FORMAT if a problem was found with the file, and
+    // other failures, such as LI_IO_ERROR, if it couldn't be verified.
+    // options may be NULL.  Optionally provide a callback that will report
+    // whenever bytes are read from input.  user_ptr is passed unchanged to
+    // the callback.
+
+    li_status li_verify(li_source* input,
+                        const li_verify_options* options,
+                        li_verify_report* report,
+                        void (*callback)(void* user_ptr, uint64_t bytes_read, uint64_t bytes_written),
+                        void* user_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* liverify_h */